@@ -0,0 +1,735 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "crowfs.h"
+#include "block_device.h"
+#include "block_trace.h"
+
+/**
+ * Size of the chunks of sequential workloads
+ */
+#define BENCH_SEQUENTIAL_CHUNK (16 * CROWFS_BLOCK_SIZE)
+/**
+ * Number of files written and read by sequential workloads. Each one has the maximum size.
+ */
+#define BENCH_SEQUENTIAL_FILES 4
+/**
+ * Number of operations of the random workloads
+ */
+#define BENCH_RANDOM_OPS 4000
+/**
+ * Depth of the folders in the path resolution workload
+ */
+#define BENCH_DEEP_DEPTH 64
+/**
+ * Number of path resolutions in the path resolution workload
+ */
+#define BENCH_DEEP_OPS 2000
+/**
+ * Number of files in the delete and move workloads
+ */
+#define BENCH_STORM_FILES 500
+/**
+ * Size of each file in the delete workload
+ */
+#define BENCH_STORM_FILE_SIZE (64 * CROWFS_BLOCK_SIZE)
+/**
+ * Default size of the disk in megabytes
+ */
+#define BENCH_DEFAULT_SIZE_MB 256
+/**
+ * Default number of blocks which the file backend caches
+ */
+#define BENCH_DEFAULT_CACHE_BLOCKS 4096
+
+/**
+ * Counts the block I/O of a filesystem. This is the ctx of the benchmarked
+ * filesystem and forwards everything to the real backend.
+ */
+struct CountingDevice {
+    struct CrowFS inner;
+    uint64_t block_reads, block_writes;
+};
+
+/**
+ * An in memory disk
+ */
+struct MemoryDevice {
+    size_t size;
+    char *buffer;
+};
+
+/**
+ * Latencies of the operations of a workload
+ */
+struct BenchResult {
+    const struct CountingDevice *counter;
+    uint64_t *latencies;
+    size_t ops, capacity;
+    uint64_t block_reads, block_writes;
+    double seconds;
+};
+
+/**
+ * Options of the whole benchmark
+ */
+struct BenchOptions {
+    size_t size_mb;
+    size_t cache_blocks;
+    const char *image;
+    const char *only;
+    // A block I/O trace to replay instead of the workloads
+    const char *replay;
+    // Replay at the recorded speed instead of the maximum speed
+    bool realtime;
+    bool json;
+    bool memory, file, direct;
+    // CROWFS_MOUNT_* flags of the filesystems
+    uint32_t mount_flags;
+};
+
+static uint64_t now_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * A small deterministic random number generator, so each run does the same work
+ */
+static uint64_t bench_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static union CrowFSBlock *counting_allocate_mem_block(void *ctx) {
+    struct CountingDevice *device = ctx;
+    return device->inner.allocate_mem_block(device->inner.ctx);
+}
+
+static void counting_free_mem_block(void *ctx, union CrowFSBlock *block) {
+    struct CountingDevice *device = ctx;
+    device->inner.free_mem_block(device->inner.ctx, block);
+}
+
+static int counting_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    struct CountingDevice *device = ctx;
+    device->block_writes++;
+    return device->inner.write_block(device->inner.ctx, block_index, block);
+}
+
+static int counting_read_block(void *ctx, uint32_t block_index, union CrowFSBlock *block) {
+    struct CountingDevice *device = ctx;
+    device->block_reads++;
+    return device->inner.read_block(device->inner.ctx, block_index, block);
+}
+
+static int counting_write_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    struct CountingDevice *device = ctx;
+    device->block_writes += count;
+    return device->inner.write_blocks(device->inner.ctx, block_index, count, blocks);
+}
+
+static int counting_read_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    struct CountingDevice *device = ctx;
+    device->block_reads += count;
+    return device->inner.read_blocks(device->inner.ctx, block_index, count, blocks);
+}
+
+static int counting_flush(void *ctx) {
+    struct CountingDevice *device = ctx;
+    return device->inner.flush(device->inner.ctx);
+}
+
+static int counting_discard(void *ctx, uint32_t block_index, uint32_t count) {
+    struct CountingDevice *device = ctx;
+    return device->inner.discard(device->inner.ctx, block_index, count);
+}
+
+/**
+ * The device reads and writes the copied blocks itself, so they count as both
+ */
+static int counting_copy_blocks(void *ctx, uint32_t from, uint32_t to, uint32_t count) {
+    struct CountingDevice *device = ctx;
+    device->block_reads += count;
+    device->block_writes += count;
+    return device->inner.copy_blocks(device->inner.ctx, from, to, count);
+}
+
+static uint32_t counting_total_blocks(void *ctx) {
+    struct CountingDevice *device = ctx;
+    return device->inner.total_blocks(device->inner.ctx);
+}
+
+static int64_t counting_current_date(void *ctx) {
+    struct CountingDevice *device = ctx;
+    return device->inner.current_date(device->inner.ctx);
+}
+
+static uint64_t counting_monotonic_nanoseconds(void *ctx) {
+    struct CountingDevice *device = ctx;
+    return device->inner.monotonic_nanoseconds(device->inner.ctx);
+}
+
+/**
+ * Wraps the backend of a filesystem with a counting device.
+ * Must be called before the filesystem is created or initialized.
+ */
+static void counting_wrap(struct CrowFS *fs, struct CountingDevice *device) {
+    *device = (struct CountingDevice) {.inner = *fs};
+    *fs = (struct CrowFS) {
+        .allocate_mem_block = counting_allocate_mem_block,
+        .free_mem_block = counting_free_mem_block,
+        .write_block = counting_write_block,
+        .read_block = counting_read_block,
+        .write_blocks = device->inner.write_blocks != NULL ? counting_write_blocks : NULL,
+        .read_blocks = device->inner.read_blocks != NULL ? counting_read_blocks : NULL,
+        .flush = device->inner.flush != NULL ? counting_flush : NULL,
+        .discard = device->inner.discard != NULL ? counting_discard : NULL,
+        .copy_blocks = device->inner.copy_blocks != NULL ? counting_copy_blocks : NULL,
+        .total_blocks = counting_total_blocks,
+        .current_date = counting_current_date,
+        .monotonic_nanoseconds = device->inner.monotonic_nanoseconds != NULL ? counting_monotonic_nanoseconds : NULL,
+        .ctx = device,
+    };
+}
+
+static union CrowFSBlock *mem_allocate_mem_block(void *ctx) {
+    return calloc(1, sizeof(union CrowFSBlock));
+}
+
+static void mem_free_mem_block(void *ctx, union CrowFSBlock *block) {
+    free(block);
+}
+
+static int mem_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    struct MemoryDevice *device = ctx;
+    memcpy(device->buffer + (size_t) block_index * CROWFS_BLOCK_SIZE, block, sizeof(*block));
+    return 0;
+}
+
+static int mem_read_block(void *ctx, uint32_t block_index, union CrowFSBlock *block) {
+    struct MemoryDevice *device = ctx;
+    memcpy(block, device->buffer + (size_t) block_index * CROWFS_BLOCK_SIZE, sizeof(*block));
+    return 0;
+}
+
+static int mem_write_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    for (uint32_t i = 0; i < count; i++)
+        mem_write_block(ctx, block_index + i, blocks[i]);
+    return 0;
+}
+
+static int mem_read_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    for (uint32_t i = 0; i < count; i++)
+        mem_read_block(ctx, block_index + i, blocks[i]);
+    return 0;
+}
+
+static uint32_t mem_total_blocks(void *ctx) {
+    struct MemoryDevice *device = ctx;
+    return device->size / CROWFS_BLOCK_SIZE;
+}
+
+static int64_t mem_current_date(void *ctx) {
+    return time(NULL);
+}
+
+static void bench_record(struct BenchResult *result, uint64_t latency) {
+    if (result->ops == result->capacity) {
+        result->capacity = result->capacity == 0 ? 1024 : result->capacity * 2;
+        result->latencies = realloc(result->latencies, result->capacity * sizeof(uint64_t));
+        if (result->latencies == NULL) {
+            puts("out of memory");
+            exit(1);
+        }
+    }
+    result->latencies[result->ops++] = latency;
+}
+
+/**
+ * Times a single operation of a workload and counts its block I/O. The operation
+ * must evaluate to CROWFS_OK or a non-negative number.
+ */
+#define BENCH_OP(result, op) do { \
+    const uint64_t op_reads = (result)->counter->block_reads, op_writes = (result)->counter->block_writes; \
+    const uint64_t op_start = now_nanoseconds(); \
+    const int op_result = (op); \
+    bench_record((result), now_nanoseconds() - op_start); \
+    (result)->block_reads += (result)->counter->block_reads - op_reads; \
+    (result)->block_writes += (result)->counter->block_writes - op_writes; \
+    if (op_result < 0) { \
+        printf("%s failed with error %d\n", #op, op_result); \
+        exit(1); \
+    } \
+} while (0)
+
+/**
+ * Sets up a workload without timing. Exits on failure.
+ */
+#define BENCH_SETUP(op) do { \
+    const int setup_result = (op); \
+    if (setup_result < 0) { \
+        printf("%s failed with error %d\n", #op, setup_result); \
+        exit(1); \
+    } \
+} while (0)
+
+static void workload_create_flat(struct CrowFS *fs, struct BenchResult *result) {
+    uint32_t folder, fd, parent;
+    BENCH_SETUP(crowfs_open_absolute(fs, "/flat", &folder, &parent, CROWFS_O_CREATE | CROWFS_O_DIR));
+    for (int i = 0; i < CROWFS_MAX_DIR_CONTENTS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "file%d", i);
+        BENCH_OP(result, crowfs_open_relative(fs, name, folder, &fd, &parent, CROWFS_O_CREATE));
+    }
+}
+
+static void workload_resolve_deep(struct CrowFS *fs, struct BenchResult *result) {
+    char path[BENCH_DEEP_DEPTH * 8 + 1] = "";
+    uint32_t fd, parent;
+    for (int i = 0; i < BENCH_DEEP_DEPTH; i++) {
+        snprintf(path + strlen(path), sizeof(path) - strlen(path), "/d%d", i);
+        BENCH_SETUP(crowfs_open_absolute(fs, path, &fd, &parent, CROWFS_O_CREATE | CROWFS_O_DIR));
+    }
+    for (int i = 0; i < BENCH_DEEP_OPS; i++)
+        BENCH_OP(result, crowfs_open_absolute(fs, path, &fd, &parent, CROWFS_O_DIR));
+}
+
+/**
+ * Creates the files of sequential workloads
+ */
+static void create_sequential_files(struct CrowFS *fs, uint32_t files[BENCH_SEQUENTIAL_FILES]) {
+    uint32_t parent;
+    for (int i = 0; i < BENCH_SEQUENTIAL_FILES; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/seq%d", i);
+        BENCH_SETUP(crowfs_open_absolute(fs, name, &files[i], &parent, CROWFS_O_CREATE));
+    }
+}
+
+/**
+ * The size of the sequential chunk at an offset. The last chunk of a file might be smaller.
+ */
+static size_t sequential_chunk(size_t offset) {
+    const size_t left = CROWFS_MAX_FILESIZE - offset;
+    return left < BENCH_SEQUENTIAL_CHUNK ? left : BENCH_SEQUENTIAL_CHUNK;
+}
+
+static void workload_sequential_write(struct CrowFS *fs, struct BenchResult *result) {
+    uint32_t files[BENCH_SEQUENTIAL_FILES];
+    char *buffer = calloc(1, BENCH_SEQUENTIAL_CHUNK);
+    create_sequential_files(fs, files);
+    for (int i = 0; i < BENCH_SEQUENTIAL_FILES; i++)
+        for (size_t offset = 0; offset < CROWFS_MAX_FILESIZE; offset += BENCH_SEQUENTIAL_CHUNK)
+            BENCH_OP(result, crowfs_write(fs, files[i], buffer, sequential_chunk(offset), offset));
+    free(buffer);
+}
+
+static void workload_sequential_read(struct CrowFS *fs, struct BenchResult *result) {
+    uint32_t files[BENCH_SEQUENTIAL_FILES];
+    char *buffer = calloc(1, BENCH_SEQUENTIAL_CHUNK);
+    create_sequential_files(fs, files);
+    for (int i = 0; i < BENCH_SEQUENTIAL_FILES; i++)
+        for (size_t offset = 0; offset < CROWFS_MAX_FILESIZE; offset += BENCH_SEQUENTIAL_CHUNK)
+            BENCH_SETUP(crowfs_write(fs, files[i], buffer, sequential_chunk(offset), offset));
+    for (int i = 0; i < BENCH_SEQUENTIAL_FILES; i++)
+        for (size_t offset = 0; offset < CROWFS_MAX_FILESIZE; offset += BENCH_SEQUENTIAL_CHUNK)
+            BENCH_OP(result, crowfs_read(fs, files[i], buffer, sequential_chunk(offset), offset));
+    free(buffer);
+}
+
+/**
+ * Creates a file with the maximum size, so random workloads hit both direct and indirect blocks
+ */
+static uint32_t create_random_file(struct CrowFS *fs) {
+    uint32_t fd, parent;
+    char *buffer = calloc(1, CROWFS_MAX_FILESIZE);
+    BENCH_SETUP(crowfs_open_absolute(fs, "/random", &fd, &parent, CROWFS_O_CREATE));
+    BENCH_SETUP(crowfs_write(fs, fd, buffer, CROWFS_MAX_FILESIZE, 0));
+    free(buffer);
+    return fd;
+}
+
+static void workload_random_write(struct CrowFS *fs, struct BenchResult *result) {
+    char buffer[CROWFS_BLOCK_SIZE] = {0};
+    uint64_t random_state = 0x9E3779B97F4A7C15;
+    const uint32_t fd = create_random_file(fs);
+    for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+        const size_t block = bench_random(&random_state) % (CROWFS_MAX_FILESIZE / CROWFS_BLOCK_SIZE);
+        BENCH_OP(result, crowfs_write(fs, fd, buffer, sizeof(buffer), block * CROWFS_BLOCK_SIZE));
+    }
+}
+
+static void workload_random_read(struct CrowFS *fs, struct BenchResult *result) {
+    char buffer[CROWFS_BLOCK_SIZE];
+    uint64_t random_state = 0x9E3779B97F4A7C15;
+    const uint32_t fd = create_random_file(fs);
+    for (int i = 0; i < BENCH_RANDOM_OPS; i++) {
+        const size_t block = bench_random(&random_state) % (CROWFS_MAX_FILESIZE / CROWFS_BLOCK_SIZE);
+        BENCH_OP(result, crowfs_read(fs, fd, buffer, sizeof(buffer), block * CROWFS_BLOCK_SIZE));
+    }
+}
+
+static void workload_delete(struct CrowFS *fs, struct BenchResult *result) {
+    uint32_t folder, files[BENCH_STORM_FILES], parent;
+    char *buffer = calloc(1, BENCH_STORM_FILE_SIZE);
+    BENCH_SETUP(crowfs_open_absolute(fs, "/storm", &folder, &parent, CROWFS_O_CREATE | CROWFS_O_DIR));
+    for (int i = 0; i < BENCH_STORM_FILES; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "file%d", i);
+        BENCH_SETUP(crowfs_open_relative(fs, name, folder, &files[i], &parent, CROWFS_O_CREATE));
+        BENCH_SETUP(crowfs_write(fs, files[i], buffer, BENCH_STORM_FILE_SIZE, 0));
+    }
+    for (int i = 0; i < BENCH_STORM_FILES; i++)
+        BENCH_OP(result, crowfs_delete(fs, files[i], folder));
+    free(buffer);
+}
+
+static void workload_move(struct CrowFS *fs, struct BenchResult *result) {
+    uint32_t from, to, files[BENCH_STORM_FILES], parent;
+    BENCH_SETUP(crowfs_open_absolute(fs, "/from", &from, &parent, CROWFS_O_CREATE | CROWFS_O_DIR));
+    BENCH_SETUP(crowfs_open_absolute(fs, "/to", &to, &parent, CROWFS_O_CREATE | CROWFS_O_DIR));
+    for (int i = 0; i < BENCH_STORM_FILES; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "file%d", i);
+        BENCH_SETUP(crowfs_open_relative(fs, name, from, &files[i], &parent, CROWFS_O_CREATE));
+    }
+    // Move everything to the other folder and back with a new name
+    for (int i = 0; i < BENCH_STORM_FILES; i++)
+        BENCH_OP(result, crowfs_move(fs, files[i], from, to, NULL));
+    for (int i = 0; i < BENCH_STORM_FILES; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "renamed%d", i);
+        BENCH_OP(result, crowfs_move(fs, files[i], to, from, name));
+    }
+}
+
+/**
+ * All workloads of the benchmark
+ */
+static const struct {
+    const char *name;
+    void (*run)(struct CrowFS *fs, struct BenchResult *result);
+} workloads[] = {
+    {"create_flat", workload_create_flat},
+    {"resolve_deep", workload_resolve_deep},
+    {"sequential_write", workload_sequential_write},
+    {"sequential_read", workload_sequential_read},
+    {"random_write", workload_random_write},
+    {"random_read", workload_random_read},
+    {"delete", workload_delete},
+    {"move", workload_move},
+};
+
+static int compare_latencies(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_microseconds(const struct BenchResult *result, double percentile) {
+    if (result->ops == 0)
+        return 0;
+    size_t index = (size_t) (percentile * (double) (result->ops - 1) + 0.5);
+    return (double) result->latencies[index] / 1000.0;
+}
+
+static void bench_print(const struct BenchOptions *options, const char *backend, const char *workload,
+                        struct BenchResult *result) {
+    qsort(result->latencies, result->ops, sizeof(uint64_t), compare_latencies);
+    const double ops = (double) result->ops;
+    const double ops_per_second = result->seconds > 0 ? ops / result->seconds : 0;
+    if (options->json) {
+        printf("{\"backend\":\"%s\",\"workload\":\"%s\",\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+               "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+               "\"reads_per_op\":%.3f,\"writes_per_op\":%.3f}\n",
+               backend, workload, result->ops, result->seconds, ops_per_second,
+               percentile_microseconds(result, 0.5), percentile_microseconds(result, 0.9),
+               percentile_microseconds(result, 0.99), percentile_microseconds(result, 1),
+               (double) result->block_reads / ops, (double) result->block_writes / ops);
+    } else {
+        printf("%-8s %-17s %8zu %12.1f %10.2f %10.2f %10.2f %10.2f %10.3f %10.3f\n",
+               backend, workload, result->ops, ops_per_second,
+               percentile_microseconds(result, 0.5), percentile_microseconds(result, 0.9),
+               percentile_microseconds(result, 0.99), percentile_microseconds(result, 1),
+               (double) result->block_reads / ops, (double) result->block_writes / ops);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Opens a fresh backend for a workload
+ * @return 0 if ok, 1 otherwise
+ */
+static int backend_open(const struct BenchOptions *options, const char *backend, struct CrowFS *fs) {
+    if (strcmp(backend, "memory") == 0) {
+        struct MemoryDevice *device = malloc(sizeof(struct MemoryDevice));
+        if (device == NULL)
+            return 1;
+        device->size = options->size_mb * 1024 * 1024;
+        device->buffer = calloc(device->size, sizeof(char));
+        if (device->buffer == NULL) {
+            free(device);
+            return 1;
+        }
+        *fs = (struct CrowFS) {
+            .allocate_mem_block = mem_allocate_mem_block,
+            .free_mem_block = mem_free_mem_block,
+            .write_block = mem_write_block,
+            .read_block = mem_read_block,
+            .write_blocks = mem_write_blocks,
+            .read_blocks = mem_read_blocks,
+            .total_blocks = mem_total_blocks,
+            .current_date = mem_current_date,
+            .ctx = device,
+        };
+        return 0;
+    }
+    // File backends use the image of the options
+    FILE *image = fopen(options->image, "wb");
+    if (image == NULL)
+        return 1;
+    fclose(image);
+    if (truncate(options->image, (off_t) options->size_mb * 1024 * 1024) != 0)
+        return 1;
+    const bool direct = strcmp(backend, "direct") == 0;
+    if ((direct ? direct_device_open(fs, options->image) : std_device_open(fs, options->image)) != 0)
+        return 1;
+    if (device_enable_cache(fs, options->cache_blocks) != 0) {
+        device_close(fs);
+        return 1;
+    }
+    return 0;
+}
+
+static void backend_close(const char *backend, struct CrowFS *fs) {
+    if (strcmp(backend, "memory") == 0) {
+        struct MemoryDevice *device = fs->ctx;
+        free(device->buffer);
+        free(device);
+    } else {
+        device_close(fs);
+    }
+}
+
+static void bench_backend(const struct BenchOptions *options, const char *backend) {
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (options->only != NULL && strcmp(options->only, workloads[i].name) != 0)
+            continue;
+        // Each workload runs on a freshly formatted disk
+        struct CrowFS fs;
+        if (backend_open(options, backend, &fs) != 0) {
+            printf("cannot open the %s backend\n", backend);
+            exit(1);
+        }
+        struct CountingDevice counter;
+        counting_wrap(&fs, &counter);
+        fs.mount_flags = options->mount_flags;
+        BENCH_SETUP(crowfs_new(&fs));
+        struct BenchResult result = {.counter = &counter};
+        workloads[i].run(&fs, &result);
+        // Only the timed operations are measured, not the setup of the workload
+        for (size_t j = 0; j < result.ops; j++)
+            result.seconds += (double) result.latencies[j] / 1e9;
+        bench_print(options, backend, workloads[i].name, &result);
+        free(result.latencies);
+        crowfs_close(&fs);
+        backend_close(backend, &counter.inner);
+    }
+}
+
+/**
+ * Issues a single request of a trace to a backend
+ * @return 0 if ok, non-zero on I/O error
+ */
+static int replay_request(struct CrowFS *fs, const struct TraceRecord *record, union CrowFSBlock *const *blocks) {
+    // A backend without these requests has nothing to do for them
+    if (record->type == TRACE_FLUSH)
+        return fs->flush != NULL ? fs->flush(fs->ctx) : 0;
+    if (record->type == TRACE_DISCARD)
+        return fs->discard != NULL ? fs->discard(fs->ctx, record->block_index, record->count) : 0;
+    if (record->count == 1) {
+        return record->type == TRACE_WRITE
+                   ? fs->write_block(fs->ctx, record->block_index, blocks[0])
+                   : fs->read_block(fs->ctx, record->block_index, blocks[0]);
+    }
+    int (*vectored)(void *, uint32_t, uint32_t, union CrowFSBlock *const *) =
+            record->type == TRACE_WRITE ? fs->write_blocks : fs->read_blocks;
+    if (vectored != NULL)
+        return vectored(fs->ctx, record->block_index, record->count, blocks);
+    for (uint32_t i = 0; i < record->count; i++) {
+        const int result = record->type == TRACE_WRITE
+                               ? fs->write_block(fs->ctx, record->block_index + i, blocks[i])
+                               : fs->read_block(fs->ctx, record->block_index + i, blocks[i]);
+        if (result != 0)
+            return result;
+    }
+    return 0;
+}
+
+/**
+ * Finds the size of the disk which a trace needs
+ * @return The size in megabytes
+ */
+static size_t replay_size_mb(const char *path) {
+    FILE *trace = trace_open(path);
+    if (trace == NULL) {
+        printf("cannot open the trace %s\n", path);
+        exit(1);
+    }
+    uint64_t end = 0;
+    struct TraceRecord record;
+    while (trace_next(trace, &record))
+        if ((uint64_t) record.block_index + record.count > end)
+            end = (uint64_t) record.block_index + record.count;
+    fclose(trace);
+    return (end * CROWFS_BLOCK_SIZE + 1024 * 1024 - 1) / (1024 * 1024);
+}
+
+/**
+ * Replays a block I/O trace on a fresh disk. Requests are issued to the backend
+ * directly, so the disk does not need to be formatted. Besides the whole trace,
+ * the requests of each CrowFS operation are reported as "replay_<operation>".
+ */
+static void bench_replay(const struct BenchOptions *options, const char *backend) {
+    FILE *trace = trace_open(options->replay);
+    if (trace == NULL) {
+        printf("cannot open the trace %s\n", options->replay);
+        exit(1);
+    }
+    struct CrowFS fs;
+    if (backend_open(options, backend, &fs) != 0) {
+        printf("cannot open the %s backend\n", backend);
+        exit(1);
+    }
+    struct CountingDevice counter;
+    counting_wrap(&fs, &counter);
+    struct BenchResult results[CROWFS_OP_COUNT] = {0}, total = {.counter = &counter};
+    for (int i = 0; i < CROWFS_OP_COUNT; i++)
+        results[i].counter = &counter;
+    union CrowFSBlock **blocks = NULL;
+    size_t block_count = 0;
+    const uint64_t start = now_nanoseconds();
+    struct TraceRecord record;
+    while (trace_next(trace, &record)) {
+        if (record.count == 0 && record.type != TRACE_FLUSH)
+            continue;
+        // Grow the buffers to the largest read or write
+        if ((record.type == TRACE_READ || record.type == TRACE_WRITE) && record.count > block_count) {
+            blocks = realloc(blocks, record.count * sizeof(union CrowFSBlock *));
+            if (blocks == NULL) {
+                puts("out of memory");
+                exit(1);
+            }
+            for (; block_count < record.count; block_count++)
+                blocks[block_count] = fs.allocate_mem_block(fs.ctx);
+        }
+        if (options->realtime) {
+            const uint64_t due = start + record.timestamp;
+            const struct timespec wake_up = {.tv_sec = due / 1000000000, .tv_nsec = due % 1000000000};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_up, NULL);
+        }
+        const uint8_t operation = record.operation < CROWFS_OP_COUNT ? record.operation : CROWFS_OP_NONE;
+        BENCH_OP(&results[operation], -replay_request(&fs, &record, blocks));
+    }
+    fclose(trace);
+    for (int i = 0; i < CROWFS_OP_COUNT; i++) {
+        if (results[i].ops == 0)
+            continue;
+        char name[32];
+        snprintf(name, sizeof(name), "replay_%s", crowfs_operation_name(i));
+        for (size_t j = 0; j < results[i].ops; j++) {
+            results[i].seconds += (double) results[i].latencies[j] / 1e9;
+            bench_record(&total, results[i].latencies[j]);
+        }
+        total.block_reads += results[i].block_reads;
+        total.block_writes += results[i].block_writes;
+        total.seconds += results[i].seconds;
+        bench_print(options, backend, name, &results[i]);
+        free(results[i].latencies);
+    }
+    bench_print(options, backend, "replay", &total);
+    free(total.latencies);
+    for (size_t i = 0; i < block_count; i++)
+        fs.free_mem_block(fs.ctx, blocks[i]);
+    free(blocks);
+    backend_close(backend, &counter.inner);
+}
+
+static void print_usage(void) {
+    puts("Usage: CrowFSBench [--backend memory|file|direct] [--size <megabytes>] [--image <path>]\n"
+         "                   [--cache <blocks>] [--workload <name>] [--replay <trace> [--realtime]] [--json]\n"
+         "                   [--extent-index]\n"
+         "Workloads:");
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+        printf("  %s\n", workloads[i].name);
+}
+
+int main(int argc, char *argv[]) {
+    struct BenchOptions options = {
+        .size_mb = BENCH_DEFAULT_SIZE_MB,
+        .cache_blocks = BENCH_DEFAULT_CACHE_BLOCKS,
+        .image = "crowfs_bench.img",
+    };
+    bool backend_selected = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            options.json = true;
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            const char *backend = argv[++i];
+            backend_selected = true;
+            if (strcmp(backend, "memory") == 0) {
+                options.memory = true;
+            } else if (strcmp(backend, "file") == 0) {
+                options.file = true;
+            } else if (strcmp(backend, "direct") == 0) {
+                options.direct = true;
+            } else {
+                print_usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            options.size_mb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            options.image = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.cache_blocks = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--workload") == 0 && i + 1 < argc) {
+            options.only = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            options.replay = argv[++i];
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            options.realtime = true;
+        } else if (strcmp(argv[i], "--extent-index") == 0) {
+            options.mount_flags |= CROWFS_MOUNT_EXTENT_INDEX;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (!backend_selected)
+        options.memory = options.file = true;
+    if (options.replay != NULL) {
+        const size_t trace_size_mb = replay_size_mb(options.replay);
+        if (trace_size_mb > options.size_mb)
+            options.size_mb = trace_size_mb;
+    }
+    void (*run)(const struct BenchOptions *, const char *) = options.replay != NULL ? bench_replay : bench_backend;
+    if (!options.json)
+        printf("%-8s %-17s %8s %12s %10s %10s %10s %10s %10s %10s\n", "backend", "workload", "ops", "ops/sec",
+               "p50_us", "p90_us", "p99_us", "max_us", "reads/op", "writes/op");
+    if (options.memory)
+        run(&options, "memory");
+    if (options.file)
+        run(&options, "file");
+    if (options.direct)
+        run(&options, "direct");
+    if (options.file || options.direct)
+        unlink(options.image);
+    return 0;
+}
@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "block_device.h"
+#include "block_trace.h"
+
+/**
+ * Size of each chunk which the aligned block pool requests from the kernel.
+ * This is the size of a hugepage on x86-64.
+ */
+#define DIRECT_POOL_CHUNK_SIZE (2 * 1024 * 1024)
+/**
+ * Maximum number of blocks which are sent to the kernel in one vectored request
+ */
+#define DIRECT_MAX_IOVEC 64
+/**
+ * The tag of an empty cache slot. This is never a valid block index because
+ * the number of blocks is stored in an uint32_t.
+ */
+#define CACHE_EMPTY_SLOT UINT32_MAX
+
+/**
+ * State of an open block device. This is the ctx of the filesystem.
+ */
+struct BlockDevice {
+    // The image file if opened with stdio
+    FILE *file;
+    // The image file descriptor if opened with O_DIRECT
+    int fd;
+    /**
+     * The aligned block pool of O_DIRECT device. Freed blocks are kept in a
+     * linked list which is stored in the blocks themselves.
+     */
+    struct {
+        union CrowFSBlock *free_list;
+        void **chunks;
+        size_t chunk_count;
+    } pool;
+    /**
+     * Direct mapped write-through cache of single block requests. Block i can
+     * only live in slot i % slots. Empty slots have CACHE_EMPTY_SLOT as tag.
+     */
+    struct {
+        size_t slots;
+        uint32_t *tags;
+        union CrowFSBlock *data;
+        // Number of single block reads served from the cache or the device
+        uint64_t hits, misses;
+    } cache;
+    /**
+     * The uncached IO functions of the device when the cache is enabled
+     */
+    struct {
+        int (*write_block)(void *ctx, uint32_t block_index, const union CrowFSBlock *block);
+        int (*read_block)(void *ctx, uint32_t block_index, union CrowFSBlock *block);
+        int (*write_blocks)(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks);
+        int (*read_blocks)(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks);
+        int (*discard)(void *ctx, uint32_t block_index, uint32_t count);
+        int (*copy_blocks)(void *ctx, uint32_t from, uint32_t to, uint32_t count);
+    } base;
+    /**
+     * The block I/O trace. Requests are recorded and then passed to the
+     * IO functions which were set before the trace was enabled.
+     */
+    struct {
+        FILE *file;
+        // The filesystem which its current operation is recorded
+        const struct CrowFS *fs;
+        uint64_t start;
+        int (*write_block)(void *ctx, uint32_t block_index, const union CrowFSBlock *block);
+        int (*read_block)(void *ctx, uint32_t block_index, union CrowFSBlock *block);
+        int (*write_blocks)(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks);
+        int (*read_blocks)(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks);
+        int (*flush)(void *ctx);
+        int (*discard)(void *ctx, uint32_t block_index, uint32_t count);
+        int (*copy_blocks)(void *ctx, uint32_t from, uint32_t to, uint32_t count);
+    } trace;
+};
+
+static union CrowFSBlock *std_allocate_mem_block(void *ctx) {
+    return calloc(1, sizeof(union CrowFSBlock));
+}
+
+static void std_free_mem_block(void *ctx, union CrowFSBlock *block) {
+    free(block);
+}
+
+static int std_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    FILE *block_file = ((struct BlockDevice *) ctx)->file;
+    if (fseek(block_file, (off_t) CROWFS_BLOCK_SIZE * block_index, SEEK_SET) == -1)
+        return 1;
+    if (fwrite(block, sizeof(*block), 1, block_file) != 1)
+        return 1;
+    return 0;
+}
+
+static int std_read_block(void *ctx, uint32_t block_index, union CrowFSBlock *block) {
+    FILE *block_file = ((struct BlockDevice *) ctx)->file;
+    if (fseek(block_file, (off_t) CROWFS_BLOCK_SIZE * block_index, SEEK_SET) == -1)
+        return 1;
+    if (fread(block, sizeof(*block), 1, block_file) != 1)
+        return 1;
+    return 0;
+}
+
+static int std_write_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    FILE *block_file = ((struct BlockDevice *) ctx)->file;
+    if (fseek(block_file, (off_t) CROWFS_BLOCK_SIZE * block_index, SEEK_SET) == -1)
+        return 1;
+    for (uint32_t i = 0; i < count; i++)
+        if (fwrite(blocks[i], sizeof(*blocks[i]), 1, block_file) != 1)
+            return 1;
+    return 0;
+}
+
+static int std_read_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    FILE *block_file = ((struct BlockDevice *) ctx)->file;
+    if (fseek(block_file, (off_t) CROWFS_BLOCK_SIZE * block_index, SEEK_SET) == -1)
+        return 1;
+    for (uint32_t i = 0; i < count; i++)
+        if (fread(blocks[i], sizeof(*blocks[i]), 1, block_file) != 1)
+            return 1;
+    return 0;
+}
+
+static int std_flush(void *ctx) {
+    FILE *block_file = ((struct BlockDevice *) ctx)->file;
+    // Empty the stdio buffer and then the page cache of the kernel
+    if (fflush(block_file) != 0)
+        return 1;
+    return fdatasync(fileno(block_file)) != 0;
+}
+
+/**
+ * Punches a hole in an image file, so the discarded blocks take no space on
+ * the host and read as zeros. The size of the file does not change.
+ */
+static int punch_hole(int fd, uint32_t block_index, uint32_t count) {
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) block_index * CROWFS_BLOCK_SIZE,
+                     (off_t) count * CROWFS_BLOCK_SIZE) != 0;
+}
+
+/**
+ * Copies blocks inside an image file with copy_file_range. The kernel copies
+ * without passing the data to the user space and filesystems such as Btrfs and
+ * XFS share the extents instead of copying them.
+ */
+static int copy_range(int fd, uint32_t from, uint32_t to, uint32_t count) {
+    loff_t from_offset = (loff_t) from * CROWFS_BLOCK_SIZE, to_offset = (loff_t) to * CROWFS_BLOCK_SIZE;
+    size_t length = (size_t) count * CROWFS_BLOCK_SIZE;
+    while (length > 0) {
+        const ssize_t copied = copy_file_range(fd, &from_offset, fd, &to_offset, length, 0);
+        if (copied <= 0)
+            return 1;
+        length -= copied;
+    }
+    return 0;
+}
+
+static int std_copy_blocks(void *ctx, uint32_t from, uint32_t to, uint32_t count) {
+    FILE *block_file = ((struct BlockDevice *) ctx)->file;
+    // The source must be in the file and the buffered reads must not be stale
+    if (fflush(block_file) != 0)
+        return 1;
+    return copy_range(fileno(block_file), from, to, count);
+}
+
+static int std_discard(void *ctx, uint32_t block_index, uint32_t count) {
+    FILE *block_file = ((struct BlockDevice *) ctx)->file;
+    // Buffered writes must not fill the hole again
+    if (fflush(block_file) != 0)
+        return 1;
+    return punch_hole(fileno(block_file), block_index, count);
+}
+
+static uint32_t std_total_blocks(void *ctx) {
+    FILE *block_file = ((struct BlockDevice *) ctx)->file;
+    fseek(block_file, 0, SEEK_END);
+    return ftell(block_file) / CROWFS_BLOCK_SIZE;
+}
+
+static int64_t std_current_date(void *ctx) {
+    return time(NULL);
+}
+
+static uint64_t std_monotonic_nanoseconds(void *ctx) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Carves a new chunk of aligned memory and puts its blocks in the free list.
+ * At first, it tries to get a hugepage and if that fails, normal pages are used.
+ * @param device The device to grow its pool
+ * @return 0 if ok, 1 if out of memory
+ */
+static int direct_pool_grow(struct BlockDevice *device) {
+    void *chunk = mmap(NULL, DIRECT_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (chunk == MAP_FAILED) {
+        chunk = mmap(NULL, DIRECT_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+            return 1;
+        madvise(chunk, DIRECT_POOL_CHUNK_SIZE, MADV_HUGEPAGE); // best effort
+    }
+    void **new_chunks = realloc(device->pool.chunks, (device->pool.chunk_count + 1) * sizeof(void *));
+    if (new_chunks == NULL) {
+        munmap(chunk, DIRECT_POOL_CHUNK_SIZE);
+        return 1;
+    }
+    device->pool.chunks = new_chunks;
+    device->pool.chunks[device->pool.chunk_count++] = chunk;
+    // Link all blocks in the free list
+    union CrowFSBlock *blocks = chunk;
+    for (size_t i = 0; i < DIRECT_POOL_CHUNK_SIZE / sizeof(union CrowFSBlock); i++) {
+        *(union CrowFSBlock **) &blocks[i] = device->pool.free_list;
+        device->pool.free_list = &blocks[i];
+    }
+    return 0;
+}
+
+static union CrowFSBlock *direct_allocate_mem_block(void *ctx) {
+    struct BlockDevice *device = ctx;
+    if (device->pool.free_list == NULL && direct_pool_grow(device) != 0)
+        return NULL;
+    union CrowFSBlock *block = device->pool.free_list;
+    device->pool.free_list = *(union CrowFSBlock **) block;
+    memset(block, 0, sizeof(*block));
+    return block;
+}
+
+static void direct_free_mem_block(void *ctx, union CrowFSBlock *block) {
+    struct BlockDevice *device = ctx;
+    *(union CrowFSBlock **) block = device->pool.free_list;
+    device->pool.free_list = block;
+}
+
+static int direct_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    const int direct_fd = ((struct BlockDevice *) ctx)->fd;
+    ssize_t n = pwrite(direct_fd, block, sizeof(*block), (off_t) CROWFS_BLOCK_SIZE * block_index);
+    return n != sizeof(*block);
+}
+
+static int direct_read_block(void *ctx, uint32_t block_index, union CrowFSBlock *block) {
+    const int direct_fd = ((struct BlockDevice *) ctx)->fd;
+    ssize_t n = pread(direct_fd, block, sizeof(*block), (off_t) CROWFS_BLOCK_SIZE * block_index);
+    return n != sizeof(*block);
+}
+
+static int direct_write_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    const int direct_fd = ((struct BlockDevice *) ctx)->fd;
+    struct iovec iov[DIRECT_MAX_IOVEC];
+    while (count > 0) {
+        uint32_t batch = count < DIRECT_MAX_IOVEC ? count : DIRECT_MAX_IOVEC;
+        for (uint32_t i = 0; i < batch; i++)
+            iov[i] = (struct iovec){.iov_base = blocks[i], .iov_len = sizeof(union CrowFSBlock)};
+        ssize_t n = pwritev(direct_fd, iov, (int) batch, (off_t) CROWFS_BLOCK_SIZE * block_index);
+        if (n != (ssize_t) (batch * sizeof(union CrowFSBlock)))
+            return 1;
+        block_index += batch;
+        blocks += batch;
+        count -= batch;
+    }
+    return 0;
+}
+
+static int direct_read_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    const int direct_fd = ((struct BlockDevice *) ctx)->fd;
+    struct iovec iov[DIRECT_MAX_IOVEC];
+    while (count > 0) {
+        uint32_t batch = count < DIRECT_MAX_IOVEC ? count : DIRECT_MAX_IOVEC;
+        for (uint32_t i = 0; i < batch; i++)
+            iov[i] = (struct iovec){.iov_base = blocks[i], .iov_len = sizeof(union CrowFSBlock)};
+        ssize_t n = preadv(direct_fd, iov, (int) batch, (off_t) CROWFS_BLOCK_SIZE * block_index);
+        if (n != (ssize_t) (batch * sizeof(union CrowFSBlock)))
+            return 1;
+        block_index += batch;
+        blocks += batch;
+        count -= batch;
+    }
+    return 0;
+}
+
+static int direct_flush(void *ctx) {
+    // O_DIRECT skips the page cache but not the write cache of the disk
+    return fdatasync(((struct BlockDevice *) ctx)->fd) != 0;
+}
+
+static int direct_copy_blocks(void *ctx, uint32_t from, uint32_t to, uint32_t count) {
+    return copy_range(((struct BlockDevice *) ctx)->fd, from, to, count);
+}
+
+static int direct_discard(void *ctx, uint32_t block_index, uint32_t count) {
+    return punch_hole(((struct BlockDevice *) ctx)->fd, block_index, count);
+}
+
+static uint32_t direct_total_blocks(void *ctx) {
+    off_t size = lseek(((struct BlockDevice *) ctx)->fd, 0, SEEK_END);
+    if (size == -1)
+        return 0;
+    return size / CROWFS_BLOCK_SIZE;
+}
+
+static int cached_read_block(void *ctx, uint32_t block_index, union CrowFSBlock *block) {
+    struct BlockDevice *device = ctx;
+    const size_t slot = block_index % device->cache.slots;
+    if (device->cache.tags[slot] == block_index) {
+        device->cache.hits++;
+    } else {
+        device->cache.misses++;
+        // Miss. Read the block in the slot. The slot is aligned so this works with O_DIRECT.
+        if (device->base.read_block(ctx, block_index, &device->cache.data[slot])) {
+            device->cache.tags[slot] = CACHE_EMPTY_SLOT;
+            return 1;
+        }
+        device->cache.tags[slot] = block_index;
+    }
+    memcpy(block, &device->cache.data[slot], sizeof(*block));
+    return 0;
+}
+
+static int cached_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    struct BlockDevice *device = ctx;
+    const size_t slot = block_index % device->cache.slots;
+    if (device->base.write_block(ctx, block_index, block)) {
+        if (device->cache.tags[slot] == block_index)
+            device->cache.tags[slot] = CACHE_EMPTY_SLOT;
+        return 1;
+    }
+    memcpy(&device->cache.data[slot], block, sizeof(*block));
+    device->cache.tags[slot] = block_index;
+    return 0;
+}
+
+/**
+ * Multi block requests are mostly file data, so they bypass the cache in order to
+ * not evict the metadata. Written blocks which are already cached are updated.
+ */
+static int cached_write_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    struct BlockDevice *device = ctx;
+    int result = device->base.write_blocks(ctx, block_index, count, blocks);
+    for (uint32_t i = 0; i < count; i++) {
+        const size_t slot = (block_index + i) % device->cache.slots;
+        if (device->cache.tags[slot] != block_index + i)
+            continue;
+        if (result == 0)
+            memcpy(&device->cache.data[slot], blocks[i], sizeof(*blocks[i]));
+        else
+            device->cache.tags[slot] = CACHE_EMPTY_SLOT;
+    }
+    return result;
+}
+
+/**
+ * Removes a range of blocks from the cache
+ */
+static void cache_invalidate(struct BlockDevice *device, uint32_t block_index, uint32_t count) {
+    if (count >= device->cache.slots) {
+        for (size_t slot = 0; slot < device->cache.slots; slot++)
+            if (device->cache.tags[slot] != CACHE_EMPTY_SLOT && device->cache.tags[slot] - block_index < count)
+                device->cache.tags[slot] = CACHE_EMPTY_SLOT;
+    } else {
+        for (uint32_t i = 0; i < count; i++)
+            if (device->cache.tags[(block_index + i) % device->cache.slots] == block_index + i)
+                device->cache.tags[(block_index + i) % device->cache.slots] = CACHE_EMPTY_SLOT;
+    }
+}
+
+/**
+ * Discarded blocks are removed from the cache, so they read as the device returns them
+ */
+static int cached_discard(void *ctx, uint32_t block_index, uint32_t count) {
+    cache_invalidate(ctx, block_index, count);
+    return ((struct BlockDevice *) ctx)->base.discard(ctx, block_index, count);
+}
+
+/**
+ * The copied blocks are written behind the cache, so their old content is removed from it
+ */
+static int cached_copy_blocks(void *ctx, uint32_t from, uint32_t to, uint32_t count) {
+    cache_invalidate(ctx, to, count);
+    return ((struct BlockDevice *) ctx)->base.copy_blocks(ctx, from, to, count);
+}
+
+void device_cache_stats(const struct CrowFS *fs, uint64_t *hits, uint64_t *misses) {
+    const struct BlockDevice *device = fs->ctx;
+    *hits = device->cache.hits;
+    *misses = device->cache.misses;
+}
+
+int device_enable_cache(struct CrowFS *fs, size_t blocks) {
+    struct BlockDevice *device = fs->ctx;
+    if (blocks == 0 || device->cache.slots != 0)
+        return 0;
+    device->cache.tags = malloc(blocks * sizeof(uint32_t));
+    device->cache.data = aligned_alloc(CROWFS_BLOCK_SIZE, blocks * sizeof(union CrowFSBlock));
+    if (device->cache.tags == NULL || device->cache.data == NULL) {
+        free(device->cache.tags);
+        free(device->cache.data);
+        device->cache.tags = NULL;
+        device->cache.data = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < blocks; i++)
+        device->cache.tags[i] = CACHE_EMPTY_SLOT;
+    device->cache.slots = blocks;
+    // Route the IO through the cache
+    device->base.write_block = fs->write_block;
+    device->base.read_block = fs->read_block;
+    device->base.write_blocks = fs->write_blocks;
+    device->base.read_blocks = fs->read_blocks;
+    device->base.discard = fs->discard;
+    device->base.copy_blocks = fs->copy_blocks;
+    fs->write_block = cached_write_block;
+    fs->read_block = cached_read_block;
+    fs->write_blocks = cached_write_blocks;
+    fs->discard = fs->discard != NULL ? cached_discard : NULL;
+    fs->copy_blocks = fs->copy_blocks != NULL ? cached_copy_blocks : NULL;
+    return 0;
+}
+
+/**
+ * Records a request in the trace of a device
+ */
+static void trace_request(struct BlockDevice *device, uint8_t type, uint32_t block_index, uint32_t count) {
+    const struct TraceRecord record = {
+        .timestamp = std_monotonic_nanoseconds(NULL) - device->trace.start,
+        .block_index = block_index,
+        .type = type,
+        .operation = device->trace.fs->current_operation,
+    };
+    trace_append(device->trace.file, record, count);
+}
+
+static int traced_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    struct BlockDevice *device = ctx;
+    trace_request(device, TRACE_WRITE, block_index, 1);
+    return device->trace.write_block(ctx, block_index, block);
+}
+
+static int traced_read_block(void *ctx, uint32_t block_index, union CrowFSBlock *block) {
+    struct BlockDevice *device = ctx;
+    trace_request(device, TRACE_READ, block_index, 1);
+    return device->trace.read_block(ctx, block_index, block);
+}
+
+static int traced_write_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    struct BlockDevice *device = ctx;
+    trace_request(device, TRACE_WRITE, block_index, count);
+    return device->trace.write_blocks(ctx, block_index, count, blocks);
+}
+
+static int traced_read_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    struct BlockDevice *device = ctx;
+    trace_request(device, TRACE_READ, block_index, count);
+    return device->trace.read_blocks(ctx, block_index, count, blocks);
+}
+
+static int traced_flush(void *ctx) {
+    struct BlockDevice *device = ctx;
+    trace_request(device, TRACE_FLUSH, 0, 0);
+    return device->trace.flush(ctx);
+}
+
+static int traced_discard(void *ctx, uint32_t block_index, uint32_t count) {
+    struct BlockDevice *device = ctx;
+    trace_request(device, TRACE_DISCARD, block_index, count);
+    return device->trace.discard(ctx, block_index, count);
+}
+
+/**
+ * The device reads and writes the blocks itself, so a copy is recorded as both
+ */
+static int traced_copy_blocks(void *ctx, uint32_t from, uint32_t to, uint32_t count) {
+    struct BlockDevice *device = ctx;
+    trace_request(device, TRACE_READ, from, count);
+    trace_request(device, TRACE_WRITE, to, count);
+    return device->trace.copy_blocks(ctx, from, to, count);
+}
+
+int device_enable_trace(struct CrowFS *fs, const char *path) {
+    struct BlockDevice *device = fs->ctx;
+    if (device->trace.file != NULL)
+        return -1;
+    device->trace.file = trace_create(path);
+    if (device->trace.file == NULL)
+        return -1;
+    device->trace.fs = fs;
+    device->trace.start = std_monotonic_nanoseconds(NULL);
+    // Route the IO through the trace
+    device->trace.write_block = fs->write_block;
+    device->trace.read_block = fs->read_block;
+    device->trace.write_blocks = fs->write_blocks;
+    device->trace.read_blocks = fs->read_blocks;
+    device->trace.flush = fs->flush;
+    device->trace.discard = fs->discard;
+    device->trace.copy_blocks = fs->copy_blocks;
+    fs->write_block = traced_write_block;
+    fs->read_block = traced_read_block;
+    fs->write_blocks = fs->write_blocks != NULL ? traced_write_blocks : NULL;
+    fs->read_blocks = fs->read_blocks != NULL ? traced_read_blocks : NULL;
+    fs->flush = fs->flush != NULL ? traced_flush : NULL;
+    fs->discard = fs->discard != NULL ? traced_discard : NULL;
+    fs->copy_blocks = fs->copy_blocks != NULL ? traced_copy_blocks : NULL;
+    return 0;
+}
+
+/**
+ * Allocates the state of a block device
+ * @return The device or NULL if out of memory
+ */
+static struct BlockDevice *device_new(void) {
+    struct BlockDevice *device = calloc(1, sizeof(struct BlockDevice));
+    if (device != NULL)
+        device->fd = -1;
+    return device;
+}
+
+int std_device_open(struct CrowFS *fs, const char *path) {
+    struct BlockDevice *device = device_new();
+    if (device == NULL)
+        return -1;
+    device->file = fopen(path, "r+b");
+    if (device->file == NULL) {
+        free(device);
+        return -1;
+    }
+    *fs = (struct CrowFS){
+        .allocate_mem_block = std_allocate_mem_block,
+        .free_mem_block = std_free_mem_block,
+        .write_block = std_write_block,
+        .read_block = std_read_block,
+        .write_blocks = std_write_blocks,
+        .read_blocks = std_read_blocks,
+        .flush = std_flush,
+        .discard = std_discard,
+        .copy_blocks = std_copy_blocks,
+        .total_blocks = std_total_blocks,
+        .current_date = std_current_date,
+        .monotonic_nanoseconds = std_monotonic_nanoseconds,
+        .ctx = device,
+    };
+    return 0;
+}
+
+int direct_device_open(struct CrowFS *fs, const char *path) {
+    struct BlockDevice *device = device_new();
+    if (device == NULL)
+        return -1;
+    device->fd = open(path, O_RDWR | O_DIRECT);
+    if (device->fd == -1) {
+        free(device);
+        return -1;
+    }
+    *fs = (struct CrowFS){
+        .allocate_mem_block = direct_allocate_mem_block,
+        .free_mem_block = direct_free_mem_block,
+        .write_block = direct_write_block,
+        .read_block = direct_read_block,
+        .write_blocks = direct_write_blocks,
+        .read_blocks = direct_read_blocks,
+        .flush = direct_flush,
+        .discard = direct_discard,
+        .copy_blocks = direct_copy_blocks,
+        .total_blocks = direct_total_blocks,
+        .current_date = std_current_date,
+        .monotonic_nanoseconds = std_monotonic_nanoseconds,
+        .ctx = device,
+    };
+    return 0;
+}
+
+void device_close(struct CrowFS *fs) {
+    struct BlockDevice *device = fs->ctx;
+    if (device == NULL)
+        return;
+    if (device->trace.file != NULL)
+        fclose(device->trace.file);
+    if (device->file != NULL)
+        fclose(device->file);
+    if (device->fd != -1)
+        close(device->fd);
+    for (size_t i = 0; i < device->pool.chunk_count; i++)
+        munmap(device->pool.chunks[i], DIRECT_POOL_CHUNK_SIZE);
+    free(device->pool.chunks);
+    free(device->cache.tags);
+    free(device->cache.data);
+    free(device);
+    fs->ctx = NULL;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "crowfs.h"
+
+/**
+ * Host side block devices which can back a CrowFS filesystem. Each function
+ * opens an image file and fills the block device callbacks of the given
+ * filesystem. The state of the device is stored in the ctx of the filesystem,
+ * so any number of devices can be open at the same time.
+ */
+
+/**
+ * Opens an image file using the buffered stdio functions. The flush callback
+ * empties the stdio buffer and syncs the file. The discard callback punches a
+ * hole in the file with fallocate and copy_blocks uses copy_file_range.
+ * @param fs The filesystem to fill its callbacks
+ * @param path The path of the image file
+ * @return 0 if ok, -1 otherwise (errno is set)
+ */
+int std_device_open(struct CrowFS *fs, const char *path);
+
+/**
+ * Opens an image file with O_DIRECT to bypass the kernel page cache.
+ * Memory blocks handed to CrowFS are 4096-byte aligned and carved from
+ * hugepage backed chunks when the kernel allows it. Discards and copies are
+ * done like std_device_open does.
+ * @param fs The filesystem to fill its callbacks
+ * @param path The path of the image file
+ * @return 0 if ok, -1 otherwise (errno is set)
+ */
+int direct_device_open(struct CrowFS *fs, const char *path);
+
+/**
+ * Puts a direct mapped write-through cache in front of the device of a filesystem.
+ * Single block requests, which are mostly metadata such as folders, dnodes and the
+ * free bitmap, are served from memory if they are cached.
+ * @param fs The filesystem which its device is opened with one of the functions above
+ * @param blocks Number of blocks to cache
+ * @return 0 if ok, -1 if out of memory
+ */
+int device_enable_cache(struct CrowFS *fs, size_t blocks);
+
+/**
+ * Records every block request of a filesystem to a trace file. See block_trace.h
+ * for the format. Enable the trace after the cache in order to record the requests
+ * which CrowFS issues rather than the ones which miss the cache.
+ * @param fs The filesystem which its device is opened with one of the functions above.
+ * The filesystem must not be moved while the trace is enabled.
+ * @param path The path of the trace file. It is overwritten if it exists.
+ * @return 0 if ok, -1 if the trace cannot be created or is already enabled
+ */
+int device_enable_trace(struct CrowFS *fs, const char *path);
+
+/**
+ * Gets the number of single block reads which were served by the cache
+ * @param fs The filesystem which its device is opened with one of the functions above
+ * @param hits Number of reads which were found in the cache
+ * @param misses Number of reads which went to the device. Zero if the cache is disabled.
+ */
+void device_cache_stats(const struct CrowFS *fs, uint64_t *hits, uint64_t *misses);
+
+/**
+ * Closes the device of a filesystem and releases its memory.
+ * @param fs The filesystem which its device is opened with one of the functions above
+ */
+void device_close(struct CrowFS *fs);
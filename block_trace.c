@@ -0,0 +1,44 @@
+#include <string.h>
+#include "block_trace.h"
+
+FILE *trace_create(const char *path) {
+    FILE *trace = fopen(path, "wb");
+    if (trace == NULL)
+        return NULL;
+    struct TraceHeader header = {
+        .version = TRACE_VERSION,
+        .record_size = sizeof(struct TraceRecord),
+    };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, trace) != 1) {
+        fclose(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+void trace_append(FILE *trace, struct TraceRecord record, uint32_t count) {
+    do {
+        record.count = count > UINT16_MAX ? UINT16_MAX : count;
+        fwrite(&record, sizeof(record), 1, trace);
+        record.block_index += record.count;
+        count -= record.count;
+    } while (count > 0);
+}
+
+FILE *trace_open(const char *path) {
+    FILE *trace = fopen(path, "rb");
+    if (trace == NULL)
+        return NULL;
+    struct TraceHeader header;
+    if (fread(&header, sizeof(header), 1, trace) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.record_size != sizeof(struct TraceRecord)) {
+        fclose(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+bool trace_next(FILE *trace, struct TraceRecord *record) {
+    return fread(record, sizeof(*record), 1, trace) == 1;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Block I/O traces. A trace file is a TraceHeader followed by TraceRecords in
+ * the order which the requests were issued. All numbers are little endian.
+ * A copy of blocks is recorded as a read of the source followed by a write of
+ * the target.
+ */
+
+/**
+ * Magic bytes at the start of each trace file
+ */
+#define TRACE_MAGIC "CROWTRCE"
+/**
+ * Current version of the trace format
+ */
+#define TRACE_VERSION 1
+/**
+ * Type of a block read request
+ */
+#define TRACE_READ 0
+/**
+ * Type of a block write request
+ */
+#define TRACE_WRITE 1
+/**
+ * Type of a flush request. Its block index and count are zero.
+ */
+#define TRACE_FLUSH 2
+/**
+ * Type of a discard request
+ */
+#define TRACE_DISCARD 3
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    // Size of each record in bytes
+    uint32_t record_size;
+};
+
+struct TraceRecord {
+    // Nanoseconds since the trace was started
+    uint64_t timestamp;
+    uint32_t block_index;
+    // Number of consecutive blocks of the request
+    uint16_t count;
+    // One of TRACE_*
+    uint8_t type;
+    // The CrowFS operation which issued the request. One of CROWFS_OP_*
+    uint8_t operation;
+};
+
+/**
+ * Creates a new trace file and writes its header
+ * @param path The path of the trace file
+ * @return The opened file or NULL on error (errno is set)
+ */
+FILE *trace_create(const char *path);
+
+/**
+ * Appends a record to a trace file. Requests which are larger than the count
+ * field are split into multiple records.
+ * @param trace The trace file created by trace_create
+ * @param record The record to append
+ * @param count Number of blocks of the request
+ */
+void trace_append(FILE *trace, struct TraceRecord record, uint32_t count);
+
+/**
+ * Opens a trace file for reading and validates its header
+ * @param path The path of the trace file
+ * @return The opened file positioned at the first record or NULL if the file
+ * cannot be opened or is not a trace
+ */
+FILE *trace_open(const char *path);
+
+/**
+ * Reads the next record of a trace
+ * @param trace The trace file opened by trace_open
+ * @param record The read record
+ * @return true if a record is read, false at the end of the trace
+ */
+bool trace_next(FILE *trace, struct TraceRecord *record);
@@ -0,0 +1,880 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "block_device.h"
+#include "commands.h"
+#include "copy_tree.h"
+#include "image_builder.h"
+
+#define MIN(x, y) ((x < y) ? (x) : (y))
+
+/**
+ * Size of the chunks which are moved between the host and the file system
+ */
+#define COPY_CHUNK_SIZE (64 * CROWFS_BLOCK_SIZE)
+/**
+ * Prefix of the files created by the bench command
+ */
+#define BENCH_FILE_PREFIX "/.bench"
+/**
+ * Maximum length of a host path
+ */
+#define HOST_PATH_MAX 4096
+/**
+ * Maximum length of each line of a batch script
+ */
+#define BATCH_LINE_MAX 16384
+/**
+ * Maximum number of arguments of each command in a batch script
+ */
+#define BATCH_MAX_ARGS 64
+/**
+ * Default number of blocks which the defrag command moves in each step
+ */
+#define DEFRAG_DEFAULT_SLICE 256
+
+char file_type_to_char(uint8_t type) {
+    switch (type) {
+        case CROWFS_ENTITY_FILE:
+            return 'F';
+        case CROWFS_ENTITY_FOLDER:
+            return 'D';
+        default:
+            assert(0);
+    }
+}
+
+/**
+ * Resolves a host path against the working directory of the command
+ * @param ctx The command context
+ * @param path The path given by the user
+ * @param buffer A buffer with HOST_PATH_MAX bytes to build the path in
+ * @return The resolved path. Might be path itself or buffer.
+ */
+static const char *host_path(const struct CommandContext *ctx, const char *path, char *buffer) {
+    if (ctx->cwd == NULL || path[0] == '/')
+        return path;
+    snprintf(buffer, HOST_PATH_MAX, "%s/%s", ctx->cwd, path);
+    return buffer;
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int command_new(const struct CommandContext *ctx, int argc, char *argv[]) {
+    // Create a new filesystem. With -l, the free bitmap is written lazily, with -s,
+    // the summary of the full bitmap blocks is kept in the superblock, with -j,
+    // the metadata is journaled and with -r, files can share data blocks.
+    uint32_t features = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0)
+            features |= CROWFS_FEATURE_LAZY_BITMAP;
+        else if (strcmp(argv[i], "-s") == 0)
+            features |= CROWFS_FEATURE_BITMAP_SUMMARY;
+        else if (strcmp(argv[i], "-j") == 0)
+            features |= CROWFS_FEATURE_JOURNAL;
+        else if (strcmp(argv[i], "-r") == 0)
+            features |= CROWFS_FEATURE_REFCOUNT;
+    }
+    int result = crowfs_format(ctx->fs, features);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot create the filesystem: error %d\n", result);
+        return 1;
+    }
+    fprintf(ctx->out, "File system created with %u blocks\n", ctx->fs->superblock.blocks);
+    return 0;
+}
+
+static int command_build(const struct CommandContext *ctx, int argc, char *argv[]) {
+    char path_buffer[HOST_PATH_MAX];
+    if (argc < 2) {
+        fputs("Please pass the host folder to build the file system from to the program\n", ctx->out);
+        return 1;
+    }
+    return image_build(ctx, host_path(ctx, argv[1], path_buffer));
+}
+
+static int command_copyin(const struct CommandContext *ctx, int argc, char *argv[]) {
+    int exit_code = 0;
+    char path_buffer[HOST_PATH_MAX], *buffer = NULL;
+    // Copy a file from host to the file system
+    if (argc < 3) {
+        fputs("Please pass the source file and destination filename to the program\n", ctx->out);
+        return 1;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        if (argc < 4) {
+            fputs("Please pass the source folder and destination folder to the program\n", ctx->out);
+            return 1;
+        }
+        return copy_tree_in(ctx, host_path(ctx, argv[2], path_buffer), argv[3]);
+    }
+    // Open the host file
+    FILE *host_file = fopen(host_path(ctx, argv[1], path_buffer), "rb");
+    if (host_file == NULL) {
+        fprintf(ctx->out, "cannot open host file: %s\n", strerror(errno));
+        return 1;
+    }
+    // Open the file in the file system
+    uint32_t fs_file, temp;
+    int result = crowfs_open_absolute(ctx->fs, argv[2], &fs_file, &temp, CROWFS_O_CREATE);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot create the file: error %d\n", result);
+        exit_code = 1;
+        goto end;
+    }
+    // Copy the file in big chunks to let the file system write multiple blocks at once
+    buffer = malloc(COPY_CHUNK_SIZE);
+    size_t offset = 0;
+    while (1) {
+        // Read a chunk
+        size_t n = fread(buffer, sizeof(char), COPY_CHUNK_SIZE, host_file);
+        if (n == 0 && feof(host_file)) {
+            // did we reach eof?
+            break;
+        }
+        // Write to file system
+        result = crowfs_write(ctx->fs, fs_file, buffer, n, offset);
+        if (result != CROWFS_OK) {
+            fprintf(ctx->out, "cannot write the file: error %d\n", result);
+            exit_code = 1;
+            goto end;
+        }
+        // Advance pointer
+        offset += n;
+    }
+    // Done
+    fprintf(ctx->out, "Copied %zu bytes to file system\n", offset);
+
+end:
+    free(buffer);
+    fclose(host_file);
+    return exit_code;
+}
+
+static int command_copyout(const struct CommandContext *ctx, int argc, char *argv[]) {
+    int exit_code = 0;
+    char path_buffer[HOST_PATH_MAX], *buffer = NULL;
+    // Copy a file from file system to the host
+    if (argc < 3) {
+        fputs("Please pass the source file and destination filename to the program\n", ctx->out);
+        return 1;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        if (argc < 4) {
+            fputs("Please pass the source folder and destination folder to the program\n", ctx->out);
+            return 1;
+        }
+        return copy_tree_out(ctx, argv[2], host_path(ctx, argv[3], path_buffer));
+    }
+    // Open the host file
+    FILE *host_file = fopen(host_path(ctx, argv[2], path_buffer), "wb");
+    if (host_file == NULL) {
+        fprintf(ctx->out, "cannot open host file: %s\n", strerror(errno));
+        return 1;
+    }
+    // Open the file in the file system
+    uint32_t fs_file, temp;
+    int result = crowfs_open_absolute(ctx->fs, argv[1], &fs_file, &temp, 0);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot open the file: error %d\n", result);
+        exit_code = 1;
+        goto end;
+    }
+    // Copy the file in big chunks to let the file system read multiple blocks at once
+    buffer = malloc(COPY_CHUNK_SIZE);
+    size_t offset = 0;
+    while (1) {
+        // Read a chunk
+        result = crowfs_read(ctx->fs, fs_file, buffer, COPY_CHUNK_SIZE, offset);
+        if (result < 0) {
+            fprintf(ctx->out, "cannot read the file: error %d\n", result);
+            exit_code = 1;
+            goto end;
+        }
+        if (result == 0)
+            break; // EOF
+        // Write to file system
+        size_t fwrite_result = fwrite(buffer, sizeof(char), result, host_file);
+        if (fwrite_result != result) {
+            fputs("short write\n", ctx->out);
+            exit_code = 1;
+            goto end;
+        }
+        // Advance pointer
+        offset += result;
+    }
+    // Done
+    fprintf(ctx->out, "Copied %zu bytes from file system\n", offset);
+
+end:
+    free(buffer);
+    fclose(host_file);
+    return exit_code;
+}
+
+static int command_ls(const struct CommandContext *ctx, int argc, char *argv[]) {
+    if (argc < 2) {
+        fputs("Please pass the folder path to list to the program\n", ctx->out);
+        return 1;
+    }
+    // Open the directory in the file system
+    uint32_t directory, temp;
+    int result = crowfs_open_absolute(ctx->fs, argv[1], &directory, &temp, 0);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot open the directory: error %d\n", result);
+        return 1;
+    }
+    // Read each file
+    fprintf(ctx->out, "Listing all files and directories in %s\n", argv[1]);
+    size_t offset = 0;
+    while (1) {
+        struct CrowFSStat stat;
+        result = crowfs_read_dir(ctx->fs, directory, &stat, offset);
+        if (result == CROWFS_ERR_LIMIT) // end
+            break;
+        if (result != CROWFS_OK) {
+            fprintf(ctx->out, "cannot read the directory: error %d\n", result);
+            return 1;
+        }
+        // Print the data
+        fprintf(ctx->out, "%c\t%s\t%u\t%lld\n",
+                file_type_to_char(stat.type), stat.name, stat.size, (long long) stat.creation_date);
+        // Read next dir
+        offset++;
+    }
+    return 0;
+}
+
+/**
+ * Measures the sequential write and read throughput of the file system by writing
+ * some files with the maximum size, reading them back and deleting them.
+ */
+static int command_bench(const struct CommandContext *ctx, int argc, char *argv[]) {
+    if (argc < 2) {
+        fputs("Please pass the number of megabytes to write and read to the program\n", ctx->out);
+        return 1;
+    }
+    struct CrowFS *fs = ctx->fs;
+    const size_t megabytes = strtoul(argv[1], NULL, 10);
+    const size_t total_bytes = megabytes * 1024 * 1024;
+    const size_t file_count = (total_bytes + CROWFS_MAX_FILESIZE - 1) / CROWFS_MAX_FILESIZE;
+    int exit_code = 0;
+    char *buffer = malloc(COPY_CHUNK_SIZE);
+    uint32_t *files = calloc(file_count, sizeof(uint32_t));
+    if (buffer == NULL || files == NULL) {
+        fputs("out of memory\n", ctx->out);
+        exit_code = 1;
+        goto end;
+    }
+    for (size_t i = 0; i < COPY_CHUNK_SIZE; i++)
+        buffer[i] = (char) i;
+    // Write the files
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t remaining = total_bytes;
+    for (size_t i = 0; i < file_count; i++) {
+        char name[32];
+        uint32_t parent;
+        snprintf(name, sizeof(name), BENCH_FILE_PREFIX "%zu", i);
+        int result = crowfs_open_absolute(fs, name, &files[i], &parent, CROWFS_O_CREATE);
+        if (result != CROWFS_OK) {
+            fprintf(ctx->out, "cannot create the file: error %d\n", result);
+            exit_code = 1;
+            goto end;
+        }
+        const size_t file_size = MIN(remaining, CROWFS_MAX_FILESIZE);
+        for (size_t offset = 0; offset < file_size; offset += COPY_CHUNK_SIZE) {
+            result = crowfs_write(fs, files[i], buffer, MIN(COPY_CHUNK_SIZE, file_size - offset), offset);
+            if (result != CROWFS_OK) {
+                fprintf(ctx->out, "cannot write the file: error %d\n", result);
+                exit_code = 1;
+                goto end;
+            }
+        }
+        remaining -= file_size;
+    }
+    double write_time = elapsed_seconds(&start);
+    // Read them back
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < file_count; i++) {
+        size_t offset = 0;
+        while (1) {
+            int result = crowfs_read(fs, files[i], buffer, COPY_CHUNK_SIZE, offset);
+            if (result < 0) {
+                fprintf(ctx->out, "cannot read the file: error %d\n", result);
+                exit_code = 1;
+                goto end;
+            }
+            if (result == 0)
+                break;
+            offset += result;
+        }
+    }
+    double read_time = elapsed_seconds(&start);
+    fprintf(ctx->out, "Sequential write: %.2f MB/s\n", (double) megabytes / write_time);
+    fprintf(ctx->out, "Sequential read: %.2f MB/s\n", (double) megabytes / read_time);
+
+end:
+    // Cleanup the files we have created
+    for (size_t i = 0; files != NULL && i < file_count; i++)
+        if (files[i] != 0)
+            crowfs_delete(fs, files[i], fs->root_dnode);
+    free(buffer);
+    free(files);
+    return exit_code;
+}
+
+/**
+ * Gets a percentile of a latency histogram of CrowFS
+ * @return The upper bound of the bucket which contains the percentile in nanoseconds
+ */
+static uint64_t latency_percentile(const struct CrowFSOperationStats *stats, double percentile) {
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < CROWFS_STATS_LATENCY_BUCKETS; i++)
+        total += stats->latency_histogram[i];
+    if (total == 0)
+        return 0;
+    for (int i = 0; i < CROWFS_STATS_LATENCY_BUCKETS; i++) {
+        seen += stats->latency_histogram[i];
+        if ((double) seen >= percentile * (double) total)
+            return (uint64_t) 1 << (i + 1);
+    }
+    return (uint64_t) 1 << CROWFS_STATS_LATENCY_BUCKETS;
+}
+
+/**
+ * Copies a file inside the image with crowfs_copy. The data does not leave the image.
+ * With --reflink, the copy shares the data blocks of the file with crowfs_clone.
+ */
+static int command_cp(const struct CommandContext *ctx, int argc, char *argv[]) {
+    const bool reflink = argc > 3 && strcmp(argv[1], "--reflink") == 0;
+    if (reflink) {
+        argc--;
+        argv++;
+    }
+    if (argc != 3) {
+        fputs("Usage: cp [--reflink] <file> <new file>\n", ctx->out);
+        return 1;
+    }
+    uint32_t source, folder, parent, copy;
+    int result = crowfs_open_absolute(ctx->fs, argv[1], &source, &parent, 0);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot open the file: error %d\n", result);
+        return 1;
+    }
+    // Split the destination into its folder and its name
+    char folder_path[HOST_PATH_MAX];
+    const char *name = strrchr(argv[2], '/');
+    if (name == NULL || name[1] == '\0' || (size_t) (name - argv[2]) >= sizeof(folder_path)) {
+        fputs("the destination must be an absolute path of a file\n", ctx->out);
+        return 1;
+    }
+    const size_t folder_length = name == argv[2] ? 1 : name - argv[2];
+    memcpy(folder_path, argv[2], folder_length);
+    folder_path[folder_length] = '\0';
+    result = crowfs_open_absolute(ctx->fs, folder_path, &folder, &parent, CROWFS_O_DIR);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot open the destination folder: error %d\n", result);
+        return 1;
+    }
+    result = reflink ? crowfs_clone(ctx->fs, source, folder, name + 1, &copy)
+                     : crowfs_copy(ctx->fs, source, folder, name + 1, &copy);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot copy the file: error %d\n", result);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Deletes a file or an empty folder. With -r, a folder is deleted with everything
+ * in it by a single crowfs_delete_recursive call.
+ */
+static int command_rm(const struct CommandContext *ctx, int argc, char *argv[]) {
+    const bool recursive = argc > 2 && strcmp(argv[1], "-r") == 0;
+    if (argc < 2 || (argc > 2 && !recursive)) {
+        fputs("Usage: rm [-r] <path>\n", ctx->out);
+        return 1;
+    }
+    uint32_t dnode, parent;
+    int result = crowfs_open_absolute(ctx->fs, argv[argc - 1], &dnode, &parent, 0);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot open the file: error %d\n", result);
+        return 1;
+    }
+    result = recursive ? crowfs_delete_recursive(ctx->fs, dnode, parent) : crowfs_delete(ctx->fs, dnode, parent);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot delete the file: error %d\n", result);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Makes a file or folder, or the whole filesystem if no path is given, durable
+ * on the image. Mostly useful in batch and server mode, where the image stays
+ * mounted between the commands.
+ */
+static int command_sync(const struct CommandContext *ctx, int argc, char *argv[]) {
+    int result;
+    if (argc > 1) {
+        uint32_t dnode, parent;
+        result = crowfs_open_absolute(ctx->fs, argv[1], &dnode, &parent, 0);
+        if (result != CROWFS_OK) {
+            fprintf(ctx->out, "cannot open the file: error %d\n", result);
+            return 1;
+        }
+        result = crowfs_fsync(ctx->fs, dnode);
+    } else {
+        result = crowfs_sync(ctx->fs);
+    }
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot sync the filesystem: error %d\n", result);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Discards every free block of the image, so it takes less space on the host
+ */
+static int command_trim(const struct CommandContext *ctx, int argc, char *argv[]) {
+    uint32_t trimmed;
+    const int result = crowfs_trim(ctx->fs, &trimmed);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot trim the filesystem: error %d\n", result);
+        return 1;
+    }
+    fprintf(ctx->out, "trimmed %u blocks\n", trimmed);
+    return 0;
+}
+
+/**
+ * Creates, lists or deletes the snapshots of the filesystem. A snapshot can be
+ * read with the --snapshot option of the interactor while the image changes.
+ */
+static int command_snapshot(const struct CommandContext *ctx, int argc, char *argv[]) {
+    int result;
+    if (argc == 3 && strcmp(argv[1], "create") == 0) {
+        uint32_t snapshot;
+        result = crowfs_snapshot_create(ctx->fs, argv[2], &snapshot);
+        if (result != CROWFS_OK) {
+            fprintf(ctx->out, "cannot create the snapshot: error %d\n", result);
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "rm") == 0) {
+        result = crowfs_snapshot_delete(ctx->fs, argv[2]);
+        if (result != CROWFS_OK) {
+            fprintf(ctx->out, "cannot delete the snapshot: error %d\n", result);
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "list") == 0) {
+        struct CrowFSStat stat;
+        for (size_t offset = 0; (result = crowfs_snapshot_list(ctx->fs, &stat, offset)) == CROWFS_OK; offset++)
+            fprintf(ctx->out, "%s\t%lld\n", stat.name, (long long) stat.creation_date);
+        if (result != CROWFS_ERR_LIMIT) {
+            fprintf(ctx->out, "cannot list the snapshots: error %d\n", result);
+            return 1;
+        }
+        return 0;
+    }
+    fputs("Usage: snapshot create <name> | snapshot list | snapshot rm <name>\n", ctx->out);
+    return 1;
+}
+
+/**
+ * Prints the statistics of the filesystem which are collected since it was
+ * mounted. Mostly useful in batch and server mode. "stats reset" zeros them.
+ */
+static int command_stats(const struct CommandContext *ctx, int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        crowfs_reset_stats(ctx->fs);
+        return 0;
+    }
+    struct CrowFSStats stats;
+    if (crowfs_get_stats(ctx->fs, &stats) != CROWFS_OK) {
+        fputs("CrowFS is compiled without statistics\n", ctx->out);
+        return 1;
+    }
+    fputs("operation\tcalls\tblock_reads\tblock_writes\tread_requests\twrite_requests\tbytes_read\tbytes_written"
+          "\tbitmap_blocks_scanned\tbitmap_blocks_skipped\tdir_entries_compared\tp50_ns\tp99_ns\n", ctx->out);
+    for (uint8_t op = CROWFS_OP_NONE + 1; op < CROWFS_OP_COUNT; op++) {
+        const struct CrowFSOperationStats *op_stats = &stats.operations[op];
+        if (op_stats->calls == 0)
+            continue;
+        fprintf(ctx->out, "%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+                crowfs_operation_name(op), (unsigned long long) op_stats->calls,
+                (unsigned long long) op_stats->block_reads, (unsigned long long) op_stats->block_writes,
+                (unsigned long long) op_stats->read_requests, (unsigned long long) op_stats->write_requests,
+                (unsigned long long) op_stats->bytes_read, (unsigned long long) op_stats->bytes_written,
+                (unsigned long long) op_stats->bitmap_blocks_scanned,
+                (unsigned long long) op_stats->bitmap_blocks_skipped,
+                (unsigned long long) op_stats->dir_entries_compared,
+                (unsigned long long) latency_percentile(op_stats, 0.5),
+                (unsigned long long) latency_percentile(op_stats, 0.99));
+    }
+    uint64_t hits, misses;
+    device_cache_stats(ctx->fs, &hits, &misses);
+    fprintf(ctx->out, "cache\t%llu hits\t%llu misses\t%.2f%% hit rate\n", (unsigned long long) hits,
+            (unsigned long long) misses, hits + misses == 0 ? 0.0 : 100.0 * (double) hits / (double) (hits + misses));
+    return 0;
+}
+
+/**
+ * Totals of a defrag command
+ */
+struct DefragTotals {
+    uint32_t files, fragmented_files, extents_before, extents_after, moved_blocks;
+};
+
+/**
+ * Measures and optionally defragments the files in a folder and its subfolders
+ * @param ctx The context of the command
+ * @param folder The folder dnode
+ * @param path The path of the folder. Used for printing.
+ * @param slice Number of blocks to move in each crowfs_defrag call or 0 to only measure
+ * @param totals The totals of the command are updated
+ * @return 0 if ok, 1 on error
+ */
+static int defrag_folder(const struct CommandContext *ctx, uint32_t folder, const char *path, uint32_t slice,
+                         struct DefragTotals *totals) {
+    for (size_t offset = 0;; offset++) {
+        struct CrowFSStat stat;
+        int result = crowfs_read_dir(ctx->fs, folder, &stat, offset);
+        if (result == CROWFS_ERR_LIMIT) // end
+            return 0;
+        if (result != CROWFS_OK) {
+            fprintf(ctx->out, "cannot read the directory %s: error %d\n", path, result);
+            return 1;
+        }
+        char child_path[HOST_PATH_MAX];
+        snprintf(child_path, sizeof(child_path), "%s/%s", strcmp(path, "/") == 0 ? "" : path, stat.name);
+        if (stat.type == CROWFS_ENTITY_FOLDER) {
+            if (defrag_folder(ctx, stat.dnode, child_path, slice, totals) != 0)
+                return 1;
+            continue;
+        }
+        struct CrowFSFragmentation before, after;
+        if ((result = crowfs_fragmentation(ctx->fs, stat.dnode, &before)) != CROWFS_OK) {
+            fprintf(ctx->out, "cannot measure %s: error %d\n", child_path, result);
+            return 1;
+        }
+        after = before;
+        // Defragment in slices, so each call takes a bounded time
+        uint32_t cursor = 0;
+        while (slice != 0 && before.extents > 1 && cursor != CROWFS_DEFRAG_DONE) {
+            result = crowfs_defrag(ctx->fs, stat.dnode, &cursor, slice);
+            if (result < 0) {
+                fprintf(ctx->out, "cannot defragment %s: error %d\n", child_path, result);
+                return 1;
+            }
+            totals->moved_blocks += result;
+        }
+        if (slice != 0 && before.extents > 1 && crowfs_fragmentation(ctx->fs, stat.dnode, &after) != CROWFS_OK)
+            return 1;
+        totals->files++;
+        totals->extents_before += before.extents;
+        totals->extents_after += after.extents;
+        if (before.extents > 1) {
+            totals->fragmented_files++;
+            fprintf(ctx->out, "%s\t%u blocks\t%u extents", child_path, before.blocks, before.extents);
+            if (slice != 0)
+                fprintf(ctx->out, " -> %u", after.extents);
+            fputc('\n', ctx->out);
+        }
+    }
+}
+
+/**
+ * Prints the fragmented files under a folder and relocates their blocks into
+ * contiguous runs. With -s, the files are only measured.
+ */
+static int command_defrag(const struct CommandContext *ctx, int argc, char *argv[]) {
+    uint32_t slice = DEFRAG_DEFAULT_SLICE;
+    const char *path = "/";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            slice = 0;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            slice = strtoul(argv[++i], NULL, 10);
+            if (slice == 0) {
+                fputs("The number of blocks of each step must be positive\n", ctx->out);
+                return 1;
+            }
+        } else {
+            path = argv[i];
+        }
+    }
+    uint32_t folder, temp;
+    int result = crowfs_open_absolute(ctx->fs, path, &folder, &temp, CROWFS_O_DIR);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot open the directory: error %d\n", result);
+        return 1;
+    }
+    struct DefragTotals totals = {0};
+    if (defrag_folder(ctx, folder, path, slice, &totals) != 0)
+        return 1;
+    fprintf(ctx->out, "%u of %u files are fragmented, %u extents", totals.fragmented_files, totals.files,
+            totals.extents_before);
+    if (slice != 0)
+        fprintf(ctx->out, " -> %u, moved %u blocks", totals.extents_after, totals.moved_blocks);
+    fputc('\n', ctx->out);
+    return 0;
+}
+
+static int command_latency(const struct CommandContext *ctx, int argc, char *argv[]) {
+    if (ctx->latencies == NULL) {
+        fputs("latencies are not recorded\n", ctx->out);
+        return 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        for (int op = 0; op < CROWFS_OP_COUNT; op++)
+            latency_histogram_reset(&ctx->latencies->operations[op]);
+        return 0;
+    }
+    fputs("operation\tcalls\tmin_ns\tmean_ns\tp50_ns\tp90_ns\tp99_ns\tp999_ns\tmax_ns\n", ctx->out);
+    for (uint8_t op = CROWFS_OP_NONE + 1; op < CROWFS_OP_COUNT; op++) {
+        const struct LatencyHistogram *histogram = &ctx->latencies->operations[op];
+        if (histogram->total == 0)
+            continue;
+        fprintf(ctx->out, "%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+                crowfs_operation_name(op), (unsigned long long) histogram->total,
+                (unsigned long long) histogram->min, (unsigned long long) (histogram->sum / histogram->total),
+                (unsigned long long) latency_histogram_percentile(histogram, 0.5),
+                (unsigned long long) latency_histogram_percentile(histogram, 0.9),
+                (unsigned long long) latency_histogram_percentile(histogram, 0.99),
+                (unsigned long long) latency_histogram_percentile(histogram, 0.999),
+                (unsigned long long) histogram->max);
+    }
+    return 0;
+}
+
+static int command_batch(const struct CommandContext *ctx, int argc, char *argv[]);
+
+/**
+ * List of all commands of the interactor
+ */
+static const struct {
+    const char *name;
+    int (*run)(const struct CommandContext *ctx, int argc, char *argv[]);
+} commands[] = {
+    {"new", command_new},
+    {"build", command_build},
+    {"copyin", command_copyin},
+    {"copyout", command_copyout},
+    {"ls", command_ls},
+    {"rm", command_rm},
+    {"cp", command_cp},
+    {"bench", command_bench},
+    {"stats", command_stats},
+    {"sync", command_sync},
+    {"trim", command_trim},
+    {"snapshot", command_snapshot},
+    {"latency", command_latency},
+    {"defrag", command_defrag},
+    {"batch", command_batch},
+};
+
+/**
+ * Splits a line of a batch script into arguments. Arguments are separated by
+ * whitespace. Double quotes can be used to have whitespace in an argument and
+ * backslash escapes the next character. Everything after a # is a comment.
+ * @param line The line to split. It is modified in place.
+ * @param argv The arguments are stored here
+ * @return Number of arguments or -1 if there are too many of them or a quote is not closed
+ */
+static int batch_split_line(char *line, char *argv[BATCH_MAX_ARGS]) {
+    int argc = 0;
+    char *read = line, *write = line;
+    while (1) {
+        // Skip the whitespace between the arguments
+        while (*read == ' ' || *read == '\t' || *read == '\n' || *read == '\r')
+            read++;
+        if (*read == '\0' || *read == '#')
+            return argc;
+        if (argc == BATCH_MAX_ARGS)
+            return -1;
+        argv[argc++] = write;
+        bool quoted = false;
+        while (*read != '\0') {
+            if (*read == '\\' && read[1] != '\0') {
+                *write++ = read[1];
+                read += 2;
+            } else if (*read == '"') {
+                quoted = !quoted;
+                read++;
+            } else if (!quoted && (*read == ' ' || *read == '\t' || *read == '\n' || *read == '\r')) {
+                break;
+            } else {
+                *write++ = *read++;
+            }
+        }
+        if (quoted)
+            return -1;
+        // Terminate the argument. The terminator never passes the read pointer.
+        const bool end = *read == '\0';
+        *write++ = '\0';
+        if (end)
+            return argc;
+        read++;
+    }
+}
+
+/**
+ * Runs the commands of a script or the input one after another on the same
+ * mounted filesystem. The output of each command is followed by its timing
+ * and a summary of all commands comes at the end. Lines of timings start with
+ * a # to be distinguishable from the output of the commands.
+ */
+static int command_batch(const struct CommandContext *ctx, int argc, char *argv[]) {
+    bool stop_on_error = false, transaction = false;
+    const char *script = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-e") == 0)
+            stop_on_error = true;
+        else if (strcmp(argv[i], "-t") == 0)
+            transaction = true;
+        else
+            script = argv[i];
+    }
+    // Open the script
+    FILE *input = ctx->in;
+    char path_buffer[HOST_PATH_MAX];
+    if (script != NULL) {
+        input = fopen(host_path(ctx, script, path_buffer), "r");
+        if (input == NULL) {
+            fprintf(ctx->out, "cannot open the script: %s\n", strerror(errno));
+            return 1;
+        }
+    } else if (input == NULL) {
+        fputs("Please pass the script to run to the program\n", ctx->out);
+        return 1;
+    }
+    // Commands which run inside the batch
+    struct CommandContext batch_ctx = *ctx;
+    batch_ctx.in = NULL;
+    // Timing of each command type
+    struct {
+        size_t count, failed;
+        double seconds;
+    } stats[sizeof(commands) / sizeof(commands[0])] = {0};
+    size_t total_count = 0, total_failed = 0, line_number = 0;
+    double total_seconds = 0;
+    int exit_code = 0;
+    // The filesystem is initialized once by the first command which needs it,
+    // unless the caller has mounted it already
+    bool initialized = ctx->initialized;
+    // With -t, the metadata writes of all commands are written together at the end
+    if (transaction && crowfs_txn_begin(ctx->fs) != CROWFS_OK) {
+        fputs("cannot begin the transaction\n", ctx->out);
+        if (script != NULL)
+            fclose(input);
+        return 1;
+    }
+    char *line = malloc(BATCH_LINE_MAX);
+    while (line != NULL && fgets(line, BATCH_LINE_MAX, input) != NULL) {
+        line_number++;
+        char *command_argv[BATCH_MAX_ARGS + 1];
+        int command_argc = batch_split_line(line, command_argv);
+        if (command_argc == 0)
+            continue;
+        total_count++;
+        if (command_argc == -1) {
+            fprintf(ctx->out, "# %zu: invalid line\n", line_number);
+            total_failed++;
+            exit_code = 1;
+            if (stop_on_error)
+                break;
+            continue;
+        }
+        command_argv[command_argc] = NULL;
+        // Find the command
+        size_t command_index;
+        for (command_index = 0; command_index < sizeof(commands) / sizeof(commands[0]); command_index++)
+            if (strcmp(command_argv[0], commands[command_index].name) == 0)
+                break;
+        if (command_index == sizeof(commands) / sizeof(commands[0]) || commands[command_index].run == command_batch) {
+            fprintf(ctx->out, "# %zu: invalid command %s\n", line_number, command_argv[0]);
+            total_failed++;
+            exit_code = 1;
+            if (stop_on_error)
+                break;
+            continue;
+        }
+        // Run it
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result;
+        if (!initialized && command_needs_init(command_argv[0]) && (result = crowfs_init(ctx->fs)) != CROWFS_OK) {
+            fprintf(ctx->out, "cannot open the filesystem: error %d\n", result);
+            result = 1;
+        } else {
+            // build writes the image without the library, so the kept blocks must not overwrite it later
+            if (transaction && commands[command_index].run == command_build &&
+                (crowfs_txn_commit(ctx->fs) != CROWFS_OK || crowfs_txn_begin(ctx->fs) != CROWFS_OK))
+                fputs("# cannot commit the transaction\n", ctx->out);
+            result = commands[command_index].run(&batch_ctx, command_argc, command_argv);
+            // Either crowfs_init is done or new has created the filesystem
+            initialized = initialized || command_needs_init(command_argv[0]) || result == 0;
+        }
+        double seconds = elapsed_seconds(&start);
+        fprintf(ctx->out, "# %zu: %s exited with %d in %.3f ms\n", line_number, command_argv[0], result,
+                seconds * 1000);
+        stats[command_index].count++;
+        stats[command_index].seconds += seconds;
+        total_seconds += seconds;
+        if (result != 0) {
+            stats[command_index].failed++;
+            total_failed++;
+            exit_code = 1;
+            if (stop_on_error)
+                break;
+        }
+    }
+    if (transaction && crowfs_txn_commit(ctx->fs) != CROWFS_OK) {
+        fputs("# cannot commit the transaction\n", ctx->out);
+        exit_code = 1;
+    }
+    // Print the summary
+    fprintf(ctx->out, "# %zu commands, %zu failed, %.3f ms total\n", total_count, total_failed,
+            total_seconds * 1000);
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        if (stats[i].count != 0)
+            fprintf(ctx->out, "# %s: %zu commands, %zu failed, %.3f ms total, %.3f ms average\n",
+                    commands[i].name, stats[i].count, stats[i].failed, stats[i].seconds * 1000,
+                    stats[i].seconds * 1000 / (double) stats[i].count);
+    free(line);
+    if (script != NULL)
+        fclose(input);
+    return exit_code;
+}
+
+
+int command_needs_init(const char *command) {
+    // batch initializes the filesystem itself because the script might start with new
+    return strcmp(command, "new") != 0 && strcmp(command, "build") != 0 && strcmp(command, "batch") != 0;
+}
+
+int command_run(const struct CommandContext *ctx, int argc, char *argv[]) {
+    if (argc < 1) {
+        fputs("Invalid command\n", ctx->out);
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        if (strcmp(argv[0], commands[i].name) == 0)
+            return commands[i].run(ctx, argc, argv);
+    fputs("Invalid command\n", ctx->out);
+    return 1;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "crowfs.h"
+#include "latency_histogram.h"
+
+/**
+ * Everything which an interactor command needs to run
+ */
+struct CommandContext {
+    // The filesystem to run the command on. It must be initialized
+    // with crowfs_init unless the command is "new".
+    struct CrowFS *fs;
+    // Set if fs is initialized already. batch initializes it otherwise.
+    bool initialized;
+    // Relative host paths are resolved against this folder. If NULL,
+    // the current working directory of the process is used.
+    const char *cwd;
+    // The output of the command is written here
+    FILE *out;
+    // The input of the command. Might be NULL if there is no input.
+    FILE *in;
+    // Number of worker threads which the command can use
+    int threads;
+    // The latencies which the operation hooks of fs record. Might be NULL.
+    struct OperationLatencies *latencies;
+};
+
+/**
+ * Checks if a command needs an initialized filesystem
+ * @param command The command name
+ * @return 1 if crowfs_init must be called before running the command, otherwise 0
+ */
+int command_needs_init(const char *command);
+
+/**
+ * Runs a single interactor command
+ * @param ctx The context of the command
+ * @param argc Number of arguments including the command name
+ * @param argv The command name followed by its arguments
+ * @return The exit code of the command. 0 if ok, 1 otherwise
+ */
+int command_run(const struct CommandContext *ctx, int argc, char *argv[]);
@@ -0,0 +1,384 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "copy_tree.h"
+
+/**
+ * A file which must be transferred by the workers
+ */
+struct CopyJob {
+    // The path of the file on host
+    char *host_path;
+    // The dnode of the file in the file system
+    uint32_t dnode;
+    // Size of the file in the file system. Only used when copying out.
+    uint32_t size;
+};
+
+/**
+ * State of a recursive copy which is shared between the walker and the workers.
+ * The walker runs on the thread of the command and creates the folders and the
+ * dnodes of the files, then queues the files. Workers transfer the files. Each
+ * file is moved with a single crowfs_write or crowfs_read call, so its blocks
+ * are allocated contiguously and only the host I/O happens in parallel.
+ */
+struct CopyTree {
+    const struct CommandContext *ctx;
+    // The library is not thread safe. This lock guards ctx->fs, ctx->out and the results.
+    pthread_mutex_t fs_lock;
+    // Queue of the files which are not transferred yet
+    struct CopyJob *jobs;
+    size_t job_count, job_capacity, next_job;
+    // Is the walker done queueing the jobs?
+    bool walk_done;
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t jobs_cond;
+    // Results
+    int exit_code;
+    size_t files, folders, bytes;
+};
+
+/**
+ * Reports an error. fs_lock must be held.
+ */
+#define COPY_ERROR(tree, ...) do { \
+    fprintf((tree)->ctx->out, __VA_ARGS__); \
+    (tree)->exit_code = 1; \
+} while (0)
+
+static char *join_path(const char *folder, const char *name) {
+    size_t folder_length = strlen(folder), name_length = strlen(name);
+    char *result = malloc(folder_length + name_length + 2);
+    if (result == NULL)
+        return NULL;
+    memcpy(result, folder, folder_length);
+    result[folder_length] = '/';
+    memcpy(result + folder_length + 1, name, name_length + 1);
+    return result;
+}
+
+/**
+ * Queues a file for the workers. Takes the ownership of host_path.
+ * @return 0 if ok, 1 if out of memory
+ */
+static int copy_tree_push(struct CopyTree *tree, char *host_path, uint32_t dnode, uint32_t size) {
+    pthread_mutex_lock(&tree->jobs_lock);
+    if (tree->job_count == tree->job_capacity) {
+        size_t new_capacity = tree->job_capacity == 0 ? 64 : tree->job_capacity * 2;
+        struct CopyJob *new_jobs = realloc(tree->jobs, new_capacity * sizeof(struct CopyJob));
+        if (new_jobs == NULL) {
+            pthread_mutex_unlock(&tree->jobs_lock);
+            free(host_path);
+            return 1;
+        }
+        tree->jobs = new_jobs;
+        tree->job_capacity = new_capacity;
+    }
+    tree->jobs[tree->job_count++] = (struct CopyJob) {
+        .host_path = host_path,
+        .dnode = dnode,
+        .size = size,
+    };
+    pthread_cond_signal(&tree->jobs_cond);
+    pthread_mutex_unlock(&tree->jobs_lock);
+    return 0;
+}
+
+/**
+ * Waits for the next job
+ * @return false if there are no more jobs
+ */
+static bool copy_tree_pop(struct CopyTree *tree, struct CopyJob *job) {
+    pthread_mutex_lock(&tree->jobs_lock);
+    while (tree->next_job == tree->job_count && !tree->walk_done)
+        pthread_cond_wait(&tree->jobs_cond, &tree->jobs_lock);
+    bool has_job = tree->next_job < tree->job_count;
+    if (has_job)
+        *job = tree->jobs[tree->next_job++];
+    pthread_mutex_unlock(&tree->jobs_lock);
+    return has_job;
+}
+
+static void copy_in_file(struct CopyTree *tree, const struct CopyJob *job) {
+    char *buffer = NULL;
+    // Read the whole host file without holding the lock
+    FILE *host_file = fopen(job->host_path, "rb");
+    if (host_file == NULL) {
+        pthread_mutex_lock(&tree->fs_lock);
+        COPY_ERROR(tree, "cannot open host file %s: %s\n", job->host_path, strerror(errno));
+        pthread_mutex_unlock(&tree->fs_lock);
+        return;
+    }
+    struct stat host_stat;
+    if (fstat(fileno(host_file), &host_stat) == -1 || host_stat.st_size > CROWFS_MAX_FILESIZE) {
+        pthread_mutex_lock(&tree->fs_lock);
+        COPY_ERROR(tree, "cannot copy host file %s: too big\n", job->host_path);
+        pthread_mutex_unlock(&tree->fs_lock);
+        goto end;
+    }
+    const size_t size = host_stat.st_size;
+    buffer = malloc(size == 0 ? 1 : size);
+    if (buffer == NULL || fread(buffer, sizeof(char), size, host_file) != size) {
+        pthread_mutex_lock(&tree->fs_lock);
+        COPY_ERROR(tree, "cannot read host file %s\n", job->host_path);
+        pthread_mutex_unlock(&tree->fs_lock);
+        goto end;
+    }
+    // Write it with a single call
+    pthread_mutex_lock(&tree->fs_lock);
+    int result = crowfs_write(tree->ctx->fs, job->dnode, buffer, size, 0);
+    if (result != CROWFS_OK) {
+        COPY_ERROR(tree, "cannot write the file of %s: error %d\n", job->host_path, result);
+    } else {
+        tree->files++;
+        tree->bytes += size;
+    }
+    pthread_mutex_unlock(&tree->fs_lock);
+
+end:
+    free(buffer);
+    fclose(host_file);
+}
+
+static void copy_out_file(struct CopyTree *tree, const struct CopyJob *job) {
+    char *buffer = malloc(job->size == 0 ? 1 : job->size);
+    if (buffer == NULL) {
+        pthread_mutex_lock(&tree->fs_lock);
+        COPY_ERROR(tree, "cannot copy %s: out of memory\n", job->host_path);
+        pthread_mutex_unlock(&tree->fs_lock);
+        return;
+    }
+    // Read the whole file with a single call
+    pthread_mutex_lock(&tree->fs_lock);
+    int result = job->size == 0 ? 0 : crowfs_read(tree->ctx->fs, job->dnode, buffer, job->size, 0);
+    if (result < 0)
+        COPY_ERROR(tree, "cannot read the file of %s: error %d\n", job->host_path, result);
+    pthread_mutex_unlock(&tree->fs_lock);
+    if (result < 0)
+        goto end;
+    // Write it to host without holding the lock
+    FILE *host_file = fopen(job->host_path, "wb");
+    bool ok = host_file != NULL && fwrite(buffer, sizeof(char), result, host_file) == (size_t) result;
+    int saved_errno = errno;
+    if (host_file != NULL && fclose(host_file) != 0)
+        ok = false;
+    pthread_mutex_lock(&tree->fs_lock);
+    if (!ok) {
+        COPY_ERROR(tree, "cannot write host file %s: %s\n", job->host_path, strerror(saved_errno));
+    } else {
+        tree->files++;
+        tree->bytes += result;
+    }
+    pthread_mutex_unlock(&tree->fs_lock);
+
+end:
+    free(buffer);
+}
+
+static void *copy_in_worker(void *arg) {
+    struct CopyTree *tree = arg;
+    struct CopyJob job;
+    while (copy_tree_pop(tree, &job))
+        copy_in_file(tree, &job);
+    return NULL;
+}
+
+static void *copy_out_worker(void *arg) {
+    struct CopyTree *tree = arg;
+    struct CopyJob job;
+    while (copy_tree_pop(tree, &job))
+        copy_out_file(tree, &job);
+    return NULL;
+}
+
+/**
+ * Creates or opens an entity in a folder of the file system. An existing file
+ * is deleted and created again to drop its old content. fs_lock must be held.
+ * @return CROWFS_OK or the error
+ */
+static int copy_tree_create(struct CopyTree *tree, uint32_t folder, const char *name, bool is_folder,
+                            uint32_t *dnode) {
+    struct CrowFS *fs = tree->ctx->fs;
+    uint32_t flags = CROWFS_O_CREATE | (is_folder ? CROWFS_O_DIR : 0), parent;
+    int result = crowfs_open_relative(fs, name, folder, dnode, &parent, flags);
+    if (result != CROWFS_OK)
+        return result;
+    struct CrowFSStat stat;
+    result = crowfs_stat(fs, *dnode, &stat);
+    if (result != CROWFS_OK)
+        return result;
+    if (stat.type != (is_folder ? CROWFS_ENTITY_FOLDER : CROWFS_ENTITY_FILE))
+        return CROWFS_ERR_ARGUMENT;
+    if (!is_folder && stat.size != 0) {
+        result = crowfs_delete(fs, *dnode, parent);
+        if (result != CROWFS_OK)
+            return result;
+        result = crowfs_open_relative(fs, name, folder, dnode, &parent, flags);
+    }
+    return result;
+}
+
+/**
+ * Creates the folders of a host folder in the file system and queues its files
+ */
+static void copy_in_walk(struct CopyTree *tree, const char *host_folder, uint32_t fs_folder) {
+    DIR *dir = opendir(host_folder);
+    if (dir == NULL) {
+        pthread_mutex_lock(&tree->fs_lock);
+        COPY_ERROR(tree, "cannot open host folder %s: %s\n", host_folder, strerror(errno));
+        pthread_mutex_unlock(&tree->fs_lock);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char *host_path = join_path(host_folder, entry->d_name);
+        struct stat host_stat;
+        if (host_path == NULL || lstat(host_path, &host_stat) == -1) {
+            pthread_mutex_lock(&tree->fs_lock);
+            COPY_ERROR(tree, "cannot stat host file %s/%s\n", host_folder, entry->d_name);
+            pthread_mutex_unlock(&tree->fs_lock);
+            free(host_path);
+            continue;
+        }
+        const bool is_folder = S_ISDIR(host_stat.st_mode);
+        if (!is_folder && !S_ISREG(host_stat.st_mode)) {
+            pthread_mutex_lock(&tree->fs_lock);
+            fprintf(tree->ctx->out, "skipping special file %s\n", host_path);
+            pthread_mutex_unlock(&tree->fs_lock);
+            free(host_path);
+            continue;
+        }
+        // Create the dnode here, so the order of entries matches the host
+        uint32_t dnode = 0;
+        int result = CROWFS_ERR_ARGUMENT;
+        pthread_mutex_lock(&tree->fs_lock);
+        if (strlen(entry->d_name) <= CROWFS_MAX_FILENAME)
+            result = copy_tree_create(tree, fs_folder, entry->d_name, is_folder, &dnode);
+        if (result != CROWFS_OK)
+            COPY_ERROR(tree, "cannot create the file of %s: error %d\n", host_path, result);
+        else if (is_folder)
+            tree->folders++;
+        pthread_mutex_unlock(&tree->fs_lock);
+        if (result != CROWFS_OK) {
+            free(host_path);
+            continue;
+        }
+        if (is_folder) {
+            copy_in_walk(tree, host_path, dnode);
+            free(host_path);
+        } else if (copy_tree_push(tree, host_path, dnode, 0) != 0) {
+            pthread_mutex_lock(&tree->fs_lock);
+            COPY_ERROR(tree, "out of memory\n");
+            pthread_mutex_unlock(&tree->fs_lock);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Creates the folders of a file system folder on host and queues its files
+ */
+static void copy_out_walk(struct CopyTree *tree, uint32_t fs_folder, const char *host_folder) {
+    if (mkdir(host_folder, 0777) == -1 && errno != EEXIST) {
+        pthread_mutex_lock(&tree->fs_lock);
+        COPY_ERROR(tree, "cannot create host folder %s: %s\n", host_folder, strerror(errno));
+        pthread_mutex_unlock(&tree->fs_lock);
+        return;
+    }
+    for (size_t offset = 0;; offset++) {
+        struct CrowFSStat stat;
+        pthread_mutex_lock(&tree->fs_lock);
+        int result = crowfs_read_dir(tree->ctx->fs, fs_folder, &stat, offset);
+        if (result != CROWFS_OK && result != CROWFS_ERR_LIMIT)
+            COPY_ERROR(tree, "cannot read the folder of %s: error %d\n", host_folder, result);
+        else if (result == CROWFS_OK && stat.type == CROWFS_ENTITY_FOLDER)
+            tree->folders++;
+        pthread_mutex_unlock(&tree->fs_lock);
+        if (result != CROWFS_OK) // end or error
+            break;
+        char *host_path = join_path(host_folder, stat.name);
+        if (host_path == NULL) {
+            pthread_mutex_lock(&tree->fs_lock);
+            COPY_ERROR(tree, "out of memory\n");
+            pthread_mutex_unlock(&tree->fs_lock);
+            continue;
+        }
+        if (stat.type == CROWFS_ENTITY_FOLDER) {
+            copy_out_walk(tree, stat.dnode, host_path);
+            free(host_path);
+        } else if (copy_tree_push(tree, host_path, stat.dnode, stat.size) != 0) {
+            pthread_mutex_lock(&tree->fs_lock);
+            COPY_ERROR(tree, "out of memory\n");
+            pthread_mutex_unlock(&tree->fs_lock);
+        }
+    }
+}
+
+/**
+ * Starts the workers, walks the tree on the current thread and waits for the workers
+ */
+static int copy_tree_run(const struct CommandContext *ctx, const char *host_folder, uint32_t fs_folder,
+                         bool copy_out) {
+    struct CopyTree tree = {
+        .ctx = ctx,
+        .fs_lock = PTHREAD_MUTEX_INITIALIZER,
+        .jobs_lock = PTHREAD_MUTEX_INITIALIZER,
+        .jobs_cond = PTHREAD_COND_INITIALIZER,
+    };
+    const int thread_count = ctx->threads < 1 ? 1 : ctx->threads;
+    pthread_t *workers = calloc(thread_count, sizeof(pthread_t));
+    int started_workers = 0;
+    for (; workers != NULL && started_workers < thread_count; started_workers++)
+        if (pthread_create(&workers[started_workers], NULL, copy_out ? copy_out_worker : copy_in_worker, &tree) != 0)
+            break;
+    if (started_workers == 0) {
+        fputs("cannot start the workers\n", ctx->out);
+        free(workers);
+        return 1;
+    }
+    if (copy_out)
+        copy_out_walk(&tree, fs_folder, host_folder);
+    else
+        copy_in_walk(&tree, host_folder, fs_folder);
+    // Let the workers finish the queue
+    pthread_mutex_lock(&tree.jobs_lock);
+    tree.walk_done = true;
+    pthread_cond_broadcast(&tree.jobs_cond);
+    pthread_mutex_unlock(&tree.jobs_lock);
+    for (int i = 0; i < started_workers; i++)
+        pthread_join(workers[i], NULL);
+    for (size_t i = 0; i < tree.job_count; i++)
+        free(tree.jobs[i].host_path);
+    free(tree.jobs);
+    free(workers);
+    fprintf(ctx->out, "Copied %zu files and %zu folders (%zu bytes) %s file system\n",
+            tree.files, tree.folders, tree.bytes, copy_out ? "from" : "to");
+    return tree.exit_code;
+}
+
+int copy_tree_in(const struct CommandContext *ctx, const char *host_folder, const char *fs_folder) {
+    uint32_t folder, temp;
+    int result = crowfs_open_absolute(ctx->fs, fs_folder, &folder, &temp, CROWFS_O_CREATE | CROWFS_O_DIR);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot create the folder: error %d\n", result);
+        return 1;
+    }
+    return copy_tree_run(ctx, host_folder, folder, false);
+}
+
+int copy_tree_out(const struct CommandContext *ctx, const char *fs_folder, const char *host_folder) {
+    uint32_t folder, temp;
+    int result = crowfs_open_absolute(ctx->fs, fs_folder, &folder, &temp, CROWFS_O_DIR);
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot open the folder: error %d\n", result);
+        return 1;
+    }
+    return copy_tree_run(ctx, host_folder, folder, true);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "commands.h"
+
+/**
+ * Copies the contents of a host folder into a folder of the file system. The
+ * destination folder and the folders inside it are created if they do not exist
+ * and existing files are overwritten. Files are transferred by ctx->threads workers.
+ * @param ctx The context of the command
+ * @param host_folder The host folder to copy
+ * @param fs_folder The absolute path of the destination folder in the file system
+ * @return The exit code of the command. 0 if ok, 1 otherwise
+ */
+int copy_tree_in(const struct CommandContext *ctx, const char *host_folder, const char *fs_folder);
+
+/**
+ * Copies the contents of a folder of the file system into a host folder. The
+ * destination folder and the folders inside it are created if they do not exist
+ * and existing files are overwritten. Files are transferred by ctx->threads workers.
+ * @param ctx The context of the command
+ * @param fs_folder The absolute path of the folder in the file system to copy
+ * @param host_folder The destination host folder
+ * @return The exit code of the command. 0 if ok, 1 otherwise
+ */
+int copy_tree_out(const struct CommandContext *ctx, const char *fs_folder, const char *host_folder);
@@ -18,6 +18,86 @@
 #define TRY_IO(func) do { if (func) {result = CROWFS_ERR_IO; goto end;} } while (0);
 
 #define MIN(x, y) ((x < y) ? (x) : (y))
+/**
+ * Maximum number of blocks which are transferred in a single multi-block request
+ */
+#define IO_BATCH_BLOCKS 16
+/**
+ * New folders are placed at the start of an empty group of this many blocks, so
+ * their entries and the data of their files can be allocated next to them
+ */
+#define FOLDER_GROUP_BLOCKS 1024
+/**
+ * Number of bitmap blocks after the parent which are searched for an empty group
+ */
+#define FOLDER_GROUP_SEARCH_BITMAPS 4
+
+#ifdef CROWFS_STATS
+/**
+ * Adds a value to a counter of the current operation
+ */
+#define STATS_ADD(fs, counter, value) ((fs)->stats.operations[(fs)->current_operation].counter += (value))
+#else
+#define STATS_ADD(fs, counter, value) ((void) 0)
+#endif
+
+/**
+ * Tracks the public operation which is running. Public functions declare one
+ * with OPERATION, so the operation ends on every return path.
+ */
+struct OperationScope {
+    struct CrowFS *fs;
+    // The operation which was running before. If it is not CROWFS_OP_NONE,
+    // this is a nested call and everything is accounted to the outer one.
+    uint8_t previous;
+#ifdef CROWFS_STATS
+    // When the operation started
+    uint64_t start;
+#endif
+};
+
+static struct OperationScope operation_begin(struct CrowFS *fs, uint8_t operation) {
+    struct OperationScope scope = {.fs = fs, .previous = fs->current_operation};
+    if (scope.previous != CROWFS_OP_NONE)
+        return scope;
+    fs->current_operation = operation;
+#ifdef CROWFS_STATS
+    fs->stats.operations[operation].calls++;
+    scope.start = fs->monotonic_nanoseconds != NULL ? fs->monotonic_nanoseconds(fs->ctx) : 0;
+#endif
+    if (fs->on_operation_begin != NULL)
+        fs->on_operation_begin(fs->hook_ctx, operation);
+    return scope;
+}
+
+static void discards_finish(struct CrowFS *fs, bool issue);
+
+static void operation_end(struct OperationScope *scope) {
+    struct CrowFS *fs = scope->fs;
+    if (scope->previous != CROWFS_OP_NONE)
+        return;
+    // Without a transaction, the bitmap which frees the blocks is written already
+    if (fs->discards != NULL && fs->transaction == NULL)
+        discards_finish(fs, true);
+#ifdef CROWFS_STATS
+    if (fs->monotonic_nanoseconds != NULL) {
+        const uint64_t elapsed = fs->monotonic_nanoseconds(fs->ctx) - scope->start;
+        uint32_t bucket = elapsed == 0 ? 0 : 63 - __builtin_clzll(elapsed);
+        if (bucket >= CROWFS_STATS_LATENCY_BUCKETS)
+            bucket = CROWFS_STATS_LATENCY_BUCKETS - 1;
+        fs->stats.operations[fs->current_operation].latency_histogram[bucket]++;
+    }
+#endif
+    if (fs->on_operation_end != NULL)
+        fs->on_operation_end(fs->hook_ctx, fs->current_operation);
+    fs->current_operation = CROWFS_OP_NONE;
+}
+
+/**
+ * Marks the rest of the function as a public operation
+ */
+#define OPERATION(fs, operation) \
+    struct OperationScope operation_scope __attribute__((cleanup(operation_end))) = operation_begin(fs, operation)
 
 /**
  * Gets the length of the next part in the path. For example, if the given string
@@ -74,309 +154,2279 @@ static void bitmap_clear(struct CrowFSBitmapBlock *bitmap, uint32_t index) {
 }
 
 /**
- * Allocates a free dnode and returns it
- * @param fs The filesystem
- * @return The dnode number or zero if no free dnode is available
+ * Maximum number of blocks which a transaction keeps in memory. The sorted list
+ * of them must fit in a single block.
  */
-static uint32_t block_alloc(struct CrowFS *fs) {
-    uint32_t allocated_dnode = 0;
-    union CrowFSBlock *block = fs->allocate_mem_block();
-    // Look for free blocks
-    for (uint32_t free_block = 0; free_block < fs->free_bitmap_blocks; free_block++) {
-        // Read the bitmap
-        if (fs->read_block(free_block + 1 + 1, block)) // well fuck?
-            goto end;
-        // Look for free block...
-        for (uint32_t i = 0; i < CROWFS_BLOCK_SIZE; i++)
-            if (block->bitmap.bitmap[i] != 0) {
-                allocated_dnode =
-                        free_block * CROWFS_BITSET_COVERED_BLOCKS + i * 8 + __builtin_ctz(block->bitmap.bitmap[i]);
-                break;
-            }
-        if (allocated_dnode != 0)
-            break;
-    }
-    // Anything found?
-    if (allocated_dnode == 0)
-        goto end;
-    // Mark this dnode as occupied
-    if (fs->read_block(allocated_dnode / 8 / CROWFS_BLOCK_SIZE + 1 + 1, block)) {
-        allocated_dnode = 0;
-        goto end;
-    }
-    bitmap_clear(&block->bitmap, allocated_dnode % CROWFS_BITSET_COVERED_BLOCKS);
-    if (fs->write_block(allocated_dnode / 8 / CROWFS_BLOCK_SIZE + 1 + 1, block)) {
-        allocated_dnode = 0;
-        goto end;
-    }
+#define TXN_MAX_BLOCKS CROWFS_INDIRECT_BLOCK_COUNT
+/**
+ * Number of hash slots of a transaction. Twice the blocks, so probes stay short.
+ */
+#define TXN_SLOTS (2 * TXN_MAX_BLOCKS)
 
-end:
-    fs->free_mem_block(block);
-    return allocated_dnode;
-}
+/**
+ * A range of freed blocks which waits to be discarded or which a transaction
+ * has freed
+ */
+struct DiscardRange {
+    uint32_t start;
+    uint32_t count;
+};
 
 /**
- * Gets the block index which a pointer is pointing to. If the block does not exists
- * it will try to allocate a new block on disk and return the new block number.
- * @param fs The filesystem
- * @param from The block index to check
- * @return The block index if successful or 0 if disk is full
+ * Number of ranges of freed blocks which a transaction remembers
  */
-static uint32_t get_or_allocate_block(struct CrowFS *fs, uint32_t *from) {
-    uint32_t content_block = *from;
-    if (content_block == 0) {
-        content_block = block_alloc(fs);
-        if (content_block == 0)
-            return 0;
-        *from = content_block;
-    }
-    return content_block;
-}
+#define TXN_FREED_RANGES 480
 
 /**
- * Frees an allocated block
- * @param dnode The dnode or block number
+ * A block which is kept by a transaction
  */
-static void block_free(struct CrowFS *fs, uint32_t dnode) {
-    union CrowFSBlock *block = fs->allocate_mem_block();
-    if (fs->read_block(dnode / 8 / CROWFS_BLOCK_SIZE + 1 + 1, block))
-        goto end;
+struct TxnSlot {
+    uint32_t block_index;
+    // The content of the block or NULL if the slot is empty
+    union CrowFSBlock *block;
+};
 
-    bitmap_set(&block->bitmap, dnode % CROWFS_BITSET_COVERED_BLOCKS);
-    fs->write_block(dnode / 8 / CROWFS_BLOCK_SIZE + 1 + 1, block);
+#define TXN_SLOTS_PER_PAGE (CROWFS_BLOCK_SIZE / sizeof(struct TxnSlot))
 
-end:
-    fs->free_mem_block(block);
+struct CrowFSTransaction {
+    // Number of crowfs_txn_begin calls which are not committed yet
+    uint32_t depth;
+    // Number of kept blocks
+    uint32_t count;
+    // Number of journaled operations which are running in the transaction
+    uint32_t operations;
+    // Set if an early write of the kept blocks has failed
+    bool failed;
+    // A hash table with linear probing. Slot i is in page i / TXN_SLOTS_PER_PAGE.
+    union CrowFSBlock *slot_pages[TXN_SLOTS / TXN_SLOTS_PER_PAGE];
+    // Set if more ranges were freed than freed can hold
+    bool freed_overflow;
+    uint32_t freed_count;
+    // Number of blocks in freed
+    uint32_t freed_blocks;
+    // The blocks which are freed since the kept blocks were last written. The disk
+    // still points to their old content until then.
+    struct DiscardRange freed[TXN_FREED_RANGES];
+};
+
+_Static_assert(sizeof(struct CrowFSTransaction) <= CROWFS_BLOCK_SIZE, "A transaction must fit in a memory block");
+
+/**
+ * Finds the slot of a block in a transaction
+ * @return The slot of the block or the empty slot where it would be kept
+ */
+static struct TxnSlot *txn_slot(const struct CrowFSTransaction *txn, uint32_t block_index) {
+    for (uint32_t i = (block_index * 2654435761u) % TXN_SLOTS;; i = (i + 1) % TXN_SLOTS) {
+        struct TxnSlot *slot = (struct TxnSlot *) txn->slot_pages[i / TXN_SLOTS_PER_PAGE] + i % TXN_SLOTS_PER_PAGE;
+        if (slot->block == NULL || slot->block_index == block_index)
+            return slot;
+    }
 }
 
 /**
- * Look for a content in this folder by the given name
- * @param fs The file system to search in
- * @param dir The given folder to search in
- * @param name The name of the file/folder to search
- * @return 0 if not found, the dnode of the block if found
+ * Remembers blocks which the running transaction has freed. A range which is
+ * next to the last remembered one extends it.
+ * @param fs The filesystem
+ * @param start The first freed block
+ * @param count Number of freed blocks
  */
-static uint32_t
-folder_lookup_name(struct CrowFS *fs, const struct CrowFSDirectoryBlock *dir, const char *name, size_t name_len) {
-    // Allocate block for dnodes
-    union CrowFSBlock *temp_dnode = fs->allocate_mem_block();
-    uint32_t result = 0;
-    for (int i = 0; i < CROWFS_MAX_DIR_CONTENTS; i++) {
-        if (dir->content_dnodes[i] == 0) // File/Folder not found
-            break;
-        // Read the dnode
-        if (fs->read_block(dir->content_dnodes[i], temp_dnode) != 0)
-            break; // IO Error
-        // Compare filenames
-        if (memcmp(temp_dnode->header.name, name, name_len) == 0 &&
-            temp_dnode->header.name[name_len] == '\0') {
-            // Matched!
-            result = dir->content_dnodes[i];
-            break;
+static void txn_freed_add(struct CrowFS *fs, uint32_t start, uint32_t count) {
+    struct CrowFSTransaction *txn = fs->transaction;
+    if (txn == NULL)
+        return;
+    txn->freed_blocks += count;
+    if (txn->freed_count > 0) {
+        struct DiscardRange *last = &txn->freed[txn->freed_count - 1];
+        if (start == last->start + last->count) {
+            last->count += count;
+            return;
+        }
+        if (start + count == last->start) {
+            last->start = start;
+            last->count += count;
+            return;
         }
-        // Continue searching...
     }
-    // Deallocate
-    fs->free_mem_block(temp_dnode);
-    return result;
+    if (txn->freed_count < TXN_FREED_RANGES)
+        txn->freed[txn->freed_count++] = (struct DiscardRange) {.start = start, .count = count};
+    else
+        txn->freed_overflow = true;
 }
 
 /**
- * Counts the number of files or folders inside a folder
- * @param dir The folder to count
- * @return The number of files or folder in the given directory
+ * Checks if any block of a range was freed by the running transaction. Such a
+ * block might be allocated again, but a crash before the commit brings back
+ * the metadata which points to its old content, so it must not be written in place.
+ * @return True if a block of the range might be freed by the transaction
  */
-static uint32_t folder_content_count(const struct CrowFSDirectoryBlock *dir) {
-    uint32_t count;
-    for (count = 0; count < CROWFS_MAX_DIR_CONTENTS; count++)
-        if (dir->content_dnodes[count] == 0)
-            return count;
-    return count; // dir is full!
+static bool txn_freed(const struct CrowFS *fs, uint32_t start, uint32_t count) {
+    const struct CrowFSTransaction *txn = fs->transaction;
+    if (txn == NULL)
+        return false;
+    if (txn->freed_overflow)
+        return true;
+    for (uint32_t i = 0; i < txn->freed_count; i++)
+        if ((uint64_t) start + count > txn->freed[i].start &&
+            start < (uint64_t) txn->freed[i].start + txn->freed[i].count)
+            return true;
+    return false;
 }
 
 /**
- * Removes a file dnode from folder content. This function does not free the dnode
- * or do anything with the file. It just removes it from the content_dnodes list.
- * @param dir The directory to perform the action on
- * @param target_dnode The target dnode to remove from the directory
- * @return 0 if target is removed, 1 if the target is not found
+ * Where the newest image of a block is in the journal
  */
-static int folder_remove_content(struct CrowFSDirectoryBlock *dir, uint32_t target_dnode) {
-    int dnode_index = -1;
-    for (int i = 0; i < CROWFS_MAX_DIR_CONTENTS; i++)
-        if (dir->content_dnodes[i] == target_dnode) {
-            dnode_index = i;
-            break;
-        }
-    if (dnode_index == -1)
-        return 1; // what?
-    int last_index = (int) (folder_content_count(dir) - 1);
-    if (last_index == 0) {
-        // only one content so remove it
-        dir->content_dnodes[0] = 0;
-    } else if (last_index == dnode_index) {
-        // dnode is last. Replace it
-        dir->content_dnodes[last_index] = 0;
-    } else {
-        // perform a swap
-        dir->content_dnodes[dnode_index] = dir->content_dnodes[last_index];
-        dir->content_dnodes[last_index] = 0;
+struct JournalSlot {
+    uint32_t block_index;
+    // Position of the image in the journal region or 0 if the slot is empty
+    uint32_t position;
+};
+
+/**
+ * Number of hash slots of the journal. Twice the blocks of the journal region,
+ * which is the most images that can be in it.
+ */
+#define JOURNAL_SLOTS (2 * CROWFS_JOURNAL_BLOCKS)
+#define JOURNAL_SLOTS_PER_PAGE (CROWFS_BLOCK_SIZE / sizeof(struct JournalSlot))
+
+struct CrowFSJournal {
+    // Sequence number of the next record
+    uint32_t sequence;
+    // Position of the next record in the journal region. The header is at zero.
+    uint32_t next;
+    // Set if the journal could not be written. Nothing is modified after that.
+    bool failed;
+    // A hash table with linear probing from the blocks to their newest image
+    union CrowFSBlock *slot_pages[JOURNAL_SLOTS / JOURNAL_SLOTS_PER_PAGE];
+};
+
+/**
+ * Finds the slot of a block in the journal
+ * @return The slot of the block or the empty slot where it would be added
+ */
+static struct JournalSlot *journal_slot(const struct CrowFSJournal *journal, uint32_t block_index) {
+    for (uint32_t i = (block_index * 2654435761u) % JOURNAL_SLOTS;; i = (i + 1) % JOURNAL_SLOTS) {
+        struct JournalSlot *slot =
+                (struct JournalSlot *) journal->slot_pages[i / JOURNAL_SLOTS_PER_PAGE] + i % JOURNAL_SLOTS_PER_PAGE;
+        if (slot->position == 0 || slot->block_index == block_index)
+            return slot;
     }
-    return 0;
 }
 
 /**
- * Counts the number of 1 bits in a number. Will either use the builtin
- * instruction, or the gcc builtin function or a simple implementation.
- * @param a The number to count the number of bits
- * @return Number of bits that has been one in the number.
+ * Gets where the newest content of a block is on disk. Blocks which are in the
+ * journal but are not checkpointed yet are read from the journal.
+ * @param fs The filesystem
+ * @param block_index The block
+ * @return The block on disk to read
  */
-static uint32_t popcount(uint32_t a) {
-#ifdef __CROWOS__
-    uint32_t c = 0;
-    for (; a; ++c)
-        a &= a - 1;
-    return c;
-#else
-    return __builtin_popcount(a);
-#endif
+static uint32_t journal_location(const struct CrowFS *fs, uint32_t block_index) {
+    if (fs->journal == NULL)
+        return block_index;
+    const struct JournalSlot *slot = journal_slot(fs->journal, block_index);
+    return slot->position != 0 ? fs->superblock.journal_start + slot->position : block_index;
 }
 
+static int txn_flush(struct CrowFS *fs);
+
 /**
- * Checks if a string has a prefix or not.
- * @param str The string to check if it has a prefix or not.
- * @param pre The prefix to see if string has
- * @return True if it has the prefix otherwise false
+ * Blocks of a journal record which are left for each operation of a longer
+ * transaction. Kept blocks which leave less room are appended before the next
+ * operation starts.
  */
-bool string_prefix(const char *str, const char *pre) {
-    return strncmp(pre, str, strlen(pre)) == 0;
-}
+#define TXN_OPERATION_BLOCKS (CROWFS_JOURNAL_RECORD_BLOCKS / 2)
 
-int crowfs_new(struct CrowFS *fs) {
-    int result = CROWFS_OK;
-    // Check if all functions exists
-    if (fs->allocate_mem_block == NULL || fs->free_mem_block == NULL || fs->write_block == NULL ||
-        fs->read_block == NULL || fs->current_date == NULL || fs->total_blocks == NULL)
-        return CROWFS_ERR_ARGUMENT;
-    // Overwrite the superblock
-    union CrowFSBlock *block = fs->allocate_mem_block();
-    block->superblock = (struct CrowFSSuperblock){
-        .magic = {0}, // fill later
-        .version = CROWFS_VERSION,
-        .blocks = fs->total_blocks(),
-    };
-    memcpy(block->superblock.magic, CROWFS_MAGIC, sizeof(block->superblock.magic));
-    // Check if the blocks on the disk is enough
-    // We need 4 blocks at least:
-    // 1. Bootloader
-    // 2. Superblock
-    // 3. Free bitmap
-    // 4. Root directory
-    if (block->superblock.blocks <= 4) {
-        result = CROWFS_ERR_TOO_SMALL;
-        goto end;
+/**
+ * Runs the rest of a public function which modifies a journaled filesystem in
+ * a transaction, so all of its metadata writes become a single journal record.
+ */
+struct JournalScope {
+    // The filesystem if a transaction was started
+    struct CrowFS *fs;
+    int result;
+};
+
+static struct JournalScope journal_scope_begin(struct CrowFS *fs, bool modifies) {
+    struct JournalScope scope = {.fs = NULL, .result = CROWFS_OK};
+    if (modifies && (fs->mount_flags & CROWFS_MOUNT_READ_ONLY)) {
+        scope.result = CROWFS_ERR_READ_ONLY;
+        return scope;
     }
-    fs->superblock = block->superblock;
-    // Write the superblock
-    TRY_IO(fs->write_block(SUPERBLOCK_DNODE, block))
-    // Calculate the free bitmap size
-    fs->free_bitmap_blocks =
-            (block->superblock.blocks + CROWFS_BITSET_COVERED_BLOCKS - 1) / CROWFS_BITSET_COVERED_BLOCKS;
-    if (block->superblock.blocks <= 3 + fs->free_bitmap_blocks) {
-        result = CROWFS_ERR_TOO_SMALL;
-        goto end;
+    if (fs->journal == NULL || !modifies)
+        return scope;
+    if (fs->journal->failed) {
+        scope.result = CROWFS_ERR_IO;
+        return scope;
     }
-    // bootloader + superblock
-    fs->root_dnode = 1 + 1 + fs->free_bitmap_blocks;
-    // Set the free bitmaps to all one in non-last and first pages
-    memset(block->bitmap.bitmap, 0xFF, sizeof(block->bitmap.bitmap));
-    // Write to disk
-    for (uint32_t i = 1; i < fs->free_bitmap_blocks - 1; i++)
-        TRY_IO(fs->write_block(1 + 1 + i, block))
-    // Set the first free block
-    // Note: Because at last we are going to use 32 free blocks
-    // this works fine
-    for (uint32_t i = 0; i < fs->free_bitmap_blocks + 3; i++)
-        bitmap_clear(&block->bitmap, i);
-    TRY_IO(fs->write_block(2, block))
-    // If the last block is different from the first block, zero the block
-    if (fs->free_bitmap_blocks != 1)
-        memset(block->bitmap.bitmap, 0xFF, sizeof(block->bitmap.bitmap));
-
-    for (uint32_t last_block_id = CROWFS_BITSET_COVERED_BLOCKS * fs->free_bitmap_blocks - 1;
-         last_block_id >= fs->superblock.blocks;
-         last_block_id--)
-        bitmap_clear(&block->bitmap, last_block_id);
-    TRY_IO(fs->write_block(2 + fs->free_bitmap_blocks - 1, block))
-    // Create the root directory
-    block->folder = (struct CrowFSDirectoryBlock){
-        .header = (struct CrowFSDnodeHeader){
-            .type = CROWFS_ENTITY_FOLDER,
-            .name = "/",
-            .creation_date = fs->current_date(),
-        },
-        .parent = fs->root_dnode,
-        .content_dnodes = {0},
-    };
-    TRY_IO(fs->write_block(fs->root_dnode, block))
-
-end:
-    fs->free_mem_block(block);
-    return result;
+    // Between the operations of a crowfs_txn_begin transaction. The freed blocks
+    // count too, because writes of them are journaled when they are allocated again.
+    struct CrowFSTransaction *txn = fs->transaction;
+    if (txn != NULL && txn->operations == 0 &&
+        (txn->freed_overflow || txn->count + txn->freed_blocks > CROWFS_JOURNAL_RECORD_BLOCKS - TXN_OPERATION_BLOCKS) &&
+        txn_flush(fs)) {
+        scope.result = CROWFS_ERR_IO;
+        return scope;
+    }
+    scope.result = crowfs_txn_begin(fs);
+    if (scope.result == CROWFS_OK) {
+        scope.fs = fs;
+        fs->transaction->operations++;
+    }
+    return scope;
 }
 
-int crowfs_init(struct CrowFS *fs) {
-    int result = CROWFS_OK;
-    // Check if all functions exists
-    if (fs->allocate_mem_block == NULL || fs->free_mem_block == NULL || fs->write_block == NULL ||
-        fs->read_block == NULL || fs->current_date == NULL)
-        return CROWFS_ERR_ARGUMENT;
-    // Check for superblock
-    union CrowFSBlock *block = fs->allocate_mem_block();
-    TRY_IO(fs->read_block(SUPERBLOCK_DNODE, block))
-    if (memcmp(block->superblock.magic, CROWFS_MAGIC, sizeof(block->superblock.magic)) != 0) {
-        result = CROWFS_ERR_INIT_INVALID_FS;
-        goto end;
+static void journal_scope_end(struct JournalScope *scope) {
+    // A failed commit marks the journal as failed, so the next operations report it
+    if (scope->fs != NULL) {
+        scope->fs->transaction->operations--;
+        crowfs_txn_commit(scope->fs);
     }
-    fs->superblock = block->superblock;
-    // Calculate the root dnode index
-    fs->free_bitmap_blocks =
-            (block->superblock.blocks + CROWFS_BITSET_COVERED_BLOCKS - 1) / CROWFS_BITSET_COVERED_BLOCKS;
-    fs->root_dnode = 1 + 1 + fs->free_bitmap_blocks;
-
-end:
-    fs->free_mem_block(block);
-    return result;
 }
 
-int crowfs_open_absolute(struct CrowFS *fs, const char *path, uint32_t *dnode, uint32_t *parent_dnode, uint32_t flags) {
-    if (path[0] != '/') // paths must be absolute
-        return CROWFS_ERR_ARGUMENT;
-    if (strcmp(path, "/") == 0) {
-        // Asking for root. fuck the flags
-        *dnode = fs->root_dnode;
-        *parent_dnode = fs->root_dnode;
-        return CROWFS_OK;
+/**
+ * Marks the rest of the function as a journaled modification if modifies is
+ * true. Returns the error if the transaction cannot be started or the filesystem
+ * is mounted read only.
+ */
+#define JOURNALED(fs, modifies) \
+    struct JournalScope journal_scope __attribute__((cleanup(journal_scope_end))) = journal_scope_begin(fs, modifies); \
+    if (journal_scope.result != CROWFS_OK) \
+        return journal_scope.result
+
+static int txn_keep(struct CrowFS *fs, uint32_t block_index, const union CrowFSBlock *block);
+
+/**
+ * Reads a single block from the disk
+ * @param fs The filesystem
+ * @param block_index The block to read
+ * @param block The block to fill
+ * @return 0 if ok, 1 otherwise
+ */
+static int block_read(struct CrowFS *fs, uint32_t block_index, union CrowFSBlock *block) {
+    if (fs->transaction != NULL) {
+        const struct TxnSlot *slot = txn_slot(fs->transaction, block_index);
+        if (slot->block != NULL) {
+            memcpy(block, slot->block, sizeof(*block));
+            return 0;
+        }
     }
-    path++; // skip the /
-    return crowfs_open_relative(fs, path, fs->root_dnode, dnode, parent_dnode, flags);
+    STATS_ADD(fs, read_requests, 1);
+    STATS_ADD(fs, block_reads, 1);
+    return fs->read_block(fs->ctx, journal_location(fs, block_index), block);
 }
 
-int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_to, uint32_t *dnode,
-                         uint32_t *parent_dnode, uint32_t flags) {
-    // Is this an absolute path?
-    if (path[0] == '/') // just call crowfs_open_absolute
-        return crowfs_open_absolute(fs, path, dnode, parent_dnode, flags);
-    // Sanity check the relative to argument to not be zero
+/**
+ * Writes a single block to the disk. In a transaction, the block is kept by
+ * it instead.
+ * @param fs The filesystem
+ * @param block_index The block to write
+ * @param block The block to write
+ * @return 0 if ok, 1 otherwise
+ */
+static int block_write(struct CrowFS *fs, uint32_t block_index, const union CrowFSBlock *block) {
+    if (fs->transaction != NULL)
+        return txn_keep(fs, block_index, block);
+    STATS_ADD(fs, write_requests, 1);
+    STATS_ADD(fs, block_writes, 1);
+    return fs->write_block(fs->ctx, block_index, block);
+}
+
+/**
+ * Makes the written blocks durable if the device has a flush callback
+ * @param fs The filesystem
+ * @return 0 if ok, 1 otherwise
+ */
+static int device_flush(struct CrowFS *fs) {
+    return fs->flush != NULL ? fs->flush(fs->ctx) : 0;
+}
+
+/**
+ * Number of ranges which can wait to be discarded. Freed blocks which do not fit
+ * are left for crowfs_trim.
+ */
+#define DISCARD_MAX_RANGES ((CROWFS_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct DiscardRange))
+
+struct CrowFSDiscards {
+    uint32_t count;
+    struct DiscardRange ranges[DISCARD_MAX_RANGES];
+};
+
+_Static_assert(sizeof(struct CrowFSDiscards) <= CROWFS_BLOCK_SIZE, "Discards must fit in a memory block");
+
+/**
+ * Remembers a freed block to discard it later. A block which is next to the last
+ * remembered range extends it, so a file which is freed in order is a single range.
+ * @param fs The filesystem
+ * @param block_index The freed block. Its bitmap block must be written already.
+ */
+static void discard_add(struct CrowFS *fs, uint32_t block_index) {
+    if (!(fs->mount_flags & CROWFS_MOUNT_DISCARD) || fs->discard == NULL)
+        return;
+    if (fs->discards == NULL) {
+        fs->discards = (struct CrowFSDiscards *) fs->allocate_mem_block(fs->ctx);
+        if (fs->discards == NULL)
+            return;
+    }
+    struct CrowFSDiscards *discards = fs->discards;
+    if (discards->count > 0) {
+        struct DiscardRange *last = &discards->ranges[discards->count - 1];
+        if (block_index == last->start + last->count) {
+            last->count++;
+            return;
+        }
+        if (block_index + 1 == last->start) {
+            last->start--;
+            last->count++;
+            return;
+        }
+    }
+    if (discards->count < DISCARD_MAX_RANGES)
+        discards->ranges[discards->count++] = (struct DiscardRange) {.start = block_index, .count = 1};
+}
+
+/**
+ * Forgets the blocks which are allocated again before they are discarded.
+ * Otherwise, the discard would destroy their new content.
+ * @param fs The filesystem
+ * @param start The first allocated block
+ * @param count Number of allocated blocks
+ */
+static void discard_forget(struct CrowFS *fs, uint32_t start, uint32_t count) {
+    struct CrowFSDiscards *discards = fs->discards;
+    if (discards == NULL)
+        return;
+    const uint64_t end = (uint64_t) start + count;
+    for (uint32_t i = 0; i < discards->count;) {
+        struct DiscardRange *range = &discards->ranges[i];
+        const uint64_t range_end = (uint64_t) range->start + range->count;
+        if (end <= range->start || start >= range_end) {
+            i++;
+            continue;
+        }
+        // Keep the parts before and after the allocated blocks
+        if (range_end > end && range->start < start) {
+            if (discards->count < DISCARD_MAX_RANGES)
+                discards->ranges[discards->count++] =
+                        (struct DiscardRange) {.start = (uint32_t) end, .count = (uint32_t) (range_end - end)};
+            range->count = start - range->start;
+            i++;
+        } else if (range_end > end) {
+            range->start = (uint32_t) end;
+            range->count = (uint32_t) (range_end - end);
+            i++;
+        } else if (range->start < start) {
+            range->count = start - range->start;
+            i++;
+        } else {
+            // The last range takes its place and is checked next
+            *range = discards->ranges[--discards->count];
+        }
+    }
+}
+
+/**
+ * Discards the remembered ranges or drops them. The ranges are sorted and
+ * adjacent ones are merged, so each run of freed blocks is a single call.
+ * @param fs The filesystem
+ * @param issue True if the bitmap blocks which free the ranges are written. If
+ * false or they cannot be flushed, the ranges are dropped without discarding.
+ */
+static void discards_finish(struct CrowFS *fs, bool issue) {
+    struct CrowFSDiscards *discards = fs->discards;
+    fs->discards = NULL;
+    // A crash must not bring back the freed blocks after their data is discarded
+    if (issue && discards->count > 0 && device_flush(fs) == 0) {
+        // Insertion sort by the start. Blocks are mostly freed in order.
+        for (uint32_t i = 1; i < discards->count; i++) {
+            const struct DiscardRange range = discards->ranges[i];
+            uint32_t j = i;
+            for (; j > 0 && discards->ranges[j - 1].start > range.start; j--)
+                discards->ranges[j] = discards->ranges[j - 1];
+            discards->ranges[j] = range;
+        }
+        for (uint32_t i = 0; i < discards->count;) {
+            const uint32_t start = discards->ranges[i].start;
+            uint32_t count = discards->ranges[i++].count;
+            while (i < discards->count && discards->ranges[i].start == start + count)
+                count += discards->ranges[i++].count;
+            fs->discard(fs->ctx, start, count);
+        }
+    }
+    fs->free_mem_block(fs->ctx, (union CrowFSBlock *) discards);
+}
+
+/**
+ * Marks the blocks in [from, to) as used in a free bitmap block
+ * @param bitmap The bitmap
+ * @param first_block The block which the first bit of this bitmap stands for
+ * @param from The first block to mark
+ * @param to One after the last block to mark
+ */
+static void bitmap_clear_range(struct CrowFSBitmapBlock *bitmap, uint64_t first_block, uint64_t from, uint64_t to) {
+    if (from < first_block)
+        from = first_block;
+    if (to > first_block + CROWFS_BITSET_COVERED_BLOCKS)
+        to = first_block + CROWFS_BITSET_COVERED_BLOCKS;
+    for (; from < to; from++)
+        bitmap_clear(bitmap, from - first_block);
+}
+
+/**
+ * Gets the first block of the refcount area. It is right after the root folder
+ * and the journal. The root folder is located from the free bitmap, because a
+ * snapshot mount has another root_dnode.
+ */
+static uint64_t refcount_start(const struct CrowFS *fs) {
+    uint64_t start = (uint64_t) 1 + 1 + fs->free_bitmap_blocks + 1;
+    if (fs->superblock.features & CROWFS_FEATURE_JOURNAL)
+        start += fs->superblock.journal_blocks;
+    return start;
+}
+
+/**
+ * Gets the number of blocks of the refcount area. Zero without CROWFS_FEATURE_REFCOUNT.
+ */
+static uint32_t refcount_blocks(const struct CrowFS *fs) {
+    if (!(fs->superblock.features & CROWFS_FEATURE_REFCOUNT))
+        return 0;
+    return (fs->superblock.blocks + CROWFS_REFCOUNTS_PER_BLOCK - 1) / CROWFS_REFCOUNTS_PER_BLOCK;
+}
+
+/**
+ * Gets the first block after the metadata at the start of the disk: the boot
+ * block, the superblock, the free bitmap, the root folder, the journal and the
+ * refcount area.
+ */
+static uint64_t metadata_end(const struct CrowFS *fs) {
+    return refcount_start(fs) + refcount_blocks(fs);
+}
+
+/**
+ * Fills a free bitmap block like it is on a freshly formatted disk. Everything
+ * is free except the metadata at the start of the disk and the blocks after
+ * the end of the disk.
+ * @param fs The filesystem
+ * @param bitmap_block The index of the bitmap block. Zero is the first one.
+ * @param block The block to fill
+ */
+static void bitmap_fill_new(const struct CrowFS *fs, uint32_t bitmap_block, union CrowFSBlock *block) {
+    const uint64_t first_block = (uint64_t) bitmap_block * CROWFS_BITSET_COVERED_BLOCKS;
+    memset(block->bitmap.bitmap, 0xFF, sizeof(block->bitmap.bitmap));
+    bitmap_clear_range(&block->bitmap, first_block, 0, metadata_end(fs));
+    bitmap_clear_range(&block->bitmap, first_block, fs->superblock.blocks, UINT64_MAX);
+}
+
+/**
+ * Checks if a free bitmap block is not written on disk yet
+ * @param fs The filesystem
+ * @param bitmap_block The index of the bitmap block. Zero is the first one.
+ * @return True if the block is implicitly all free
+ */
+static bool bitmap_is_lazy(const struct CrowFS *fs, uint32_t bitmap_block) {
+    return (fs->superblock.features & CROWFS_FEATURE_LAZY_BITMAP) &&
+           bitmap_block >= fs->superblock.bitmap_initialized_blocks;
+}
+
+/**
+ * Finds the first free block in a bitmap block at or after a bit
+ * @param bitmap The bitmap block
+ * @param from The bit to start from
+ * @return The bit of the free block or CROWFS_BITSET_COVERED_BLOCKS if none is free
+ */
+static uint32_t bitmap_find_free(const struct CrowFSBitmapBlock *bitmap, uint32_t from) {
+    // Ignore the bits before from in the first byte
+    uint8_t byte = bitmap->bitmap[from / 8] & (uint8_t) (0xFF << (from % 8));
+    for (uint32_t i = from / 8;;) {
+        if (byte != 0)
+            return i * 8 + __builtin_ctz(byte);
+        if (++i == CROWFS_BLOCK_SIZE)
+            return CROWFS_BITSET_COVERED_BLOCKS;
+        byte = bitmap->bitmap[i];
+    }
+}
+
+/**
+ * Writes the cached superblock to the disk. Without CROWFS_FEATURE_BITMAP_SUMMARY,
+ * the summary is only kept in memory and zeros are written instead.
+ * @param fs The filesystem
+ * @return 0 if ok, 1 otherwise
+ */
+static int superblock_write(struct CrowFS *fs) {
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    block->superblock = fs->superblock;
+    if (!(fs->superblock.features & CROWFS_FEATURE_BITMAP_SUMMARY))
+        memset(block->superblock.bitmap_summary, 0, sizeof(block->superblock.bitmap_summary));
+    const int result = block_write(fs, SUPERBLOCK_DNODE, block);
+    fs->free_mem_block(fs->ctx, block);
+    return result;
+}
+
+/**
+ * Checks the bitmap summary for free blocks in a free bitmap block
+ * @param fs The filesystem
+ * @param bitmap_block The index of the bitmap block. Zero is the first one.
+ * @return False if the bitmap block is known to be full
+ */
+static bool bitmap_summary_has_free(const struct CrowFS *fs, uint32_t bitmap_block) {
+    if (bitmap_block >= CROWFS_BITMAP_SUMMARY_BYTES * 8)
+        return true; // not covered
+    return (fs->superblock.bitmap_summary[bitmap_block / 8] >> (bitmap_block % 8)) & 1;
+}
+
+/**
+ * Updates the bitmap summary of a free bitmap block. The superblock is written
+ * if the summary is persisted and has changed.
+ * @param fs The filesystem
+ * @param bitmap_block The index of the bitmap block. Zero is the first one.
+ * @param has_free Does the bitmap block have any free blocks?
+ * @return 0 if ok, 1 otherwise
+ */
+static int bitmap_summary_update(struct CrowFS *fs, uint32_t bitmap_block, bool has_free) {
+    if (bitmap_block >= CROWFS_BITMAP_SUMMARY_BYTES * 8 || bitmap_summary_has_free(fs, bitmap_block) == has_free)
+        return 0;
+    fs->superblock.bitmap_summary[bitmap_block / 8] ^= 1 << (bitmap_block % 8);
+    if (!(fs->superblock.features & CROWFS_FEATURE_BITMAP_SUMMARY))
+        return 0;
+    return superblock_write(fs);
+}
+
+/**
+ * Reads a free bitmap block. Lazy bitmap blocks are filled without any I/O.
+ * @param fs The filesystem
+ * @param bitmap_block The index of the bitmap block. Zero is the first one.
+ * @param block The block to fill
+ * @return 0 if ok, 1 otherwise
+ */
+static int bitmap_read(struct CrowFS *fs, uint32_t bitmap_block, union CrowFSBlock *block) {
+    if (bitmap_is_lazy(fs, bitmap_block)) {
+        bitmap_fill_new(fs, bitmap_block, block);
+        return 0;
+    }
+    return block_read(fs, bitmap_block + 1 + 1, block);
+}
+
+/**
+ * Writes a free bitmap block. If the block is lazy, it and the lazy blocks
+ * before it are written on disk and the superblock is updated.
+ * @param fs The filesystem
+ * @param bitmap_block The index of the bitmap block. Zero is the first one.
+ * @param block The block to write
+ * @return 0 if ok, 1 otherwise
+ */
+static int bitmap_write(struct CrowFS *fs, uint32_t bitmap_block, const union CrowFSBlock *block) {
+    // A bitmap block which gets free blocks is marked in the summary before it is
+    // written and a full one is cleared after it is written
+    const bool has_free = bitmap_find_free(&block->bitmap, 0) != CROWFS_BITSET_COVERED_BLOCKS;
+    if (has_free && bitmap_summary_update(fs, bitmap_block, true))
+        return 1;
+    int result = 0;
+    if (!bitmap_is_lazy(fs, bitmap_block)) {
+        result = block_write(fs, bitmap_block + 1 + 1, block);
+    } else {
+        union CrowFSBlock *temp = fs->allocate_mem_block(fs->ctx);
+        // Materialize the lazy blocks before this one
+        for (uint32_t i = fs->superblock.bitmap_initialized_blocks; i < bitmap_block && result == 0; i++) {
+            bitmap_fill_new(fs, i, temp);
+            result = block_write(fs, i + 1 + 1, temp);
+        }
+        if (result == 0)
+            result = block_write(fs, bitmap_block + 1 + 1, block);
+        fs->free_mem_block(fs->ctx, temp);
+        // Record them in the superblock
+        if (result == 0) {
+            fs->superblock.bitmap_initialized_blocks = bitmap_block + 1;
+            result = superblock_write(fs);
+        }
+    }
+    if (result == 0 && !has_free)
+        result = bitmap_summary_update(fs, bitmap_block, false);
+    return result;
+}
+
+/**
+ * Reads consecutive blocks from the disk. Uses read_blocks if the device
+ * supports it, otherwise each block is read with read_block.
+ * @param fs The filesystem
+ * @param block_index The first block to read
+ * @param count Number of blocks to read
+ * @param blocks The blocks to fill
+ * @return 0 if ok, 1 otherwise
+ */
+static int blocks_read(struct CrowFS *fs, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    if (fs->read_blocks != NULL && count > 1) {
+        STATS_ADD(fs, read_requests, 1);
+        STATS_ADD(fs, block_reads, count);
+        if (fs->read_blocks(fs->ctx, block_index, count, blocks))
+            return 1;
+        // The blocks which are kept by the transaction are newer than the disk
+        for (uint32_t i = 0; fs->transaction != NULL && i < count; i++) {
+            const struct TxnSlot *slot = txn_slot(fs->transaction, block_index + i);
+            if (slot->block != NULL)
+                memcpy(blocks[i], slot->block, sizeof(*blocks[i]));
+        }
+        // And so are the images in the journal
+        for (uint32_t i = 0; fs->journal != NULL && i < count; i++)
+            if (journal_location(fs, block_index + i) != block_index + i && block_read(fs, block_index + i, blocks[i]))
+                return 1;
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        if (block_read(fs, block_index + i, blocks[i]))
+            return 1;
+    return 0;
+}
+
+/**
+ * Checks if a write of a block must be kept by the transaction instead of
+ * going in place. The older image of a journaled block would be replayed over
+ * an in place write after a crash, and the disk still points to the old content
+ * of a block which the transaction has freed.
+ */
+static bool block_write_journaled(const struct CrowFS *fs, uint32_t block_index) {
+    if (fs->transaction == NULL)
+        return false;
+    return txn_freed(fs, block_index, 1) || journal_location(fs, block_index) != block_index;
+}
+
+/**
+ * Writes consecutive blocks to the disk. Uses write_blocks if the device
+ * supports it, otherwise each block is written with write_block. In a
+ * transaction, only the blocks which block_write_journaled picks are kept by
+ * it, so file data goes in place and never fills a journal record.
+ * @param fs The filesystem
+ * @param block_index The first block to write
+ * @param count Number of blocks to write
+ * @param blocks The blocks to write
+ * @return 0 if ok, 1 otherwise
+ */
+static int blocks_write(struct CrowFS *fs, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    for (uint32_t i = 0; i < count;) {
+        if (block_write_journaled(fs, block_index + i)) {
+            if (block_write(fs, block_index + i, blocks[i]))
+                return 1;
+            i++;
+            continue;
+        }
+        uint32_t length = 1;
+        while (i + length < count && !block_write_journaled(fs, block_index + i + length))
+            length++;
+        // Kept copies would overwrite these blocks at the commit
+        for (uint32_t j = 0; fs->transaction != NULL && j < length; j++) {
+            struct TxnSlot *slot = txn_slot(fs->transaction, block_index + i + j);
+            if (slot->block != NULL)
+                memcpy(slot->block, blocks[i + j], sizeof(*slot->block));
+        }
+        STATS_ADD(fs, write_requests, fs->write_blocks != NULL ? 1 : length);
+        STATS_ADD(fs, block_writes, length);
+        if (fs->write_blocks != NULL && length > 1) {
+            if (fs->write_blocks(fs->ctx, block_index + i, length, blocks + i))
+                return 1;
+        } else {
+            for (uint32_t j = 0; j < length; j++)
+                if (fs->write_block(fs->ctx, block_index + i + j, blocks[i + j]))
+                    return 1;
+        }
+        i += length;
+    }
+    return 0;
+}
+
+/**
+ * Checks if the newest content of a block is somewhere else than its place on
+ * the device, because it is kept by the transaction or its image is in the journal
+ */
+static bool block_redirected(const struct CrowFS *fs, uint32_t block_index) {
+    if (fs->transaction != NULL && txn_slot(fs->transaction, block_index)->block != NULL)
+        return true;
+    return journal_location(fs, block_index) != block_index;
+}
+
+/**
+ * Copies consecutive blocks to other consecutive blocks. Uses copy_blocks if the
+ * device supports it, so the data does not pass through the memory. Otherwise, or
+ * if it fails, the blocks are read and written in batches of IO_BATCH_BLOCKS.
+ * @param fs The filesystem
+ * @param from The first block to copy
+ * @param to The first block to copy into. The ranges must not overlap.
+ * @param count Number of blocks to copy
+ * @param data_blocks IO_BATCH_BLOCKS temporary blocks
+ * @return 0 if ok, 1 otherwise
+ */
+static int blocks_copy(struct CrowFS *fs, uint32_t from, uint32_t to, uint32_t count,
+                       union CrowFSBlock *const *data_blocks) {
+    // The device only sees the blocks at their place and must not overwrite
+    // the blocks which the transaction has freed
+    bool redirected = fs->copy_blocks != NULL && txn_freed(fs, to, count);
+    for (uint32_t i = 0; fs->copy_blocks != NULL && i < count && !redirected; i++)
+        redirected = block_redirected(fs, from + i) || block_redirected(fs, to + i);
+    if (fs->copy_blocks != NULL && !redirected) {
+        STATS_ADD(fs, write_requests, 1);
+        STATS_ADD(fs, block_writes, count);
+        if (fs->copy_blocks(fs->ctx, from, to, count) == 0)
+            return 0;
+    }
+    for (uint32_t done = 0; done < count;) {
+        const uint32_t batch = MIN(count - done, (uint32_t) IO_BATCH_BLOCKS);
+        if (blocks_read(fs, from + done, batch, data_blocks) || blocks_write(fs, to + done, batch, data_blocks))
+            return 1;
+        done += batch;
+    }
+    return 0;
+}
+
+/**
+ * Moves a block number down a max-heap until its children are smaller
+ */
+static void heap_sift_down(uint32_t *blocks, uint32_t parent, uint32_t count) {
+    for (uint32_t child; (child = 2 * parent + 1) < count; parent = child) {
+        if (child + 1 < count && blocks[child + 1] > blocks[child])
+            child++;
+        if (blocks[parent] >= blocks[child])
+            return;
+        const uint32_t temp = blocks[parent];
+        blocks[parent] = blocks[child];
+        blocks[child] = temp;
+    }
+}
+
+/**
+ * Sorts block numbers in ascending order with heapsort
+ */
+static void sort_blocks(uint32_t *blocks, uint32_t count) {
+    for (uint32_t i = count / 2; i-- > 0;)
+        heap_sift_down(blocks, i, count);
+    for (uint32_t end = count; end-- > 1;) {
+        const uint32_t temp = blocks[0];
+        blocks[0] = blocks[end];
+        blocks[end] = temp;
+        heap_sift_down(blocks, 0, end);
+    }
+}
+
+/**
+ * Starting value of the journal checksums
+ */
+#define CHECKSUM_SEED 2166136261u
+
+/**
+ * Adds a block to a checksum. This is FNV-1a over 32-bit words.
+ */
+static uint32_t checksum_block(uint32_t checksum, const union CrowFSBlock *block) {
+    for (size_t i = 0; i < CROWFS_INDIRECT_BLOCK_COUNT; i++)
+        checksum = (checksum ^ block->indirect_block[i]) * 16777619u;
+    return checksum;
+}
+
+/**
+ * Frees the memory of the journal
+ */
+static void journal_destroy(struct CrowFS *fs) {
+    struct CrowFSJournal *journal = fs->journal;
+    if (journal == NULL)
+        return;
+    for (size_t i = 0; i < sizeof(journal->slot_pages) / sizeof(journal->slot_pages[0]); i++)
+        if (journal->slot_pages[i] != NULL)
+            fs->free_mem_block(fs->ctx, journal->slot_pages[i]);
+    fs->free_mem_block(fs->ctx, (union CrowFSBlock *) journal);
+    fs->journal = NULL;
+}
+
+/**
+ * Creates an empty journal in memory
+ * @param fs The filesystem
+ * @param sequence The sequence of the next record
+ * @return 0 if ok, 1 if there is not enough memory
+ */
+static int journal_create(struct CrowFS *fs, uint32_t sequence) {
+    journal_destroy(fs);
+    struct CrowFSJournal *journal = (struct CrowFSJournal *) fs->allocate_mem_block(fs->ctx);
+    if (journal == NULL)
+        return 1;
+    memset(journal, 0, sizeof(*journal));
+    fs->journal = journal;
+    for (size_t i = 0; i < sizeof(journal->slot_pages) / sizeof(journal->slot_pages[0]); i++) {
+        journal->slot_pages[i] = fs->allocate_mem_block(fs->ctx);
+        if (journal->slot_pages[i] == NULL) {
+            journal_destroy(fs);
+            return 1;
+        }
+    }
+    journal->sequence = sequence;
+    journal->next = 1;
+    return 0;
+}
+
+/**
+ * Writes the newest images of the journal in place in ascending block order
+ * and empties the journal. The records stay valid until the header is written
+ * with a new sequence, so a crash in the middle only repeats the checkpoint.
+ * @param fs The filesystem. Must have a journal.
+ * @return 0 if ok, 1 otherwise
+ */
+static int journal_checkpoint(struct CrowFS *fs) {
+    struct CrowFSJournal *journal = fs->journal;
+    if (journal->next == 1)
+        return 0; // nothing since the last checkpoint
+    // The records must be durable before the blocks in place are overwritten
+    if (device_flush(fs))
+        return 1;
+    union CrowFSBlock *order_block = fs->allocate_mem_block(fs->ctx), *images[IO_BATCH_BLOCKS];
+    for (uint32_t i = 0; i < IO_BATCH_BLOCKS; i++)
+        images[i] = fs->allocate_mem_block(fs->ctx);
+    // At most one image for each block of the journal, so they fit in a single block
+    uint32_t *order = order_block->indirect_block, count = 0;
+    for (uint32_t i = 0; i < JOURNAL_SLOTS; i++) {
+        const struct JournalSlot *slot =
+                (struct JournalSlot *) journal->slot_pages[i / JOURNAL_SLOTS_PER_PAGE] + i % JOURNAL_SLOTS_PER_PAGE;
+        if (slot->position != 0)
+            order[count++] = slot->block_index;
+    }
+    sort_blocks(order, count);
+    int result = 0;
+    for (uint32_t i = 0; i < count && result == 0;) {
+        uint32_t length = 0;
+        while (i + length < count && length < IO_BATCH_BLOCKS && order[i + length] == order[i] + length &&
+               result == 0) {
+            result = block_read(fs, order[i + length], images[length]);
+            length++;
+        }
+        if (result == 0)
+            result = blocks_write(fs, order[i], length, images);
+        i += length;
+    }
+    // Retire the records after the blocks in place are durable
+    if (result == 0)
+        result = device_flush(fs);
+    if (result == 0) {
+        memset(images[0], 0, sizeof(*images[0]));
+        memcpy(images[0]->journal_header.magic, CROWFS_JOURNAL_MAGIC, sizeof(images[0]->journal_header.magic));
+        images[0]->journal_header.sequence = journal->sequence;
+        result = block_write(fs, fs->superblock.journal_start, images[0]);
+    }
+    if (result == 0) {
+        for (size_t i = 0; i < sizeof(journal->slot_pages) / sizeof(journal->slot_pages[0]); i++)
+            memset(journal->slot_pages[i], 0, sizeof(*journal->slot_pages[i]));
+        journal->next = 1;
+    }
+    for (uint32_t i = 0; i < IO_BATCH_BLOCKS; i++)
+        fs->free_mem_block(fs->ctx, images[i]);
+    fs->free_mem_block(fs->ctx, order_block);
+    return result;
+}
+
+/**
+ * Appends the kept blocks of a transaction to the journal as a single record.
+ * The whole record is written sequentially; its checksum makes a torn record
+ * invalid. If the record does not fit, the journal is checkpointed at first.
+ * @param fs The filesystem. Must have a journal.
+ * @param txn The transaction
+ * @param order The kept blocks in ascending order
+ * @param count Number of kept blocks. At most CROWFS_JOURNAL_RECORD_BLOCKS.
+ * @return 0 if ok, 1 otherwise. Then the journal is marked as failed.
+ */
+static int journal_append(struct CrowFS *fs, const struct CrowFSTransaction *txn, const uint32_t *order,
+                          uint32_t count) {
+    struct CrowFSJournal *journal = fs->journal;
+    if (journal->failed)
+        return 1;
+    if (journal->next + 1 + count > fs->superblock.journal_blocks && journal_checkpoint(fs)) {
+        journal->failed = true;
+        return 1;
+    }
+    union CrowFSBlock *descriptor = fs->allocate_mem_block(fs->ctx);
+    memset(descriptor, 0, sizeof(*descriptor));
+    memcpy(descriptor->journal_descriptor.magic, CROWFS_JOURNAL_DESCRIPTOR_MAGIC,
+           sizeof(descriptor->journal_descriptor.magic));
+    descriptor->journal_descriptor.sequence = journal->sequence;
+    descriptor->journal_descriptor.count = count;
+    memcpy(descriptor->journal_descriptor.blocks, order, count * sizeof(order[0]));
+    uint32_t checksum = checksum_block(CHECKSUM_SEED, descriptor);
+    for (uint32_t i = 0; i < count; i++)
+        checksum = checksum_block(checksum, txn_slot(txn, order[i])->block);
+    descriptor->journal_descriptor.checksum = checksum;
+    // The descriptor and then the images
+    int result = 0;
+    union CrowFSBlock *run[IO_BATCH_BLOCKS];
+    for (uint32_t i = 0; i < count + 1 && result == 0;) {
+        const uint32_t length = MIN(count + 1 - i, IO_BATCH_BLOCKS);
+        for (uint32_t j = 0; j < length; j++)
+            run[j] = i + j == 0 ? descriptor : txn_slot(txn, order[i + j - 1])->block;
+        result = blocks_write(fs, fs->superblock.journal_start + journal->next + i, length, run);
+        i += length;
+    }
+    fs->free_mem_block(fs->ctx, descriptor);
+    if (result != 0) {
+        journal->failed = true;
+        return 1;
+    }
+    // Reads find the images in the journal from now on
+    for (uint32_t i = 0; i < count; i++) {
+        struct JournalSlot *slot = journal_slot(journal, order[i]);
+        slot->block_index = order[i];
+        slot->position = journal->next + 1 + i;
+    }
+    journal->next += 1 + count;
+    journal->sequence++;
+    return 0;
+}
+
+/**
+ * Loads the journal of a filesystem which is being mounted and replays the
+ * complete records in it. Records are read until one has a wrong sequence or
+ * checksum, which is where the journal ended before the crash.
+ * @param fs The filesystem. The superblock must be loaded.
+ * @return CROWFS_OK, CROWFS_ERR_LIMIT if there is not enough memory,
+ * CROWFS_ERR_INIT_INVALID_FS if the journal header is invalid or CROWFS_ERR_IO
+ */
+static int journal_load(struct CrowFS *fs) {
+    int result = CROWFS_OK;
+    union CrowFSBlock *descriptor = fs->allocate_mem_block(fs->ctx), *image = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, fs->superblock.journal_start, descriptor))
+    if (memcmp(descriptor->journal_header.magic, CROWFS_JOURNAL_MAGIC, sizeof(descriptor->journal_header.magic)) != 0) {
+        result = CROWFS_ERR_INIT_INVALID_FS;
+        goto end;
+    }
+    if (journal_create(fs, descriptor->journal_header.sequence)) {
+        result = CROWFS_ERR_LIMIT;
+        goto end;
+    }
+    struct CrowFSJournal *journal = fs->journal;
+    while (journal->next + 1 < fs->superblock.journal_blocks) {
+        TRY_IO(block_read(fs, fs->superblock.journal_start + journal->next, descriptor))
+        const uint32_t count = descriptor->journal_descriptor.count;
+        if (memcmp(descriptor->journal_descriptor.magic, CROWFS_JOURNAL_DESCRIPTOR_MAGIC,
+                   sizeof(descriptor->journal_descriptor.magic)) != 0 ||
+            descriptor->journal_descriptor.sequence != journal->sequence || count == 0 ||
+            count > CROWFS_JOURNAL_RECORD_BLOCKS || journal->next + 1 + count > fs->superblock.journal_blocks)
+            break;
+        const uint32_t expected = descriptor->journal_descriptor.checksum;
+        descriptor->journal_descriptor.checksum = 0;
+        uint32_t checksum = checksum_block(CHECKSUM_SEED, descriptor);
+        for (uint32_t i = 0; i < count; i++) {
+            TRY_IO(block_read(fs, fs->superblock.journal_start + journal->next + 1 + i, image))
+            checksum = checksum_block(checksum, image);
+        }
+        if (checksum != expected)
+            break;
+        for (uint32_t i = 0; i < count; i++) {
+            struct JournalSlot *slot = journal_slot(journal, descriptor->journal_descriptor.blocks[i]);
+            slot->block_index = descriptor->journal_descriptor.blocks[i];
+            slot->position = journal->next + 1 + i;
+        }
+        journal->next += 1 + count;
+        journal->sequence++;
+    }
+    // A read only mount keeps reading the blocks from the records
+    if (!(fs->mount_flags & CROWFS_MOUNT_READ_ONLY))
+        TRY_IO(journal_checkpoint(fs))
+
+end:
+    fs->free_mem_block(fs->ctx, descriptor);
+    fs->free_mem_block(fs->ctx, image);
+    return result;
+}
+
+/**
+ * Writes all blocks which are kept by the transaction in ascending order and
+ * empties it. Consecutive blocks are written with a single request. With a
+ * journal, the blocks are appended to it as a single record instead.
+ * @param fs The filesystem
+ * @return 0 if ok, 1 if a block could not be written
+ */
+static int txn_flush(struct CrowFS *fs) {
+    struct CrowFSTransaction *txn = fs->transaction;
+    if (txn->count == 0)
+        return 0;
+    // Writes of the flush go to the disk
+    fs->transaction = NULL;
+    union CrowFSBlock *order_block = fs->allocate_mem_block(fs->ctx);
+    uint32_t *order = order_block->indirect_block, count = 0;
+    for (uint32_t i = 0; i < TXN_SLOTS; i++) {
+        const struct TxnSlot *slot = (struct TxnSlot *) txn->slot_pages[i / TXN_SLOTS_PER_PAGE] + i % TXN_SLOTS_PER_PAGE;
+        if (slot->block != NULL)
+            order[count++] = slot->block_index;
+    }
+    sort_blocks(order, count);
+    int result = 0;
+    union CrowFSBlock *run[IO_BATCH_BLOCKS];
+    if (fs->journal != NULL)
+        result = journal_append(fs, txn, order, count);
+    for (uint32_t i = 0; fs->journal == NULL && i < count;) {
+        uint32_t length = 0;
+        while (i + length < count && length < IO_BATCH_BLOCKS && order[i + length] == order[i] + length) {
+            run[length] = txn_slot(txn, order[i + length])->block;
+            length++;
+        }
+        if (blocks_write(fs, order[i], length, run))
+            result = 1;
+        i += length;
+    }
+    // Empty the transaction
+    for (uint32_t i = 0; i < TXN_SLOTS; i++) {
+        struct TxnSlot *slot = (struct TxnSlot *) txn->slot_pages[i / TXN_SLOTS_PER_PAGE] + i % TXN_SLOTS_PER_PAGE;
+        if (slot->block != NULL)
+            fs->free_mem_block(fs->ctx, slot->block);
+        slot->block = NULL;
+    }
+    txn->count = 0;
+    // The freed blocks are free on the disk too now
+    txn->freed_count = 0;
+    txn->freed_blocks = 0;
+    txn->freed_overflow = false;
+    fs->free_mem_block(fs->ctx, order_block);
+    fs->transaction = txn;
+    if (fs->discards != NULL)
+        discards_finish(fs, result == 0);
+    return result;
+}
+
+/**
+ * Keeps a written block in the transaction. If the transaction is full, the
+ * kept blocks are written at first. A journaled transaction is never written
+ * in the middle of an operation, because its record must hold the whole
+ * operation, so the write fails instead.
+ * @param fs The filesystem. Must have a transaction.
+ * @param block_index The block which is written
+ * @param block The new content of the block
+ * @return 0 if the block is kept, 1 if there is not enough memory, the journal
+ * record is full or the kept blocks could not be written. Reads would not see an in place write of the
+ * block, so it is not written at all then.
+ */
+static int txn_keep(struct CrowFS *fs, uint32_t block_index, const union CrowFSBlock *block) {
+    struct CrowFSTransaction *txn = fs->transaction;
+    struct TxnSlot *slot = txn_slot(txn, block_index);
+    if (slot->block == NULL) {
+        if (fs->journal != NULL && txn->count == CROWFS_JOURNAL_RECORD_BLOCKS)
+            return 1;
+        if (txn->count == TXN_MAX_BLOCKS) {
+            if (txn_flush(fs)) {
+                txn->failed = true;
+                return 1;
+            }
+            slot = txn_slot(txn, block_index);
+        }
+        slot->block = fs->allocate_mem_block(fs->ctx);
+        if (slot->block == NULL)
+            return 1;
+        slot->block_index = block_index;
+        txn->count++;
+    }
+    memcpy(slot->block, block, sizeof(*slot->block));
+    return 0;
+}
+
+/**
+ * Gets the disk block which holds the nth block of a file
+ * @param file The file dnode
+ * @param indirect_block The indirect block of the file (only used if index is indirect)
+ * @param index The block index in the file
+ * @return The block number or 0 if not allocated
+ */
+static uint32_t file_content_block(const struct CrowFSFileBlock *file, const union CrowFSBlock *indirect_block,
+                                   size_t index) {
+    if (index >= CROWFS_DIRECT_BLOCKS)
+        return indirect_block->indirect_block[index - CROWFS_DIRECT_BLOCKS];
+    return file->direct_blocks[index];
+}
+
+/**
+ * Gets the pointer to the disk block of the nth block of a file
+ * @param file The file dnode
+ * @param indirect_block The indirect block of the file (only used if index is indirect)
+ * @param index The block index in the file
+ * @return The pointer in the dnode or the indirect block
+ */
+static uint32_t *file_content_pointer(struct CrowFSFileBlock *file, union CrowFSBlock *indirect_block, size_t index) {
+    if (index >= CROWFS_DIRECT_BLOCKS)
+        return &indirect_block->indirect_block[index - CROWFS_DIRECT_BLOCKS];
+    return &file->direct_blocks[index];
+}
+
+/**
+ * Tree of the free extent index which is ordered by the first block
+ */
+#define EXTENT_BY_START 0
+/**
+ * Tree of the free extent index which is ordered by the length and then the first block
+ */
+#define EXTENT_BY_LENGTH 1
+
+/**
+ * A run of free blocks. Each extent is a node of two treaps which share the
+ * same priority: one is ordered by the start and one by the length.
+ */
+struct ExtentNode {
+    uint32_t start, length;
+    // Random priority of the treaps. Parents have higher priorities.
+    uint32_t priority;
+    // Largest length of the subtree in the EXTENT_BY_START tree
+    uint32_t max_length;
+    // Left and right children in each tree
+    struct ExtentNode *children[2][2];
+};
+
+/**
+ * A memory block which holds the extent nodes
+ */
+struct ExtentPool {
+    union CrowFSBlock *next;
+    struct ExtentNode nodes[(CROWFS_BLOCK_SIZE - sizeof(union CrowFSBlock *)) / sizeof(struct ExtentNode)];
+};
+
+/**
+ * The free extent index. It lives in a memory block and its nodes are in pools
+ * which are allocated on demand.
+ */
+struct CrowFSExtentIndex {
+    struct ExtentNode *roots[2];
+    // Unused nodes linked with children[EXTENT_BY_START][0]
+    struct ExtentNode *free_nodes;
+    // All pools linked with their next field
+    union CrowFSBlock *pools;
+    // Sum of the lengths of all extents
+    uint32_t free_blocks;
+    // State of the random priorities
+    uint32_t seed;
+};
+
+/**
+ * Compares two extents in a tree
+ * @return True if a comes before b
+ */
+static bool extent_less(const struct ExtentNode *a, const struct ExtentNode *b, int tree) {
+    if (tree == EXTENT_BY_LENGTH && a->length != b->length)
+        return a->length < b->length;
+    return a->start < b->start;
+}
+
+/**
+ * Recomputes the max_length of a node from its children in the EXTENT_BY_START tree
+ */
+static void extent_update(struct ExtentNode *node, int tree) {
+    if (tree != EXTENT_BY_START)
+        return;
+    node->max_length = node->length;
+    for (int i = 0; i < 2; i++) {
+        const struct ExtentNode *child = node->children[EXTENT_BY_START][i];
+        if (child != NULL && child->max_length > node->max_length)
+            node->max_length = child->max_length;
+    }
+}
+
+/**
+ * Joins two treaps where every node of left comes before every node of right
+ * @return The root of the joined treap
+ */
+static struct ExtentNode *extent_merge(struct ExtentNode *left, struct ExtentNode *right, int tree) {
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+    struct ExtentNode *root;
+    if (left->priority > right->priority) {
+        left->children[tree][1] = extent_merge(left->children[tree][1], right, tree);
+        root = left;
+    } else {
+        right->children[tree][0] = extent_merge(left, right->children[tree][0], tree);
+        root = right;
+    }
+    extent_update(root, tree);
+    return root;
+}
+
+/**
+ * Splits a treap into the nodes which come before a key and the rest
+ */
+static void extent_split(struct ExtentNode *root, const struct ExtentNode *key, int tree, struct ExtentNode **left,
+                         struct ExtentNode **right) {
+    if (root == NULL) {
+        *left = *right = NULL;
+        return;
+    }
+    if (extent_less(root, key, tree)) {
+        extent_split(root->children[tree][1], key, tree, &root->children[tree][1], right);
+        *left = root;
+    } else {
+        extent_split(root->children[tree][0], key, tree, left, &root->children[tree][0]);
+        *right = root;
+    }
+    extent_update(root, tree);
+}
+
+/**
+ * Removes a node from a treap
+ * @return The new root of the treap
+ */
+static struct ExtentNode *extent_remove_from(struct ExtentNode *root, const struct ExtentNode *node, int tree) {
+    if (root == node)
+        return extent_merge(node->children[tree][0], node->children[tree][1], tree);
+    const int side = extent_less(node, root, tree) ? 0 : 1;
+    root->children[tree][side] = extent_remove_from(root->children[tree][side], node, tree);
+    extent_update(root, tree);
+    return root;
+}
+
+/**
+ * Adds a free extent to the index. The node must be filled with its start and length.
+ */
+static void extent_insert(struct CrowFSExtentIndex *index, struct ExtentNode *node) {
+    // xorshift is enough to keep the treaps balanced
+    index->seed ^= index->seed << 13;
+    index->seed ^= index->seed >> 17;
+    index->seed ^= index->seed << 5;
+    node->priority = index->seed;
+    for (int tree = 0; tree < 2; tree++) {
+        struct ExtentNode *left, *right;
+        extent_split(index->roots[tree], node, tree, &left, &right);
+        node->children[tree][0] = node->children[tree][1] = NULL;
+        extent_update(node, tree);
+        index->roots[tree] = extent_merge(extent_merge(left, node, tree), right, tree);
+    }
+    index->free_blocks += node->length;
+}
+
+/**
+ * Removes a free extent from the index. The node is not freed.
+ */
+static void extent_remove(struct CrowFSExtentIndex *index, struct ExtentNode *node) {
+    for (int tree = 0; tree < 2; tree++)
+        index->roots[tree] = extent_remove_from(index->roots[tree], node, tree);
+    index->free_blocks -= node->length;
+}
+
+/**
+ * Gets an unused node from the pools of the index
+ * @return The node or NULL if no memory is available
+ */
+static struct ExtentNode *extent_node_new(struct CrowFS *fs, uint32_t start, uint32_t length) {
+    struct CrowFSExtentIndex *index = fs->extent_index;
+    if (index->free_nodes == NULL) {
+        union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+        if (block == NULL)
+            return NULL;
+        struct ExtentPool *pool = (struct ExtentPool *) block;
+        pool->next = index->pools;
+        index->pools = block;
+        for (size_t i = 0; i < sizeof(pool->nodes) / sizeof(pool->nodes[0]); i++) {
+            pool->nodes[i].children[EXTENT_BY_START][0] = index->free_nodes;
+            index->free_nodes = &pool->nodes[i];
+        }
+    }
+    struct ExtentNode *node = index->free_nodes;
+    index->free_nodes = node->children[EXTENT_BY_START][0];
+    node->start = start;
+    node->length = length;
+    return node;
+}
+
+/**
+ * Returns a node to the unused nodes of the index
+ */
+static void extent_node_free(struct CrowFSExtentIndex *index, struct ExtentNode *node) {
+    node->children[EXTENT_BY_START][0] = index->free_nodes;
+    index->free_nodes = node;
+}
+
+/**
+ * Finds the extent which contains a block
+ * @return The extent or NULL if the block is not free
+ */
+static struct ExtentNode *extent_containing(const struct CrowFSExtentIndex *index, uint32_t block) {
+    struct ExtentNode *node = index->roots[EXTENT_BY_START], *floor = NULL;
+    while (node != NULL) {
+        if (node->start <= block) {
+            floor = node;
+            node = node->children[EXTENT_BY_START][1];
+        } else {
+            node = node->children[EXTENT_BY_START][0];
+        }
+    }
+    if (floor != NULL && block - floor->start < floor->length)
+        return floor;
+    return NULL;
+}
+
+/**
+ * Finds the first extent which starts at or after a block and has enough blocks
+ * @param node The root of the EXTENT_BY_START tree
+ * @param from The smallest start of the extent
+ * @param count The smallest length of the extent
+ * @return The extent or NULL if there is none
+ */
+static struct ExtentNode *extent_first_fit(struct ExtentNode *node, uint32_t from, uint32_t count) {
+    if (node == NULL || node->max_length < count)
+        return NULL;
+    if (node->start >= from) {
+        struct ExtentNode *left = extent_first_fit(node->children[EXTENT_BY_START][0], from, count);
+        if (left != NULL)
+            return left;
+        if (node->length >= count)
+            return node;
+    }
+    return extent_first_fit(node->children[EXTENT_BY_START][1], from, count);
+}
+
+/**
+ * Finds the smallest extent which has enough blocks. Ties go to the lower start.
+ * @return The extent or NULL if there is none
+ */
+static struct ExtentNode *extent_best_fit(const struct CrowFSExtentIndex *index, uint32_t count) {
+    struct ExtentNode *node = index->roots[EXTENT_BY_LENGTH], *best = NULL;
+    while (node != NULL) {
+        if (node->length >= count) {
+            best = node;
+            node = node->children[EXTENT_BY_LENGTH][0];
+        } else {
+            node = node->children[EXTENT_BY_LENGTH][1];
+        }
+    }
+    return best;
+}
+
+/**
+ * Finds a free run near a goal block. The run starts at the goal if possible,
+ * otherwise at the first fitting extent after the goal. The search wraps around
+ * to the start of the disk.
+ * @return The first block of the run or 0 if there is none
+ */
+static uint32_t extent_find_near(const struct CrowFSExtentIndex *index, uint32_t goal, uint32_t count) {
+    const struct ExtentNode *node = extent_containing(index, goal);
+    if (node != NULL && node->length - (goal - node->start) >= count)
+        return goal;
+    node = extent_first_fit(index->roots[EXTENT_BY_START], goal, count);
+    if (node == NULL)
+        node = extent_first_fit(index->roots[EXTENT_BY_START], 0, count);
+    return node != NULL ? node->start : 0;
+}
+
+/**
+ * Releases the free extent index and its memory. Allocation falls back to the bitmap.
+ */
+static void extent_index_destroy(struct CrowFS *fs) {
+    struct CrowFSExtentIndex *index = fs->extent_index;
+    if (index == NULL)
+        return;
+    while (index->pools != NULL) {
+        union CrowFSBlock *next = ((struct ExtentPool *) index->pools)->next;
+        fs->free_mem_block(fs->ctx, index->pools);
+        index->pools = next;
+    }
+    fs->extent_index = NULL;
+    fs->free_mem_block(fs->ctx, (union CrowFSBlock *) index);
+}
+
+/**
+ * Marks a run of free blocks as used in the free extent index. The run must be
+ * inside a single extent. If the index is inconsistent or out of memory, it is dropped.
+ */
+static void extent_index_take(struct CrowFS *fs, uint32_t start, uint32_t count) {
+    struct CrowFSExtentIndex *index = fs->extent_index;
+    if (index == NULL)
+        return;
+    struct ExtentNode *node = extent_containing(index, start);
+    if (node == NULL || node->length - (start - node->start) < count) {
+        extent_index_destroy(fs);
+        return;
+    }
+    extent_remove(index, node);
+    const uint32_t end = node->start + node->length;
+    // The node is reused for the part before the run and a new one holds the part after it
+    if (start > node->start) {
+        node->length = start - node->start;
+        extent_insert(index, node);
+        node = NULL;
+    }
+    if (start + count < end) {
+        if (node == NULL && (node = extent_node_new(fs, 0, 0)) == NULL) {
+            extent_index_destroy(fs);
+            return;
+        }
+        node->start = start + count;
+        node->length = end - node->start;
+        extent_insert(index, node);
+        node = NULL;
+    }
+    if (node != NULL)
+        extent_node_free(index, node);
+}
+
+/**
+ * Adds a run of freed blocks to the free extent index and joins it with its neighbours
+ */
+static void extent_index_give(struct CrowFS *fs, uint32_t start, uint32_t count) {
+    struct CrowFSExtentIndex *index = fs->extent_index;
+    if (index == NULL || extent_containing(index, start) != NULL)
+        return; // already free
+    struct ExtentNode *before = start > 0 ? extent_containing(index, start - 1) : NULL,
+            *after = extent_containing(index, start + count);
+    if (after != NULL && after->start != start + count) { // overlaps
+        extent_index_destroy(fs);
+        return;
+    }
+    if (before != NULL) {
+        extent_remove(index, before);
+        start = before->start;
+        count += before->length;
+    }
+    if (after != NULL) {
+        extent_remove(index, after);
+        count += after->length;
+    }
+    struct ExtentNode *node = before != NULL ? before : after != NULL ? after : extent_node_new(fs, 0, 0);
+    if (node == NULL) {
+        extent_index_destroy(fs);
+        return;
+    }
+    if (before != NULL && after != NULL)
+        extent_node_free(index, after);
+    node->start = start;
+    node->length = count;
+    extent_insert(index, node);
+}
+
+/**
+ * Builds the free extent index from the free bitmap
+ * @param fs The filesystem. Its extent index is replaced.
+ * @return 0 if ok or the index could not get memory, 1 on I/O error
+ */
+static int extent_index_build(struct CrowFS *fs) {
+    extent_index_destroy(fs);
+    struct CrowFSExtentIndex *index = (struct CrowFSExtentIndex *) fs->allocate_mem_block(fs->ctx);
+    if (index == NULL)
+        return 0;
+    memset(index, 0, sizeof(*index));
+    index->seed = 0x9E3779B9;
+    fs->extent_index = index;
+    union CrowFSBlock *bitmap = fs->allocate_mem_block(fs->ctx);
+    int result = 0;
+    uint32_t run_start = 0, run_length = 0;
+    for (uint32_t bitmap_block = 0; bitmap_block <= fs->free_bitmap_blocks && fs->extent_index != NULL;
+         bitmap_block++) {
+        // One more round after the last block ends the last run
+        if (bitmap_block == fs->free_bitmap_blocks || !bitmap_summary_has_free(fs, bitmap_block))
+            memset(bitmap->bitmap.bitmap, 0, sizeof(bitmap->bitmap.bitmap));
+        else if ((result = bitmap_read(fs, bitmap_block, bitmap)) != 0)
+            break;
+        const uint32_t first_block = bitmap_block * CROWFS_BITSET_COVERED_BLOCKS;
+        for (uint32_t i = 0; i < CROWFS_BLOCK_SIZE && fs->extent_index != NULL; i++) {
+            const uint8_t byte = bitmap->bitmap.bitmap[i];
+            if (byte == 0xFF && run_length != 0) {
+                run_length += 8;
+                continue;
+            }
+            for (uint32_t bit = 0; bit < 8; bit++) {
+                if ((byte >> bit) & 1) {
+                    if (run_length++ == 0)
+                        run_start = first_block + i * 8 + bit;
+                } else if (run_length != 0) {
+                    struct ExtentNode *node = extent_node_new(fs, run_start, run_length);
+                    if (node == NULL) {
+                        extent_index_destroy(fs);
+                        break;
+                    }
+                    extent_insert(index, node);
+                    run_length = 0;
+                }
+            }
+        }
+    }
+    fs->free_mem_block(fs->ctx, bitmap);
+    if (result != 0)
+        extent_index_destroy(fs);
+    return result;
+}
+
+/**
+ * Allocates a free block near a goal block. The first free block at or after the
+ * goal is used and the search wraps around to the start of the disk, so related
+ * blocks such as a folder and its children or a file and its data are kept close
+ * to each other on the disk.
+ * @param fs The filesystem
+ * @param goal The preferred block. Zero or an out of range block means the start of the disk.
+ * @return The dnode number or zero if no free dnode is available
+ */
+static uint32_t block_alloc(struct CrowFS *fs, uint32_t goal) {
+    uint32_t allocated_dnode = 0;
+    if (goal >= fs->superblock.blocks)
+        goal = 0;
+    const uint32_t goal_bitmap = goal / CROWFS_BITSET_COVERED_BLOCKS;
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    // The extent index knows the block without scanning the bitmap
+    if (fs->extent_index != NULL) {
+        const uint32_t found = extent_find_near(fs->extent_index, goal, 1);
+        if (found == 0 || bitmap_read(fs, found / CROWFS_BITSET_COVERED_BLOCKS, block))
+            goto end;
+        bitmap_clear(&block->bitmap, found % CROWFS_BITSET_COVERED_BLOCKS);
+        if (bitmap_write(fs, found / CROWFS_BITSET_COVERED_BLOCKS, block))
+            goto end;
+        extent_index_take(fs, found, 1);
+        allocated_dnode = found;
+        goto end;
+    }
+    // Look for free blocks. The bitmap block of the goal is scanned from the goal
+    // at first and once more from its start after every other bitmap block.
+    for (uint32_t step = 0; step <= fs->free_bitmap_blocks; step++) {
+        const uint32_t free_block = (goal_bitmap + step) % fs->free_bitmap_blocks;
+        const uint32_t from = step == 0 ? goal % CROWFS_BITSET_COVERED_BLOCKS : 0;
+        if (step == fs->free_bitmap_blocks && goal % CROWFS_BITSET_COVERED_BLOCKS == 0)
+            break; // already scanned completely
+        // Full bitmap blocks are skipped without reading them
+        if (!bitmap_summary_has_free(fs, free_block)) {
+            STATS_ADD(fs, bitmap_blocks_skipped, 1);
+            continue;
+        }
+        // Read the bitmap
+        STATS_ADD(fs, bitmap_blocks_scanned, 1);
+        if (bitmap_read(fs, free_block, block)) // well fuck?
+            goto end;
+        // Look for free block...
+        const uint32_t bit = bitmap_find_free(&block->bitmap, from);
+        if (bit == CROWFS_BITSET_COVERED_BLOCKS) {
+            // The whole block is scanned, so it is full
+            if (from == 0 && bitmap_summary_update(fs, free_block, false))
+                goto end;
+            continue;
+        }
+        // Mark this dnode as occupied
+        bitmap_clear(&block->bitmap, bit);
+        if (bitmap_write(fs, free_block, block))
+            goto end;
+        allocated_dnode = free_block * CROWFS_BITSET_COVERED_BLOCKS + bit;
+        break;
+    }
+
+end:
+    fs->free_mem_block(fs->ctx, block);
+    if (allocated_dnode != 0)
+        discard_forget(fs, allocated_dnode, 1);
+    return allocated_dnode;
+}
+
+/**
+ * Chooses the goal block of a new folder. This is the start of the first group of
+ * FOLDER_GROUP_BLOCKS free blocks after the parent, so the folder has room for its
+ * children. If there is no such group close to the parent, the block after the
+ * parent is used instead.
+ * @param fs The filesystem
+ * @param parent The parent folder of the new folder
+ * @return The goal block to pass to block_alloc
+ */
+static uint32_t folder_goal(struct CrowFS *fs, uint32_t parent) {
+    const uint32_t parent_bitmap = parent / CROWFS_BITSET_COVERED_BLOCKS;
+    uint32_t goal = parent + 1;
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    for (uint32_t free_block = parent_bitmap; free_block < fs->free_bitmap_blocks &&
+                                              free_block - parent_bitmap < FOLDER_GROUP_SEARCH_BITMAPS; free_block++) {
+        if (!bitmap_summary_has_free(fs, free_block)) {
+            STATS_ADD(fs, bitmap_blocks_skipped, 1);
+            continue;
+        }
+        STATS_ADD(fs, bitmap_blocks_scanned, 1);
+        if (bitmap_read(fs, free_block, block))
+            break;
+        uint32_t group = free_block == parent_bitmap
+                         ? parent % CROWFS_BITSET_COVERED_BLOCKS / FOLDER_GROUP_BLOCKS + 1 : 0;
+        for (; group < CROWFS_BITSET_COVERED_BLOCKS / FOLDER_GROUP_BLOCKS; group++) {
+            // Is every block of this group free?
+            const uint8_t *bytes = block->bitmap.bitmap + group * (FOLDER_GROUP_BLOCKS / 8);
+            uint32_t i = 0;
+            while (i < FOLDER_GROUP_BLOCKS / 8 && bytes[i] == 0xFF)
+                i++;
+            if (i == FOLDER_GROUP_BLOCKS / 8) {
+                goal = free_block * CROWFS_BITSET_COVERED_BLOCKS + group * FOLDER_GROUP_BLOCKS;
+                goto end;
+            }
+        }
+    }
+
+end:
+    fs->free_mem_block(fs->ctx, block);
+    return goal;
+}
+
+/**
+ * Gets the block index which a pointer is pointing to. If the block does not exists
+ * it will try to allocate a new block on disk and return the new block number.
+ * @param fs The filesystem
+ * @param from The block index to check
+ * @param goal The block to allocate near if the block does not exist
+ * @return The block index if successful or 0 if disk is full
+ */
+static uint32_t get_or_allocate_block(struct CrowFS *fs, uint32_t *from, uint32_t goal) {
+    uint32_t content_block = *from;
+    if (content_block == 0) {
+        content_block = block_alloc(fs, goal);
+        if (content_block == 0)
+            return 0;
+        *from = content_block;
+    }
+    return content_block;
+}
+
+/**
+ * Checks if some blocks have the highest refcount, so they cannot be shared once more
+ * @param fs The filesystem. Must have CROWFS_FEATURE_REFCOUNT.
+ * @param blocks The blocks. They are sorted in place.
+ * @param count Number of blocks
+ * @param saturated True if any of the blocks has the highest refcount
+ * @return 0 if ok, 1 on I/O error
+ */
+static int refcounts_saturated(struct CrowFS *fs, uint32_t *blocks, uint32_t count, bool *saturated) {
+    int result = 0;
+    union CrowFSBlock *refcounts = fs->allocate_mem_block(fs->ctx);
+    sort_blocks(blocks, count);
+    *saturated = false;
+    for (uint32_t i = 0; i < count && !*saturated;) {
+        const uint32_t refcount_block = blocks[i] / CROWFS_REFCOUNTS_PER_BLOCK;
+        if (block_read(fs, refcount_start(fs) + refcount_block, refcounts)) {
+            result = 1;
+            break;
+        }
+        for (; i < count && blocks[i] / CROWFS_REFCOUNTS_PER_BLOCK == refcount_block; i++)
+            if (refcounts->refcounts[blocks[i] % CROWFS_REFCOUNTS_PER_BLOCK] == UINT16_MAX)
+                *saturated = true;
+    }
+    fs->free_mem_block(fs->ctx, refcounts);
+    return result;
+}
+
+/**
+ * Adds or drops a reference of some blocks. The blocks are sorted, so each
+ * block of the refcount area is read and written once.
+ * @param fs The filesystem. Must have CROWFS_FEATURE_REFCOUNT.
+ * @param blocks The blocks. They are sorted in place.
+ * @param count Number of blocks. When references are dropped, the blocks which
+ * were not shared are moved to the start of blocks and count is set to their
+ * number. The caller must free them.
+ * @param add True to add a reference. The blocks must not be saturated.
+ * @return 0 if ok, 1 on I/O error
+ */
+static int refcounts_change(struct CrowFS *fs, uint32_t *blocks, uint32_t *count, bool add) {
+    int result = 0;
+    uint32_t unshared = 0;
+    union CrowFSBlock *refcounts = fs->allocate_mem_block(fs->ctx);
+    sort_blocks(blocks, *count);
+    for (uint32_t i = 0; i < *count;) {
+        const uint32_t refcount_block = blocks[i] / CROWFS_REFCOUNTS_PER_BLOCK;
+        bool changed = false;
+        if (block_read(fs, refcount_start(fs) + refcount_block, refcounts)) {
+            result = 1;
+            break;
+        }
+        for (; i < *count && blocks[i] / CROWFS_REFCOUNTS_PER_BLOCK == refcount_block; i++) {
+            uint16_t *refcount = &refcounts->refcounts[blocks[i] % CROWFS_REFCOUNTS_PER_BLOCK];
+            if (!add && *refcount == 0) {
+                blocks[unshared++] = blocks[i];
+                continue;
+            }
+            *refcount = add ? *refcount + 1 : *refcount - 1;
+            changed = true;
+        }
+        if (changed && block_write(fs, refcount_start(fs) + refcount_block, refcounts)) {
+            result = 1;
+            break;
+        }
+    }
+    if (result == 0 && !add)
+        *count = unshared;
+    fs->free_mem_block(fs->ctx, refcounts);
+    return result;
+}
+
+/**
+ * Checks if a data block is shared. The block of the refcount area which holds
+ * its refcount is only read if it is not already loaded.
+ * @param fs The filesystem. Must have CROWFS_FEATURE_REFCOUNT.
+ * @param block_index The block to check
+ * @param refcounts The loaded block of the refcount area
+ * @param loaded The index of the loaded refcount block or UINT32_MAX if none is loaded
+ * @return 1 if shared, 0 if not and -1 on I/O error
+ */
+static int block_is_shared(struct CrowFS *fs, uint32_t block_index, union CrowFSBlock *refcounts, uint32_t *loaded) {
+    const uint32_t refcount_block = block_index / CROWFS_REFCOUNTS_PER_BLOCK;
+    if (*loaded != refcount_block) {
+        if (block_read(fs, refcount_start(fs) + refcount_block, refcounts))
+            return -1;
+        *loaded = refcount_block;
+    }
+    return refcounts->refcounts[block_index % CROWFS_REFCOUNTS_PER_BLOCK] != 0;
+}
+
+/**
+ * Frees an allocated block
+ * @param dnode The dnode or block number
+ */
+static void block_free(struct CrowFS *fs, uint32_t dnode) {
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    if (bitmap_read(fs, dnode / CROWFS_BITSET_COVERED_BLOCKS, block))
+        goto end;
+
+    bitmap_set(&block->bitmap, dnode % CROWFS_BITSET_COVERED_BLOCKS);
+    if (bitmap_write(fs, dnode / CROWFS_BITSET_COVERED_BLOCKS, block) == 0) {
+        extent_index_give(fs, dnode, 1);
+        discard_add(fs, dnode);
+        txn_freed_add(fs, dnode, 1);
+    }
+
+end:
+    fs->free_mem_block(fs->ctx, block);
+}
+
+/**
+ * Freed blocks which are applied to the free bitmap together
+ */
+struct FreeBatch {
+    uint32_t count;
+    uint32_t blocks[CROWFS_INDIRECT_BLOCK_COUNT - 1];
+};
+
+_Static_assert(sizeof(struct FreeBatch) == CROWFS_BLOCK_SIZE, "A free batch must be a memory block");
+
+/**
+ * Frees the blocks of a batch and empties it. The blocks are sorted, so each
+ * bitmap block is read and written once for all of its blocks. Shared blocks
+ * are not freed but their refcount is decreased.
+ * @param fs The filesystem
+ * @param batch The batch
+ * @return 0 if ok, 1 on I/O error
+ */
+static int free_batch_apply(struct CrowFS *fs, struct FreeBatch *batch) {
+    int result = 0;
+    union CrowFSBlock *bitmap = fs->allocate_mem_block(fs->ctx);
+    // Shared blocks only lose a reference
+    if ((fs->superblock.features & CROWFS_FEATURE_REFCOUNT) &&
+        refcounts_change(fs, batch->blocks, &batch->count, false))
+        result = 1;
+    else
+        sort_blocks(batch->blocks, batch->count);
+    for (uint32_t i = 0; i < batch->count && result == 0;) {
+        const uint32_t bitmap_block = batch->blocks[i] / CROWFS_BITSET_COVERED_BLOCKS;
+        uint32_t end = i;
+        if (bitmap_read(fs, bitmap_block, bitmap)) {
+            result = 1;
+            break;
+        }
+        for (; end < batch->count && batch->blocks[end] / CROWFS_BITSET_COVERED_BLOCKS == bitmap_block; end++)
+            bitmap_set(&bitmap->bitmap, batch->blocks[end] % CROWFS_BITSET_COVERED_BLOCKS);
+        if (bitmap_write(fs, bitmap_block, bitmap)) {
+            result = 1;
+            break;
+        }
+        // Give back the runs of consecutive blocks
+        while (i < end) {
+            uint32_t length = 1;
+            while (i + length < end && batch->blocks[i + length] == batch->blocks[i] + length)
+                length++;
+            extent_index_give(fs, batch->blocks[i], length);
+            txn_freed_add(fs, batch->blocks[i], length);
+            for (uint32_t j = 0; j < length; j++)
+                discard_add(fs, batch->blocks[i + j]);
+            i += length;
+        }
+    }
+    batch->count = 0;
+    fs->free_mem_block(fs->ctx, bitmap);
+    return result;
+}
+
+/**
+ * Drops a reference of a data block. The block is freed if no other file uses it.
+ * @param fs The filesystem
+ * @param block_index The data block
+ */
+static void data_block_free(struct CrowFS *fs, uint32_t block_index) {
+    uint32_t unshared = 1;
+    if ((fs->superblock.features & CROWFS_FEATURE_REFCOUNT) && refcounts_change(fs, &block_index, &unshared, false))
+        return;
+    if (unshared != 0)
+        block_free(fs, block_index);
+}
+
+/**
+ * Adds a block to a batch of freed blocks. A full batch is applied at first.
+ * @return 0 if ok, 1 on I/O error
+ */
+static int free_batch_add(struct CrowFS *fs, struct FreeBatch *batch, uint32_t block_index) {
+    if (batch->count == sizeof(batch->blocks) / sizeof(batch->blocks[0]) && free_batch_apply(fs, batch))
+        return 1;
+    batch->blocks[batch->count++] = block_index;
+    return 0;
+}
+
+/**
+ * Adds the data blocks and the indirect block of a file to a batch of freed blocks.
+ * The dnode itself is not added.
+ * @param fs The filesystem
+ * @param file The file dnode
+ * @param indirect_block A temporary block to read the indirect block into
+ * @param batch The batch
+ * @return 0 if ok, 1 on I/O error
+ */
+static int file_free_blocks(struct CrowFS *fs, const struct CrowFSFileBlock *file, union CrowFSBlock *indirect_block,
+                            struct FreeBatch *batch) {
+    if (file->indirect_block != 0) {
+        if (block_read(fs, file->indirect_block, indirect_block))
+            return 1;
+        for (size_t i = 0; i < CROWFS_INDIRECT_BLOCK_COUNT && indirect_block->indirect_block[i] != 0; i++)
+            if (free_batch_add(fs, batch, indirect_block->indirect_block[i]))
+                return 1;
+        if (free_batch_add(fs, batch, file->indirect_block))
+            return 1;
+    }
+    for (int i = 0; i < CROWFS_DIRECT_BLOCKS && file->direct_blocks[i] != 0; i++)
+        if (free_batch_add(fs, batch, file->direct_blocks[i]))
+            return 1;
+    return 0;
+}
+
+/**
+ * A folder which is walked by tree_free or copied by snapshot_build
+ */
+struct WalkFrame {
+    uint32_t dnode;
+    // The next entry of the folder to visit
+    uint32_t index;
+    // (snapshot_build only) The folder which is copied to dnode
+    uint32_t source;
+};
+
+#define WALK_FRAMES_PER_PAGE ((CROWFS_BLOCK_SIZE - 2 * sizeof(void *)) / sizeof(struct WalkFrame))
+
+/**
+ * The folders from the top of a walk to the current one. The pages are chained,
+ * so the depth of a tree is only limited by the memory. The parent field of the
+ * folders is not followed, because moving a folder does not update it.
+ */
+struct WalkStack {
+    struct WalkStack *previous;
+    uint32_t count;
+    struct WalkFrame frames[WALK_FRAMES_PER_PAGE];
+};
+
+_Static_assert(sizeof(struct WalkStack) <= CROWFS_BLOCK_SIZE, "A walk stack page must fit in a memory block");
+
+/**
+ * Pushes a folder on a walk stack
+ * @return 0 if ok, 1 if out of memory
+ */
+static int walk_push(struct CrowFS *fs, struct WalkStack **stack, uint32_t dnode) {
+    if (*stack == NULL || (*stack)->count == WALK_FRAMES_PER_PAGE) {
+        struct WalkStack *page = (struct WalkStack *) fs->allocate_mem_block(fs->ctx);
+        if (page == NULL)
+            return 1;
+        page->previous = *stack;
+        page->count = 0;
+        *stack = page;
+    }
+    (*stack)->frames[(*stack)->count++] = (struct WalkFrame) {.dnode = dnode, .index = 0};
+    return 0;
+}
+
+/**
+ * Pops the top folder of a walk stack. Empty pages are freed.
+ */
+static void walk_pop(struct CrowFS *fs, struct WalkStack **stack) {
+    if (--(*stack)->count > 0)
+        return;
+    struct WalkStack *previous = (*stack)->previous;
+    fs->free_mem_block(fs->ctx, (union CrowFSBlock *) *stack);
+    *stack = previous;
+}
+
+/**
+ * Look for a content in this folder by the given name
+ * @param fs The file system to search in
+ * @param dir The given folder to search in
+ * @param name The name of the file/folder to search
+ * @return 0 if not found, the dnode of the block if found
+ */
+static uint32_t
+folder_lookup_name(struct CrowFS *fs, const struct CrowFSDirectoryBlock *dir, const char *name, size_t name_len) {
+    // Allocate block for dnodes
+    union CrowFSBlock *temp_dnode = fs->allocate_mem_block(fs->ctx);
+    uint32_t result = 0;
+    for (int i = 0; i < CROWFS_MAX_DIR_CONTENTS; i++) {
+        if (dir->content_dnodes[i] == 0) // File/Folder not found
+            break;
+        // Read the dnode
+        if (block_read(fs, dir->content_dnodes[i], temp_dnode) != 0)
+            break; // IO Error
+        // Compare filenames
+        STATS_ADD(fs, dir_entries_compared, 1);
+        if (memcmp(temp_dnode->header.name, name, name_len) == 0 &&
+            temp_dnode->header.name[name_len] == '\0') {
+            // Matched!
+            result = dir->content_dnodes[i];
+            break;
+        }
+        // Continue searching...
+    }
+    // Deallocate
+    fs->free_mem_block(fs->ctx, temp_dnode);
+    return result;
+}
+
+/**
+ * Counts the number of files or folders inside a folder
+ * @param dir The folder to count
+ * @return The number of files or folder in the given directory
+ */
+static uint32_t folder_content_count(const struct CrowFSDirectoryBlock *dir) {
+    uint32_t count;
+    for (count = 0; count < CROWFS_MAX_DIR_CONTENTS; count++)
+        if (dir->content_dnodes[count] == 0)
+            return count;
+    return count; // dir is full!
+}
+
+/**
+ * Removes a file dnode from folder content. This function does not free the dnode
+ * or do anything with the file. It just removes it from the content_dnodes list.
+ * @param dir The directory to perform the action on
+ * @param target_dnode The target dnode to remove from the directory
+ * @return 0 if target is removed, 1 if the target is not found
+ */
+static int folder_remove_content(struct CrowFSDirectoryBlock *dir, uint32_t target_dnode) {
+    int dnode_index = -1;
+    for (int i = 0; i < CROWFS_MAX_DIR_CONTENTS; i++)
+        if (dir->content_dnodes[i] == target_dnode) {
+            dnode_index = i;
+            break;
+        }
+    if (dnode_index == -1)
+        return 1; // what?
+    int last_index = (int) (folder_content_count(dir) - 1);
+    if (last_index == 0) {
+        // only one content so remove it
+        dir->content_dnodes[0] = 0;
+    } else if (last_index == dnode_index) {
+        // dnode is last. Replace it
+        dir->content_dnodes[last_index] = 0;
+    } else {
+        // perform a swap
+        dir->content_dnodes[dnode_index] = dir->content_dnodes[last_index];
+        dir->content_dnodes[last_index] = 0;
+    }
+    return 0;
+}
+
+/**
+ * Counts the number of 1 bits in a number. Will either use the builtin
+ * instruction, or the gcc builtin function or a simple implementation.
+ * @param a The number to count the number of bits
+ * @return Number of bits that has been one in the number.
+ */
+static uint32_t popcount(uint32_t a) {
+#ifdef __CROWOS__
+    uint32_t c = 0;
+    for (; a; ++c)
+        a &= a - 1;
+    return c;
+#else
+    return __builtin_popcount(a);
+#endif
+}
+
+/**
+ * Checks if a string has a prefix or not.
+ * @param str The string to check if it has a prefix or not.
+ * @param pre The prefix to see if string has
+ * @return True if it has the prefix otherwise false
+ */
+bool string_prefix(const char *str, const char *pre) {
+    return strncmp(pre, str, strlen(pre)) == 0;
+}
+
+/**
+ * Reads and validates the superblock and calculates the layout of the disk
+ * from it. The journal is not loaded.
+ * @param fs The filesystem
+ * @param block A temporary block
+ * @return CROWFS_OK, CROWFS_ERR_INIT_INVALID_FS or CROWFS_ERR_IO
+ */
+static int superblock_load(struct CrowFS *fs, union CrowFSBlock *block) {
+    if (block_read(fs, SUPERBLOCK_DNODE, block))
+        return CROWFS_ERR_IO;
+    if (memcmp(block->superblock.magic, CROWFS_MAGIC, sizeof(block->superblock.magic)) != 0 ||
+        (block->superblock.features & ~CROWFS_FEATURES_SUPPORTED) != 0)
+        return CROWFS_ERR_INIT_INVALID_FS;
+    fs->superblock = block->superblock;
+    // Calculate the root dnode index
+    fs->free_bitmap_blocks =
+            (block->superblock.blocks + CROWFS_BITSET_COVERED_BLOCKS - 1) / CROWFS_BITSET_COVERED_BLOCKS;
+    fs->root_dnode = 1 + 1 + fs->free_bitmap_blocks;
+    // The journal is right after the root folder and the map of its images has a fixed size
+    if ((fs->superblock.features & CROWFS_FEATURE_JOURNAL) &&
+        (fs->superblock.journal_start != fs->root_dnode + 1 || fs->superblock.journal_blocks < 3 ||
+         fs->superblock.journal_blocks > CROWFS_JOURNAL_BLOCKS ||
+         (uint64_t) fs->superblock.journal_start + fs->superblock.journal_blocks > fs->superblock.blocks))
+        return CROWFS_ERR_INIT_INVALID_FS;
+    // The refcount area must be on the disk
+    if (metadata_end(fs) >= fs->superblock.blocks)
+        return CROWFS_ERR_INIT_INVALID_FS;
+    return CROWFS_OK;
+}
+
+int crowfs_new(struct CrowFS *fs) {
+    return crowfs_format(fs, 0);
+}
+
+int crowfs_format(struct CrowFS *fs, uint32_t features) {
+    OPERATION(fs, CROWFS_OP_FORMAT);
+    int result = CROWFS_OK;
+    // Check if all functions exists
+    if (fs->allocate_mem_block == NULL || fs->free_mem_block == NULL || fs->write_block == NULL ||
+        fs->read_block == NULL || fs->current_date == NULL || fs->total_blocks == NULL)
+        return CROWFS_ERR_ARGUMENT;
+    if ((features & ~CROWFS_FEATURES_SUPPORTED) != 0)
+        return CROWFS_ERR_ARGUMENT;
+    if (fs->mount_flags & CROWFS_MOUNT_READ_ONLY)
+        return CROWFS_ERR_READ_ONLY;
+    // The index and the journal of the old filesystem are not valid anymore
+    extent_index_destroy(fs);
+    journal_destroy(fs);
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    block->superblock = (struct CrowFSSuperblock){
+        .magic = {0}, // fill later
+        .version = CROWFS_VERSION,
+        .blocks = fs->total_blocks(fs->ctx),
+        .features = features,
+        .bitmap_initialized_blocks = 0,
+    };
+    memcpy(block->superblock.magic, CROWFS_MAGIC, sizeof(block->superblock.magic));
+    // Every bitmap block has free blocks on a new disk
+    memset(block->superblock.bitmap_summary, 0xFF, sizeof(block->superblock.bitmap_summary));
+    // Check if the blocks on the disk is enough
+    // We need 4 blocks at least:
+    // 1. Bootloader
+    // 2. Superblock
+    // 3. Free bitmap
+    // 4. Root directory
+    if (block->superblock.blocks <= 4) {
+        result = CROWFS_ERR_TOO_SMALL;
+        goto end;
+    }
+    // Calculate the free bitmap size
+    fs->free_bitmap_blocks =
+            (block->superblock.blocks + CROWFS_BITSET_COVERED_BLOCKS - 1) / CROWFS_BITSET_COVERED_BLOCKS;
+    if (block->superblock.blocks <= 3 + fs->free_bitmap_blocks) {
+        result = CROWFS_ERR_TOO_SMALL;
+        goto end;
+    }
+    // bootloader + superblock
+    fs->root_dnode = 1 + 1 + fs->free_bitmap_blocks;
+    if (features & CROWFS_FEATURE_JOURNAL) {
+        block->superblock.journal_start = fs->root_dnode + 1;
+        block->superblock.journal_blocks = CROWFS_JOURNAL_BLOCKS;
+        if (block->superblock.blocks <= block->superblock.journal_start + CROWFS_JOURNAL_BLOCKS) {
+            result = CROWFS_ERR_TOO_SMALL;
+            goto end;
+        }
+    }
+    fs->superblock = block->superblock;
+    // The refcount area must fit as well
+    if (metadata_end(fs) >= fs->superblock.blocks) {
+        result = CROWFS_ERR_TOO_SMALL;
+        goto end;
+    }
+    // With the lazy bitmap, only the bitmap blocks which cover the metadata are written
+    if (features & CROWFS_FEATURE_LAZY_BITMAP)
+        fs->superblock.bitmap_initialized_blocks = (metadata_end(fs) - 1) / CROWFS_BITSET_COVERED_BLOCKS + 1;
+    // Write the superblock
+    TRY_IO(superblock_write(fs))
+    // Write the free bitmap
+    for (uint32_t i = 0; i < fs->free_bitmap_blocks && !bitmap_is_lazy(fs, i); i++) {
+        bitmap_fill_new(fs, i, block);
+        TRY_IO(block_write(fs, 1 + 1 + i, block))
+    }
+    // Create the root directory
+    block->folder = (struct CrowFSDirectoryBlock){
+        .header = (struct CrowFSDnodeHeader){
+            .type = CROWFS_ENTITY_FOLDER,
+            .name = "/",
+            .creation_date = fs->current_date(fs->ctx),
+        },
+        .parent = fs->root_dnode,
+        .content_dnodes = {0},
+    };
+    TRY_IO(block_write(fs, fs->root_dnode, block))
+    if (features & CROWFS_FEATURE_REFCOUNT) {
+        // Nothing is shared on a new disk
+        union CrowFSBlock *zeros[IO_BATCH_BLOCKS];
+        memset(block, 0, sizeof(*block));
+        for (uint32_t i = 0; i < IO_BATCH_BLOCKS; i++)
+            zeros[i] = block;
+        for (uint32_t i = 0; i < refcount_blocks(fs); i += IO_BATCH_BLOCKS)
+            TRY_IO(blocks_write(fs, refcount_start(fs) + i, MIN(refcount_blocks(fs) - i, (uint32_t) IO_BATCH_BLOCKS),
+                                zeros))
+    }
+    if (features & CROWFS_FEATURE_JOURNAL) {
+        // An empty journal. The block after the header is cleared, so a record of an
+        // older journal is not taken as the first record.
+        memset(block, 0, sizeof(*block));
+        TRY_IO(block_write(fs, fs->superblock.journal_start + 1, block))
+        memcpy(block->journal_header.magic, CROWFS_JOURNAL_MAGIC, sizeof(block->journal_header.magic));
+        block->journal_header.sequence = 1;
+        TRY_IO(block_write(fs, fs->superblock.journal_start, block))
+        if (journal_create(fs, 1)) {
+            result = CROWFS_ERR_LIMIT;
+            goto end;
+        }
+    }
+    if (fs->mount_flags & CROWFS_MOUNT_EXTENT_INDEX)
+        TRY_IO(extent_index_build(fs))
+
+end:
+    fs->free_mem_block(fs->ctx, block);
+    return result;
+}
+
+int crowfs_init(struct CrowFS *fs) {
+    OPERATION(fs, CROWFS_OP_INIT);
+    int result = CROWFS_OK;
+    // Check if all functions exists
+    if (fs->allocate_mem_block == NULL || fs->free_mem_block == NULL || fs->write_block == NULL ||
+        fs->read_block == NULL || fs->current_date == NULL)
+        return CROWFS_ERR_ARGUMENT;
+    extent_index_destroy(fs);
+    journal_destroy(fs);
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    result = superblock_load(fs, block);
+    if (result != CROWFS_OK)
+        goto end;
+    if (fs->superblock.features & CROWFS_FEATURE_JOURNAL) {
+        result = journal_load(fs);
+        if (result != CROWFS_OK)
+            goto end;
+        // The superblock itself might have been replayed
+        TRY_IO(block_read(fs, SUPERBLOCK_DNODE, block))
+        fs->superblock = block->superblock;
+    }
+    // Without a persisted summary, every bitmap block might have free blocks until it is scanned
+    if (!(fs->superblock.features & CROWFS_FEATURE_BITMAP_SUMMARY))
+        memset(fs->superblock.bitmap_summary, 0xFF, sizeof(fs->superblock.bitmap_summary));
+    if (fs->mount_flags & CROWFS_MOUNT_EXTENT_INDEX)
+        TRY_IO(extent_index_build(fs))
+
+end:
+    if (result != CROWFS_OK)
+        journal_destroy(fs);
+    fs->free_mem_block(fs->ctx, block);
+    return result;
+}
+
+void crowfs_close(struct CrowFS *fs) {
+    // Nothing which was written may be lost
+    if (fs->transaction != NULL) {
+        fs->transaction->depth = 1;
+        crowfs_txn_commit(fs);
+    }
+    // The next mount has nothing to replay
+    if (fs->journal != NULL && !fs->journal->failed && !(fs->mount_flags & CROWFS_MOUNT_READ_ONLY))
+        journal_checkpoint(fs);
+    journal_destroy(fs);
+    device_flush(fs);
+    extent_index_destroy(fs);
+    if (fs->discards != NULL)
+        discards_finish(fs, true);
+}
+
+int crowfs_txn_begin(struct CrowFS *fs) {
+    if (fs->transaction != NULL) {
+        fs->transaction->depth++;
+        return CROWFS_OK;
+    }
+    struct CrowFSTransaction *txn = (struct CrowFSTransaction *) fs->allocate_mem_block(fs->ctx);
+    if (txn == NULL)
+        return CROWFS_ERR_LIMIT;
+    memset(txn, 0, sizeof(*txn));
+    for (size_t i = 0; i < sizeof(txn->slot_pages) / sizeof(txn->slot_pages[0]); i++) {
+        txn->slot_pages[i] = fs->allocate_mem_block(fs->ctx);
+        if (txn->slot_pages[i] == NULL) {
+            while (i-- > 0)
+                fs->free_mem_block(fs->ctx, txn->slot_pages[i]);
+            fs->free_mem_block(fs->ctx, (union CrowFSBlock *) txn);
+            return CROWFS_ERR_LIMIT;
+        }
+    }
+    txn->depth = 1;
+    fs->transaction = txn;
+    return CROWFS_OK;
+}
+
+int crowfs_txn_commit(struct CrowFS *fs) {
+    OPERATION(fs, CROWFS_OP_TXN_COMMIT);
+    struct CrowFSTransaction *txn = fs->transaction;
+    if (txn == NULL)
+        return CROWFS_ERR_ARGUMENT;
+    if (--txn->depth > 0)
+        return CROWFS_OK;
+    const int result = txn_flush(fs) || txn->failed ? CROWFS_ERR_IO : CROWFS_OK;
+    fs->transaction = NULL;
+    for (size_t i = 0; i < sizeof(txn->slot_pages) / sizeof(txn->slot_pages[0]); i++)
+        fs->free_mem_block(fs->ctx, txn->slot_pages[i]);
+    fs->free_mem_block(fs->ctx, (union CrowFSBlock *) txn);
+    return result;
+}
+
+int crowfs_sync(struct CrowFS *fs) {
+    OPERATION(fs, CROWFS_OP_SYNC);
+    // The kept blocks of the transaction are the only dirty blocks in memory
+    if (fs->transaction != NULL && (txn_flush(fs) || fs->transaction->failed))
+        return CROWFS_ERR_IO;
+    if (fs->journal != NULL && fs->journal->failed)
+        return CROWFS_ERR_IO;
+    return device_flush(fs) ? CROWFS_ERR_IO : CROWFS_OK;
+}
+
+int crowfs_fsync(struct CrowFS *fs, uint32_t dnode) {
+    OPERATION(fs, CROWFS_OP_SYNC);
+    if (dnode == 0 || dnode >= fs->superblock.blocks)
+        return CROWFS_ERR_ARGUMENT;
+    int result = CROWFS_OK;
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, dnode, block))
+    if (block->header.type != CROWFS_ENTITY_FILE && block->header.type != CROWFS_ENTITY_FOLDER) {
+        result = CROWFS_ERR_ARGUMENT;
+        goto end;
+    }
+    result = crowfs_sync(fs);
+
+end:
+    fs->free_mem_block(fs->ctx, block);
+    return result;
+}
+
+int crowfs_open_absolute(struct CrowFS *fs, const char *path, uint32_t *dnode, uint32_t *parent_dnode, uint32_t flags) {
+    OPERATION(fs, CROWFS_OP_OPEN);
+    if (path[0] != '/') // paths must be absolute
+        return CROWFS_ERR_ARGUMENT;
+    if (strcmp(path, "/") == 0) {
+        // Asking for root. fuck the flags
+        *dnode = fs->root_dnode;
+        *parent_dnode = fs->root_dnode;
+        return CROWFS_OK;
+    }
+    path++; // skip the /
+    return crowfs_open_relative(fs, path, fs->root_dnode, dnode, parent_dnode, flags);
+}
+
+int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_to, uint32_t *dnode,
+                         uint32_t *parent_dnode, uint32_t flags) {
+    OPERATION(fs, CROWFS_OP_OPEN);
+    JOURNALED(fs, flags & CROWFS_O_CREATE);
+    // Is this an absolute path?
+    if (path[0] == '/') // just call crowfs_open_absolute
+        return crowfs_open_absolute(fs, path, dnode, parent_dnode, flags);
+    // Sanity check the relative to argument to not be zero
     if (relative_to == 0)
         return CROWFS_ERR_ARGUMENT;
 
     *parent_dnode = relative_to;
     int result = CROWFS_OK;
-    union CrowFSBlock *current_dnode = fs->allocate_mem_block(),
-            *temp_dnode = fs->allocate_mem_block();
+    union CrowFSBlock *current_dnode = fs->allocate_mem_block(fs->ctx),
+            *temp_dnode = fs->allocate_mem_block(fs->ctx);
     // Relative to must be folder
-    TRY_IO(fs->read_block(relative_to, current_dnode))
+    TRY_IO(block_read(fs, relative_to, current_dnode))
     // Check . and ..
     while (1) {
         // Is this pointing to the current directory?
@@ -387,7 +2437,7 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
         }
         if (string_prefix(path, "../")) {
             // Move one directory up
-            TRY_IO(fs->read_block(relative_to, current_dnode))
+            TRY_IO(block_read(fs, relative_to, current_dnode))
             // Are we at root?
             if (current_dnode->folder.parent != 0) {
                 // Not yet, go up
@@ -399,7 +2449,7 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
         // Last .. in the path. Just return the dnode of the folder above
         if (strcmp(path, "..") == 0) {
             // Move one directory up
-            TRY_IO(fs->read_block(relative_to, current_dnode))
+            TRY_IO(block_read(fs, relative_to, current_dnode))
             // Are we at root?
             if (current_dnode->folder.parent != 0) {
                 // Not yet, go up
@@ -415,14 +2465,14 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
     // Is the path empty? This means that we should return the current relative to as the dnode
     if (path[0] == '\0' || strcmp(path, ".") == 0) {
         *dnode = relative_to;
-        TRY_IO(fs->read_block(relative_to, current_dnode))
+        TRY_IO(block_read(fs, relative_to, current_dnode))
         *parent_dnode = current_dnode->folder.parent;
         goto end;
     }
 
     // Traverse the file system
     uint32_t current_dnode_index = relative_to;
-    TRY_IO(fs->read_block(current_dnode_index, current_dnode))
+    TRY_IO(block_read(fs, current_dnode_index, current_dnode))
     // Traverse the file system
     while (true) {
         size_t next_path_size = path_next_part_len(path);
@@ -432,7 +2482,8 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
             if (current_dnode->folder.content_dnodes[i] == 0) // File/Folder not found
                 break;
             // Compare filenames
-            TRY_IO(fs->read_block(current_dnode->folder.content_dnodes[i], temp_dnode))
+            TRY_IO(block_read(fs, current_dnode->folder.content_dnodes[i], temp_dnode))
+            STATS_ADD(fs, dir_entries_compared, 1);
             if (memcmp(temp_dnode->header.name, path, next_path_size) == 0 &&
                 temp_dnode->header.name[next_path_size] == '\0') {
                 // Matched!
@@ -452,8 +2503,10 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
                     result = CROWFS_ERR_LIMIT;
                     goto end;
                 }
-                // Allocate dnode
-                *dnode = block_alloc(fs);
+                // Allocate dnode near its parent, so the entries of a folder are close to each other.
+                // Folders get an empty group for their own entries.
+                *dnode = block_alloc(fs, (flags & CROWFS_O_DIR) ? folder_goal(fs, current_dnode_index)
+                                                                : current_dnode_index + 1);
                 if (*dnode == 0) {
                     result = CROWFS_ERR_FULL;
                     goto end;
@@ -462,7 +2515,7 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
                 *parent_dnode = current_dnode_index;
                 // Create the dnode
                 memset(temp_dnode, 0, sizeof(*temp_dnode));
-                temp_dnode->header.creation_date = fs->current_date();
+                temp_dnode->header.creation_date = fs->current_date(fs->ctx);
                 memcpy(temp_dnode->header.name, path, next_path_size);
                 temp_dnode->header.name[next_path_size] = '\0';
                 if (flags & CROWFS_O_DIR) {
@@ -472,8 +2525,8 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
                     temp_dnode->header.type = CROWFS_ENTITY_FILE;
                 }
                 // Write to disk
-                TRY_IO(fs->write_block(*parent_dnode, current_dnode))
-                TRY_IO(fs->write_block(*dnode, temp_dnode))
+                TRY_IO(block_write(fs, *parent_dnode, current_dnode))
+                TRY_IO(block_write(fs, *dnode, temp_dnode))
                 break;
             } else {
                 // well shit.
@@ -493,7 +2546,7 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
             break;
         } else {
             // Traverse more into the directories...
-            TRY_IO(fs->read_block(dnode_search_result, current_dnode))
+            TRY_IO(block_read(fs, dnode_search_result, current_dnode))
             if (current_dnode->header.type != CROWFS_ENTITY_FOLDER) {
                 // We found a file instead of a folder...
                 result = CROWFS_ERR_NOT_FOUND;
@@ -505,18 +2558,44 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
     }
 
 end:
-    fs->free_mem_block(current_dnode);
-    fs->free_mem_block(temp_dnode);
+    fs->free_mem_block(fs->ctx, current_dnode);
+    fs->free_mem_block(fs->ctx, temp_dnode);
     return result;
 }
 
+/**
+ * Writes the indirect block and the dnode of a file which crowfs_write has
+ * changed
+ * @param offset The end of the written data. The file grows to it.
+ * @return 0 if ok, 1 on I/O error
+ */
+static int file_pointers_write(struct CrowFS *fs, uint32_t dnode, union CrowFSBlock *dnode_block,
+                               const union CrowFSBlock *indirect_block, size_t offset) {
+    if (dnode_block->file.indirect_block != 0 && block_write(fs, dnode_block->file.indirect_block, indirect_block))
+        return 1;
+    if (offset > dnode_block->file.size)
+        dnode_block->file.size = offset;
+    return block_write(fs, dnode, dnode_block);
+}
+
 int crowfs_write(struct CrowFS *fs, uint32_t dnode, const char *data, size_t size, size_t offset) {
+    OPERATION(fs, CROWFS_OP_WRITE);
+    JOURNALED(fs, true);
     int result = CROWFS_OK;
+    // Only allocate a batch of blocks if we can write them at once
+    const uint32_t batch_size = fs->write_blocks != NULL ? IO_BATCH_BLOCKS : 1;
+    union CrowFSBlock *data_blocks[IO_BATCH_BLOCKS] = {0};
     // Read the dnode block at first
-    union CrowFSBlock *dnode_block = fs->allocate_mem_block(),
-            *data_block = fs->allocate_mem_block(),
-            *indirect_block = fs->allocate_mem_block();
-    TRY_IO(fs->read_block(dnode, dnode_block))
+    union CrowFSBlock *dnode_block = fs->allocate_mem_block(fs->ctx),
+            *indirect_block = fs->allocate_mem_block(fs->ctx);
+    for (uint32_t i = 0; i < batch_size; i++)
+        data_blocks[i] = fs->allocate_mem_block(fs->ctx);
+    // Shared blocks are copied on write and lose a reference after the file points to the copies
+    const bool refcount = (fs->superblock.features & CROWFS_FEATURE_REFCOUNT) != 0;
+    union CrowFSBlock *refcounts = refcount ? fs->allocate_mem_block(fs->ctx) : NULL;
+    struct FreeBatch *unshared = refcount ? (struct FreeBatch *) fs->allocate_mem_block(fs->ctx) : NULL;
+    uint32_t refcounts_loaded = UINT32_MAX;
+    TRY_IO(block_read(fs, dnode, dnode_block))
     if (dnode_block->header.type != CROWFS_ENTITY_FILE) {
         // this is a file right?
         result = CROWFS_ERR_ARGUMENT;
@@ -534,110 +2613,169 @@ int crowfs_write(struct CrowFS *fs, uint32_t dnode, const char *data, size_t siz
     }
     // Read the indirect block list as well
     if (dnode_block->file.indirect_block != 0)
-        TRY_IO(fs->read_block(dnode_block->file.indirect_block, indirect_block))
+        TRY_IO(block_read(fs, dnode_block->file.indirect_block, indirect_block))
     // Copy to disk
+    const size_t old_size = dnode_block->file.size;
     size_t to_write_bytes = size;
     while (to_write_bytes > 0) {
-        size_t content_block_index = offset / CROWFS_BLOCK_SIZE;
-        size_t raw_data_index = offset % CROWFS_BLOCK_SIZE;
-        uint32_t content_block;
-        if (content_block_index >= CROWFS_DIRECT_BLOCKS) {
+        // The shared blocks must keep their references while the disk points to them,
+        // so the copies are written to the file before a full batch is applied
+        if (refcount && unshared->count + batch_size > sizeof(unshared->blocks) / sizeof(unshared->blocks[0])) {
+            TRY_IO(file_pointers_write(fs, dnode, dnode_block, indirect_block, offset))
+            TRY_IO(free_batch_apply(fs, unshared))
+            refcounts_loaded = UINT32_MAX;
+        }
+        // Gather a run of physically consecutive blocks
+        uint32_t run = 0, first_block = 0;
+        while (run < batch_size && to_write_bytes > 0) {
+            size_t content_block_index = offset / CROWFS_BLOCK_SIZE;
+            size_t raw_data_index = offset % CROWFS_BLOCK_SIZE;
+            uint32_t content_block;
+            // New blocks are allocated right after the previous block of the file or its dnode
+            uint32_t goal = content_block_index == 0 ? 0 : file_content_block(&dnode_block->file, indirect_block,
+                                                                              content_block_index - 1);
+            goal = (goal == 0 ? dnode : goal) + 1;
             // Is indirect block available?
-            if (dnode_block->file.indirect_block == 0) {
-                dnode_block->file.indirect_block = block_alloc(fs);
+            if (content_block_index >= CROWFS_DIRECT_BLOCKS && dnode_block->file.indirect_block == 0) {
+                dnode_block->file.indirect_block = block_alloc(fs, goal);
                 if (dnode_block->file.indirect_block == 0) {
                     result = CROWFS_ERR_FULL;
                     goto end;
                 }
             }
-            // Get from indirect block
-            content_block = get_or_allocate_block(fs, &indirect_block->indirect_block[content_block_index -
-                                                      CROWFS_DIRECT_BLOCKS]);
+            uint32_t *pointer = file_content_pointer(&dnode_block->file, indirect_block, content_block_index);
+            const uint32_t old_block = *pointer;
+            content_block = get_or_allocate_block(fs, pointer, goal);
             if (content_block == 0) {
                 result = CROWFS_ERR_FULL;
                 goto end;
             }
-        } else {
-            content_block = get_or_allocate_block(fs, &dnode_block->file.direct_blocks[content_block_index]);
-            if (content_block == 0) {
-                result = CROWFS_ERR_FULL;
-                goto end;
+            // A shared block is written to a new block instead
+            if (refcount && old_block != 0) {
+                const int shared = block_is_shared(fs, old_block, refcounts, &refcounts_loaded);
+                if (shared < 0) {
+                    result = CROWFS_ERR_IO;
+                    goto end;
+                }
+                if (shared) {
+                    content_block = block_alloc(fs, run != 0 ? first_block + run : goal);
+                    if (content_block == 0) {
+                        result = CROWFS_ERR_FULL;
+                        goto end;
+                    }
+                    // The copy is allocated again in the next run
+                    if (run != 0 && content_block != first_block + run) {
+                        block_free(fs, content_block);
+                        break;
+                    }
+                    *pointer = content_block;
+                    TRY_IO(free_batch_add(fs, unshared, old_block))
+                }
+            }
+            // The block is not consecutive. Leave it for the next run.
+            if (run != 0 && content_block != first_block + run)
+                break;
+            if (run == 0)
+                first_block = content_block;
+            // We might need to partially write to a block. For this, we must issue a
+            // read if the block already contains data, otherwise the rest of it is zero.
+            size_t to_copy = MIN(CROWFS_BLOCK_SIZE - raw_data_index, to_write_bytes);
+            if (to_copy != CROWFS_BLOCK_SIZE) {
+                if (content_block_index * CROWFS_BLOCK_SIZE < old_size)
+                    TRY_IO(block_read(fs, old_block, data_blocks[run]))
+                else
+                    memset(data_blocks[run], 0, sizeof(*data_blocks[run]));
             }
+            memcpy(data_blocks[run]->raw_data + raw_data_index, data, to_copy);
+            data += to_copy;
+            to_write_bytes -= to_copy;
+            offset += to_copy;
+            run++;
         }
-        // We might need to partially write to a block. For this, we must issue a
-        // read and then issue a write to disk.
-        if (offset > 0)
-            TRY_IO(fs->read_block(content_block, data_block))
-        size_t to_copy = MIN(CROWFS_BLOCK_SIZE - raw_data_index, to_write_bytes);
-        memcpy(data_block->raw_data + raw_data_index, data, to_copy);
-        TRY_IO(fs->write_block(content_block, data_block))
-        data += to_copy;
-        to_write_bytes -= to_copy;
-        offset += to_copy;
+        TRY_IO(blocks_write(fs, first_block, run, data_blocks))
     }
     // Update dnode and indirect blocks
-    if (dnode_block->file.indirect_block != 0)
-        TRY_IO(fs->write_block(dnode_block->file.indirect_block, indirect_block))
-    dnode_block->file.size += size;
-    TRY_IO(fs->write_block(dnode, dnode_block))
+    TRY_IO(file_pointers_write(fs, dnode, dnode_block, indirect_block, offset))
+    if (refcount)
+        TRY_IO(free_batch_apply(fs, unshared))
+    STATS_ADD(fs, bytes_written, size);
 
 end:
-    fs->free_mem_block(dnode_block);
-    fs->free_mem_block(data_block);
-    fs->free_mem_block(indirect_block);
+    fs->free_mem_block(fs->ctx, dnode_block);
+    fs->free_mem_block(fs->ctx, indirect_block);
+    for (uint32_t i = 0; i < batch_size; i++)
+        fs->free_mem_block(fs->ctx, data_blocks[i]);
+    if (refcount) {
+        fs->free_mem_block(fs->ctx, refcounts);
+        fs->free_mem_block(fs->ctx, (union CrowFSBlock *) unshared);
+    }
     return result;
 }
 
 int crowfs_read(struct CrowFS *fs, uint32_t dnode, char *buf, size_t size, size_t offset) {
+    OPERATION(fs, CROWFS_OP_READ);
     int result = CROWFS_OK, read_bytes = 0;
+    // Only allocate a batch of blocks if we can read them at once
+    const uint32_t batch_size = fs->read_blocks != NULL ? IO_BATCH_BLOCKS : 1;
+    union CrowFSBlock *data_blocks[IO_BATCH_BLOCKS] = {0};
     // Read the dnode
-    union CrowFSBlock *dnode_block = fs->allocate_mem_block(),
-            *data_block = fs->allocate_mem_block(),
-            *indirect_block = fs->allocate_mem_block();
-    TRY_IO(fs->read_block(dnode, dnode_block))
+    union CrowFSBlock *dnode_block = fs->allocate_mem_block(fs->ctx),
+            *indirect_block = fs->allocate_mem_block(fs->ctx);
+    for (uint32_t i = 0; i < batch_size; i++)
+        data_blocks[i] = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, dnode, dnode_block))
     if (dnode_block->header.type != CROWFS_ENTITY_FILE) {
         // this is a file right?
         result = CROWFS_ERR_ARGUMENT;
         goto end;
     }
-    if (dnode_block->file.indirect_block != 0)
-        TRY_IO(fs->read_block(dnode_block->file.indirect_block, indirect_block))
     if (offset >= dnode_block->file.size) // nothing to read...
         goto end;
     int to_read_bytes = MIN(dnode_block->file.size - offset, size);
+    // Only read the indirect block if we are going to use it
+    if (dnode_block->file.indirect_block != 0 &&
+        (offset + to_read_bytes - 1) / CROWFS_BLOCK_SIZE >= CROWFS_DIRECT_BLOCKS)
+        TRY_IO(block_read(fs, dnode_block->file.indirect_block, indirect_block))
     // Read the corresponding data blocks
     while (to_read_bytes > 0) {
         size_t content_block_index = offset / CROWFS_BLOCK_SIZE;
         size_t raw_data_index = offset % CROWFS_BLOCK_SIZE;
-        uint32_t content_block;
-        if (content_block_index >= CROWFS_DIRECT_BLOCKS)
-            content_block = indirect_block->indirect_block[content_block_index - CROWFS_DIRECT_BLOCKS];
-        else
-            content_block = dnode_block->file.direct_blocks[content_block_index];
-        TRY_IO(fs->read_block(content_block, data_block))
-        int to_copy = MIN((int) (CROWFS_BLOCK_SIZE - raw_data_index), to_read_bytes);
-        memcpy(buf, data_block->raw_data + raw_data_index, to_copy);
-        buf += to_copy;
-        to_read_bytes -= to_copy;
-        offset += to_copy;
-        read_bytes += to_copy;
+        const size_t last_block_index = (offset + to_read_bytes - 1) / CROWFS_BLOCK_SIZE;
+        // Find a run of physically consecutive blocks
+        uint32_t first_block = file_content_block(&dnode_block->file, indirect_block, content_block_index);
+        uint32_t run = 1;
+        while (run < batch_size && content_block_index + run <= last_block_index &&
+               file_content_block(&dnode_block->file, indirect_block, content_block_index + run) == first_block + run)
+            run++;
+        TRY_IO(blocks_read(fs, first_block, run, data_blocks))
+        for (uint32_t i = 0; i < run; i++) {
+            int to_copy = MIN((int) (CROWFS_BLOCK_SIZE - raw_data_index), to_read_bytes);
+            memcpy(buf, data_blocks[i]->raw_data + raw_data_index, to_copy);
+            buf += to_copy;
+            to_read_bytes -= to_copy;
+            offset += to_copy;
+            read_bytes += to_copy;
+            raw_data_index = 0;
+        }
     }
 
 end:
-    fs->free_mem_block(dnode_block);
-    fs->free_mem_block(data_block);
-    fs->free_mem_block(indirect_block);
-    if (result == CROWFS_OK)
-        return read_bytes;
-    else
+    fs->free_mem_block(fs->ctx, dnode_block);
+    fs->free_mem_block(fs->ctx, indirect_block);
+    for (uint32_t i = 0; i < batch_size; i++)
+        fs->free_mem_block(fs->ctx, data_blocks[i]);
+    if (result != CROWFS_OK)
         return result;
+    STATS_ADD(fs, bytes_read, read_bytes);
+    return read_bytes;
 }
 
 int crowfs_read_dir(struct CrowFS *fs, uint32_t dnode, struct CrowFSStat *stat, size_t offset) {
+    OPERATION(fs, CROWFS_OP_READ_DIR);
     int result = CROWFS_OK;
     // Read the dnode block at first
-    union CrowFSBlock *dnode_block = fs->allocate_mem_block();
-    TRY_IO(fs->read_block(dnode, dnode_block))
+    union CrowFSBlock *dnode_block = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, dnode, dnode_block))
     if (dnode_block->header.type != CROWFS_ENTITY_FOLDER) {
         // this is a folder right?
         result = CROWFS_ERR_ARGUMENT;
@@ -657,30 +2795,27 @@ int crowfs_read_dir(struct CrowFS *fs, uint32_t dnode, struct CrowFSStat *stat,
     result = crowfs_stat(fs, requested_dnode, stat);
 
 end:
-    fs->free_mem_block(dnode_block);
+    fs->free_mem_block(fs->ctx, dnode_block);
     return result;
 }
 
 int crowfs_delete(struct CrowFS *fs, uint32_t dnode, uint32_t parent_dnode) {
+    OPERATION(fs, CROWFS_OP_DELETE);
+    JOURNALED(fs, true);
     int result = CROWFS_OK;
     if (dnode == fs->root_dnode) // Bruh
         return CROWFS_ERR_ARGUMENT;
     // Read the dnode block at first
-    union CrowFSBlock *dnode_block = fs->allocate_mem_block(),
-            *indirect_block = fs->allocate_mem_block();
-    TRY_IO(fs->read_block(dnode, dnode_block))
+    union CrowFSBlock *dnode_block = fs->allocate_mem_block(fs->ctx),
+            *indirect_block = fs->allocate_mem_block(fs->ctx);
+    struct FreeBatch *batch = (struct FreeBatch *) fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, dnode, dnode_block))
     // What is this entity?
     switch (dnode_block->header.type) {
         case CROWFS_ENTITY_FILE:
-            // Delete each indirect block of file
-            if (dnode_block->file.indirect_block != 0) {
-                TRY_IO(fs->read_block(dnode_block->file.indirect_block, indirect_block))
-                for (size_t i = 0; i < CROWFS_INDIRECT_BLOCK_COUNT && indirect_block->indirect_block[i] != 0; i++)
-                    block_free(fs, indirect_block->indirect_block[i]);
-            }
-        // Delete direct blocks
-            for (int i = 0; i < CROWFS_DIRECT_BLOCKS && dnode_block->file.direct_blocks[i] != 0; i++)
-                block_free(fs, dnode_block->file.direct_blocks[i]);
+            // Delete the indirect and direct blocks of the file with one bitmap write
+            TRY_IO(file_free_blocks(fs, &dnode_block->file, indirect_block, batch))
+            TRY_IO(free_batch_apply(fs, batch))
             break;
         case CROWFS_ENTITY_FOLDER:
             // Is the folder emtpy?
@@ -694,31 +2829,124 @@ int crowfs_delete(struct CrowFS *fs, uint32_t dnode, uint32_t parent_dnode) {
             result = CROWFS_ERR_ARGUMENT;
             goto end;
     }
-    // Delete in parent as well
-    TRY_IO(fs->read_block(parent_dnode, dnode_block))
-    if (dnode_block->header.type != CROWFS_ENTITY_FOLDER) {
+    // Delete in parent as well
+    TRY_IO(block_read(fs, parent_dnode, dnode_block))
+    if (dnode_block->header.type != CROWFS_ENTITY_FOLDER) {
+        result = CROWFS_ERR_ARGUMENT;
+        goto end;
+    }
+    if (folder_remove_content(&dnode_block->folder, dnode) != 0) {
+        result = CROWFS_ERR_ARGUMENT; // child does not exist in parent
+        goto end;
+    }
+    TRY_IO(block_write(fs, parent_dnode, dnode_block))
+
+    // Delete this dnode/block as well
+    block_free(fs, dnode);
+
+end:
+    fs->free_mem_block(fs->ctx, dnode_block);
+    fs->free_mem_block(fs->ctx, indirect_block);
+    fs->free_mem_block(fs->ctx, (union CrowFSBlock *) batch);
+    return result;
+}
+
+/**
+ * Frees a tree which is not in any folder anymore. The tree is walked once and
+ * its blocks are freed in batches.
+ * @param fs The filesystem
+ * @param dnode The top of the tree. A file or a folder.
+ * @param top The content of the top dnode
+ * @return CROWFS_OK, CROWFS_ERR_LIMIT if there is no memory to walk the tree or CROWFS_ERR_IO
+ */
+static int tree_free(struct CrowFS *fs, uint32_t dnode, const union CrowFSBlock *top) {
+    int result = CROWFS_OK;
+    union CrowFSBlock *folder_block = fs->allocate_mem_block(fs->ctx),
+            *child_block = fs->allocate_mem_block(fs->ctx),
+            *indirect_block = fs->allocate_mem_block(fs->ctx);
+    struct FreeBatch *batch = (struct FreeBatch *) fs->allocate_mem_block(fs->ctx);
+    struct WalkStack *stack = NULL;
+    if (top->header.type == CROWFS_ENTITY_FILE) {
+        TRY_IO(file_free_blocks(fs, &top->file, indirect_block, batch))
+        TRY_IO(free_batch_add(fs, batch, dnode))
+    } else if (walk_push(fs, &stack, dnode)) {
+        result = CROWFS_ERR_LIMIT;
+        goto end;
+    }
+    // Visit the folders depth first. A folder is freed after all of its entries.
+    while (stack != NULL) {
+        struct WalkFrame *frame = &stack->frames[stack->count - 1];
+        TRY_IO(block_read(fs, frame->dnode, folder_block))
+        bool descended = false;
+        while (!descended && frame->index < CROWFS_MAX_DIR_CONTENTS &&
+               folder_block->folder.content_dnodes[frame->index] != 0) {
+            const uint32_t child = folder_block->folder.content_dnodes[frame->index++];
+            TRY_IO(block_read(fs, child, child_block))
+            if (child_block->header.type == CROWFS_ENTITY_FOLDER && child_block->folder.content_dnodes[0] != 0) {
+                if (walk_push(fs, &stack, child)) {
+                    result = CROWFS_ERR_LIMIT;
+                    goto end;
+                }
+                descended = true;
+                continue;
+            }
+            if (child_block->header.type == CROWFS_ENTITY_FILE)
+                TRY_IO(file_free_blocks(fs, &child_block->file, indirect_block, batch))
+            TRY_IO(free_batch_add(fs, batch, child))
+        }
+        if (descended)
+            continue;
+        TRY_IO(free_batch_add(fs, batch, frame->dnode))
+        walk_pop(fs, &stack);
+    }
+    TRY_IO(free_batch_apply(fs, batch))
+
+end:
+    while (stack != NULL) {
+        struct WalkStack *previous = stack->previous;
+        fs->free_mem_block(fs->ctx, (union CrowFSBlock *) stack);
+        stack = previous;
+    }
+    fs->free_mem_block(fs->ctx, folder_block);
+    fs->free_mem_block(fs->ctx, child_block);
+    fs->free_mem_block(fs->ctx, indirect_block);
+    fs->free_mem_block(fs->ctx, (union CrowFSBlock *) batch);
+    return result;
+}
+
+int crowfs_delete_recursive(struct CrowFS *fs, uint32_t dnode, uint32_t parent_dnode) {
+    OPERATION(fs, CROWFS_OP_DELETE);
+    JOURNALED(fs, true);
+    int result = CROWFS_OK;
+    if (dnode == fs->root_dnode)
+        return CROWFS_ERR_ARGUMENT;
+    union CrowFSBlock *folder_block = fs->allocate_mem_block(fs->ctx),
+            *top_block = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, dnode, top_block))
+    if (top_block->header.type != CROWFS_ENTITY_FILE && top_block->header.type != CROWFS_ENTITY_FOLDER) {
         result = CROWFS_ERR_ARGUMENT;
         goto end;
     }
-    if (folder_remove_content(&dnode_block->folder, dnode) != 0) {
-        result = CROWFS_ERR_ARGUMENT; // child does not exist in parent
+    // Unlink the tree at first, so a failure in the middle of the walk can only leak blocks
+    TRY_IO(block_read(fs, parent_dnode, folder_block))
+    if (folder_block->header.type != CROWFS_ENTITY_FOLDER || folder_remove_content(&folder_block->folder, dnode) != 0) {
+        result = CROWFS_ERR_ARGUMENT;
         goto end;
     }
-    TRY_IO(fs->write_block(parent_dnode, dnode_block))
-
-    // Delete this dnode/block as well
-    block_free(fs, dnode);
+    TRY_IO(block_write(fs, parent_dnode, folder_block))
+    result = tree_free(fs, dnode, top_block);
 
 end:
-    fs->free_mem_block(dnode_block);
-    fs->free_mem_block(indirect_block);
+    fs->free_mem_block(fs->ctx, folder_block);
+    fs->free_mem_block(fs->ctx, top_block);
     return result;
 }
 
 int crowfs_stat(struct CrowFS *fs, uint32_t dnode, struct CrowFSStat *stat) {
+    OPERATION(fs, CROWFS_OP_STAT);
     int result = CROWFS_OK;
-    union CrowFSBlock *dnode_block = fs->allocate_mem_block();
-    TRY_IO(fs->read_block(dnode, dnode_block))
+    union CrowFSBlock *dnode_block = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, dnode, dnode_block))
     // Read the header
     memset(stat, 0, sizeof(*stat));
     stat->type = dnode_block->header.type;
@@ -740,22 +2968,24 @@ int crowfs_stat(struct CrowFS *fs, uint32_t dnode, struct CrowFSStat *stat) {
 
 end:
     stat->dnode = dnode;
-    fs->free_mem_block(dnode_block);
+    fs->free_mem_block(fs->ctx, dnode_block);
     return result;
 }
 
 int crowfs_move(struct CrowFS *fs, uint32_t dnode, uint32_t old_parent, uint32_t new_parent, const char *new_name) {
+    OPERATION(fs, CROWFS_OP_MOVE);
+    JOURNALED(fs, true);
     int result = CROWFS_OK;
     if (old_parent == new_parent && new_name == NULL) // no clue why would someone do this
         return CROWFS_OK;
-    union CrowFSBlock *dnode_block = fs->allocate_mem_block(),
-            *file_dnode = fs->allocate_mem_block();
-    TRY_IO(fs->read_block(dnode, file_dnode))
+    union CrowFSBlock *dnode_block = fs->allocate_mem_block(fs->ctx),
+            *file_dnode = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, dnode, file_dnode))
     // Check same dest and source filename
     if (old_parent == new_parent && strcmp(new_name, file_dnode->header.name) == 0) // do nothing
         goto end;
     // Read the parent and do some sanity checks
-    TRY_IO(fs->read_block(new_parent, dnode_block))
+    TRY_IO(block_read(fs, new_parent, dnode_block))
     if (dnode_block->header.type != CROWFS_ENTITY_FOLDER) {
         result = CROWFS_ERR_ARGUMENT;
         goto end;
@@ -778,7 +3008,7 @@ int crowfs_move(struct CrowFS *fs, uint32_t dnode, uint32_t old_parent, uint32_t
             result = delete_result;
             goto end;
         }
-        TRY_IO(fs->read_block(new_parent, dnode_block))
+        TRY_IO(block_read(fs, new_parent, dnode_block))
     }
     // Add the file to directory
     uint32_t new_dnode_index = folder_content_count(&dnode_block->folder);
@@ -787,9 +3017,9 @@ int crowfs_move(struct CrowFS *fs, uint32_t dnode, uint32_t old_parent, uint32_t
         goto end;
     }
     dnode_block->folder.content_dnodes[new_dnode_index] = dnode;
-    TRY_IO(fs->write_block(new_parent, dnode_block))
+    TRY_IO(block_write(fs, new_parent, dnode_block))
     // Remove from old parent
-    TRY_IO(fs->read_block(old_parent, dnode_block))
+    TRY_IO(block_read(fs, old_parent, dnode_block))
     if (dnode_block->header.type != CROWFS_ENTITY_FOLDER) {
         result = CROWFS_ERR_ARGUMENT;
         goto end;
@@ -798,26 +3028,968 @@ int crowfs_move(struct CrowFS *fs, uint32_t dnode, uint32_t old_parent, uint32_t
         result = CROWFS_ERR_ARGUMENT; // child does not exist in parent
         goto end;
     }
-    TRY_IO(fs->write_block(old_parent, dnode_block))
+    TRY_IO(block_write(fs, old_parent, dnode_block))
     // Was this also a rename?
     if (new_name != NULL)
-        TRY_IO(fs->write_block(dnode, file_dnode))
+        TRY_IO(block_write(fs, dnode, file_dnode))
+
+end:
+    fs->free_mem_block(fs->ctx, dnode_block);
+    fs->free_mem_block(fs->ctx, file_dnode);
+    return result;
+}
+
+/**
+ * Reads a file dnode and its indirect block and counts its data blocks
+ * @param fs The filesystem
+ * @param dnode The file dnode
+ * @param dnode_block The dnode is read here
+ * @param indirect_block The indirect block is read here if the file has one
+ * @param blocks Number of data blocks of the file
+ * @return CROWFS_OK, CROWFS_ERR_ARGUMENT if the dnode is not a file or CROWFS_ERR_IO
+ */
+static int file_load(struct CrowFS *fs, uint32_t dnode, union CrowFSBlock *dnode_block,
+                     union CrowFSBlock *indirect_block, uint32_t *blocks) {
+    if (block_read(fs, dnode, dnode_block))
+        return CROWFS_ERR_IO;
+    if (dnode_block->header.type != CROWFS_ENTITY_FILE)
+        return CROWFS_ERR_ARGUMENT;
+    uint32_t count = 0;
+    while (count < CROWFS_DIRECT_BLOCKS && dnode_block->file.direct_blocks[count] != 0)
+        count++;
+    if (count == CROWFS_DIRECT_BLOCKS && dnode_block->file.indirect_block != 0) {
+        if (block_read(fs, dnode_block->file.indirect_block, indirect_block))
+            return CROWFS_ERR_IO;
+        while (count < CROWFS_DIRECT_BLOCKS + CROWFS_INDIRECT_BLOCK_COUNT &&
+               indirect_block->indirect_block[count - CROWFS_DIRECT_BLOCKS] != 0)
+            count++;
+    }
+    *blocks = count;
+    return CROWFS_OK;
+}
+
+/**
+ * Counts the runs of physically consecutive blocks in a range of a file
+ * @param file The file dnode
+ * @param indirect_block The indirect block of the file
+ * @param from The first file block of the range
+ * @param to One after the last file block of the range
+ * @return Number of runs
+ */
+static uint32_t file_extents(const struct CrowFSFileBlock *file, const union CrowFSBlock *indirect_block,
+                             uint32_t from, uint32_t to) {
+    uint32_t extents = 0;
+    for (uint32_t i = from; i < to; i++)
+        if (i == from || file_content_block(file, indirect_block, i) !=
+                         file_content_block(file, indirect_block, i - 1) + 1)
+            extents++;
+    return extents;
+}
+
+/**
+ * Checks if a block is free. The bitmap block which holds its bit is only read
+ * if it is not already loaded.
+ * @param fs The filesystem
+ * @param block_index The block to check
+ * @param bitmap The loaded bitmap block
+ * @param loaded The index of the loaded bitmap block or UINT32_MAX if none is loaded
+ * @return 1 if free, 0 if used and -1 on I/O error
+ */
+static int block_is_free(struct CrowFS *fs, uint32_t block_index, union CrowFSBlock *bitmap, uint32_t *loaded) {
+    const uint32_t bitmap_block = block_index / CROWFS_BITSET_COVERED_BLOCKS;
+    if (bitmap_block >= fs->free_bitmap_blocks)
+        return 0;
+    if (*loaded != bitmap_block) {
+        STATS_ADD(fs, bitmap_blocks_scanned, 1);
+        if (bitmap_read(fs, bitmap_block, bitmap))
+            return -1;
+        *loaded = bitmap_block;
+    }
+    const uint32_t bit = block_index % CROWFS_BITSET_COVERED_BLOCKS;
+    return (bitmap->bitmap.bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+/**
+ * Checks if all blocks in a range are free
+ * @return 1 if all are free, 0 if not and -1 on I/O error
+ */
+static int free_run_check(struct CrowFS *fs, uint32_t start, uint32_t count, union CrowFSBlock *bitmap) {
+    uint32_t loaded = UINT32_MAX;
+    for (uint32_t i = 0; i < count; i++) {
+        const int free = block_is_free(fs, start + i, bitmap, &loaded);
+        if (free != 1)
+            return free;
+    }
+    return 1;
+}
+
+/**
+ * Finds a run of consecutive free blocks with the given length. With the extent
+ * index, the smallest free extent which fits is used. Otherwise, the bitmap is
+ * scanned for the first run.
+ * @param fs The filesystem
+ * @param count The length of the run
+ * @param bitmap A temporary block
+ * @return The first block of the run or 0 if there is no such run
+ */
+static uint32_t free_run_find(struct CrowFS *fs, uint32_t count, union CrowFSBlock *bitmap) {
+    if (fs->extent_index != NULL) {
+        const struct ExtentNode *node = extent_best_fit(fs->extent_index, count);
+        return node != NULL ? node->start : 0;
+    }
+    uint32_t run_start = 0, run_length = 0;
+    for (uint32_t bitmap_block = 0; bitmap_block < fs->free_bitmap_blocks; bitmap_block++) {
+        // A full bitmap block ends the run
+        if (!bitmap_summary_has_free(fs, bitmap_block)) {
+            STATS_ADD(fs, bitmap_blocks_skipped, 1);
+            run_length = 0;
+            continue;
+        }
+        STATS_ADD(fs, bitmap_blocks_scanned, 1);
+        if (bitmap_read(fs, bitmap_block, bitmap))
+            return 0;
+        const uint32_t first_block = bitmap_block * CROWFS_BITSET_COVERED_BLOCKS;
+        for (uint32_t i = 0; i < CROWFS_BLOCK_SIZE; i++) {
+            const uint8_t byte = bitmap->bitmap.bitmap[i];
+            if (byte == 0) {
+                run_length = 0;
+                continue;
+            }
+            for (uint32_t bit = 0; bit < 8; bit++) {
+                if (((byte >> bit) & 1) == 0) {
+                    run_length = 0;
+                    continue;
+                }
+                if (run_length++ == 0)
+                    run_start = first_block + i * 8 + bit;
+                if (run_length == count)
+                    return run_start;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Marks a run of blocks as used
+ * @return 0 if ok, 1 on I/O error
+ */
+static int free_run_take(struct CrowFS *fs, uint32_t start, uint32_t count, union CrowFSBlock *bitmap) {
+    for (uint32_t bitmap_block = start / CROWFS_BITSET_COVERED_BLOCKS;
+         bitmap_block <= (start + count - 1) / CROWFS_BITSET_COVERED_BLOCKS; bitmap_block++) {
+        if (bitmap_read(fs, bitmap_block, bitmap))
+            return 1;
+        bitmap_clear_range(&bitmap->bitmap, (uint64_t) bitmap_block * CROWFS_BITSET_COVERED_BLOCKS, start,
+                           (uint64_t) start + count);
+        if (bitmap_write(fs, bitmap_block, bitmap))
+            return 1;
+    }
+    extent_index_take(fs, start, count);
+    discard_forget(fs, start, count);
+    return 0;
+}
+
+/**
+ * Moves a range of file blocks to a free run. The new blocks are taken and
+ * filled before the pointers of the file are written. Then the old blocks are freed.
+ * @param fs The filesystem
+ * @param dnode The file dnode
+ * @param dnode_block The file dnode. Its pointers are updated.
+ * @param indirect_block The indirect block of the file. Its pointers are updated.
+ * @param from The first file block to move
+ * @param count Number of blocks to move
+ * @param target The first block of the free run
+ * @param data_blocks IO_BATCH_BLOCKS temporary blocks
+ * @return 0 if ok, 1 on I/O error
+ */
+static int file_relocate(struct CrowFS *fs, uint32_t dnode, union CrowFSBlock *dnode_block,
+                         union CrowFSBlock *indirect_block, uint32_t from, uint32_t count, uint32_t target,
+                         union CrowFSBlock *const *data_blocks) {
+    if (free_run_take(fs, target, count, data_blocks[0]))
+        return 1;
+    // Copy the data in batches
+    for (uint32_t done = 0; done < count;) {
+        const uint32_t batch = MIN(count - done, (uint32_t) IO_BATCH_BLOCKS);
+        for (uint32_t i = 0; i < batch; i++)
+            if (block_read(fs, file_content_block(&dnode_block->file, indirect_block, from + done + i),
+                           data_blocks[i]))
+                return 1;
+        if (blocks_write(fs, target + done, batch, data_blocks))
+            return 1;
+        done += batch;
+    }
+    // Point the file to the new blocks. The old ones are remembered in the batch
+    // blocks to free them after the pointers are on disk.
+    uint32_t *old_blocks = data_blocks[0]->indirect_block;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t *pointer = file_content_pointer(&dnode_block->file, indirect_block, from + i);
+        old_blocks[i] = *pointer;
+        *pointer = target + i;
+    }
+    if (from + count > CROWFS_DIRECT_BLOCKS && block_write(fs, dnode_block->file.indirect_block, indirect_block))
+        return 1;
+    if (from < CROWFS_DIRECT_BLOCKS && block_write(fs, dnode, dnode_block))
+        return 1;
+    for (uint32_t i = 0; i < count; i++)
+        data_block_free(fs, old_blocks[i]);
+    return 0;
+}
+
+int crowfs_fragmentation(struct CrowFS *fs, uint32_t dnode, struct CrowFSFragmentation *fragmentation) {
+    OPERATION(fs, CROWFS_OP_DEFRAG);
+    union CrowFSBlock *dnode_block = fs->allocate_mem_block(fs->ctx),
+            *indirect_block = fs->allocate_mem_block(fs->ctx);
+    uint32_t blocks;
+    int result = file_load(fs, dnode, dnode_block, indirect_block, &blocks);
+    if (result == CROWFS_OK) {
+        fragmentation->blocks = blocks;
+        fragmentation->extents = file_extents(&dnode_block->file, indirect_block, 0, blocks);
+    }
+    fs->free_mem_block(fs->ctx, dnode_block);
+    fs->free_mem_block(fs->ctx, indirect_block);
+    return result;
+}
+
+int crowfs_defrag(struct CrowFS *fs, uint32_t dnode, uint32_t *cursor, uint32_t max_blocks) {
+    OPERATION(fs, CROWFS_OP_DEFRAG);
+    JOURNALED(fs, true);
+    int result = CROWFS_OK;
+    int moved = 0;
+    union CrowFSBlock *dnode_block = fs->allocate_mem_block(fs->ctx),
+            *indirect_block = fs->allocate_mem_block(fs->ctx);
+    union CrowFSBlock *data_blocks[IO_BATCH_BLOCKS];
+    for (uint32_t i = 0; i < IO_BATCH_BLOCKS; i++)
+        data_blocks[i] = fs->allocate_mem_block(fs->ctx);
+    // The old blocks of a move are kept in a single block
+    if (max_blocks > CROWFS_INDIRECT_BLOCK_COUNT)
+        max_blocks = CROWFS_INDIRECT_BLOCK_COUNT;
+    // Moves into the blocks which this call frees are journaled, and they must fit in its record
+    if (fs->journal != NULL && max_blocks > TXN_OPERATION_BLOCKS)
+        max_blocks = TXN_OPERATION_BLOCKS;
+    uint32_t blocks, i = *cursor;
+    bool rest_search_failed = false, slice_search_failed = false;
+    result = file_load(fs, dnode, dnode_block, indirect_block, &blocks);
+    if (result != CROWFS_OK)
+        goto end;
+    while (i < blocks && (uint32_t) moved < max_blocks) {
+        // Skip the blocks which are already in place
+        if (i > 0 && file_content_block(&dnode_block->file, indirect_block, i) ==
+                     file_content_block(&dnode_block->file, indirect_block, i - 1) + 1) {
+            i++;
+            continue;
+        }
+        const uint32_t count = MIN(blocks - i, max_blocks - (uint32_t) moved);
+        uint32_t target = 0;
+        // Best case: continue right after the previous block
+        if (i > 0) {
+            const uint32_t next = file_content_block(&dnode_block->file, indirect_block, i - 1) + 1;
+            const int free = free_run_check(fs, next, count, data_blocks[0]);
+            if (free < 0) {
+                result = CROWFS_ERR_IO;
+                goto end;
+            }
+            if (free)
+                target = next;
+        }
+        // Otherwise, make the rest of the file contiguous if it is not already.
+        // Each search scans the bitmap, so a failed one is not repeated in this call.
+        if (target == 0 && !rest_search_failed && file_extents(&dnode_block->file, indirect_block, i, blocks) > 1) {
+            target = free_run_find(fs, blocks - i, data_blocks[0]);
+            rest_search_failed = target == 0;
+        }
+        // No space for the whole rest. At least join this slice.
+        if (target == 0 && !slice_search_failed && count > 1 &&
+            file_extents(&dnode_block->file, indirect_block, i, i + count) > 1) {
+            target = free_run_find(fs, count, data_blocks[0]);
+            slice_search_failed = target == 0;
+        }
+        if (target == 0) {
+            i++;
+            continue;
+        }
+        TRY_IO(file_relocate(fs, dnode, dnode_block, indirect_block, i, count, target, data_blocks))
+        moved += (int) count;
+        i += count;
+    }
+    *cursor = i >= blocks ? CROWFS_DEFRAG_DONE : i;
+    result = moved;
+
+end:
+    fs->free_mem_block(fs->ctx, dnode_block);
+    fs->free_mem_block(fs->ctx, indirect_block);
+    for (uint32_t j = 0; j < IO_BATCH_BLOCKS; j++)
+        fs->free_mem_block(fs->ctx, data_blocks[j]);
+    return result;
+}
+
+int crowfs_copy(struct CrowFS *fs, uint32_t src_dnode, uint32_t dst_parent, const char *name, uint32_t *dnode) {
+    OPERATION(fs, CROWFS_OP_COPY);
+    JOURNALED(fs, true);
+    int result = CROWFS_OK;
+    uint32_t parent, existing;
+    *dnode = 0;
+    // Only a new name in the destination folder
+    if (name[0] == '\0' || name[path_next_part_len(name)] != '\0')
+        return CROWFS_ERR_ARGUMENT;
+    if (crowfs_open_relative(fs, name, dst_parent, &existing, &parent, 0) == CROWFS_OK)
+        return CROWFS_ERR_ARGUMENT;
+    union CrowFSBlock *src_block = fs->allocate_mem_block(fs->ctx),
+            *src_indirect = fs->allocate_mem_block(fs->ctx),
+            *dst_block = fs->allocate_mem_block(fs->ctx),
+            *dst_indirect = fs->allocate_mem_block(fs->ctx);
+    union CrowFSBlock *data_blocks[IO_BATCH_BLOCKS];
+    for (uint32_t i = 0; i < IO_BATCH_BLOCKS; i++)
+        data_blocks[i] = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, src_dnode, src_block))
+    if (src_block->header.type != CROWFS_ENTITY_FILE) {
+        result = CROWFS_ERR_ARGUMENT;
+        goto end;
+    }
+    if (src_block->file.indirect_block != 0)
+        TRY_IO(block_read(fs, src_block->file.indirect_block, src_indirect))
+    result = crowfs_open_relative(fs, name, dst_parent, dnode, &parent, CROWFS_O_CREATE);
+    if (result != CROWFS_OK)
+        goto end;
+    TRY_IO(block_read(fs, *dnode, dst_block))
+    // The data is allocated as few free runs as possible. Each run is the largest
+    // power of two fraction of the rest which fits somewhere.
+    const uint32_t blocks = (src_block->file.size + CROWFS_BLOCK_SIZE - 1) / CROWFS_BLOCK_SIZE;
+    uint32_t last_block = *dnode;
+    for (uint32_t done = 0; done < blocks;) {
+        uint32_t length = blocks - done, start;
+        while ((start = free_run_find(fs, length, data_blocks[0])) == 0 && length > 1)
+            length /= 2;
+        if (start == 0) {
+            result = CROWFS_ERR_FULL;
+            goto cleanup;
+        }
+        if (free_run_take(fs, start, length, data_blocks[0])) {
+            result = CROWFS_ERR_IO;
+            goto cleanup;
+        }
+        for (uint32_t i = done; i < done + length; i++) {
+            if (i < CROWFS_DIRECT_BLOCKS)
+                dst_block->file.direct_blocks[i] = start + i - done;
+            else
+                dst_indirect->indirect_block[i - CROWFS_DIRECT_BLOCKS] = start + i - done;
+        }
+        // Copy each physically consecutive part of the source with a single request
+        for (uint32_t i = 0; i < length;) {
+            const uint32_t from = file_content_block(&src_block->file, src_indirect, done + i);
+            uint32_t count = 1;
+            while (i + count < length && file_content_block(&src_block->file, src_indirect, done + i + count) ==
+                                         from + count)
+                count++;
+            if (blocks_copy(fs, from, start + i, count, data_blocks)) {
+                result = CROWFS_ERR_IO;
+                goto cleanup;
+            }
+            i += count;
+        }
+        done += length;
+        last_block = start + length - 1;
+    }
+    if (blocks > CROWFS_DIRECT_BLOCKS) {
+        dst_block->file.indirect_block = block_alloc(fs, last_block + 1);
+        if (dst_block->file.indirect_block == 0) {
+            result = CROWFS_ERR_FULL;
+            goto cleanup;
+        }
+        if (block_write(fs, dst_block->file.indirect_block, dst_indirect)) {
+            result = CROWFS_ERR_IO;
+            goto cleanup;
+        }
+    }
+    dst_block->file.size = src_block->file.size;
+    if (block_write(fs, *dnode, dst_block) == 0)
+        goto end;
+    result = CROWFS_ERR_IO;
+
+cleanup:
+    // The dnode on disk does not point to the taken blocks yet, so free them here
+    {
+        struct FreeBatch *batch = (struct FreeBatch *) data_blocks[0];
+        batch->count = 0;
+        for (uint32_t i = 0; i < blocks && file_content_block(&dst_block->file, dst_indirect, i) != 0; i++)
+            free_batch_add(fs, batch, file_content_block(&dst_block->file, dst_indirect, i));
+        if (dst_block->file.indirect_block != 0)
+            free_batch_add(fs, batch, dst_block->file.indirect_block);
+        free_batch_apply(fs, batch);
+        crowfs_delete(fs, *dnode, parent);
+        *dnode = 0;
+    }
+
+end:
+    fs->free_mem_block(fs->ctx, src_block);
+    fs->free_mem_block(fs->ctx, src_indirect);
+    fs->free_mem_block(fs->ctx, dst_block);
+    fs->free_mem_block(fs->ctx, dst_indirect);
+    for (uint32_t i = 0; i < IO_BATCH_BLOCKS; i++)
+        fs->free_mem_block(fs->ctx, data_blocks[i]);
+    return result;
+}
+
+/**
+ * Copies the direct and the indirect pointers of a file to two lists
+ * @param file The file dnode
+ * @param indirect_block The indirect block of the file if it has one
+ * @param lists Two temporary blocks for the direct and the indirect pointers
+ * @param counts Number of blocks in each list
+ */
+static void file_block_lists(const struct CrowFSFileBlock *file, const union CrowFSBlock *indirect_block,
+                             union CrowFSBlock *const *lists, uint32_t *counts) {
+    counts[0] = 0;
+    counts[1] = 0;
+    while (counts[0] < CROWFS_DIRECT_BLOCKS && file->direct_blocks[counts[0]] != 0) {
+        lists[0]->indirect_block[counts[0]] = file->direct_blocks[counts[0]];
+        counts[0]++;
+    }
+    while (file->indirect_block != 0 && counts[1] < CROWFS_INDIRECT_BLOCK_COUNT &&
+           indirect_block->indirect_block[counts[1]] != 0) {
+        lists[1]->indirect_block[counts[1]] = indirect_block->indirect_block[counts[1]];
+        counts[1]++;
+    }
+}
+
+/**
+ * Adds a reference to each data block of a file. Nothing is changed if any of
+ * its blocks cannot be shared once more.
+ * @param fs The filesystem. Must have CROWFS_FEATURE_REFCOUNT.
+ * @param file The file dnode
+ * @param indirect_block The indirect block of the file if it has one
+ * @param lists Two temporary blocks for the sorted copies of the direct and the indirect pointers
+ * @return CROWFS_OK, CROWFS_ERR_LIMIT if a block is shared too many times or CROWFS_ERR_IO
+ */
+static int file_share_blocks(struct CrowFS *fs, const struct CrowFSFileBlock *file,
+                             const union CrowFSBlock *indirect_block, union CrowFSBlock *const *lists) {
+    uint32_t counts[2];
+    bool saturated;
+    file_block_lists(file, indirect_block, lists, counts);
+    if (refcounts_saturated(fs, lists[0]->indirect_block, counts[0], &saturated) ||
+        (!saturated && refcounts_saturated(fs, lists[1]->indirect_block, counts[1], &saturated)))
+        return CROWFS_ERR_IO;
+    if (saturated)
+        return CROWFS_ERR_LIMIT;
+    if (refcounts_change(fs, lists[0]->indirect_block, &counts[0], true) ||
+        refcounts_change(fs, lists[1]->indirect_block, &counts[1], true))
+        return CROWFS_ERR_IO;
+    return CROWFS_OK;
+}
+
+/**
+ * Drops the references which file_share_blocks added. The file still uses
+ * the blocks, so none of them is freed.
+ * @return 0 if ok, 1 on I/O error
+ */
+static int file_unshare_blocks(struct CrowFS *fs, const struct CrowFSFileBlock *file,
+                               const union CrowFSBlock *indirect_block, union CrowFSBlock *const *lists) {
+    uint32_t counts[2];
+    file_block_lists(file, indirect_block, lists, counts);
+    return refcounts_change(fs, lists[0]->indirect_block, &counts[0], false) ||
+           refcounts_change(fs, lists[1]->indirect_block, &counts[1], false);
+}
+
+int crowfs_clone(struct CrowFS *fs, uint32_t src_dnode, uint32_t dst_parent, const char *name, uint32_t *dnode) {
+    OPERATION(fs, CROWFS_OP_CLONE);
+    JOURNALED(fs, true);
+    int result = CROWFS_OK;
+    uint32_t parent, existing, indirect = 0;
+    bool shared = false;
+    *dnode = 0;
+    if (!(fs->superblock.features & CROWFS_FEATURE_REFCOUNT))
+        return CROWFS_ERR_NOT_SUPPORTED;
+    // Only a new name in the destination folder
+    if (name[0] == '\0' || name[path_next_part_len(name)] != '\0')
+        return CROWFS_ERR_ARGUMENT;
+    if (crowfs_open_relative(fs, name, dst_parent, &existing, &parent, 0) == CROWFS_OK)
+        return CROWFS_ERR_ARGUMENT;
+    union CrowFSBlock *src_block = fs->allocate_mem_block(fs->ctx),
+            *src_indirect = fs->allocate_mem_block(fs->ctx),
+            *dst_block = fs->allocate_mem_block(fs->ctx);
+    union CrowFSBlock *lists[2] = {fs->allocate_mem_block(fs->ctx), fs->allocate_mem_block(fs->ctx)};
+    TRY_IO(block_read(fs, src_dnode, src_block))
+    if (src_block->header.type != CROWFS_ENTITY_FILE) {
+        result = CROWFS_ERR_ARGUMENT;
+        goto end;
+    }
+    if (src_block->file.indirect_block != 0)
+        TRY_IO(block_read(fs, src_block->file.indirect_block, src_indirect))
+    result = crowfs_open_relative(fs, name, dst_parent, dnode, &parent, CROWFS_O_CREATE);
+    if (result != CROWFS_OK)
+        goto end;
+    // The clone gets its own indirect block, so the pointers of the files stay independent
+    if (src_block->file.indirect_block != 0) {
+        indirect = block_alloc(fs, *dnode + 1);
+        if (indirect == 0) {
+            result = CROWFS_ERR_FULL;
+            goto cleanup;
+        }
+        if (block_write(fs, indirect, src_indirect)) {
+            result = CROWFS_ERR_IO;
+            goto cleanup;
+        }
+    }
+    // The references are added before the clone points to the blocks, so a crash
+    // can only leave blocks which are never freed
+    result = file_share_blocks(fs, &src_block->file, src_indirect, lists);
+    if (result != CROWFS_OK)
+        goto cleanup;
+    shared = true;
+    if (block_read(fs, *dnode, dst_block)) {
+        result = CROWFS_ERR_IO;
+        goto cleanup;
+    }
+    memcpy(dst_block->file.direct_blocks, src_block->file.direct_blocks, sizeof(src_block->file.direct_blocks));
+    dst_block->file.indirect_block = indirect;
+    dst_block->file.size = src_block->file.size;
+    if (block_write(fs, *dnode, dst_block)) {
+        result = CROWFS_ERR_IO;
+        goto cleanup;
+    }
+    goto end;
+
+cleanup:
+    // The dnode on disk does not point to the blocks yet, so only the source keeps its references
+    if (shared)
+        file_unshare_blocks(fs, &src_block->file, src_indirect, lists);
+    if (indirect != 0)
+        block_free(fs, indirect);
+    crowfs_delete(fs, *dnode, parent);
+    *dnode = 0;
+
+end:
+    fs->free_mem_block(fs->ctx, src_block);
+    fs->free_mem_block(fs->ctx, src_indirect);
+    fs->free_mem_block(fs->ctx, dst_block);
+    fs->free_mem_block(fs->ctx, lists[0]);
+    fs->free_mem_block(fs->ctx, lists[1]);
+    return result;
+}
+
+/**
+ * Copies the dnode of an entry of a folder for a snapshot. A file gets a copy of
+ * its indirect block and shares its data blocks with the copy. A folder copy is
+ * empty until it is filled from the walk stack.
+ * @param fs The filesystem
+ * @param block The dnode of the entry. It is changed to the copy.
+ * @param parent The copy of the folder which contains the entry
+ * @param goal Where the copy is allocated. Moved after the allocated blocks.
+ * @param indirect_block A temporary block
+ * @param lists Two temporary blocks for file_share_blocks
+ * @param copy The copy of the dnode
+ * @return CROWFS_OK, CROWFS_ERR_FULL, CROWFS_ERR_LIMIT or CROWFS_ERR_IO
+ */
+static int snapshot_copy_entry(struct CrowFS *fs, union CrowFSBlock *block, uint32_t parent, uint32_t *goal,
+                               union CrowFSBlock *indirect_block, union CrowFSBlock *const *lists, uint32_t *copy) {
+    int result = CROWFS_OK;
+    uint32_t indirect = 0;
+    bool shared = false;
+    *copy = block_alloc(fs, *goal);
+    if (*copy == 0)
+        return CROWFS_ERR_FULL;
+    *goal = *copy + 1;
+    if (block->header.type == CROWFS_ENTITY_FILE) {
+        if (block->file.indirect_block != 0) {
+            TRY_IO(block_read(fs, block->file.indirect_block, indirect_block))
+            indirect = block_alloc(fs, *goal);
+            if (indirect == 0) {
+                result = CROWFS_ERR_FULL;
+                goto end;
+            }
+            *goal = indirect + 1;
+            TRY_IO(block_write(fs, indirect, indirect_block))
+            block->file.indirect_block = indirect;
+        }
+        result = file_share_blocks(fs, &block->file, indirect_block, lists);
+        if (result != CROWFS_OK)
+            goto end;
+        shared = true;
+    } else if (block->header.type == CROWFS_ENTITY_FOLDER) {
+        block->folder.parent = parent;
+        memset(block->folder.content_dnodes, 0, sizeof(block->folder.content_dnodes));
+    }
+    TRY_IO(block_write(fs, *copy, block))
+
+end:
+    if (result != CROWFS_OK) {
+        if (shared)
+            file_unshare_blocks(fs, &block->file, indirect_block, lists);
+        if (indirect != 0)
+            block_free(fs, indirect);
+        block_free(fs, *copy);
+        *copy = 0;
+    }
+    return result;
+}
+
+/**
+ * Copies the tree of the root folder to a new root folder in the snapshots
+ * folder. Each folder copy only points to copies, so a failure in the middle
+ * leaves a valid tree which is freed again.
+ * @param fs The filesystem. Must have CROWFS_FEATURE_REFCOUNT.
+ * @param name The name of the snapshot. Must be valid.
+ * @param snapshot The root folder of the snapshot
+ * @return The result of crowfs_snapshot_create
+ */
+static int snapshot_build(struct CrowFS *fs, const char *name, uint32_t *snapshot) {
+    JOURNALED(fs, true);
+    int result = CROWFS_OK;
+    const size_t name_len = strlen(name);
+    uint32_t root = 0, goal, copy;
+    // The folder copy which is in folder_block while its entries are copied
+    uint32_t loaded_folder = 0;
+    union CrowFSBlock *folder_block = fs->allocate_mem_block(fs->ctx),
+            *source_block = fs->allocate_mem_block(fs->ctx),
+            *child_block = fs->allocate_mem_block(fs->ctx),
+            *indirect_block = fs->allocate_mem_block(fs->ctx);
+    union CrowFSBlock *lists[2] = {fs->allocate_mem_block(fs->ctx), fs->allocate_mem_block(fs->ctx)};
+    struct WalkStack *stack = NULL;
+    // The snapshots folder is created with the first snapshot. Like the root
+    // folder, it is its own parent.
+    if (fs->superblock.snapshots == 0) {
+        const uint32_t snapshots = block_alloc(fs, metadata_end(fs));
+        if (snapshots == 0) {
+            result = CROWFS_ERR_FULL;
+            goto end;
+        }
+        folder_block->folder = (struct CrowFSDirectoryBlock){
+            .header = (struct CrowFSDnodeHeader){
+                .type = CROWFS_ENTITY_FOLDER,
+                .name = "snapshots",
+                .creation_date = fs->current_date(fs->ctx),
+            },
+            .parent = snapshots,
+            .content_dnodes = {0},
+        };
+        TRY_IO(block_write(fs, snapshots, folder_block))
+        fs->superblock.snapshots = snapshots;
+        TRY_IO(superblock_write(fs))
+    }
+    TRY_IO(block_read(fs, fs->superblock.snapshots, folder_block))
+    if (folder_lookup_name(fs, &folder_block->folder, name, name_len) != 0) {
+        result = CROWFS_ERR_ARGUMENT;
+        goto end;
+    }
+    if (folder_content_count(&folder_block->folder) == CROWFS_MAX_DIR_CONTENTS) {
+        result = CROWFS_ERR_LIMIT;
+        goto end;
+    }
+    // The root of the snapshot is named after it and is its own parent
+    TRY_IO(block_read(fs, fs->root_dnode, child_block))
+    goal = fs->superblock.snapshots + 1;
+    result = snapshot_copy_entry(fs, child_block, 0, &goal, indirect_block, lists, &root);
+    if (result != CROWFS_OK)
+        goto end;
+    memcpy(child_block->header.name, name, name_len + 1);
+    child_block->header.creation_date = fs->current_date(fs->ctx);
+    child_block->folder.parent = root;
+    TRY_IO(block_write(fs, root, child_block))
+    if (walk_push(fs, &stack, root)) {
+        result = CROWFS_ERR_LIMIT;
+        goto end;
+    }
+    stack->frames[stack->count - 1].source = fs->root_dnode;
+    // Fill the folder copies. The copy on disk stays empty until all of its entries are copied.
+    while (stack != NULL) {
+        const struct WalkFrame frame = stack->frames[stack->count - 1];
+        walk_pop(fs, &stack);
+        TRY_IO(block_read(fs, frame.dnode, folder_block))
+        loaded_folder = frame.dnode;
+        TRY_IO(block_read(fs, frame.source, source_block))
+        goal = frame.dnode + 1;
+        for (int i = 0; i < CROWFS_MAX_DIR_CONTENTS && source_block->folder.content_dnodes[i] != 0; i++) {
+            const uint32_t child = source_block->folder.content_dnodes[i];
+            TRY_IO(block_read(fs, child, child_block))
+            result = snapshot_copy_entry(fs, child_block, frame.dnode, &goal, indirect_block, lists, &copy);
+            if (result != CROWFS_OK)
+                goto end;
+            folder_block->folder.content_dnodes[i] = copy;
+            if (child_block->header.type == CROWFS_ENTITY_FOLDER) {
+                if (walk_push(fs, &stack, copy)) {
+                    result = CROWFS_ERR_LIMIT;
+                    goto end;
+                }
+                stack->frames[stack->count - 1].source = child;
+            }
+        }
+        TRY_IO(block_write(fs, frame.dnode, folder_block))
+        loaded_folder = 0;
+    }
+    // The snapshot only becomes visible when it is complete
+    TRY_IO(block_read(fs, fs->superblock.snapshots, folder_block))
+    folder_block->folder.content_dnodes[folder_content_count(&folder_block->folder)] = root;
+    TRY_IO(block_write(fs, fs->superblock.snapshots, folder_block))
+    *snapshot = root;
+
+end:
+    if (result != CROWFS_OK && root != 0) {
+        // The entries which were copied are in the folder copy, so they are freed with the tree
+        if (loaded_folder != 0)
+            block_write(fs, loaded_folder, folder_block);
+        if (block_read(fs, root, child_block) == 0)
+            tree_free(fs, root, child_block);
+    }
+    while (stack != NULL) {
+        struct WalkStack *previous = stack->previous;
+        fs->free_mem_block(fs->ctx, (union CrowFSBlock *) stack);
+        stack = previous;
+    }
+    fs->free_mem_block(fs->ctx, folder_block);
+    fs->free_mem_block(fs->ctx, source_block);
+    fs->free_mem_block(fs->ctx, child_block);
+    fs->free_mem_block(fs->ctx, indirect_block);
+    fs->free_mem_block(fs->ctx, lists[0]);
+    fs->free_mem_block(fs->ctx, lists[1]);
+    return result;
+}
+
+/**
+ * Writes the changes of a snapshot operation in place, so a snapshot mount
+ * which does not read the journal sees them
+ * @return 0 if ok, 1 otherwise
+ */
+static int snapshot_persist(struct CrowFS *fs) {
+    if (fs->journal == NULL)
+        return device_flush(fs);
+    if (fs->journal->failed || journal_checkpoint(fs))
+        return 1;
+    return device_flush(fs);
+}
+
+int crowfs_snapshot_create(struct CrowFS *fs, const char *name, uint32_t *snapshot) {
+    OPERATION(fs, CROWFS_OP_SNAPSHOT);
+    *snapshot = 0;
+    if (!(fs->superblock.features & CROWFS_FEATURE_REFCOUNT))
+        return CROWFS_ERR_NOT_SUPPORTED;
+    if (fs->transaction != NULL || name[0] == '\0' || name[path_next_part_len(name)] != '\0' ||
+        strlen(name) > CROWFS_MAX_FILENAME)
+        return CROWFS_ERR_ARGUMENT;
+    const int result = snapshot_build(fs, name, snapshot);
+    if (result != CROWFS_OK)
+        return result;
+    return snapshot_persist(fs) ? CROWFS_ERR_IO : CROWFS_OK;
+}
+
+int crowfs_snapshot_list(struct CrowFS *fs, struct CrowFSStat *stat, size_t offset) {
+    OPERATION(fs, CROWFS_OP_SNAPSHOT);
+    if (!(fs->superblock.features & CROWFS_FEATURE_REFCOUNT))
+        return CROWFS_ERR_NOT_SUPPORTED;
+    if (fs->superblock.snapshots == 0)
+        return CROWFS_ERR_LIMIT;
+    return crowfs_read_dir(fs, fs->superblock.snapshots, stat, offset);
+}
+
+int crowfs_snapshot_delete(struct CrowFS *fs, const char *name) {
+    OPERATION(fs, CROWFS_OP_SNAPSHOT);
+    int result = CROWFS_OK;
+    if (!(fs->superblock.features & CROWFS_FEATURE_REFCOUNT))
+        return CROWFS_ERR_NOT_SUPPORTED;
+    if (fs->transaction != NULL)
+        return CROWFS_ERR_ARGUMENT;
+    if (fs->superblock.snapshots == 0)
+        return CROWFS_ERR_NOT_FOUND;
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    TRY_IO(block_read(fs, fs->superblock.snapshots, block))
+    const uint32_t snapshot = folder_lookup_name(fs, &block->folder, name, strlen(name));
+    if (snapshot == 0) {
+        result = CROWFS_ERR_NOT_FOUND;
+        goto end;
+    }
+    result = crowfs_delete_recursive(fs, snapshot, fs->superblock.snapshots);
+    if (result == CROWFS_OK && snapshot_persist(fs))
+        result = CROWFS_ERR_IO;
+
+end:
+    fs->free_mem_block(fs->ctx, block);
+    return result;
+}
+
+int crowfs_snapshot_mount(struct CrowFS *fs, const char *name) {
+    OPERATION(fs, CROWFS_OP_INIT);
+    int result = CROWFS_OK;
+    if (fs->allocate_mem_block == NULL || fs->free_mem_block == NULL || fs->write_block == NULL ||
+        fs->read_block == NULL || fs->current_date == NULL)
+        return CROWFS_ERR_ARGUMENT;
+    extent_index_destroy(fs);
+    journal_destroy(fs);
+    union CrowFSBlock *block = fs->allocate_mem_block(fs->ctx);
+    // The snapshots are written in place, so the journal of the writer is not needed
+    result = superblock_load(fs, block);
+    if (result != CROWFS_OK)
+        goto end;
+    if (!(fs->superblock.features & CROWFS_FEATURE_REFCOUNT)) {
+        result = CROWFS_ERR_NOT_SUPPORTED;
+        goto end;
+    }
+    if (fs->superblock.snapshots == 0) {
+        result = CROWFS_ERR_NOT_FOUND;
+        goto end;
+    }
+    TRY_IO(block_read(fs, fs->superblock.snapshots, block))
+    const uint32_t snapshot = folder_lookup_name(fs, &block->folder, name, strlen(name));
+    if (snapshot == 0) {
+        result = CROWFS_ERR_NOT_FOUND;
+        goto end;
+    }
+    fs->root_dnode = snapshot;
+    fs->mount_flags |= CROWFS_MOUNT_READ_ONLY;
+    if (!(fs->superblock.features & CROWFS_FEATURE_BITMAP_SUMMARY))
+        memset(fs->superblock.bitmap_summary, 0xFF, sizeof(fs->superblock.bitmap_summary));
+    if (fs->mount_flags & CROWFS_MOUNT_EXTENT_INDEX)
+        TRY_IO(extent_index_build(fs))
 
 end:
-    fs->free_mem_block(dnode_block);
-    fs->free_mem_block(file_dnode);
+    fs->free_mem_block(fs->ctx, block);
     return result;
 }
 
 uint32_t crowfs_free_blocks(struct CrowFS *fs) {
+    OPERATION(fs, CROWFS_OP_FREE_BLOCKS);
+    if (fs->extent_index != NULL)
+        return fs->extent_index->free_blocks;
     uint32_t free_blocks = 0;
-    union CrowFSBlock *bitmap = fs->allocate_mem_block();
+    // Remembering the full blocks might write the superblock, which must be journaled too
+    const bool read_only = fs->mount_flags & CROWFS_MOUNT_READ_ONLY;
+    const bool journaled =
+            !read_only && fs->journal != NULL && !fs->journal->failed && crowfs_txn_begin(fs) == CROWFS_OK;
+    union CrowFSBlock *bitmap = fs->allocate_mem_block(fs->ctx);
     for (uint32_t block = 0; block < fs->free_bitmap_blocks; block++) {
-        if (fs->read_block(block + 2, bitmap) != 0)
+        if (!bitmap_summary_has_free(fs, block)) {
+            STATS_ADD(fs, bitmap_blocks_skipped, 1);
+            continue;
+        }
+        STATS_ADD(fs, bitmap_blocks_scanned, 1);
+        if (bitmap_is_lazy(fs, block)) {
+            // All blocks in its range are free
+            const uint64_t first_block = (uint64_t) block * CROWFS_BITSET_COVERED_BLOCKS;
+            free_blocks += MIN(first_block + CROWFS_BITSET_COVERED_BLOCKS, fs->superblock.blocks) - first_block;
+            continue;
+        }
+        if (block_read(fs, block + 2, bitmap) != 0)
             continue; // just skip this block
+        uint32_t block_free_blocks = 0;
         for (size_t i = 0; i < sizeof(bitmap->bitmap.bitmap) / sizeof(bitmap->bitmap.bitmap[0]); i++)
-            free_blocks += popcount(bitmap->bitmap.bitmap[i]);
+            block_free_blocks += popcount(bitmap->bitmap.bitmap[i]);
+        free_blocks += block_free_blocks;
+        // Remember the full blocks for the allocator
+        if (block_free_blocks == 0 && !read_only && (fs->journal == NULL || journaled))
+            bitmap_summary_update(fs, block, false);
     }
-    fs->free_mem_block(bitmap);
+    fs->free_mem_block(fs->ctx, bitmap);
+    if (journaled)
+        crowfs_txn_commit(fs);
     return free_blocks;
 }
+
+int crowfs_trim(struct CrowFS *fs, uint32_t *trimmed) {
+    OPERATION(fs, CROWFS_OP_TRIM);
+    *trimmed = 0;
+    if (fs->mount_flags & CROWFS_MOUNT_READ_ONLY)
+        return CROWFS_ERR_READ_ONLY;
+    // The blocks which a running transaction frees are not free on disk yet
+    if (fs->transaction != NULL)
+        return CROWFS_ERR_ARGUMENT;
+    if (fs->discard == NULL)
+        return CROWFS_OK;
+    // The bitmap blocks which free the blocks must be durable before the data is gone
+    if (device_flush(fs))
+        return CROWFS_ERR_IO;
+    int result = CROWFS_OK;
+    uint32_t run_start = 0, run_length = 0;
+    union CrowFSBlock *bitmap = fs->allocate_mem_block(fs->ctx);
+    for (uint32_t bitmap_block = 0; bitmap_block < fs->free_bitmap_blocks; bitmap_block++) {
+        const uint32_t first_block = bitmap_block * CROWFS_BITSET_COVERED_BLOCKS;
+        if (bitmap_summary_has_free(fs, bitmap_block)) {
+            STATS_ADD(fs, bitmap_blocks_scanned, 1);
+            TRY_IO(bitmap_read(fs, bitmap_block, bitmap))
+        } else {
+            // A full bitmap block ends the run
+            STATS_ADD(fs, bitmap_blocks_skipped, 1);
+            memset(bitmap, 0, sizeof(*bitmap));
+        }
+        for (uint32_t i = 0; i < CROWFS_BLOCK_SIZE; i++) {
+            const uint8_t byte = bitmap->bitmap.bitmap[i];
+            if ((byte == 0 && run_length == 0) || (byte == 0xFF && run_length != 0)) {
+                run_length += byte == 0xFF ? 8 : 0;
+                continue;
+            }
+            for (uint32_t bit = 0; bit < 8; bit++) {
+                if ((byte >> bit) & 1) {
+                    if (run_length++ == 0)
+                        run_start = first_block + i * 8 + bit;
+                } else if (run_length != 0) {
+                    fs->discard(fs->ctx, run_start, run_length);
+                    *trimmed += run_length;
+                    run_length = 0;
+                }
+            }
+        }
+    }
+    if (run_length != 0) {
+        fs->discard(fs->ctx, run_start, run_length);
+        *trimmed += run_length;
+    }
+
+end:
+    fs->free_mem_block(fs->ctx, bitmap);
+    return result;
+}
+
+int crowfs_get_stats(const struct CrowFS *fs, struct CrowFSStats *stats) {
+#ifdef CROWFS_STATS
+    *stats = fs->stats;
+    return CROWFS_OK;
+#else
+    memset(stats, 0, sizeof(*stats));
+    return CROWFS_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void crowfs_reset_stats(struct CrowFS *fs) {
+#ifdef CROWFS_STATS
+    memset(&fs->stats, 0, sizeof(fs->stats));
+#endif
+}
+
+const char *crowfs_operation_name(uint8_t operation) {
+    switch (operation) {
+        case CROWFS_OP_NONE:
+            return "none";
+        case CROWFS_OP_FORMAT:
+            return "format";
+        case CROWFS_OP_INIT:
+            return "init";
+        case CROWFS_OP_OPEN:
+            return "open";
+        case CROWFS_OP_WRITE:
+            return "write";
+        case CROWFS_OP_READ:
+            return "read";
+        case CROWFS_OP_READ_DIR:
+            return "read_dir";
+        case CROWFS_OP_DELETE:
+            return "delete";
+        case CROWFS_OP_STAT:
+            return "stat";
+        case CROWFS_OP_MOVE:
+            return "move";
+        case CROWFS_OP_FREE_BLOCKS:
+            return "free_blocks";
+        case CROWFS_OP_DEFRAG:
+            return "defrag";
+        case CROWFS_OP_TXN_COMMIT:
+            return "txn_commit";
+        case CROWFS_OP_SYNC:
+            return "sync";
+        case CROWFS_OP_TRIM:
+            return "trim";
+        case CROWFS_OP_COPY:
+            return "copy";
+        case CROWFS_OP_CLONE:
+            return "clone";
+        case CROWFS_OP_SNAPSHOT:
+            return "snapshot";
+        default:
+            return "unknown";
+    }
+}
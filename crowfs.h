@@ -34,6 +34,12 @@
  */
 #define CROWFS_BITSET_COVERED_BLOCKS (CROWFS_BLOCK_SIZE * 8)
 
+/**
+ * Size of the free bitmap summary in the superblock. Each bit stands for a free
+ * bitmap block, so the summary covers about 4 TiB of disk.
+ */
+#define CROWFS_BITMAP_SUMMARY_BYTES 4064
+
 /**
  * Structure of the super block for CrowFS
  */
@@ -48,8 +54,138 @@ struct __attribute__((__packed__)) CrowFSSuperblock {
      * Number of blocks which this disk has.
      */
     uint32_t blocks;
+    /**
+     * Optional features of this filesystem. A combination of CROWFS_FEATURE_*.
+     * Filesystems created before features existed have zero here.
+     */
+    uint32_t features;
+    /**
+     * (CROWFS_FEATURE_LAZY_BITMAP only) Number of free bitmap blocks from the start
+     * which are written on disk. The rest of them are implicitly all free and
+     * are written when a block in their range is allocated for the first time.
+     */
+    uint32_t bitmap_initialized_blocks;
+    /**
+     * (CROWFS_FEATURE_BITMAP_SUMMARY only) One bit for each free bitmap block. A zero
+     * bit means that the bitmap block has no free blocks, so the allocator skips it
+     * without reading it. A bitmap block is marked before it gets free blocks and
+     * cleared after it is full, so the summary never hides free blocks.
+     */
+    uint8_t bitmap_summary[CROWFS_BITMAP_SUMMARY_BYTES];
+    /**
+     * (CROWFS_FEATURE_JOURNAL only) The first block of the journal region. The
+     * journal comes right after the root folder.
+     */
+    uint32_t journal_start;
+    /**
+     * (CROWFS_FEATURE_JOURNAL only) Number of blocks of the journal region
+     */
+    uint32_t journal_blocks;
+    /**
+     * (CROWFS_FEATURE_REFCOUNT only) A folder which is not reachable from the root
+     * folder and contains the root folder of each snapshot. Zero until the first
+     * snapshot is created.
+     */
+    uint32_t snapshots;
+};
+
+/**
+ * Free bitmap blocks are not written when formatting the disk. Instead, they
+ * are written on their first use. This makes the format time constant.
+ */
+#define CROWFS_FEATURE_LAZY_BITMAP 0b1
+/**
+ * The superblock contains a summary of the free bitmap blocks which have free
+ * blocks. Without this feature, the summary is only kept in memory and is
+ * learned again after each mount.
+ */
+#define CROWFS_FEATURE_BITMAP_SUMMARY 0b10
+/**
+ * A journal region is reserved after the root folder. Metadata blocks are
+ * appended to it before they are written in place, so a crash never leaves
+ * the folders or the free bitmap half updated.
+ */
+#define CROWFS_FEATURE_JOURNAL 0b100
+/**
+ * Data blocks can be shared by many files, see crowfs_clone. A refcount area
+ * after the root folder and the journal keeps a counter for each block of the
+ * disk: the number of files which use the block besides the first one. A shared
+ * block is copied before a file changes it and is only freed when its counter
+ * is zero.
+ */
+#define CROWFS_FEATURE_REFCOUNT 0b1000
+/**
+ * All features which this implementation understands
+ */
+#define CROWFS_FEATURES_SUPPORTED (CROWFS_FEATURE_LAZY_BITMAP | CROWFS_FEATURE_BITMAP_SUMMARY | \
+                                   CROWFS_FEATURE_JOURNAL | CROWFS_FEATURE_REFCOUNT)
+
+/**
+ * Number of blocks of the journal region which crowfs_format reserves
+ */
+#define CROWFS_JOURNAL_BLOCKS 1024
+#define CROWFS_JOURNAL_MAGIC "CrJL"
+#define CROWFS_JOURNAL_DESCRIPTOR_MAGIC "CrJD"
+/**
+ * Maximum number of blocks in a journal record
+ */
+#define CROWFS_JOURNAL_RECORD_BLOCKS 1020
+
+/**
+ * Number of refcounts in each block of the refcount area
+ */
+#define CROWFS_REFCOUNTS_PER_BLOCK (CROWFS_BLOCK_SIZE / sizeof(uint16_t))
+
+/**
+ * The first block of the journal region
+ */
+struct CrowFSJournalHeader {
+    // Must be equal to CROWFS_JOURNAL_MAGIC
+    char magic[4];
+    // Sequence number of the record which starts right after this block. The
+    // records before the last checkpoint have smaller numbers, so they are ignored.
+    uint32_t sequence;
 };
 
+/**
+ * Each record of the journal starts with a descriptor. The images of the blocks
+ * follow it in the same order as the block numbers.
+ */
+struct CrowFSJournalDescriptor {
+    // Must be equal to CROWFS_JOURNAL_DESCRIPTOR_MAGIC
+    char magic[4];
+    // One more than the sequence of the previous record
+    uint32_t sequence;
+    // Number of block images in this record
+    uint32_t count;
+    // Checksum of this descriptor (with a zero checksum) and the block images. A
+    // record which was not written completely does not match it.
+    uint32_t checksum;
+    // Where each block image belongs, in ascending order
+    uint32_t blocks[CROWFS_JOURNAL_RECORD_BLOCKS];
+};
+
+/**
+ * Keeps an in memory index of the free extents of the disk. It is built from the
+ * free bitmap by crowfs_init and crowfs_format, so allocations find free blocks
+ * and runs in logarithmic time and crowfs_free_blocks does not read the bitmap.
+ * The index uses memory blocks from allocate_mem_block until crowfs_close.
+ */
+#define CROWFS_MOUNT_EXTENT_INDEX 0b1
+/**
+ * Discards the blocks which are freed by crowfs_delete and crowfs_defrag with
+ * the discard callback. Adjacent freed blocks are merged into ranges, which are
+ * discarded once the free bitmap which frees them is written and flushed. Without
+ * this flag, freed blocks are only discarded by crowfs_trim.
+ */
+#define CROWFS_MOUNT_DISCARD 0b10
+/**
+ * Operations which would write to the disk fail with CROWFS_ERR_READ_ONLY. The
+ * journal is read but not replayed, and nothing is written on crowfs_close.
+ * crowfs_snapshot_mount sets it.
+ */
+#define CROWFS_MOUNT_READ_ONLY 0b100
+
 #define CROWFS_ENTITY_FILE 1
 #define CROWFS_ENTITY_FOLDER 2
 
@@ -115,6 +251,10 @@ struct CrowFSBitmapBlock {
 union CrowFSBlock {
     struct CrowFSSuperblock superblock;
     struct CrowFSBitmapBlock bitmap;
+    struct CrowFSJournalHeader journal_header;
+    struct CrowFSJournalDescriptor journal_descriptor;
+    // The extra references of CROWFS_REFCOUNTS_PER_BLOCK blocks of the disk
+    uint16_t refcounts[CROWFS_REFCOUNTS_PER_BLOCK];
     struct CrowFSDnodeHeader header;
     struct CrowFSFileBlock file;
     struct CrowFSDirectoryBlock folder;
@@ -148,7 +288,100 @@ struct CrowFSStat {
 };
 
 /**
- * CrowFS is a very simple non-logged filesystem best for read mostly scenarios.
+ * Public operations of CrowFS. While a public function runs, its operation is
+ * stored in the current_operation field of the filesystem. Public functions which
+ * are called by other public functions are accounted to the outermost one.
+ */
+#define CROWFS_OP_NONE 0
+#define CROWFS_OP_FORMAT 1
+#define CROWFS_OP_INIT 2
+#define CROWFS_OP_OPEN 3
+#define CROWFS_OP_WRITE 4
+#define CROWFS_OP_READ 5
+#define CROWFS_OP_READ_DIR 6
+#define CROWFS_OP_DELETE 7
+#define CROWFS_OP_STAT 8
+#define CROWFS_OP_MOVE 9
+#define CROWFS_OP_FREE_BLOCKS 10
+#define CROWFS_OP_DEFRAG 11
+#define CROWFS_OP_TXN_COMMIT 12
+#define CROWFS_OP_SYNC 13
+#define CROWFS_OP_TRIM 14
+#define CROWFS_OP_COPY 15
+#define CROWFS_OP_CLONE 16
+#define CROWFS_OP_SNAPSHOT 17
+/**
+ * Number of CROWFS_OP_* values
+ */
+#define CROWFS_OP_COUNT 18
+
+/**
+ * Number of buckets in the latency histograms. Bucket i counts the operations
+ * which took [2^i, 2^(i+1)) nanoseconds. The last bucket also counts everything
+ * slower than that.
+ */
+#define CROWFS_STATS_LATENCY_BUCKETS 40
+
+/**
+ * Counters of a single public operation
+ */
+struct CrowFSOperationStats {
+    // Number of calls
+    uint64_t calls;
+    // Number of blocks read from the device
+    uint64_t block_reads;
+    // Number of blocks written to the device
+    uint64_t block_writes;
+    // Number of read requests sent to the device. A multi-block read is one request.
+    uint64_t read_requests;
+    // Number of write requests sent to the device. A multi-block write is one request.
+    uint64_t write_requests;
+    // Bytes of file data returned by crowfs_read
+    uint64_t bytes_read;
+    // Bytes of file data written by crowfs_write
+    uint64_t bytes_written;
+    // Number of free bitmap blocks which the allocator and crowfs_free_blocks scanned
+    uint64_t bitmap_blocks_scanned;
+    // Number of full free bitmap blocks which were skipped because of the bitmap summary
+    uint64_t bitmap_blocks_skipped;
+    // Number of directory entries which were compared with a name while resolving paths
+    uint64_t dir_entries_compared;
+    // Latency histogram of the calls. Only filled if monotonic_nanoseconds is set.
+    uint64_t latency_histogram[CROWFS_STATS_LATENCY_BUCKETS];
+};
+
+/**
+ * Statistics of a filesystem. They are only collected if CrowFS is compiled
+ * with CROWFS_STATS defined.
+ */
+struct CrowFSStats {
+    // Indexed by CROWFS_OP_*. CROWFS_OP_NONE is unused.
+    struct CrowFSOperationStats operations[CROWFS_OP_COUNT];
+};
+
+/**
+ * The free extent index. Its layout is private to the library.
+ */
+struct CrowFSExtentIndex;
+
+/**
+ * The running transaction. Its layout is private to the library.
+ */
+struct CrowFSTransaction;
+
+/**
+ * The journal of a mounted filesystem. Its layout is private to the library.
+ */
+struct CrowFSJournal;
+
+/**
+ * Freed blocks which are not discarded yet. Its layout is private to the library.
+ */
+struct CrowFSDiscards;
+
+/**
+ * CrowFS is a very simple filesystem best for read mostly scenarios. The metadata
+ * is only logged if the filesystem is formatted with CROWFS_FEATURE_JOURNAL.
  * Maximum disk size is 2^32-1 bytes.
  * Maximum filesize is 4096*(1024+956) = 8110080 bytes ~ 8 MB
  * Maximum files in directory is 957
@@ -171,46 +404,149 @@ struct CrowFS {
     /**
      * Allocates an in memory block of filesystem for use.
      * Allocated block must be filled with zero.
+     * @param ctx The ctx field of this filesystem
      * @return The allocated block or NULL.
      * @note Use free_mem_block to free the memory
      */
-    union CrowFSBlock *(*allocate_mem_block)(void);
+    union CrowFSBlock *(*allocate_mem_block)(void *ctx);
 
     /**
      * Frees an memory block of filesystem allocated with allocate_mem_block
+     * @param ctx The ctx field of this filesystem
      */
-    void (*free_mem_block)(union CrowFSBlock *);
+    void (*free_mem_block)(void *ctx, union CrowFSBlock *);
 
     /**
      * Write a block to the disk
+     * @param ctx The ctx field of this filesystem
      * @param block_index The block index to write. Zero based. Zeroth block is the
      * bootloader.
      * @param block The block to write.
      * @return 0 if ok, 1 otherwise
      */
-    int (*write_block)(uint32_t block_index, const union CrowFSBlock *block);
+    int (*write_block)(void *ctx, uint32_t block_index, const union CrowFSBlock *block);
 
     /**
      * Read a block from the disk
+     * @param ctx The ctx field of this filesystem
      * @param block_index The block index to read. Zero based. Zeroth block is the
      * bootloader.
      * @param block The block to read and fill.
      * @return 0 if ok, 1 otherwise
      */
-    int (*read_block)(uint32_t block_index, union CrowFSBlock *block);
+    int (*read_block)(void *ctx, uint32_t block_index, union CrowFSBlock *block);
+
+    /**
+     * (Optional) Write consecutive blocks to the disk in a single request.
+     * If this is NULL, write_block is called for each block instead.
+     * @param ctx The ctx field of this filesystem
+     * @param block_index The first block index to write.
+     * @param count Number of blocks to write.
+     * @param blocks The blocks to write. blocks[i] is written to block_index + i.
+     * @return 0 if ok, 1 otherwise
+     */
+    int (*write_blocks)(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks);
+
+    /**
+     * (Optional) Read consecutive blocks from the disk in a single request.
+     * If this is NULL, read_block is called for each block instead.
+     * @param ctx The ctx field of this filesystem
+     * @param block_index The first block index to read.
+     * @param count Number of blocks to read.
+     * @param blocks The blocks to fill. blocks[i] is filled from block_index + i.
+     * @return 0 if ok, 1 otherwise
+     */
+    int (*read_blocks)(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks);
+
+    /**
+     * (Optional) Makes every block which was written before durable, for example
+     * with fsync or a cache flush command of the disk. CrowFS also uses it as a
+     * barrier when some blocks must reach the disk before others. If this is NULL,
+     * writes are assumed to be durable when they return.
+     * @param ctx The ctx field of this filesystem
+     * @return 0 if ok, 1 otherwise
+     */
+    int (*flush)(void *ctx);
+
+    /**
+     * (Optional) Tells the device that a range of blocks is not used anymore, for
+     * example with TRIM or by punching a hole in an image file. The content of the
+     * blocks is undefined afterwards. Failures are ignored because this is a hint.
+     * @param ctx The ctx field of this filesystem
+     * @param block_index The first block to discard.
+     * @param count Number of consecutive blocks to discard.
+     * @return 0 if ok, 1 otherwise
+     */
+    int (*discard)(void *ctx, uint32_t block_index, uint32_t count);
+
+    /**
+     * (Optional) Copies consecutive blocks to other consecutive blocks inside the
+     * device, for example with copy_file_range or a copy offload command, so the
+     * data does not pass through the memory. If this is NULL or fails, the blocks
+     * are read and written instead.
+     * @param ctx The ctx field of this filesystem
+     * @param from The first block to copy.
+     * @param to The first block to copy into. The ranges never overlap.
+     * @param count Number of blocks to copy.
+     * @return 0 if ok, 1 otherwise
+     */
+    int (*copy_blocks)(void *ctx, uint32_t from, uint32_t to, uint32_t count);
 
     /**
      * Gets number of blocks in the disk. This function is only used
      * if you are going to use crowfs_new()
+     * @param ctx The ctx field of this filesystem
      * @return 0 if failure or the number of blocks on the disk
      */
-    uint32_t (*total_blocks)(void);
+    uint32_t (*total_blocks)(void *ctx);
 
     /**
      * Gets the current date in unix epoch format.
+     * @param ctx The ctx field of this filesystem
      * @return The unix date
      */
-    int64_t (*current_date)(void);
+    int64_t (*current_date)(void *ctx);
+
+    /**
+     * (Optional) Gets a monotonic time in nanoseconds. This is only used to fill
+     * the latency histograms when statistics are enabled.
+     * @param ctx The ctx field of this filesystem
+     * @return The time in nanoseconds
+     */
+    uint64_t (*monotonic_nanoseconds)(void *ctx);
+
+    /**
+     * User defined context which is passed to all of the callbacks above.
+     * This can be used to run multiple filesystems in a single process, each
+     * one with its own block device and memory. CrowFS never touches it.
+     */
+    void *ctx;
+
+    /**
+     * (Optional) Called when a public operation begins. Nested calls of public
+     * functions are not reported. If the hooks are NULL, they cost a single check.
+     * @param hook_ctx The hook_ctx field of this filesystem
+     * @param operation One of CROWFS_OP_*
+     */
+    void (*on_operation_begin)(void *hook_ctx, uint8_t operation);
+
+    /**
+     * (Optional) Called when a public operation ends, on every return path.
+     * @param hook_ctx The hook_ctx field of this filesystem
+     * @param operation The same operation which was passed to on_operation_begin
+     */
+    void (*on_operation_end)(void *hook_ctx, uint8_t operation);
+
+    /**
+     * User defined context which is passed to the operation hooks. It is separate
+     * from ctx so the hooks can be set without knowing the block device.
+     */
+    void *hook_ctx;
+
+    /**
+     * Combination of CROWFS_MOUNT_* flags. Set it before crowfs_init or crowfs_format.
+     */
+    uint32_t mount_flags;
 
     /**
      * Superblock of this filesystem cached in the memory to reduce
@@ -227,6 +563,43 @@ struct CrowFS {
      * The root folder dnode index.
      */
     uint32_t root_dnode;
+
+    /**
+     * The free extent index if CROWFS_MOUNT_EXTENT_INDEX is set. It is NULL if
+     * the flag is not set or there was not enough memory for the index; then
+     * the free bitmap is scanned instead.
+     */
+    struct CrowFSExtentIndex *extent_index;
+
+    /**
+     * The transaction which was started by crowfs_txn_begin or NULL.
+     */
+    struct CrowFSTransaction *transaction;
+
+    /**
+     * The journal if the filesystem has CROWFS_FEATURE_JOURNAL, otherwise NULL.
+     */
+    struct CrowFSJournal *journal;
+
+    /**
+     * The freed blocks which wait to be discarded if CROWFS_MOUNT_DISCARD is set
+     * or NULL.
+     */
+    struct CrowFSDiscards *discards;
+
+    /**
+     * The public operation which is running. One of CROWFS_OP_*. Block devices
+     * can read this to know which operation has issued a request. Must be
+     * zero before the first call.
+     */
+    uint8_t current_operation;
+
+#ifdef CROWFS_STATS
+    /**
+     * Collected statistics. Use crowfs_get_stats to read them.
+     */
+    struct CrowFSStats stats;
+#endif
 };
 
 #define CROWFS_OK 0
@@ -238,6 +611,8 @@ struct CrowFS {
 #define CROWFS_ERR_NOT_EMPTY (-6)
 #define CROWFS_ERR_TOO_SMALL (-7)
 #define CROWFS_ERR_IO (-8)
+#define CROWFS_ERR_NOT_SUPPORTED (-9)
+#define CROWFS_ERR_READ_ONLY (-10)
 
 /**
  * Creates a new filesystem on the given disk.
@@ -247,16 +622,93 @@ struct CrowFS {
  */
 int crowfs_new(struct CrowFS *fs);
 
+/**
+ * Creates a new filesystem on the given disk with optional features.
+ * crowfs_new is the same as calling this function with no features.
+ * @param fs The block device functions
+ * @param features A combination of CROWFS_FEATURE_*. With CROWFS_FEATURE_LAZY_BITMAP,
+ * only the free bitmap blocks of the metadata are written, so formatting does not
+ * depend on the size of the disk. With CROWFS_FEATURE_JOURNAL, CROWFS_JOURNAL_BLOCKS
+ * blocks are reserved for the journal. With CROWFS_FEATURE_REFCOUNT, a zeroed
+ * refcount area of one block for every CROWFS_REFCOUNTS_PER_BLOCK blocks is written.
+ * @return CROWFS_OK if everything is fine or CROWFS_ERR_ARGUMENT
+ * (if functions are not filled or a feature is unknown)
+ */
+int crowfs_format(struct CrowFS *fs, uint32_t features);
+
 /**
  * Initialize the CrowFS filesystem structure in order to be able to use
  * the filesystem. Before calling this function, all of the
  *
  * @param fs The filesystem to open.
  * @return CROWFS_OK or CROWFS_ERR_ARGUMENT (if functions are not filled)
- * or CROWFS_ERR_INIT_INVALID_FS if the filesystem is corrupt
+ * or CROWFS_ERR_INIT_INVALID_FS if the filesystem is corrupt or uses unknown features
+ * @note If the filesystem has a journal, the complete records in it are written
+ * in place before anything else, so the changes of an interrupted session are
+ * either fully applied or not at all. With CROWFS_MOUNT_READ_ONLY, the records
+ * are only read and the blocks in them are read from the journal instead.
  */
 int crowfs_init(struct CrowFS *fs);
 
+/**
+ * Releases the memory which is held by an initialized filesystem, such as the
+ * free extent index. The journal is checkpointed, so the blocks in it are written
+ * in place, and the device is flushed. The filesystem must be initialized again
+ * to be used.
+ * @param fs The filesystem to close
+ */
+void crowfs_close(struct CrowFS *fs);
+
+/**
+ * Starts a transaction. Until it is committed, the blocks which are written with
+ * single block writes (dnodes, folders, the free bitmap and the superblock) are
+ * kept in memory. A block which is modified by many operations is written only
+ * once. Reads see the kept blocks. Multi-block data writes still go to the disk
+ * directly, so file data reaches the disk before the metadata which points to it.
+ * Transactions can be nested; only the outermost commit writes the blocks.
+ * @param fs The filesystem
+ * @return CROWFS_OK or CROWFS_ERR_LIMIT if there is no memory for the transaction
+ * @note If more than 1024 blocks (1020 with a journal) are modified, the kept
+ * blocks are written early and the transaction goes on.
+ */
+int crowfs_txn_begin(struct CrowFS *fs);
+
+/**
+ * Ends a transaction. At the outermost commit, the kept blocks are written in
+ * ascending block order and consecutive blocks are merged into multi-block writes.
+ * With a journal, they are appended to the journal as a single record instead
+ * and are written in place at the next checkpoint.
+ * @param fs The filesystem
+ * @return CROWFS_OK, CROWFS_ERR_ARGUMENT if no transaction is running or
+ * CROWFS_ERR_IO if a block could not be written
+ * @note Every operation which modifies a journaled filesystem runs in its own
+ * transaction. If the journal cannot be written, the filesystem is not modified
+ * anymore and the operations fail with CROWFS_ERR_IO until it is mounted again.
+ */
+int crowfs_txn_commit(struct CrowFS *fs);
+
+/**
+ * Makes everything which was written to the filesystem durable. The blocks which
+ * are kept by a running transaction are written in ascending block order with
+ * consecutive blocks merged into multi-block writes, as if the transaction was
+ * full, and then the device is flushed once.
+ * @param fs The filesystem
+ * @return CROWFS_OK or CROWFS_ERR_IO if a block could not be written or the
+ * device could not be flushed
+ */
+int crowfs_sync(struct CrowFS *fs);
+
+/**
+ * Makes a file or folder durable. Its blocks depend on the free bitmap and its
+ * folder, which are shared with other files, so this writes the same blocks as
+ * crowfs_sync.
+ * @param fs The filesystem
+ * @param dnode The dnode of the file or folder
+ * @return CROWFS_OK, CROWFS_ERR_ARGUMENT if the dnode is not a file or folder or
+ * CROWFS_ERR_IO
+ */
+int crowfs_fsync(struct CrowFS *fs, uint32_t dnode);
+
 /**
  * Create a new file/directory if it does not exists
  */
@@ -303,6 +755,8 @@ int crowfs_open_relative(struct CrowFS *fs, const char *path, uint32_t relative_
  * @param size The size of the buffer to write
  * @param offset The offset of the file to write into
  * @return CROWFS_OK or CROWFS_ERR_LIMIT if the file is very big
+ * @note Physically consecutive blocks are written with write_blocks if it is available.
+ * Only partially written blocks which already contain data are read from the disk.
  */
 int crowfs_write(struct CrowFS *fs, uint32_t dnode, const char *data, size_t size, size_t offset);
 
@@ -314,6 +768,7 @@ int crowfs_write(struct CrowFS *fs, uint32_t dnode, const char *data, size_t siz
  * @param offset The offset of the file to read from
  * @return The number of bytes read (more than zero) if everything was ok.
  * Will return zero on EOF
+ * @note Physically consecutive blocks are read with read_blocks if it is available.
  */
 int crowfs_read(struct CrowFS *fs, uint32_t dnode, char *buf, size_t size, size_t offset);
 
@@ -338,6 +793,20 @@ int crowfs_read_dir(struct CrowFS *fs, uint32_t dnode, struct CrowFSStat *stat,
  */
 int crowfs_delete(struct CrowFS *fs, uint32_t dnode, uint32_t parent_dnode);
 
+/**
+ * Deletes a file or a folder with everything in it. The tree is removed from
+ * the parent at first, so the parent is written once. Then the tree is walked
+ * once and its blocks are freed in batches: the blocks are sorted and each free
+ * bitmap block is read and written once for each batch of 1023 blocks.
+ * @param dnode A file or folder. This cannot be root dnode
+ * @param parent_dnode Parent's folder dnode
+ * @return CROWFS_OK, CROWFS_ERR_ARGUMENT if the dnode is not in the parent,
+ * CROWFS_ERR_LIMIT if there is no memory to walk the tree or CROWFS_ERR_IO
+ * @note If the walk fails, the rest of the tree is not freed. CrowFSCheck
+ * reports these blocks as leaked.
+ */
+int crowfs_delete_recursive(struct CrowFS *fs, uint32_t dnode, uint32_t parent_dnode);
+
 /**
  * Gets the stats of a file dnode
  * @param dnode The file dnode
@@ -362,9 +831,174 @@ int crowfs_stat(struct CrowFS *fs, uint32_t dnode, struct CrowFSStat *stat);
  */
 int crowfs_move(struct CrowFS *fs, uint32_t dnode, uint32_t old_parent, uint32_t new_parent, const char *new_name);
 
+/**
+ * Copies a file to a new file without passing its data through the caller. The
+ * data of the copy is allocated as a few free runs as possible, preferably one,
+ * and each physically consecutive part of the source is copied with a single
+ * copy_blocks call, or with multi-block reads and writes if the device has no
+ * copy_blocks.
+ * @param src_dnode The file to copy
+ * @param dst_parent The folder to create the copy in
+ * @param name The name of the copy. Must not exist in dst_parent.
+ * @param dnode The dnode of the copy. Zero if the copy failed.
+ * @return CROWFS_OK, CROWFS_ERR_ARGUMENT if the source is not a file or the name
+ * is taken or is not a single path part, CROWFS_ERR_FULL if the data does not fit
+ * or the errors of creating the file. A failed copy leaves nothing behind.
+ */
+int crowfs_copy(struct CrowFS *fs, uint32_t src_dnode, uint32_t dst_parent, const char *name, uint32_t *dnode);
+
+/**
+ * Creates a new file which shares the data blocks of another file. Only the
+ * dnode and the indirect block are written and the refcounts of the data blocks
+ * are increased, so the time and space of a clone do not depend on the size of
+ * the data. Both files can be changed afterwards: crowfs_write copies a shared
+ * block before it changes it.
+ * @param src_dnode The file to clone
+ * @param dst_parent The folder to create the clone in
+ * @param name The name of the clone. Must not exist in dst_parent.
+ * @param dnode The dnode of the clone. Zero if the clone failed.
+ * @return CROWFS_OK, CROWFS_ERR_NOT_SUPPORTED without CROWFS_FEATURE_REFCOUNT,
+ * CROWFS_ERR_ARGUMENT if the source is not a file or the name is taken or is not
+ * a single path part, CROWFS_ERR_LIMIT if a block is shared too many times or the
+ * errors of creating the file
+ */
+int crowfs_clone(struct CrowFS *fs, uint32_t src_dnode, uint32_t dst_parent, const char *name, uint32_t *dnode);
+
+/**
+ * Freezes the current tree as a snapshot. The root folder is pinned by copying
+ * the folders, the file dnodes and the indirect blocks of the tree, and the data
+ * blocks are shared with the snapshot like crowfs_clone does, so the time and
+ * space of a snapshot depend on the number of files but not on their size. Later
+ * writes copy the shared blocks, so the snapshot never changes. The snapshot is
+ * written in place and flushed before this returns, so it can be mounted with
+ * crowfs_snapshot_mount while this filesystem keeps changing.
+ * @param fs The filesystem. No transaction may be running.
+ * @param name The name of the snapshot. Must be a single path part.
+ * @param snapshot The root folder of the snapshot. Zero if the snapshot failed.
+ * @return CROWFS_OK, CROWFS_ERR_NOT_SUPPORTED without CROWFS_FEATURE_REFCOUNT,
+ * CROWFS_ERR_ARGUMENT if a transaction is running or the name is taken or invalid,
+ * CROWFS_ERR_LIMIT if there are too many snapshots, there is no memory to walk
+ * the tree or a block is shared too many times, CROWFS_ERR_FULL or CROWFS_ERR_IO.
+ * A failed snapshot leaves nothing behind.
+ */
+int crowfs_snapshot_create(struct CrowFS *fs, const char *name, uint32_t *snapshot);
+
+/**
+ * Lists the snapshots of a filesystem like crowfs_read_dir. The name of each
+ * entry is the name of the snapshot, its creation date is when it was created
+ * and its dnode is the root folder of the snapshot.
+ * @param stat The result goes here
+ * @param offset The index of the snapshot
+ * @return CROWFS_OK, CROWFS_ERR_NOT_SUPPORTED without CROWFS_FEATURE_REFCOUNT or
+ * CROWFS_ERR_LIMIT if offset is not less than the number of snapshots
+ */
+int crowfs_snapshot_list(struct CrowFS *fs, struct CrowFSStat *stat, size_t offset);
+
+/**
+ * Deletes a snapshot. Its folders and dnodes are freed and its data blocks lose
+ * a reference, so only the blocks which the live tree does not share are freed.
+ * @param fs The filesystem. No transaction may be running.
+ * @param name The name of the snapshot
+ * @return CROWFS_OK, CROWFS_ERR_NOT_SUPPORTED without CROWFS_FEATURE_REFCOUNT,
+ * CROWFS_ERR_ARGUMENT if a transaction is running, CROWFS_ERR_NOT_FOUND or the
+ * errors of crowfs_delete_recursive
+ */
+int crowfs_snapshot_delete(struct CrowFS *fs, const char *name);
+
+/**
+ * Mounts a snapshot read only instead of crowfs_init. The root folder of the
+ * filesystem is the root folder of the snapshot, so the paths and the other
+ * read operations work in the frozen tree, and CROWFS_MOUNT_READ_ONLY is set.
+ * The journal is not used, because the snapshots are written in place, so the
+ * image can be mounted this way while another CrowFS writes to it, as long as
+ * that one does not delete the snapshot.
+ * @param fs The filesystem with the same functions as for crowfs_init
+ * @param name The name of the snapshot
+ * @return CROWFS_OK, CROWFS_ERR_ARGUMENT if functions are not filled,
+ * CROWFS_ERR_INIT_INVALID_FS, CROWFS_ERR_NOT_SUPPORTED without
+ * CROWFS_FEATURE_REFCOUNT, CROWFS_ERR_NOT_FOUND or CROWFS_ERR_IO
+ */
+int crowfs_snapshot_mount(struct CrowFS *fs, const char *name);
+
+/**
+ * Fragmentation of the data of a file
+ */
+struct CrowFSFragmentation {
+    // Number of data blocks of the file
+    uint32_t blocks;
+    // Number of runs of physically consecutive data blocks. One if the file is
+    // contiguous and zero if it is empty.
+    uint32_t extents;
+};
+
+/**
+ * Measures the fragmentation of a file
+ * @param dnode The file dnode
+ * @param fragmentation The result goes here
+ * @return CROWFS_OK or CROWFS_ERR_ARGUMENT if the dnode is not a file
+ */
+int crowfs_fragmentation(struct CrowFS *fs, uint32_t dnode, struct CrowFSFragmentation *fragmentation);
+
+/**
+ * The value of the cursor of crowfs_defrag when the whole file is processed
+ */
+#define CROWFS_DEFRAG_DONE UINT32_MAX
+
+/**
+ * Relocates the data blocks of a file into contiguous free runs. This works
+ * incrementally: each call moves at most max_blocks blocks, so a file can be
+ * defragmented in bounded slices between other operations. Blocks which are
+ * already right after their previous block are left in place. Otherwise, the
+ * blocks are moved to the free blocks after the previous block, or to the first
+ * free run which can hold the rest of the file. Data is copied and the new blocks
+ * are marked used before the pointers of the file are changed, so a crash can
+ * only leak the new blocks.
+ * @param dnode The file dnode
+ * @param cursor The index of the file block to continue from. Must be zero at
+ * the first call. It is CROWFS_DEFRAG_DONE when the whole file is processed.
+ * @param max_blocks Maximum number of blocks to move in this call. At most 1024
+ * are moved, or half of CROWFS_JOURNAL_RECORD_BLOCKS with a journal.
+ * @return Number of moved blocks, CROWFS_ERR_ARGUMENT if the dnode is not a file
+ * or CROWFS_ERR_IO
+ */
+int crowfs_defrag(struct CrowFS *fs, uint32_t dnode, uint32_t *cursor, uint32_t max_blocks);
+
 /**
  * Counts the free blocks in a filesystem
  * @param fs The filesystem to count the free blocks in
  * @return The number of free blocks
  */
 uint32_t crowfs_free_blocks(struct CrowFS *fs);
+
+/**
+ * Discards every free block of the filesystem with the discard callback. Runs
+ * of free blocks are discarded with a single call, even across free bitmap
+ * blocks. This is the batched alternative of CROWFS_MOUNT_DISCARD and can run
+ * between other operations, for example periodically.
+ * @param fs The filesystem
+ * @param trimmed Number of discarded blocks. Zero if there is no discard callback.
+ * @return CROWFS_OK, CROWFS_ERR_ARGUMENT if a transaction is running or
+ * CROWFS_ERR_IO if the free bitmap could not be read
+ */
+int crowfs_trim(struct CrowFS *fs, uint32_t *trimmed);
+
+/**
+ * Copies the statistics of a filesystem
+ * @param fs The filesystem
+ * @param stats The statistics are copied here. Zeroed if statistics are not collected.
+ * @return CROWFS_OK or CROWFS_ERR_NOT_SUPPORTED if CrowFS is compiled without CROWFS_STATS
+ */
+int crowfs_get_stats(const struct CrowFS *fs, struct CrowFSStats *stats);
+
+/**
+ * Zeros the statistics of a filesystem
+ * @param fs The filesystem
+ */
+void crowfs_reset_stats(struct CrowFS *fs);
+
+/**
+ * Gets the name of a public operation
+ * @param operation One of CROWFS_OP_*
+ * @return The name of the operation such as "write" or "unknown"
+ */
+const char *crowfs_operation_name(uint8_t operation);
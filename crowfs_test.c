@@ -8,51 +8,172 @@
 #include <stdbool.h>
 #include <errno.h>
 
-struct {
+#define MIN(x, y) ((x < y) ? (x) : (y))
+
+/**
+ * An in memory disk. This is the ctx of the filesystems in tests.
+ */
+struct MemoryDevice {
     size_t size;
     char *buffer;
-} memory_buffer;
+    // Only counted by the counting backend
+    uint64_t block_reads, block_writes;
+    // Number of flush calls
+    uint64_t flushes;
+    // Number of discard calls and discarded blocks
+    uint64_t discards, discarded_blocks;
+    // Number of copy_blocks calls
+    uint64_t copies;
+};
 
-union CrowFSBlock *std_allocate_mem_block(void) {
+union CrowFSBlock *std_allocate_mem_block(void *ctx) {
     return calloc(1, sizeof(union CrowFSBlock));
 }
 
-void std_free_mem_block(union CrowFSBlock *block) {
+void std_free_mem_block(void *ctx, union CrowFSBlock *block) {
     free(block);
 }
 
-int mem_write_block(uint32_t block_index, const union CrowFSBlock *block) {
-    memcpy(memory_buffer.buffer + block_index * CROWFS_BLOCK_SIZE, block, sizeof(union CrowFSBlock));
+/**
+ * Number of memory blocks which are allocated by counting_allocate_mem_block
+ * and not freed yet
+ */
+static long live_mem_blocks;
+
+union CrowFSBlock *counting_allocate_mem_block(void *ctx) {
+    live_mem_blocks++;
+    return std_allocate_mem_block(ctx);
+}
+
+void counting_free_mem_block(void *ctx, union CrowFSBlock *block) {
+    live_mem_blocks--;
+    std_free_mem_block(ctx, block);
+}
+
+int mem_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    struct MemoryDevice *memory_buffer = ctx;
+    memcpy(memory_buffer->buffer + block_index * CROWFS_BLOCK_SIZE, block, sizeof(union CrowFSBlock));
+    return 0;
+}
+
+/**
+ * The only file dnode with data which failing_dnode_write_block writes
+ */
+static uint32_t writable_file_dnode;
+
+/**
+ * Fails the writes of the file dnodes with data except writable_file_dnode, so
+ * an operation fails after it has allocated and shared the blocks of a new file
+ */
+int failing_dnode_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    if (block->header.type == CROWFS_ENTITY_FILE && block->file.size != 0 && block_index != writable_file_dnode)
+        return 1;
+    return mem_write_block(ctx, block_index, block);
+}
+
+int failing_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    return 1;
+}
+
+int mem_read_block(void *ctx, uint32_t block_index, union CrowFSBlock *block) {
+    struct MemoryDevice *memory_buffer = ctx;
+    memcpy(block, memory_buffer->buffer + block_index * CROWFS_BLOCK_SIZE, sizeof(union CrowFSBlock));
+    return 0;
+}
+
+int mem_write_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    for (uint32_t i = 0; i < count; i++)
+        mem_write_block(ctx, block_index + i, blocks[i]);
+    return 0;
+}
+
+int mem_read_blocks(void *ctx, uint32_t block_index, uint32_t count, union CrowFSBlock *const *blocks) {
+    for (uint32_t i = 0; i < count; i++)
+        mem_read_block(ctx, block_index + i, blocks[i]);
+    return 0;
+}
+
+int mem_flush(void *ctx) {
+    ((struct MemoryDevice *) ctx)->flushes++;
+    return 0;
+}
+
+int mem_discard(void *ctx, uint32_t block_index, uint32_t count) {
+    struct MemoryDevice *memory_buffer = ctx;
+    memory_buffer->discards++;
+    memory_buffer->discarded_blocks += count;
+    // Discarded blocks read as zeros, like a hole in an image file
+    memset(memory_buffer->buffer + (size_t) block_index * CROWFS_BLOCK_SIZE, 0, (size_t) count * CROWFS_BLOCK_SIZE);
     return 0;
 }
 
-int mem_read_block(uint32_t block_index, union CrowFSBlock *block) {
-    memcpy(block, memory_buffer.buffer + block_index * CROWFS_BLOCK_SIZE, sizeof(union CrowFSBlock));
+int mem_copy_blocks(void *ctx, uint32_t from, uint32_t to, uint32_t count) {
+    struct MemoryDevice *memory_buffer = ctx;
+    memory_buffer->copies++;
+    memcpy(memory_buffer->buffer + (size_t) to * CROWFS_BLOCK_SIZE,
+           memory_buffer->buffer + (size_t) from * CROWFS_BLOCK_SIZE, (size_t) count * CROWFS_BLOCK_SIZE);
     return 0;
 }
 
-uint32_t mem_total_blocks(void) {
-    return memory_buffer.size / CROWFS_BLOCK_SIZE;
+uint32_t mem_total_blocks(void *ctx) {
+    struct MemoryDevice *memory_buffer = ctx;
+    return memory_buffer->size / CROWFS_BLOCK_SIZE;
 }
 
-int64_t std_current_date(void) {
+int64_t std_current_date(void *ctx) {
     return time(NULL);
 }
 
+int counting_write_block(void *ctx, uint32_t block_index, const union CrowFSBlock *block) {
+    ((struct MemoryDevice *) ctx)->block_writes++;
+    return mem_write_block(ctx, block_index, block);
+}
+
+int counting_read_block(void *ctx, uint32_t block_index, union CrowFSBlock *block) {
+    ((struct MemoryDevice *) ctx)->block_reads++;
+    return mem_read_block(ctx, block_index, block);
+}
+
 void mem_fs_init(struct CrowFS *fs, size_t size) {
-    if (memory_buffer.buffer != NULL)
-        free(memory_buffer.buffer);
-    memory_buffer.buffer = calloc(size, sizeof(char));
-    memory_buffer.size = size;
-    fs->allocate_mem_block = std_allocate_mem_block;
-    fs->free_mem_block = std_free_mem_block;
-    fs->write_block = mem_write_block;
-    fs->read_block = mem_read_block;
-    fs->total_blocks = mem_total_blocks;
-    fs->current_date = std_current_date;
+    struct MemoryDevice *memory_buffer = malloc(sizeof(struct MemoryDevice));
+    memory_buffer->buffer = calloc(size, sizeof(char));
+    memory_buffer->size = size;
+    memory_buffer->flushes = 0;
+    memory_buffer->discards = 0;
+    memory_buffer->discarded_blocks = 0;
+    memory_buffer->copies = 0;
+    *fs = (struct CrowFS){
+        .allocate_mem_block = std_allocate_mem_block,
+        .free_mem_block = std_free_mem_block,
+        .write_block = mem_write_block,
+        .read_block = mem_read_block,
+        .total_blocks = mem_total_blocks,
+        .current_date = std_current_date,
+        .ctx = memory_buffer,
+    };
     crowfs_new(fs);
 }
 
+/**
+ * Creates an in memory filesystem which counts the block reads and writes
+ * in its MemoryDevice. Only single block callbacks are set so each block is
+ * counted exactly once.
+ */
+void counting_fs_init(struct CrowFS *fs, size_t size) {
+    mem_fs_init(fs, size);
+    fs->write_block = counting_write_block;
+    fs->read_block = counting_read_block;
+}
+
+/**
+ * Resets the I/O counters of a filesystem created by counting_fs_init
+ */
+void counting_reset(struct CrowFS *fs) {
+    struct MemoryDevice *device = fs->ctx;
+    device->block_reads = 0;
+    device->block_writes = 0;
+}
+
 int test_open_file() {
     struct CrowFS fs;
     mem_fs_init(&fs, 1024 * 1024);
@@ -773,6 +894,1143 @@ int test_relative() {
     return 0;
 }
 
+int test_read_write_multi_block() {
+    struct CrowFS fs;
+    mem_fs_init(&fs, 1024 * 1024 * 16);
+    fs.write_blocks = mem_write_blocks;
+    fs.read_blocks = mem_read_blocks;
+    uint32_t fd, fd_parent;
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    // Write the file with chunks which are not aligned to blocks
+    const size_t file_size = CROWFS_MAX_FILESIZE;
+    char *content = malloc(file_size), *read_buffer = malloc(file_size);
+    for (size_t i = 0; i < file_size; i++)
+        content[i] = (char) (i * 7);
+    const size_t chunk = CROWFS_BLOCK_SIZE * 5 + 123;
+    for (size_t offset = 0; offset < file_size; offset += chunk)
+        assert(crowfs_write(&fs, fd, content + offset, MIN(chunk, file_size - offset), offset) == CROWFS_OK);
+    // Read all back with another chunk size
+    const size_t read_chunk = CROWFS_BLOCK_SIZE * 17 + 1;
+    for (size_t offset = 0; offset < file_size; offset += read_chunk)
+        assert(crowfs_read(&fs, fd, read_buffer + offset, read_chunk, offset) == MIN(read_chunk, file_size - offset));
+    assert(memcmp(content, read_buffer, file_size) == 0);
+    // Overwrite the middle of the file. This should not change the size
+    memset(content + 1000, 'A', CROWFS_BLOCK_SIZE * 3);
+    assert(crowfs_write(&fs, fd, content + 1000, CROWFS_BLOCK_SIZE * 3, 1000) == CROWFS_OK);
+    struct CrowFSStat stat;
+    assert(crowfs_stat(&fs, fd, &stat) == CROWFS_OK);
+    assert(stat.size == file_size);
+    assert(crowfs_read(&fs, fd, read_buffer, file_size, 0) == file_size);
+    assert(memcmp(content, read_buffer, file_size) == 0);
+    free(content);
+    free(read_buffer);
+    return 0;
+}
+
+int test_multiple_filesystems() {
+#define FS_COUNT 4
+    struct CrowFS fs[FS_COUNT];
+    uint32_t fd, fd_parent;
+    for (int i = 0; i < FS_COUNT; i++)
+        mem_fs_init(&fs[i], 1024 * 1024);
+    // Create a different file in each filesystem
+    for (int i = 0; i < FS_COUNT; i++) {
+        char name[16];
+        sprintf(name, "/file%d", i);
+        assert(crowfs_open_absolute(&fs[i], name, &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+        assert(crowfs_write(&fs[i], fd, name, strlen(name), 0) == CROWFS_OK);
+    }
+    // Each filesystem must only see its own file
+    for (int i = 0; i < FS_COUNT; i++) {
+        // Reopen the filesystem from its disk
+        struct CrowFS reopened = fs[i];
+        assert(crowfs_init(&reopened) == CROWFS_OK);
+        for (int j = 0; j < FS_COUNT; j++) {
+            char name[16], read_buffer[16] = {0};
+            sprintf(name, "/file%d", j);
+            int result = crowfs_open_absolute(&reopened, name, &fd, &fd_parent, 0);
+            if (i == j) {
+                assert(result == CROWFS_OK);
+                assert(crowfs_read(&reopened, fd, read_buffer, sizeof(read_buffer), 0) == strlen(name));
+                assert(strcmp(read_buffer, name) == 0);
+            } else {
+                assert(result == CROWFS_ERR_NOT_FOUND);
+            }
+        }
+    }
+#undef FS_COUNT
+    return 0;
+}
+
+int test_lazy_bitmap() {
+    // Three bitmap blocks. Only the first one must be written when formatting.
+    const size_t size = (2 * CROWFS_BITSET_COVERED_BLOCKS + 100) * (size_t) CROWFS_BLOCK_SIZE;
+    struct CrowFS fs, eager_fs;
+    uint32_t fd, fd_parent;
+    mem_fs_init(&eager_fs, size);
+    mem_fs_init(&fs, size);
+    struct MemoryDevice *device = fs.ctx;
+    // Garbage in the bitmap blocks must never be read
+    memset(device->buffer + 2 * CROWFS_BLOCK_SIZE, 0xAB, 3 * CROWFS_BLOCK_SIZE);
+    assert(crowfs_format(&fs, CROWFS_FEATURE_LAZY_BITMAP) == CROWFS_OK);
+    assert(fs.superblock.bitmap_initialized_blocks == 1);
+    assert((uint8_t) device->buffer[3 * CROWFS_BLOCK_SIZE] == 0xAB);
+    assert((uint8_t) device->buffer[4 * CROWFS_BLOCK_SIZE] == 0xAB);
+    const uint32_t free_blocks = crowfs_free_blocks(&fs);
+    assert(free_blocks == crowfs_free_blocks(&eager_fs));
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == free_blocks);
+    // Fill the range of the first bitmap block and go over it
+    char *data = malloc(CROWFS_MAX_FILESIZE);
+    for (size_t i = 0; i < CROWFS_MAX_FILESIZE; i++)
+        data[i] = (char) (i * 7);
+    int file_count = 0;
+    while (fs.superblock.bitmap_initialized_blocks == 1) {
+        char name[32];
+        snprintf(name, sizeof(name), "/file%d", file_count++);
+        assert(crowfs_open_absolute(&fs, name, &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+        assert(crowfs_write(&fs, fd, data, CROWFS_MAX_FILESIZE, 0) == CROWFS_OK);
+    }
+    // Only the second bitmap block is materialized
+    assert(fs.superblock.bitmap_initialized_blocks == 2);
+    assert((uint8_t) device->buffer[3 * CROWFS_BLOCK_SIZE] != 0xAB);
+    assert((uint8_t) device->buffer[4 * CROWFS_BLOCK_SIZE] == 0xAB);
+    // Everything must survive a remount
+    struct CrowFS reopened = fs;
+    assert(crowfs_init(&reopened) == CROWFS_OK);
+    assert(reopened.superblock.bitmap_initialized_blocks == 2);
+    char *read_buffer = malloc(CROWFS_MAX_FILESIZE);
+    assert(crowfs_open_absolute(&reopened, "/file0", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&reopened, fd, read_buffer, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(data, read_buffer, CROWFS_MAX_FILESIZE) == 0);
+    // Deleting everything frees all blocks
+    for (int i = 0; i < file_count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/file%d", i);
+        assert(crowfs_open_absolute(&reopened, name, &fd, &fd_parent, 0) == CROWFS_OK);
+        assert(crowfs_delete(&reopened, fd, fd_parent) == CROWFS_OK);
+    }
+    assert(crowfs_free_blocks(&reopened) == free_blocks);
+    // Unknown features are rejected
+    assert(crowfs_format(&fs, 0x80000000) == CROWFS_ERR_ARGUMENT);
+    ((union CrowFSBlock *) (device->buffer + CROWFS_BLOCK_SIZE))->superblock.features |= 0x80000000;
+    assert(crowfs_init(&reopened) == CROWFS_ERR_INIT_INVALID_FS);
+    free(data);
+    free(read_buffer);
+    return 0;
+}
+
+int test_stats() {
+    struct CrowFS fs;
+    struct CrowFSStats stats;
+    uint32_t fd, fd_parent;
+    mem_fs_init(&fs, 1024 * 1024);
+    if (crowfs_get_stats(&fs, &stats) == CROWFS_ERR_NOT_SUPPORTED)
+        return 0; // compiled without statistics
+    crowfs_reset_stats(&fs);
+    assert(crowfs_open_absolute(&fs, "/folder", &fd, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/folder/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    char data[CROWFS_BLOCK_SIZE * 2] = {1};
+    assert(crowfs_write(&fs, fd, data, sizeof(data), 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, fd, data, sizeof(data), 0) == sizeof(data));
+    assert(fs.current_operation == CROWFS_OP_NONE);
+    assert(crowfs_get_stats(&fs, &stats) == CROWFS_OK);
+    // Nested calls are accounted to the outer operation
+    assert(stats.operations[CROWFS_OP_OPEN].calls == 2);
+    assert(stats.operations[CROWFS_OP_OPEN].dir_entries_compared == 1);
+    // The folder scans the bitmap once for an empty group and once to allocate
+    assert(stats.operations[CROWFS_OP_OPEN].bitmap_blocks_scanned == 3);
+    assert(stats.operations[CROWFS_OP_WRITE].calls == 1);
+    assert(stats.operations[CROWFS_OP_WRITE].bytes_written == sizeof(data));
+    assert(stats.operations[CROWFS_OP_WRITE].bitmap_blocks_scanned == 2);
+    assert(stats.operations[CROWFS_OP_READ].calls == 1);
+    assert(stats.operations[CROWFS_OP_READ].bytes_read == sizeof(data));
+    // Dnode and two data blocks without multi-block callbacks
+    assert(stats.operations[CROWFS_OP_READ].block_reads == 3);
+    assert(stats.operations[CROWFS_OP_READ].read_requests == 3);
+    assert(stats.operations[CROWFS_OP_READ].block_writes == 0);
+    assert(stats.operations[CROWFS_OP_DELETE].calls == 0);
+    crowfs_reset_stats(&fs);
+    assert(crowfs_get_stats(&fs, &stats) == CROWFS_OK);
+    assert(stats.operations[CROWFS_OP_WRITE].calls == 0);
+    return 0;
+}
+
+/**
+ * Records the calls of the operation hooks
+ */
+struct HookCalls {
+    int begins[CROWFS_OP_COUNT], ends[CROWFS_OP_COUNT];
+    // The operation which has begun but not ended yet
+    uint8_t running;
+};
+
+void hook_operation_begin(void *hook_ctx, uint8_t operation) {
+    struct HookCalls *calls = hook_ctx;
+    assert(calls->running == CROWFS_OP_NONE);
+    calls->running = operation;
+    calls->begins[operation]++;
+}
+
+void hook_operation_end(void *hook_ctx, uint8_t operation) {
+    struct HookCalls *calls = hook_ctx;
+    assert(calls->running == operation);
+    calls->running = CROWFS_OP_NONE;
+    calls->ends[operation]++;
+}
+
+int test_operation_hooks() {
+    struct CrowFS fs;
+    struct HookCalls calls = {0};
+    uint32_t fd, fd_parent;
+    mem_fs_init(&fs, 1024 * 1024);
+    fs.on_operation_begin = hook_operation_begin;
+    fs.on_operation_end = hook_operation_end;
+    fs.hook_ctx = &calls;
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, "hello", 5, 0) == CROWFS_OK);
+    // Failing operations end too
+    assert(crowfs_open_absolute(&fs, "/missing", &fd, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(calls.running == CROWFS_OP_NONE);
+    for (int i = 0; i < CROWFS_OP_COUNT; i++)
+        assert(calls.begins[i] == calls.ends[i]);
+    assert(calls.begins[CROWFS_OP_OPEN] == 3);
+    assert(calls.begins[CROWFS_OP_WRITE] == 1);
+    assert(calls.begins[CROWFS_OP_DELETE] == 1);
+    assert(calls.begins[CROWFS_OP_READ] == 0);
+    return 0;
+}
+
+int test_defrag() {
+    struct CrowFS fs;
+    uint32_t fd1, fd2, fd_parent;
+    mem_fs_init(&fs, 32 * 1024 * 1024);
+    // Interleave two files which go over the direct blocks
+    const size_t file_blocks = CROWFS_DIRECT_BLOCKS + 100;
+    char *data = malloc(file_blocks * CROWFS_BLOCK_SIZE), *read_buffer = malloc(file_blocks * CROWFS_BLOCK_SIZE);
+    for (size_t i = 0; i < file_blocks * CROWFS_BLOCK_SIZE; i++)
+        data[i] = (char) (i * 13 + i / CROWFS_BLOCK_SIZE);
+    assert(crowfs_open_absolute(&fs, "/file1", &fd1, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/file2", &fd2, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    for (size_t i = 0; i < file_blocks; i++) {
+        const size_t offset = i * CROWFS_BLOCK_SIZE;
+        assert(crowfs_write(&fs, fd1, data + offset, CROWFS_BLOCK_SIZE, offset) == CROWFS_OK);
+        assert(crowfs_write(&fs, fd2, data + offset, CROWFS_BLOCK_SIZE, offset) == CROWFS_OK);
+    }
+    struct CrowFSFragmentation fragmentation;
+    assert(crowfs_fragmentation(&fs, fd1, &fragmentation) == CROWFS_OK);
+    assert(fragmentation.blocks == file_blocks);
+    assert(fragmentation.extents > file_blocks / 2);
+    assert(crowfs_fragmentation(&fs, fs.root_dnode, &fragmentation) == CROWFS_ERR_ARGUMENT);
+    // Defragment in small slices
+    const uint32_t free_blocks = crowfs_free_blocks(&fs);
+    uint32_t cursor = 0;
+    int calls = 0;
+    while (cursor != CROWFS_DEFRAG_DONE) {
+        const int moved = crowfs_defrag(&fs, fd1, &cursor, 64);
+        assert(moved >= 0 && moved <= 64);
+        calls++;
+    }
+    assert(calls > 1);
+    assert(crowfs_free_blocks(&fs) == free_blocks);
+    assert(crowfs_fragmentation(&fs, fd1, &fragmentation) == CROWFS_OK);
+    assert(fragmentation.blocks == file_blocks);
+    assert(fragmentation.extents == 1);
+    // A contiguous file is not moved again
+    cursor = 0;
+    assert(crowfs_defrag(&fs, fd1, &cursor, 64) == 0);
+    assert(cursor == CROWFS_DEFRAG_DONE);
+    // Both files still have their data
+    assert(crowfs_read(&fs, fd1, read_buffer, file_blocks * CROWFS_BLOCK_SIZE, 0) == file_blocks * CROWFS_BLOCK_SIZE);
+    assert(memcmp(data, read_buffer, file_blocks * CROWFS_BLOCK_SIZE) == 0);
+    assert(crowfs_read(&fs, fd2, read_buffer, file_blocks * CROWFS_BLOCK_SIZE, 0) == file_blocks * CROWFS_BLOCK_SIZE);
+    assert(memcmp(data, read_buffer, file_blocks * CROWFS_BLOCK_SIZE) == 0);
+    // The second file goes after the first one
+    cursor = 0;
+    while (cursor != CROWFS_DEFRAG_DONE)
+        assert(crowfs_defrag(&fs, fd2, &cursor, 1024) >= 0);
+    assert(crowfs_fragmentation(&fs, fd2, &fragmentation) == CROWFS_OK);
+    assert(fragmentation.extents == 1);
+    assert(crowfs_read(&fs, fd2, read_buffer, file_blocks * CROWFS_BLOCK_SIZE, 0) == file_blocks * CROWFS_BLOCK_SIZE);
+    assert(memcmp(data, read_buffer, file_blocks * CROWFS_BLOCK_SIZE) == 0);
+    // Deleting frees everything
+    assert(crowfs_delete(&fs, fd1, fd_parent) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd2, fd_parent) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == free_blocks + 2 * (file_blocks + 2));
+    free(data);
+    free(read_buffer);
+    return 0;
+}
+
+int test_allocation_locality() {
+    struct CrowFS fs;
+    uint32_t folders[2], fd, fd_parent;
+    union CrowFSBlock dnode_block;
+    mem_fs_init(&fs, 64 * 1024 * 1024);
+    assert(crowfs_open_absolute(&fs, "/a", &folders[0], &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/b", &folders[1], &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    // Each folder starts its own group
+    assert(folders[0] > fs.root_dnode);
+    assert(folders[1] >= folders[0] + 1024);
+    // Create files in both folders one after another
+    char data[CROWFS_BLOCK_SIZE * 3] = {1};
+    for (int i = 0; i < 20; i++) {
+        const uint32_t folder = folders[i % 2];
+        char path[32];
+        snprintf(path, sizeof(path), "/%c/file%d", 'a' + i % 2, i);
+        assert(crowfs_open_absolute(&fs, path, &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+        assert(fd_parent == folder);
+        assert(crowfs_write(&fs, fd, data, sizeof(data), 0) == CROWFS_OK);
+        // The dnode and the data stay in the group of the folder and the data follows the dnode
+        assert(fd > folder && fd < folder + 1024);
+        assert(fs.read_block(fs.ctx, fd, &dnode_block) == 0);
+        for (int j = 0; j < 3; j++)
+            assert(dnode_block.file.direct_blocks[j] == fd + 1 + j);
+    }
+    return 0;
+}
+
+/**
+ * Counts the free blocks from the free bitmap even if the extent index is built
+ */
+static uint32_t bitmap_free_blocks(struct CrowFS *fs) {
+    struct CrowFSExtentIndex *index = fs->extent_index;
+    fs->extent_index = NULL;
+    const uint32_t free_blocks = crowfs_free_blocks(fs);
+    fs->extent_index = index;
+    return free_blocks;
+}
+
+int test_extent_index() {
+    struct CrowFS plain, indexed;
+    union CrowFSBlock plain_block, indexed_block;
+    mem_fs_init(&plain, 16 * 1024 * 1024);
+    mem_fs_init(&indexed, 16 * 1024 * 1024);
+    indexed.mount_flags = CROWFS_MOUNT_EXTENT_INDEX;
+    assert(crowfs_new(&indexed) == CROWFS_OK);
+    assert(indexed.extent_index != NULL);
+    assert(crowfs_free_blocks(&indexed) == crowfs_free_blocks(&plain));
+    // Both filesystems must make the same choices while files come and go
+    uint32_t files[64][2] = {0};
+    char data[CROWFS_BLOCK_SIZE * 40] = {1};
+    srand(1);
+    for (int i = 0; i < 300; i++) {
+        const int slot = rand() % 64;
+        uint32_t parent;
+        char path[32];
+        snprintf(path, sizeof(path), "/file%d", slot);
+        if (files[slot][0] != 0) {
+            assert(crowfs_delete(&plain, files[slot][0], plain.root_dnode) == CROWFS_OK);
+            assert(crowfs_delete(&indexed, files[slot][1], indexed.root_dnode) == CROWFS_OK);
+            files[slot][0] = files[slot][1] = 0;
+        } else {
+            assert(crowfs_open_absolute(&plain, path, &files[slot][0], &parent, CROWFS_O_CREATE) == CROWFS_OK);
+            assert(crowfs_open_absolute(&indexed, path, &files[slot][1], &parent, CROWFS_O_CREATE) == CROWFS_OK);
+            assert(files[slot][0] == files[slot][1]);
+            const size_t size = (rand() % 40) * CROWFS_BLOCK_SIZE + rand() % CROWFS_BLOCK_SIZE;
+            assert(crowfs_write(&plain, files[slot][0], data, size, 0) == CROWFS_OK);
+            assert(crowfs_write(&indexed, files[slot][1], data, size, 0) == CROWFS_OK);
+            assert(plain.read_block(plain.ctx, files[slot][0], &plain_block) == 0);
+            assert(indexed.read_block(indexed.ctx, files[slot][1], &indexed_block) == 0);
+            assert(memcmp(plain_block.file.direct_blocks, indexed_block.file.direct_blocks,
+                          sizeof(plain_block.file.direct_blocks)) == 0);
+        }
+        assert(crowfs_free_blocks(&indexed) == crowfs_free_blocks(&plain));
+    }
+    assert(indexed.extent_index != NULL);
+    assert(crowfs_free_blocks(&indexed) == bitmap_free_blocks(&indexed));
+    // Defragmenting with best fit runs keeps the index in sync
+    const uint32_t free_blocks = crowfs_free_blocks(&indexed);
+    for (int slot = 0; slot < 64; slot++) {
+        uint32_t cursor = 0;
+        while (files[slot][1] != 0 && cursor != CROWFS_DEFRAG_DONE)
+            assert(crowfs_defrag(&indexed, files[slot][1], &cursor, 16) >= 0);
+    }
+    assert(crowfs_free_blocks(&indexed) == free_blocks);
+    assert(bitmap_free_blocks(&indexed) == free_blocks);
+    // Mounting again builds the same index
+    assert(crowfs_init(&indexed) == CROWFS_OK);
+    assert(indexed.extent_index != NULL);
+    assert(crowfs_free_blocks(&indexed) == free_blocks);
+    crowfs_close(&indexed);
+    assert(indexed.extent_index == NULL);
+    assert(crowfs_free_blocks(&indexed) == free_blocks);
+    return 0;
+}
+
+int test_bitmap_summary() {
+    struct CrowFS fs;
+    struct CrowFSStats stats;
+    uint32_t old_file, new_file, fd_parent;
+    mem_fs_init(&fs, (CROWFS_BITSET_COVERED_BLOCKS + 4096) * CROWFS_BLOCK_SIZE);
+    assert(crowfs_format(&fs, CROWFS_FEATURE_BITMAP_SUMMARY) == CROWFS_OK);
+    assert(fs.free_bitmap_blocks == 2);
+    char data[CROWFS_BLOCK_SIZE] = {1};
+    assert(crowfs_open_absolute(&fs, "/old", &old_file, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, old_file, data, sizeof(data), 0) == CROWFS_OK);
+    assert(old_file < CROWFS_BITSET_COVERED_BLOCKS);
+    // Use up the rest of the first bitmap block behind the back of the filesystem
+    union CrowFSBlock bitmap = {0};
+    assert(fs.write_block(fs.ctx, 2, &bitmap) == 0);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    // Counting finds the full block and the summary is persisted
+    assert(crowfs_free_blocks(&fs) == fs.superblock.blocks - CROWFS_BITSET_COVERED_BLOCKS);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert((fs.superblock.bitmap_summary[0] & 1) == 0);
+    crowfs_reset_stats(&fs);
+    assert(crowfs_open_absolute(&fs, "/new", &new_file, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(new_file >= CROWFS_BITSET_COVERED_BLOCKS);
+    if (crowfs_get_stats(&fs, &stats) == CROWFS_OK) {
+        // The full block is not read
+        assert(stats.operations[CROWFS_OP_OPEN].bitmap_blocks_skipped == 1);
+        assert(stats.operations[CROWFS_OP_OPEN].bitmap_blocks_scanned == 1);
+    }
+    // Freeing blocks of a full bitmap block makes it visible again
+    assert(crowfs_delete(&fs, old_file, fs.root_dnode) == CROWFS_OK);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert((fs.superblock.bitmap_summary[0] & 1) == 1);
+    assert(crowfs_open_absolute(&fs, "/again", &new_file, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(new_file < CROWFS_BITSET_COVERED_BLOCKS);
+    return 0;
+}
+
+int test_transaction() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent;
+    counting_fs_init(&fs, 16 * 1024 * 1024);
+    struct MemoryDevice *device = fs.ctx;
+    assert(crowfs_txn_commit(&fs) == CROWFS_ERR_ARGUMENT);
+    // Nothing is written until the outermost commit, but the operations see their own writes
+    counting_reset(&fs);
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/folder", &fd, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    for (int i = 0; i < 50; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/folder/file%d", i);
+        assert(crowfs_open_absolute(&fs, path, &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    }
+    assert(crowfs_open_absolute(&fs, "/folder/file49", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_txn_commit(&fs) == CROWFS_OK);
+    assert(device->block_writes == 0);
+    assert(crowfs_txn_commit(&fs) == CROWFS_OK);
+    assert(fs.transaction == NULL);
+    // Each modified block is written once: the root, the bitmap, the folder and 50 dnodes
+    assert(device->block_writes == 53);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/folder/file49", &fd, &fd_parent, 0) == CROWFS_OK);
+    // File data is not kept by the transaction
+    const size_t size = 1500 * CROWFS_BLOCK_SIZE;
+    char *data = malloc(size), *read_buffer = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char) (i * 7 + i / CROWFS_BLOCK_SIZE);
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/large", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    counting_reset(&fs);
+    assert(crowfs_write(&fs, fd, data, size, 0) == CROWFS_OK);
+    assert(device->block_writes > 0);
+    assert(crowfs_read(&fs, fd, read_buffer, size, 0) == size);
+    assert(memcmp(data, read_buffer, size) == 0);
+    assert(crowfs_txn_commit(&fs) == CROWFS_OK);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/large", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, fd, read_buffer, size, 0) == size);
+    assert(memcmp(data, read_buffer, size) == 0);
+    // If the early write fails, the operation which fills the transaction fails too
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    fs.write_block = failing_write_block;
+    int result = CROWFS_OK, created = 0;
+    for (; created < 1200 && result == CROWFS_OK; created++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/many%d", created / 600);
+        if (created % 600 == 0)
+            result = crowfs_open_absolute(&fs, path, &fd, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR);
+        snprintf(path, sizeof(path), "/many%d/file%d", created / 600, created % 600);
+        if (result == CROWFS_OK)
+            result = crowfs_open_absolute(&fs, path, &fd, &fd_parent, CROWFS_O_CREATE);
+    }
+    assert(result == CROWFS_ERR_IO);
+    assert(created < 1200);
+    assert(crowfs_txn_commit(&fs) == CROWFS_ERR_IO);
+    fs.write_block = counting_write_block;
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/many0", &fd, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    free(data);
+    free(read_buffer);
+    return 0;
+}
+
+// Upper bounds of block I/O of common operations. If a change makes an operation
+// do more I/O than this, it is a performance regression and the bound should only
+// be raised on purpose.
+#define IO_OPEN_PATH_READS 7
+#define IO_OPEN_PATH_WRITES 0
+#define IO_APPEND_READS 3
+#define IO_APPEND_WRITES 3
+#define IO_DELETE_LARGE_READS 6
+#define IO_DELETE_LARGE_WRITES 4
+#define IO_LIST_FOLDER_READS 1915
+#define IO_TXN_CREATE_WRITES 102
+
+/**
+ * Counts the records which are appended to the journal since its last checkpoint
+ * @param largest Set to the number of blocks of the largest record
+ */
+static uint32_t journal_records(struct CrowFS *fs, uint32_t *largest) {
+    const struct MemoryDevice *device = fs->ctx;
+    uint32_t records = 0, position = 1, sequence = 0;
+    *largest = 0;
+    while (position < fs->superblock.journal_blocks) {
+        const union CrowFSBlock *descriptor = (const union CrowFSBlock *) (device->buffer + (size_t) (
+                fs->superblock.journal_start + position) * CROWFS_BLOCK_SIZE);
+        if (memcmp(descriptor->journal_descriptor.magic, CROWFS_JOURNAL_DESCRIPTOR_MAGIC, 4) != 0 ||
+            (records > 0 && descriptor->journal_descriptor.sequence != sequence + 1))
+            break;
+        sequence = descriptor->journal_descriptor.sequence;
+        if (descriptor->journal_descriptor.count > *largest)
+            *largest = descriptor->journal_descriptor.count;
+        position += 1 + descriptor->journal_descriptor.count;
+        records++;
+    }
+    return records;
+}
+
+int test_journal() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent, folder;
+    mem_fs_init(&fs, 16 * 1024 * 1024);
+    fs.write_blocks = mem_write_blocks;
+    fs.read_blocks = mem_read_blocks;
+    struct MemoryDevice *device = fs.ctx;
+    assert(crowfs_format(&fs, CROWFS_FEATURE_JOURNAL) == CROWFS_OK);
+    assert(fs.superblock.journal_start == fs.root_dnode + 1);
+    assert(crowfs_free_blocks(&fs) == fs.superblock.blocks - fs.superblock.journal_start - CROWFS_JOURNAL_BLOCKS);
+    // The metadata is only in the journal until it is checkpointed
+    const union CrowFSBlock *root = (const union CrowFSBlock *) (device->buffer + fs.root_dnode * CROWFS_BLOCK_SIZE);
+    const size_t size = 20 * CROWFS_BLOCK_SIZE + 100;
+    char *data = malloc(size), *read_buffer = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char) (i * 13 + i / CROWFS_BLOCK_SIZE);
+    assert(crowfs_open_absolute(&fs, "/folder", &folder, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/folder/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, size, 0) == CROWFS_OK);
+    assert(root->folder.content_dnodes[0] == 0);
+    assert(crowfs_read(&fs, fd, read_buffer, size, 0) == size);
+    assert(memcmp(data, read_buffer, size) == 0);
+    // Mount again without crowfs_close like after a crash. The journal is replayed.
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(root->folder.content_dnodes[0] == folder);
+    assert(crowfs_open_absolute(&fs, "/folder/file", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, fd, read_buffer, size, 0) == size);
+    assert(memcmp(data, read_buffer, size) == 0);
+    // The journal is empty after the replay, so the next record is the first one. If it
+    // is not written completely, it is ignored.
+    assert(crowfs_open_absolute(&fs, "/torn", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    const union CrowFSBlock *descriptor =
+            (const union CrowFSBlock *) (device->buffer + (fs.superblock.journal_start + 1) * CROWFS_BLOCK_SIZE);
+    assert(memcmp(descriptor->journal_descriptor.magic, CROWFS_JOURNAL_DESCRIPTOR_MAGIC, 4) == 0);
+    device->buffer[(fs.superblock.journal_start + 1 + descriptor->journal_descriptor.count) * CROWFS_BLOCK_SIZE] ^= 1;
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/torn", &fd, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    assert(crowfs_open_absolute(&fs, "/folder/file", &fd, &fd_parent, 0) == CROWFS_OK);
+    // A full journal is checkpointed before the next record
+    for (int i = 0; i < 400; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/folder/file%d", i);
+        assert(crowfs_open_absolute(&fs, path, &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    }
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    for (int i = 0; i < 400; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/folder/file%d", i);
+        assert(crowfs_open_absolute(&fs, path, &fd, &fd_parent, 0) == CROWFS_OK);
+    }
+    // Closing checkpoints the journal, so the disk is up to date without it
+    assert(crowfs_open_absolute(&fs, "/last", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    crowfs_close(&fs);
+    assert(fs.journal == NULL);
+    assert(root->folder.content_dnodes[1] == fd);
+    // Blocks which are freed by a transaction are not overwritten in place before it
+    // is committed, so a crash brings back the deleted file with its data
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/folder/file", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/folder/new", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    memset(read_buffer, 0x55, size);
+    assert(crowfs_write(&fs, fd, read_buffer, size, 0) == CROWFS_OK);
+    // Drop the transaction without committing it like after a crash
+    fs.transaction = NULL;
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/folder/new", &fd, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    assert(crowfs_open_absolute(&fs, "/folder/file", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, fd, read_buffer, size, 0) == size);
+    assert(memcmp(data, read_buffer, size) == 0);
+    // Without multi-block writes, file data still goes in place, so writing the largest
+    // file appends a single small record
+    fs.write_blocks = NULL;
+    fs.read_blocks = NULL;
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    char *large = malloc(CROWFS_MAX_FILESIZE), *large_read = malloc(CROWFS_MAX_FILESIZE);
+    for (size_t i = 0; i < CROWFS_MAX_FILESIZE; i++)
+        large[i] = (char) (i * 7 + i / CROWFS_BLOCK_SIZE);
+    uint32_t largest;
+    assert(crowfs_open_absolute(&fs, "/max", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, large, CROWFS_MAX_FILESIZE, 0) == CROWFS_OK);
+    assert(journal_records(&fs, &largest) == 2);
+    assert(largest < 16);
+    // A longer transaction appends what it has freed before the next operation, so
+    // the data which reuses those blocks is written in place too
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/max2", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    for (size_t i = 0; i < CROWFS_MAX_FILESIZE; i++)
+        large[i] = (char) (i * 11 + i / CROWFS_BLOCK_SIZE);
+    assert(crowfs_write(&fs, fd, large, CROWFS_MAX_FILESIZE, 0) == CROWFS_OK);
+    assert(crowfs_txn_commit(&fs) == CROWFS_OK);
+    assert(journal_records(&fs, &largest) == 4);
+    assert(largest < 16);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/max", &fd, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    assert(crowfs_open_absolute(&fs, "/max2", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, fd, large_read, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(large, large_read, CROWFS_MAX_FILESIZE) == 0);
+    free(large);
+    free(large_read);
+    free(data);
+    free(read_buffer);
+    return 0;
+}
+
+int test_sync() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent;
+    counting_fs_init(&fs, 16 * 1024 * 1024);
+    fs.flush = mem_flush;
+    struct MemoryDevice *device = fs.ctx;
+    const union CrowFSBlock *root = (const union CrowFSBlock *) (device->buffer + fs.root_dnode * CROWFS_BLOCK_SIZE);
+    // Nothing is dirty, so only the device is flushed
+    counting_reset(&fs);
+    assert(crowfs_sync(&fs) == CROWFS_OK);
+    assert(device->block_writes == 0 && device->flushes == 1);
+    // The kept blocks of a transaction are written once and then flushed
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(root->folder.content_dnodes[0] == 0);
+    assert(crowfs_fsync(&fs, fd) == CROWFS_OK);
+    assert(root->folder.content_dnodes[0] == fd);
+    assert(device->block_writes == 3 && device->flushes == 2);
+    assert(crowfs_txn_commit(&fs) == CROWFS_OK);
+    assert(device->block_writes == 3);
+    // Only files and folders can be synced
+    assert(crowfs_fsync(&fs, 0) == CROWFS_ERR_ARGUMENT);
+    assert(crowfs_fsync(&fs, UINT32_MAX) == CROWFS_ERR_ARGUMENT);
+    assert(crowfs_fsync(&fs, fs.root_dnode) == CROWFS_OK);
+    // A checkpoint flushes before it overwrites the blocks in place and before it retires
+    // the records, and closing flushes once more
+    assert(crowfs_format(&fs, CROWFS_FEATURE_JOURNAL) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    device->flushes = 0;
+    crowfs_close(&fs);
+    assert(device->flushes == 3);
+    return 0;
+}
+
+int test_discard() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent;
+    mem_fs_init(&fs, 16 * 1024 * 1024);
+    fs.discard = mem_discard;
+    struct MemoryDevice *device = fs.ctx;
+    char *data = malloc(CROWFS_MAX_FILESIZE), *read_back = malloc(100 * CROWFS_BLOCK_SIZE);
+    memset(data, 1, CROWFS_MAX_FILESIZE);
+    // Without the mount flag, nothing is discarded
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, 100 * CROWFS_BLOCK_SIZE, 0) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(device->discards == 0);
+    // The dnode and the data of a contiguous file are discarded with a single call
+    fs.mount_flags = CROWFS_MOUNT_DISCARD;
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, 100 * CROWFS_BLOCK_SIZE, 0) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(device->discards == 1 && device->discarded_blocks == 101);
+    // So are the indirect block and its data
+    uint32_t trimmed;
+    device->discards = 0;
+    device->discarded_blocks = 0;
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, CROWFS_MAX_FILESIZE, 0) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(device->discards == 1 && device->discarded_blocks == 1 + 1 + CROWFS_MAX_FILESIZE / CROWFS_BLOCK_SIZE);
+    // In a transaction, the blocks are discarded at the commit. The ones which are
+    // allocated again keep their new data.
+    assert(crowfs_open_absolute(&fs, "/old", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, 100 * CROWFS_BLOCK_SIZE, 0) == CROWFS_OK);
+    device->discards = 0;
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/new", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, 50 * CROWFS_BLOCK_SIZE, 0) == CROWFS_OK);
+    assert(device->discards == 0);
+    assert(crowfs_trim(&fs, &trimmed) == CROWFS_ERR_ARGUMENT);
+    assert(crowfs_txn_commit(&fs) == CROWFS_OK);
+    assert(device->discards == 1);
+    assert(crowfs_read(&fs, fd, read_back, 50 * CROWFS_BLOCK_SIZE, 0) == 50 * CROWFS_BLOCK_SIZE);
+    assert(memcmp(read_back, data, 50 * CROWFS_BLOCK_SIZE) == 0);
+    // A trim discards every free block
+    device->discarded_blocks = 0;
+    assert(crowfs_trim(&fs, &trimmed) == CROWFS_OK);
+    assert(trimmed == crowfs_free_blocks(&fs) && device->discarded_blocks == trimmed);
+    assert(crowfs_read(&fs, fd, read_back, 50 * CROWFS_BLOCK_SIZE, 0) == 50 * CROWFS_BLOCK_SIZE);
+    assert(memcmp(read_back, data, 50 * CROWFS_BLOCK_SIZE) == 0);
+    // With a journal, the blocks are discarded once the record is appended
+    assert(crowfs_format(&fs, CROWFS_FEATURE_JOURNAL) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, 100 * CROWFS_BLOCK_SIZE, 0) == CROWFS_OK);
+    device->discards = 0;
+    device->discarded_blocks = 0;
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(device->discards == 1 && device->discarded_blocks == 101);
+    crowfs_close(&fs);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    crowfs_close(&fs);
+    free(data);
+    free(read_back);
+    return 0;
+}
+
+int test_delete_recursive() {
+    struct CrowFS fs;
+    uint32_t folder, moved, fd, fd_parent;
+    counting_fs_init(&fs, 16 * 1024 * 1024);
+    struct MemoryDevice *device = fs.ctx;
+    char data[3 * CROWFS_BLOCK_SIZE] = {1};
+    const uint32_t free_blocks = crowfs_free_blocks(&fs);
+    assert(crowfs_open_absolute(&fs, "/tree", &folder, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    const uint32_t tree_parent = fd_parent;
+    // Files and folders a few levels deep. One folder is moved in, so its parent field is stale.
+    for (int i = 0; i < 100; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tree/%d", i % 5);
+        assert(crowfs_open_absolute(&fs, path, &fd, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK ||
+               i >= 5);
+        snprintf(path, sizeof(path), "/tree/%d/%d", i % 5, i);
+        assert(crowfs_open_absolute(&fs, path, &fd, &fd_parent, CROWFS_O_CREATE | (i % 10 == 0 ? CROWFS_O_DIR : 0))
+               == CROWFS_OK);
+        if (i % 10 != 0)
+            assert(crowfs_write(&fs, fd, data, sizeof(data), 0) == CROWFS_OK);
+    }
+    assert(crowfs_open_absolute(&fs, "/moved", &moved, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/moved/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, sizeof(data), 0) == CROWFS_OK);
+    assert(crowfs_move(&fs, moved, fs.root_dnode, folder, NULL) == CROWFS_OK);
+    // The root and dnodes which are not in the parent cannot be deleted
+    assert(crowfs_delete_recursive(&fs, fs.root_dnode, 0) == CROWFS_ERR_ARGUMENT);
+    assert(crowfs_delete_recursive(&fs, moved, fs.root_dnode) == CROWFS_ERR_ARGUMENT);
+    // The parent and the free bitmap are written once
+    counting_reset(&fs);
+    assert(crowfs_delete_recursive(&fs, folder, tree_parent) == CROWFS_OK);
+    fprintf(stderr, "delete a tree of 108 entries: %lu reads, %lu writes\n", device->block_reads, device->block_writes);
+    assert(device->block_writes == 2);
+    assert(crowfs_free_blocks(&fs) == free_blocks);
+    assert(crowfs_open_absolute(&fs, "/tree", &folder, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    struct CrowFSStat stat;
+    assert(crowfs_read_dir(&fs, fs.root_dnode, &stat, 0) == CROWFS_ERR_LIMIT);
+    // A file is deleted like crowfs_delete does
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, sizeof(data), 0) == CROWFS_OK);
+    assert(crowfs_delete_recursive(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == free_blocks);
+    return 0;
+}
+
+int test_copy() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent, folder, copy;
+    struct CrowFSFragmentation fragmentation;
+    mem_fs_init(&fs, 32 * 1024 * 1024);
+    fs.write_blocks = mem_write_blocks;
+    fs.read_blocks = mem_read_blocks;
+    struct MemoryDevice *device = fs.ctx;
+    char *data = malloc(CROWFS_MAX_FILESIZE), *read_back = malloc(CROWFS_MAX_FILESIZE);
+    for (size_t i = 0; i < CROWFS_MAX_FILESIZE; i++)
+        data[i] = (char) (i * 7 + i / CROWFS_BLOCK_SIZE);
+    // A fragmented source, so it is copied with several requests
+    uint32_t a, b;
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/b", &b, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    for (size_t offset = 0; offset < CROWFS_MAX_FILESIZE; offset += 64 * CROWFS_BLOCK_SIZE) {
+        const size_t size = MIN(64 * CROWFS_BLOCK_SIZE, CROWFS_MAX_FILESIZE - offset);
+        assert(crowfs_write(&fs, a, data + offset, size, offset) == CROWFS_OK);
+        assert(crowfs_write(&fs, b, data + offset, size, offset) == CROWFS_OK);
+    }
+    assert(crowfs_open_absolute(&fs, "/folder", &folder, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    // Without copy_blocks, the blocks are read and written. The copy is contiguous.
+    assert(crowfs_copy(&fs, a, folder, "copy", &copy) == CROWFS_OK);
+    assert(crowfs_fragmentation(&fs, copy, &fragmentation) == CROWFS_OK);
+    assert(fragmentation.blocks == CROWFS_MAX_FILESIZE / CROWFS_BLOCK_SIZE && fragmentation.extents == 1);
+    assert(crowfs_read(&fs, copy, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, data, CROWFS_MAX_FILESIZE) == 0);
+    assert(crowfs_open_absolute(&fs, "/folder/copy", &fd, &fd_parent, 0) == CROWFS_OK && fd == copy);
+    // With copy_blocks, each consecutive part of the source is a single call
+    fs.copy_blocks = mem_copy_blocks;
+    assert(crowfs_copy(&fs, a, fs.root_dnode, "copy", &copy) == CROWFS_OK);
+    assert(crowfs_fragmentation(&fs, a, &fragmentation) == CROWFS_OK);
+    assert(fragmentation.extents > 1 && device->copies == fragmentation.extents);
+    assert(crowfs_read(&fs, copy, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, data, CROWFS_MAX_FILESIZE) == 0);
+    // Folders, taken names and paths cannot be copied to
+    assert(crowfs_copy(&fs, folder, fs.root_dnode, "folder2", &copy) == CROWFS_ERR_ARGUMENT);
+    assert(crowfs_copy(&fs, a, fs.root_dnode, "b", &copy) == CROWFS_ERR_ARGUMENT);
+    assert(crowfs_copy(&fs, a, fs.root_dnode, "folder/x", &copy) == CROWFS_ERR_ARGUMENT);
+    assert(crowfs_copy(&fs, a, fs.root_dnode, "", &copy) == CROWFS_ERR_ARGUMENT);
+    // A copy which does not fit leaves nothing behind
+    const uint32_t free_blocks = crowfs_free_blocks(&fs);
+    assert(free_blocks < CROWFS_MAX_FILESIZE / CROWFS_BLOCK_SIZE);
+    assert(crowfs_copy(&fs, a, fs.root_dnode, "full", &copy) == CROWFS_ERR_FULL && copy == 0);
+    assert(crowfs_free_blocks(&fs) == free_blocks);
+    assert(crowfs_open_absolute(&fs, "/full", &fd, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    // An empty file
+    assert(crowfs_open_absolute(&fs, "/empty", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_copy(&fs, fd, fs.root_dnode, "empty2", &copy) == CROWFS_OK);
+    assert(crowfs_read(&fs, copy, read_back, 1, 0) == 0);
+    // With a journal
+    assert(crowfs_format(&fs, CROWFS_FEATURE_JOURNAL) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, data, 100 * CROWFS_BLOCK_SIZE, 0) == CROWFS_OK);
+    assert(crowfs_copy(&fs, a, fs.root_dnode, "copy", &copy) == CROWFS_OK);
+    crowfs_close(&fs);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/copy", &copy, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, copy, read_back, CROWFS_MAX_FILESIZE, 0) == 100 * CROWFS_BLOCK_SIZE);
+    assert(memcmp(read_back, data, 100 * CROWFS_BLOCK_SIZE) == 0);
+    free(data);
+    free(read_back);
+    return 0;
+}
+
+int test_clone() {
+    struct CrowFS fs;
+    uint32_t a, clone, fd, fd_parent;
+    const uint32_t blocks = CROWFS_MAX_FILESIZE / CROWFS_BLOCK_SIZE;
+    mem_fs_init(&fs, 12 * 1024 * 1024);
+    char *data = malloc(CROWFS_MAX_FILESIZE), *read_back = malloc(CROWFS_MAX_FILESIZE);
+    for (size_t i = 0; i < CROWFS_MAX_FILESIZE; i++)
+        data[i] = (char) (i * 7 + i / CROWFS_BLOCK_SIZE);
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_clone(&fs, a, fs.root_dnode, "clone", &clone) == CROWFS_ERR_NOT_SUPPORTED && clone == 0);
+    assert(crowfs_format(&fs, CROWFS_FEATURE_REFCOUNT) == CROWFS_OK);
+    const uint32_t empty_free_blocks = crowfs_free_blocks(&fs);
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, data, CROWFS_MAX_FILESIZE, 0) == CROWFS_OK);
+    // The clone only takes a dnode and an indirect block, even if the data does not fit twice
+    uint32_t free_blocks = crowfs_free_blocks(&fs);
+    assert(free_blocks < blocks);
+    assert(crowfs_clone(&fs, a, fs.root_dnode, "clone", &clone) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == free_blocks - 2);
+    assert(crowfs_read(&fs, clone, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, data, CROWFS_MAX_FILESIZE) == 0);
+    // Taken names and folders are rejected
+    assert(crowfs_clone(&fs, a, fs.root_dnode, "clone", &fd) == CROWFS_ERR_ARGUMENT && fd == 0);
+    assert(crowfs_clone(&fs, fs.root_dnode, fs.root_dnode, "root", &fd) == CROWFS_ERR_ARGUMENT && fd == 0);
+    // Writing to the clone copies the changed blocks: a partial direct block and a whole indirect one
+    free_blocks = crowfs_free_blocks(&fs);
+    const size_t partial = 5 * CROWFS_BLOCK_SIZE + 100, whole = (CROWFS_DIRECT_BLOCKS + 10) * CROWFS_BLOCK_SIZE;
+    assert(crowfs_write(&fs, clone, "changed", 7, partial) == CROWFS_OK);
+    assert(crowfs_write(&fs, clone, read_back + 3, CROWFS_BLOCK_SIZE, whole) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == free_blocks - 2);
+    assert(crowfs_read(&fs, a, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, data, CROWFS_MAX_FILESIZE) == 0);
+    memcpy(data + partial, "changed", 7);
+    memmove(data + whole, data + 3, CROWFS_BLOCK_SIZE);
+    assert(crowfs_read(&fs, clone, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, data, CROWFS_MAX_FILESIZE) == 0);
+    // Writing the same blocks again does not copy them anymore
+    assert(crowfs_write(&fs, clone, "again", 5, partial) == CROWFS_OK);
+    memcpy(data + partial, "again", 5);
+    assert(crowfs_free_blocks(&fs) == free_blocks - 2);
+    // Deleting the source only frees the blocks which the clone does not use
+    assert(crowfs_delete(&fs, a, fs.root_dnode) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == free_blocks + 2);
+    assert(crowfs_read(&fs, clone, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, data, CROWFS_MAX_FILESIZE) == 0);
+    // A clone of a clone survives a defrag and the deletion of the others
+    uint32_t second, cursor = 0;
+    assert(crowfs_clone(&fs, clone, fs.root_dnode, "second", &second) == CROWFS_OK);
+    assert(crowfs_defrag(&fs, clone, &cursor, blocks) >= 0);
+    assert(crowfs_delete(&fs, clone, fs.root_dnode) == CROWFS_OK);
+    assert(crowfs_read(&fs, second, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, data, CROWFS_MAX_FILESIZE) == 0);
+    assert(crowfs_delete(&fs, second, fs.root_dnode) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == empty_free_blocks);
+    // A clone whose dnode cannot be written leaves neither an entry nor references behind
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, data, CROWFS_MAX_FILESIZE, 0) == CROWFS_OK);
+    free_blocks = crowfs_free_blocks(&fs);
+    writable_file_dnode = a;
+    fs.write_block = failing_dnode_write_block;
+    assert(crowfs_clone(&fs, a, fs.root_dnode, "clone", &clone) == CROWFS_ERR_IO && clone == 0);
+    fs.write_block = mem_write_block;
+    assert(crowfs_free_blocks(&fs) == free_blocks);
+    assert(crowfs_open_absolute(&fs, "/clone", &clone, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    assert(crowfs_delete(&fs, a, fs.root_dnode) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == empty_free_blocks);
+    // A rewrite of a clone which runs out of space keeps the references of the blocks
+    // which the clone still points to, so writing the source does not change the clone
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, data, CROWFS_MAX_FILESIZE, 0) == CROWFS_OK);
+    assert(crowfs_clone(&fs, a, fs.root_dnode, "clone", &clone) == CROWFS_OK);
+    for (size_t i = 0; i < CROWFS_MAX_FILESIZE; i++)
+        read_back[i] = (char) ~data[i];
+    assert(crowfs_write(&fs, clone, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_ERR_FULL);
+    char *clone_data = malloc(CROWFS_MAX_FILESIZE);
+    assert(crowfs_read(&fs, clone, clone_data, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(crowfs_write(&fs, a, "source", 6, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, clone, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, clone_data, CROWFS_MAX_FILESIZE) == 0);
+    assert(crowfs_read(&fs, a, read_back, CROWFS_MAX_FILESIZE, 0) == CROWFS_MAX_FILESIZE);
+    assert(memcmp(read_back, "source", 6) == 0 && memcmp(read_back + 6, data + 6, CROWFS_MAX_FILESIZE - 6) == 0);
+    free(clone_data);
+    // With a journal, the refcounts are replayed like the other metadata
+    assert(crowfs_format(&fs, CROWFS_FEATURE_JOURNAL | CROWFS_FEATURE_REFCOUNT) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, data, 100 * CROWFS_BLOCK_SIZE, 0) == CROWFS_OK);
+    assert(crowfs_clone(&fs, a, fs.root_dnode, "clone", &clone) == CROWFS_OK);
+    crowfs_close(&fs);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_delete(&fs, a, fs.root_dnode) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/clone", &clone, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, clone, read_back, CROWFS_MAX_FILESIZE, 0) == 100 * CROWFS_BLOCK_SIZE);
+    assert(memcmp(read_back, data, 100 * CROWFS_BLOCK_SIZE) == 0);
+    free(data);
+    free(read_back);
+    return 0;
+}
+
+int test_snapshot() {
+    struct CrowFS fs, reader;
+    uint32_t dir, a, b, snapshot, fd, fd_parent;
+    struct CrowFSStat stat;
+    const size_t size = 100 * CROWFS_BLOCK_SIZE;
+    char *data = malloc(size), *read_back = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char) (i * 3 + i / CROWFS_BLOCK_SIZE);
+    mem_fs_init(&fs, 8 * 1024 * 1024);
+    assert(crowfs_snapshot_create(&fs, "monday", &snapshot) == CROWFS_ERR_NOT_SUPPORTED && snapshot == 0);
+    assert(crowfs_format(&fs, CROWFS_FEATURE_REFCOUNT) == CROWFS_OK);
+    const uint32_t empty_free_blocks = crowfs_free_blocks(&fs);
+    assert(crowfs_snapshot_list(&fs, &stat, 0) == CROWFS_ERR_LIMIT);
+    assert(crowfs_open_absolute(&fs, "/dir", &dir, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/dir/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, data, size, 0) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/b", &b, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, b, "hello", 5, 0) == CROWFS_OK);
+    // Only the snapshots folder and the dnodes are copied, the data is shared
+    uint32_t free_blocks = crowfs_free_blocks(&fs);
+    assert(crowfs_snapshot_create(&fs, "monday", &snapshot) == CROWFS_OK && snapshot != 0);
+    assert(crowfs_free_blocks(&fs) == free_blocks - 5);
+    // The writer keeps going and its writes copy the shared blocks
+    assert(crowfs_write(&fs, a, "changed", 7, 0) == CROWFS_OK);
+    assert(crowfs_delete(&fs, b, fs.root_dnode) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/c", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_open_relative(&fs, "dir/a", snapshot, &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, fd, read_back, size, 0) == size);
+    assert(memcmp(read_back, data, size) == 0);
+    assert(crowfs_open_relative(&fs, "b", snapshot, &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&fs, fd, read_back, size, 0) == 5 && memcmp(read_back, "hello", 5) == 0);
+    assert(crowfs_read(&fs, a, read_back, 7, 0) == 7 && memcmp(read_back, "changed", 7) == 0);
+    // Taken and invalid names are rejected
+    assert(crowfs_snapshot_create(&fs, "monday", &fd) == CROWFS_ERR_ARGUMENT && fd == 0);
+    assert(crowfs_snapshot_create(&fs, "a/b", &fd) == CROWFS_ERR_ARGUMENT && fd == 0);
+    assert(crowfs_snapshot_create(&fs, "tuesday", &fd) == CROWFS_OK);
+    assert(crowfs_snapshot_list(&fs, &stat, 0) == CROWFS_OK);
+    assert(strcmp(stat.name, "monday") == 0 && stat.dnode == snapshot && stat.type == CROWFS_ENTITY_FOLDER);
+    assert(crowfs_snapshot_list(&fs, &stat, 1) == CROWFS_OK && strcmp(stat.name, "tuesday") == 0);
+    assert(crowfs_snapshot_list(&fs, &stat, 2) == CROWFS_ERR_LIMIT);
+    // A failed snapshot gives back its blocks and references
+    free_blocks = crowfs_free_blocks(&fs);
+    writable_file_dnode = 0;
+    fs.write_block = failing_dnode_write_block;
+    assert(crowfs_snapshot_create(&fs, "failed", &fd) == CROWFS_ERR_IO && fd == 0);
+    fs.write_block = mem_write_block;
+    assert(crowfs_free_blocks(&fs) == free_blocks);
+    assert(crowfs_snapshot_list(&fs, &stat, 2) == CROWFS_ERR_LIMIT);
+    // Another mount of the same disk reads the frozen tree and cannot change it
+    reader = (struct CrowFS){
+        .allocate_mem_block = std_allocate_mem_block,
+        .free_mem_block = std_free_mem_block,
+        .write_block = mem_write_block,
+        .read_block = mem_read_block,
+        .total_blocks = mem_total_blocks,
+        .current_date = std_current_date,
+        .ctx = fs.ctx,
+    };
+    assert(crowfs_snapshot_mount(&reader, "sunday") == CROWFS_ERR_NOT_FOUND);
+    assert(crowfs_snapshot_mount(&reader, "monday") == CROWFS_OK);
+    assert(reader.root_dnode == snapshot);
+    assert(crowfs_open_absolute(&reader, "/dir/a", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&reader, fd, read_back, size, 0) == size);
+    assert(memcmp(read_back, data, size) == 0);
+    assert(crowfs_open_absolute(&reader, "/c", &fd_parent, &fd_parent, 0) == CROWFS_ERR_NOT_FOUND);
+    assert(crowfs_write(&reader, fd, "x", 1, 0) == CROWFS_ERR_READ_ONLY);
+    assert(crowfs_open_absolute(&reader, "/d", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_ERR_READ_ONLY);
+    assert(crowfs_snapshot_delete(&reader, "monday") == CROWFS_ERR_READ_ONLY);
+    crowfs_close(&reader);
+    // Deleting the snapshots and the live tree gives back everything but the snapshots folder
+    assert(crowfs_snapshot_delete(&fs, "monday") == CROWFS_OK);
+    assert(crowfs_snapshot_delete(&fs, "monday") == CROWFS_ERR_NOT_FOUND);
+    assert(crowfs_snapshot_delete(&fs, "tuesday") == CROWFS_OK);
+    assert(crowfs_snapshot_list(&fs, &stat, 0) == CROWFS_ERR_LIMIT);
+    assert(crowfs_delete_recursive(&fs, dir, fs.root_dnode) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/c", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    assert(crowfs_free_blocks(&fs) == empty_free_blocks - 1);
+    // With a journal, the snapshot is written in place, so it can be mounted while
+    // the newer changes of the writer are only in the journal
+    assert(crowfs_format(&fs, CROWFS_FEATURE_JOURNAL | CROWFS_FEATURE_REFCOUNT) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, data, size, 0) == CROWFS_OK);
+    assert(crowfs_snapshot_create(&fs, "backup", &snapshot) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, "changed", 7, 0) == CROWFS_OK);
+    assert(crowfs_snapshot_mount(&reader, "backup") == CROWFS_OK);
+    assert(crowfs_open_absolute(&reader, "/a", &fd, &fd_parent, 0) == CROWFS_OK);
+    assert(crowfs_read(&reader, fd, read_back, size, 0) == size);
+    assert(memcmp(read_back, data, size) == 0);
+    crowfs_close(&reader);
+    crowfs_close(&fs);
+    assert(crowfs_init(&fs) == CROWFS_OK);
+    assert(crowfs_snapshot_list(&fs, &stat, 0) == CROWFS_OK && strcmp(stat.name, "backup") == 0);
+    assert(crowfs_read(&fs, a, read_back, 7, 0) == 7 && memcmp(read_back, "changed", 7) == 0);
+    free(data);
+    free(read_back);
+    return 0;
+}
+
+int test_read_memory() {
+    struct CrowFS fs;
+    uint32_t a, clone, fd_parent;
+    char data[10 * CROWFS_BLOCK_SIZE] = {1, 2, 3}, read_back[sizeof(data)];
+    mem_fs_init(&fs, 4 * 1024 * 1024);
+    assert(crowfs_format(&fs, CROWFS_FEATURE_REFCOUNT) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/a", &a, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, a, data, sizeof(data), 0) == CROWFS_OK);
+    assert(crowfs_clone(&fs, a, fs.root_dnode, "clone", &clone) == CROWFS_OK);
+    // Reads of shared blocks free every memory block which they allocate
+    fs.allocate_mem_block = counting_allocate_mem_block;
+    fs.free_mem_block = counting_free_mem_block;
+    live_mem_blocks = 0;
+    for (int i = 0; i < 100; i++) {
+        assert(crowfs_read(&fs, clone, read_back, sizeof(read_back), 0) == sizeof(read_back));
+        assert(crowfs_read(&fs, a, read_back, sizeof(read_back), 0) == sizeof(read_back));
+    }
+    assert(live_mem_blocks == 0);
+    assert(memcmp(read_back, data, sizeof(data)) == 0);
+    return 0;
+}
+
+int test_io_open_path() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent;
+    counting_fs_init(&fs, 1024 * 1024);
+    struct MemoryDevice *device = fs.ctx;
+    assert(crowfs_open_absolute(&fs, "/a", &fd, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/a/b", &fd, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    assert(crowfs_open_absolute(&fs, "/a/b/c", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    counting_reset(&fs);
+    assert(crowfs_open_absolute(&fs, "/a/b/c", &fd, &fd_parent, 0) == CROWFS_OK);
+    fprintf(stderr, "open /a/b/c: %lu reads, %lu writes\n", device->block_reads, device->block_writes);
+    assert(device->block_reads <= IO_OPEN_PATH_READS);
+    assert(device->block_writes <= IO_OPEN_PATH_WRITES);
+    return 0;
+}
+
+int test_io_append() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent;
+    counting_fs_init(&fs, 1024 * 1024);
+    struct MemoryDevice *device = fs.ctx;
+    char data[CROWFS_BLOCK_SIZE] = {1};
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, sizeof(data), 0) == CROWFS_OK);
+    counting_reset(&fs);
+    assert(crowfs_write(&fs, fd, data, sizeof(data), sizeof(data)) == CROWFS_OK);
+    fprintf(stderr, "append 4 KiB: %lu reads, %lu writes\n", device->block_reads, device->block_writes);
+    assert(device->block_reads <= IO_APPEND_READS);
+    assert(device->block_writes <= IO_APPEND_WRITES);
+    return 0;
+}
+
+int test_io_delete_large() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent;
+    counting_fs_init(&fs, 16 * 1024 * 1024);
+    struct MemoryDevice *device = fs.ctx;
+    char *data = calloc(1, CROWFS_MAX_FILESIZE);
+    const uint32_t free_blocks = crowfs_free_blocks(&fs);
+    assert(crowfs_open_absolute(&fs, "/file", &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    assert(crowfs_write(&fs, fd, data, CROWFS_MAX_FILESIZE, 0) == CROWFS_OK);
+    counting_reset(&fs);
+    assert(crowfs_delete(&fs, fd, fd_parent) == CROWFS_OK);
+    fprintf(stderr, "delete 8 MB: %lu reads, %lu writes\n", device->block_reads, device->block_writes);
+    assert(device->block_reads <= IO_DELETE_LARGE_READS);
+    assert(device->block_writes <= IO_DELETE_LARGE_WRITES);
+    assert(crowfs_free_blocks(&fs) == free_blocks);
+    free(data);
+    return 0;
+}
+
+int test_io_list_folder() {
+    struct CrowFS fs;
+    uint32_t folder, fd, fd_parent;
+    counting_fs_init(&fs, 8 * 1024 * 1024);
+    struct MemoryDevice *device = fs.ctx;
+    assert(crowfs_open_absolute(&fs, "/folder", &folder, &fd_parent, CROWFS_O_CREATE | CROWFS_O_DIR) == CROWFS_OK);
+    for (int i = 0; i < CROWFS_MAX_DIR_CONTENTS; i++) {
+        char name[16];
+        sprintf(name, "%d", i);
+        assert(crowfs_open_relative(&fs, name, folder, &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    }
+    counting_reset(&fs);
+    uint32_t entries = 0;
+    for (uint32_t offset = 0;; offset++) {
+        struct CrowFSStat stat;
+        int result = crowfs_read_dir(&fs, folder, &stat, offset);
+        if (result == CROWFS_ERR_LIMIT)
+            break;
+        assert(result == CROWFS_OK);
+        entries++;
+    }
+    fprintf(stderr, "list 957 entries: %lu reads, %lu writes\n", device->block_reads, device->block_writes);
+    assert(entries == CROWFS_MAX_DIR_CONTENTS);
+    assert(device->block_reads <= IO_LIST_FOLDER_READS);
+    assert(device->block_writes == 0);
+    return 0;
+}
+
+int test_io_txn_create() {
+    struct CrowFS fs;
+    uint32_t fd, fd_parent;
+    counting_fs_init(&fs, 1024 * 1024);
+    struct MemoryDevice *device = fs.ctx;
+    counting_reset(&fs);
+    assert(crowfs_txn_begin(&fs) == CROWFS_OK);
+    for (int i = 0; i < 100; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/file%d", i);
+        assert(crowfs_open_absolute(&fs, path, &fd, &fd_parent, CROWFS_O_CREATE) == CROWFS_OK);
+    }
+    assert(crowfs_txn_commit(&fs) == CROWFS_OK);
+    fprintf(stderr, "create 100 files in a transaction: %lu reads, %lu writes\n", device->block_reads,
+            device->block_writes);
+    assert(device->block_writes <= IO_TXN_CREATE_WRITES);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     if (argc != 2) {
         puts("Enter the test number as argument");
@@ -812,6 +2070,52 @@ int main(int argc, char **argv) {
             return test_rename_move();
         case 16:
             return test_relative();
+        case 17:
+            return test_read_write_multi_block();
+        case 18:
+            return test_multiple_filesystems();
+        case 19:
+            return test_lazy_bitmap();
+        case 20:
+            return test_stats();
+        case 21:
+            return test_io_open_path();
+        case 22:
+            return test_io_append();
+        case 23:
+            return test_io_delete_large();
+        case 24:
+            return test_io_list_folder();
+        case 25:
+            return test_operation_hooks();
+        case 26:
+            return test_defrag();
+        case 27:
+            return test_allocation_locality();
+        case 28:
+            return test_extent_index();
+        case 29:
+            return test_bitmap_summary();
+        case 30:
+            return test_transaction();
+        case 31:
+            return test_io_txn_create();
+        case 32:
+            return test_journal();
+        case 33:
+            return test_sync();
+        case 34:
+            return test_discard();
+        case 35:
+            return test_delete_recursive();
+        case 36:
+            return test_copy();
+        case 37:
+            return test_clone();
+        case 38:
+            return test_snapshot();
+        case 39:
+            return test_read_memory();
         default:
             puts("invalid test number");
             return 1;
@@ -0,0 +1,594 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "crowfs.h"
+
+/**
+ * Number of 64-bit words in a free bitmap block
+ */
+#define BITMAP_WORDS (CROWFS_BLOCK_SIZE / sizeof(uint64_t))
+/**
+ * Index of the superblock on disk
+ */
+#define SUPERBLOCK_BLOCK 1
+
+/**
+ * A dnode which a worker must check
+ */
+struct CheckJob {
+    uint32_t dnode;
+    // The folder which contains this dnode
+    uint32_t parent;
+};
+
+/**
+ * State of a check which is shared between the workers
+ */
+struct Checker {
+    int fd;
+    bool repair;
+    struct CrowFSSuperblock superblock;
+    uint32_t free_bitmap_blocks, root_dnode;
+    // The first block after the metadata. The journal and the refcount area are metadata too.
+    uint32_t metadata_end;
+    // (CROWFS_FEATURE_REFCOUNT only) The first block of the refcount area
+    uint32_t refcount_start;
+    // (CROWFS_FEATURE_REFCOUNT only) Number of files which point to each block, otherwise NULL
+    uint16_t *references;
+    /**
+     * Bit i is set if block i is reachable from the root folder. The metadata at
+     * the start of the disk and the bits after the end of the disk are set too,
+     * so this is the expected free bitmap with all of its bits inverted.
+     */
+    uint64_t *reachable;
+    // Dnodes which are not checked yet
+    struct {
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+        struct CheckJob *jobs;
+        size_t count, capacity;
+        // Number of jobs which are queued or running
+        size_t pending;
+    } queue;
+    // The next free bitmap block which is compared
+    uint32_t next_bitmap_block;
+    // The highest lazy bitmap block which must be written by the repair. -1 if none.
+    int64_t last_dirty_lazy_block;
+    // Serializes the reports
+    pthread_mutex_t report_lock;
+    // Results of the check
+    uint64_t folders, files, data_blocks, errors;
+    // Blocks which are not free in the bitmap but are not reachable
+    uint64_t leaked_blocks;
+    // Blocks which are free in the bitmap but are reachable
+    uint64_t unmarked_blocks;
+    // Bitmap blocks with free blocks which the bitmap summary marks as full
+    uint64_t hidden_bitmap_blocks;
+    uint64_t repaired_bitmap_blocks;
+    // Blocks whose refcount is not the number of files which share them minus one
+    uint64_t wrong_refcounts;
+    uint64_t repaired_refcount_blocks;
+};
+
+/**
+ * Reports a problem which was found in the filesystem
+ */
+__attribute__((format(printf, 2, 3)))
+static void check_error(struct Checker *checker, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    pthread_mutex_lock(&checker->report_lock);
+    checker->errors++;
+    vprintf(format, args);
+    putchar('\n');
+    pthread_mutex_unlock(&checker->report_lock);
+    va_end(args);
+}
+
+static int read_block(const struct Checker *checker, uint32_t block_index, union CrowFSBlock *block) {
+    ssize_t n = pread(checker->fd, block, sizeof(*block), (off_t) CROWFS_BLOCK_SIZE * block_index);
+    return n != sizeof(*block);
+}
+
+static int write_block(const struct Checker *checker, uint32_t block_index, const union CrowFSBlock *block) {
+    ssize_t n = pwrite(checker->fd, block, sizeof(*block), (off_t) CROWFS_BLOCK_SIZE * block_index);
+    return n != sizeof(*block);
+}
+
+/**
+ * Checks if a block can hold data or dnodes
+ */
+static bool is_data_block(const struct Checker *checker, uint32_t block_index) {
+    return block_index >= checker->metadata_end && block_index < checker->superblock.blocks;
+}
+
+static void reachable_set(uint64_t *reachable, uint64_t block_index) {
+    reachable[block_index / 64] |= UINT64_C(1) << (block_index % 64);
+}
+
+/**
+ * Marks a block as reachable
+ * @return true if the block was not reachable before. Otherwise, it is referenced
+ * more than once and an error is reported.
+ */
+static bool mark_reachable(struct Checker *checker, uint32_t block_index, uint32_t owner) {
+    const uint64_t bit = UINT64_C(1) << (block_index % 64);
+    const uint64_t old = __atomic_fetch_or(&checker->reachable[block_index / 64], bit, __ATOMIC_RELAXED);
+    if (old & bit) {
+        check_error(checker, "block %u of dnode %u is referenced more than once", block_index, owner);
+        return false;
+    }
+    return true;
+}
+
+static void queue_push(struct Checker *checker, struct CheckJob job) {
+    pthread_mutex_lock(&checker->queue.lock);
+    if (checker->queue.count == checker->queue.capacity) {
+        checker->queue.capacity = checker->queue.capacity == 0 ? 1024 : checker->queue.capacity * 2;
+        checker->queue.jobs = realloc(checker->queue.jobs, checker->queue.capacity * sizeof(struct CheckJob));
+        if (checker->queue.jobs == NULL) {
+            puts("out of memory");
+            exit(1);
+        }
+    }
+    checker->queue.jobs[checker->queue.count++] = job;
+    checker->queue.pending++;
+    pthread_cond_signal(&checker->queue.changed);
+    pthread_mutex_unlock(&checker->queue.lock);
+}
+
+/**
+ * Takes a job from the queue. Waits while other workers might still add jobs.
+ * @return false if all dnodes are checked
+ */
+static bool queue_pop(struct Checker *checker, struct CheckJob *job) {
+    pthread_mutex_lock(&checker->queue.lock);
+    while (checker->queue.count == 0 && checker->queue.pending != 0)
+        pthread_cond_wait(&checker->queue.changed, &checker->queue.lock);
+    const bool found = checker->queue.count != 0;
+    if (found)
+        *job = checker->queue.jobs[--checker->queue.count];
+    pthread_mutex_unlock(&checker->queue.lock);
+    return found;
+}
+
+static void queue_done(struct Checker *checker) {
+    pthread_mutex_lock(&checker->queue.lock);
+    if (--checker->queue.pending == 0)
+        pthread_cond_broadcast(&checker->queue.changed);
+    pthread_mutex_unlock(&checker->queue.lock);
+}
+
+static void check_folder(struct Checker *checker, const struct CheckJob *job, const union CrowFSBlock *block) {
+    __atomic_fetch_add(&checker->folders, 1, __ATOMIC_RELAXED);
+    // The root folders of the snapshots are their own parents like the root folder
+    const uint32_t parent = job->parent == checker->superblock.snapshots ? job->dnode : job->parent;
+    if (job->dnode != checker->root_dnode && block->folder.parent != parent)
+        check_error(checker, "folder %u has %u as parent instead of %u", job->dnode, block->folder.parent, parent);
+    for (int i = 0; i < CROWFS_MAX_DIR_CONTENTS && block->folder.content_dnodes[i] != 0; i++) {
+        const uint32_t child = block->folder.content_dnodes[i];
+        if (!is_data_block(checker, child)) {
+            check_error(checker, "folder %u contains the invalid dnode %u", job->dnode, child);
+            continue;
+        }
+        if (mark_reachable(checker, child, job->dnode))
+            queue_push(checker, (struct CheckJob){.dnode = child, .parent = job->dnode});
+    }
+}
+
+/**
+ * Marks the data blocks of a list which is terminated by zero. With refcounts,
+ * the files which point to each block are counted instead of reporting them.
+ * @return Number of blocks in the list
+ */
+static uint32_t check_block_list(struct Checker *checker, uint32_t dnode, const uint32_t *list, size_t length) {
+    uint32_t count = 0;
+    for (; count < length && list[count] != 0; count++) {
+        if (!is_data_block(checker, list[count]))
+            check_error(checker, "file %u points to the invalid block %u", dnode, list[count]);
+        else if (checker->references == NULL ||
+                 __atomic_fetch_add(&checker->references[list[count]], 1, __ATOMIC_RELAXED) == 0)
+            mark_reachable(checker, list[count], dnode);
+    }
+    return count;
+}
+
+static void check_file(struct Checker *checker, const struct CheckJob *job, const union CrowFSBlock *block) {
+    __atomic_fetch_add(&checker->files, 1, __ATOMIC_RELAXED);
+    if (block->file.size > CROWFS_MAX_FILESIZE)
+        check_error(checker, "file %u has the invalid size %u", job->dnode, block->file.size);
+    const uint64_t needed = ((uint64_t) block->file.size + CROWFS_BLOCK_SIZE - 1) / CROWFS_BLOCK_SIZE;
+    uint64_t count = check_block_list(checker, job->dnode, block->file.direct_blocks, CROWFS_DIRECT_BLOCKS);
+    const uint32_t indirect = block->file.indirect_block;
+    if (indirect != 0) {
+        union CrowFSBlock indirect_block;
+        if (!is_data_block(checker, indirect)) {
+            check_error(checker, "file %u points to the invalid indirect block %u", job->dnode, indirect);
+        } else if (mark_reachable(checker, indirect, job->dnode)) {
+            if (read_block(checker, indirect, &indirect_block) != 0)
+                check_error(checker, "cannot read the indirect block %u of file %u", indirect, job->dnode);
+            else
+                count += check_block_list(checker, job->dnode, indirect_block.indirect_block,
+                                          CROWFS_INDIRECT_BLOCK_COUNT);
+        }
+    }
+    __atomic_fetch_add(&checker->data_blocks, count, __ATOMIC_RELAXED);
+    if (count < needed)
+        check_error(checker, "file %u has %llu blocks but its size needs %llu", job->dnode,
+                    (unsigned long long) count, (unsigned long long) needed);
+}
+
+static void *tree_worker(void *arg) {
+    struct Checker *checker = arg;
+    struct CheckJob job;
+    union CrowFSBlock block;
+    while (queue_pop(checker, &job)) {
+        if (read_block(checker, job.dnode, &block) != 0) {
+            check_error(checker, "cannot read dnode %u", job.dnode);
+        } else if (block.header.type == CROWFS_ENTITY_FOLDER) {
+            check_folder(checker, &job, &block);
+        } else if (block.header.type == CROWFS_ENTITY_FILE) {
+            if (job.dnode == checker->root_dnode)
+                check_error(checker, "the root folder is a file");
+            else
+                check_file(checker, &job, &block);
+        } else {
+            check_error(checker, "dnode %u in folder %u has the unknown type %u", job.dnode, job.parent,
+                        block.header.type);
+        }
+        queue_done(checker);
+    }
+    return NULL;
+}
+
+/**
+ * Checks if a free bitmap block is not written on disk yet
+ */
+static bool bitmap_is_lazy(const struct Checker *checker, uint32_t bitmap_block) {
+    return (checker->superblock.features & CROWFS_FEATURE_LAZY_BITMAP) &&
+           bitmap_block >= checker->superblock.bitmap_initialized_blocks;
+}
+
+/**
+ * Checks if the persisted bitmap summary marks a free bitmap block as full
+ */
+static bool summary_marks_full(const struct Checker *checker, uint32_t bitmap_block) {
+    return (checker->superblock.features & CROWFS_FEATURE_BITMAP_SUMMARY) &&
+           bitmap_block < CROWFS_BITMAP_SUMMARY_BYTES * 8 &&
+           ((checker->superblock.bitmap_summary[bitmap_block / 8] >> (bitmap_block % 8)) & 1) == 0;
+}
+
+/**
+ * Fills a free bitmap block from the reachable blocks
+ */
+static void bitmap_from_reachable(const struct Checker *checker, uint32_t bitmap_block, union CrowFSBlock *block) {
+    uint64_t words[BITMAP_WORDS];
+    for (size_t i = 0; i < BITMAP_WORDS; i++)
+        words[i] = ~checker->reachable[bitmap_block * BITMAP_WORDS + i];
+    memcpy(block->bitmap.bitmap, words, sizeof(words));
+}
+
+/**
+ * Compares the free bitmap blocks with the reachable blocks, a word at a time.
+ * Lazy bitmap blocks are all free except the metadata.
+ */
+static void *bitmap_worker(void *arg) {
+    struct Checker *checker = arg;
+    union CrowFSBlock block;
+    uint32_t bitmap_block;
+    while ((bitmap_block = __atomic_fetch_add(&checker->next_bitmap_block, 1, __ATOMIC_RELAXED)) <
+           checker->free_bitmap_blocks) {
+        const bool lazy = bitmap_is_lazy(checker, bitmap_block);
+        uint64_t words[BITMAP_WORDS];
+        if (lazy) {
+            // Same as a new bitmap: everything is free except the metadata and after the end of the disk
+            const uint64_t first_block = (uint64_t) bitmap_block * CROWFS_BITSET_COVERED_BLOCKS;
+            for (size_t i = 0; i < BITMAP_WORDS; i++)
+                words[i] = UINT64_MAX;
+            for (uint64_t b = first_block; b < first_block + CROWFS_BITSET_COVERED_BLOCKS; b++)
+                if (b < checker->metadata_end || b >= checker->superblock.blocks)
+                    words[(b - first_block) / 64] &= ~(UINT64_C(1) << (b % 64));
+        } else if (read_block(checker, bitmap_block + SUPERBLOCK_BLOCK + 1, &block) != 0) {
+            check_error(checker, "cannot read the free bitmap block %u", bitmap_block);
+            continue;
+        } else {
+            memcpy(words, block.bitmap.bitmap, sizeof(words));
+        }
+        uint64_t leaked = 0, unmarked = 0, free_words = 0;
+        for (size_t i = 0; i < BITMAP_WORDS; i++) {
+            const uint64_t used = checker->reachable[bitmap_block * BITMAP_WORDS + i];
+            leaked += __builtin_popcountll(~words[i] & ~used);
+            unmarked += __builtin_popcountll(words[i] & used);
+            free_words |= words[i];
+        }
+        // The allocator would never look at these free blocks
+        if (free_words != 0 && summary_marks_full(checker, bitmap_block))
+            __atomic_fetch_add(&checker->hidden_bitmap_blocks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&checker->leaked_blocks, leaked, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&checker->unmarked_blocks, unmarked, __ATOMIC_RELAXED);
+        if (!checker->repair || leaked + unmarked == 0)
+            continue;
+        if (lazy) {
+            // Lazy blocks are written in order after all workers are done
+            pthread_mutex_lock(&checker->report_lock);
+            if (bitmap_block > checker->last_dirty_lazy_block)
+                checker->last_dirty_lazy_block = bitmap_block;
+            pthread_mutex_unlock(&checker->report_lock);
+            continue;
+        }
+        bitmap_from_reachable(checker, bitmap_block, &block);
+        if (write_block(checker, bitmap_block + SUPERBLOCK_BLOCK + 1, &block) != 0)
+            check_error(checker, "cannot write the free bitmap block %u", bitmap_block);
+        else
+            __atomic_fetch_add(&checker->repaired_bitmap_blocks, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/**
+ * Compares the refcount area with the number of files which point to each block.
+ * Blocks of the refcount area which differ are rewritten by the repair.
+ * @return 0 if ok, 1 on I/O error
+ */
+static int check_refcounts(struct Checker *checker) {
+    union CrowFSBlock block;
+    const uint32_t refcount_blocks = checker->metadata_end - checker->refcount_start;
+    for (uint32_t i = 0; i < refcount_blocks; i++) {
+        if (read_block(checker, checker->refcount_start + i, &block) != 0)
+            return 1;
+        uint64_t wrong = 0;
+        for (uint32_t j = 0; j < CROWFS_REFCOUNTS_PER_BLOCK; j++) {
+            const uint64_t b = (uint64_t) i * CROWFS_REFCOUNTS_PER_BLOCK + j;
+            const uint16_t expected = b < checker->superblock.blocks && checker->references[b] != 0
+                                      ? checker->references[b] - 1 : 0;
+            if (block.refcounts[j] != expected) {
+                block.refcounts[j] = expected;
+                wrong++;
+            }
+        }
+        checker->wrong_refcounts += wrong;
+        if (!checker->repair || wrong == 0)
+            continue;
+        if (write_block(checker, checker->refcount_start + i, &block) != 0)
+            return 1;
+        checker->repaired_refcount_blocks++;
+    }
+    return 0;
+}
+
+/**
+ * Runs a function on a number of threads and waits for all of them
+ * @return 0 if ok, 1 if no thread can be created
+ */
+static int run_workers(int threads, void *(*worker)(void *), struct Checker *checker) {
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    if (workers != NULL)
+        for (; started < threads; started++)
+            if (pthread_create(&workers[started], NULL, worker, checker) != 0)
+                break;
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    return started == 0;
+}
+
+/**
+ * Writes the lazy bitmap blocks up to the last one which needs a repair and
+ * updates the superblock. The blocks before it are written too, because only
+ * a prefix of the bitmap can be initialized.
+ * @return 0 if ok, 1 on I/O error
+ */
+static int repair_lazy_bitmap(struct Checker *checker) {
+    union CrowFSBlock block;
+    const uint32_t first = checker->superblock.bitmap_initialized_blocks;
+    for (uint32_t i = first; i <= checker->last_dirty_lazy_block; i++) {
+        bitmap_from_reachable(checker, i, &block);
+        if (write_block(checker, i + SUPERBLOCK_BLOCK + 1, &block) != 0)
+            return 1;
+        checker->repaired_bitmap_blocks++;
+    }
+    if (read_block(checker, SUPERBLOCK_BLOCK, &block) != 0)
+        return 1;
+    block.superblock.bitmap_initialized_blocks = checker->last_dirty_lazy_block + 1;
+    return write_block(checker, SUPERBLOCK_BLOCK, &block);
+}
+
+/**
+ * Rewrites the bitmap summary of the superblock from the reachable blocks if it differs
+ * @return 0 if ok, 1 on I/O error
+ */
+static int repair_bitmap_summary(struct Checker *checker) {
+    union CrowFSBlock block;
+    if (read_block(checker, SUPERBLOCK_BLOCK, &block) != 0)
+        return 1;
+    bool changed = false;
+    for (uint32_t bitmap_block = 0;
+         bitmap_block < checker->free_bitmap_blocks && bitmap_block < CROWFS_BITMAP_SUMMARY_BYTES * 8; bitmap_block++) {
+        bool has_free = false;
+        for (size_t i = 0; i < BITMAP_WORDS && !has_free; i++)
+            has_free = ~checker->reachable[bitmap_block * BITMAP_WORDS + i] != 0;
+        uint8_t *byte = &block.superblock.bitmap_summary[bitmap_block / 8];
+        const uint8_t bit = 1 << (bitmap_block % 8);
+        if (((*byte & bit) != 0) != has_free) {
+            *byte ^= bit;
+            changed = true;
+        }
+    }
+    return changed ? write_block(checker, SUPERBLOCK_BLOCK, &block) : 0;
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_usage(void) {
+    puts("Usage: CrowFSCheck [--threads <count>] [--repair] <image>");
+}
+
+int main(int argc, char *argv[]) {
+    struct Checker checker = {
+        .queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER},
+        .report_lock = PTHREAD_MUTEX_INITIALIZER,
+        .last_dirty_lazy_block = -1,
+    };
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    const char *image = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--repair") == 0) {
+            checker.repair = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = (int) strtol(argv[++i], NULL, 10);
+        } else if (image == NULL && strncmp(argv[i], "--", 2) != 0) {
+            image = argv[i];
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (image == NULL) {
+        print_usage();
+        return 1;
+    }
+    if (threads < 1)
+        threads = 1;
+    checker.fd = open(image, checker.repair ? O_RDWR : O_RDONLY);
+    if (checker.fd == -1) {
+        perror("cannot open the image");
+        return 1;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Read the superblock
+    union CrowFSBlock block;
+    if (read_block(&checker, SUPERBLOCK_BLOCK, &block) != 0 ||
+        memcmp(block.superblock.magic, CROWFS_MAGIC, sizeof(block.superblock.magic)) != 0 ||
+        (block.superblock.features & ~CROWFS_FEATURES_SUPPORTED) != 0) {
+        puts("the image does not contain a supported CrowFS filesystem");
+        close(checker.fd);
+        return 1;
+    }
+    checker.superblock = block.superblock;
+    checker.free_bitmap_blocks =
+            (checker.superblock.blocks + CROWFS_BITSET_COVERED_BLOCKS - 1) / CROWFS_BITSET_COVERED_BLOCKS;
+    checker.root_dnode = SUPERBLOCK_BLOCK + 1 + checker.free_bitmap_blocks;
+    if (checker.superblock.blocks <= checker.root_dnode) {
+        puts("the superblock has an invalid number of blocks");
+        close(checker.fd);
+        return 1;
+    }
+    checker.metadata_end = checker.root_dnode + 1;
+    if (checker.superblock.features & CROWFS_FEATURE_JOURNAL) {
+        if (checker.superblock.journal_start != checker.root_dnode + 1 ||
+            checker.superblock.journal_blocks > CROWFS_JOURNAL_BLOCKS ||
+            (uint64_t) checker.superblock.journal_start + checker.superblock.journal_blocks > checker.superblock.blocks) {
+            puts("the superblock has an invalid journal");
+            close(checker.fd);
+            return 1;
+        }
+        checker.metadata_end += checker.superblock.journal_blocks;
+        // The blocks in place are older than the journal until it is replayed
+        union CrowFSBlock descriptor;
+        if (read_block(&checker, checker.superblock.journal_start, &block) != 0 ||
+            read_block(&checker, checker.superblock.journal_start + 1, &descriptor) != 0) {
+            puts("cannot read the journal");
+            close(checker.fd);
+            return 1;
+        }
+        if (memcmp(descriptor.journal_descriptor.magic, CROWFS_JOURNAL_DESCRIPTOR_MAGIC,
+                   sizeof(descriptor.journal_descriptor.magic)) == 0 &&
+            descriptor.journal_descriptor.sequence == block.journal_header.sequence) {
+            puts("the journal has records which are not replayed, mount the image to replay them");
+            close(checker.fd);
+            return 1;
+        }
+    }
+    if (checker.superblock.features & CROWFS_FEATURE_REFCOUNT) {
+        // The refcount area is right after the journal
+        checker.refcount_start = checker.metadata_end;
+        checker.metadata_end += (checker.superblock.blocks + CROWFS_REFCOUNTS_PER_BLOCK - 1) /
+                                CROWFS_REFCOUNTS_PER_BLOCK;
+        if (checker.metadata_end >= checker.superblock.blocks) {
+            puts("the superblock has an invalid number of blocks");
+            close(checker.fd);
+            return 1;
+        }
+        checker.references = calloc(checker.superblock.blocks, sizeof(uint16_t));
+        if (checker.references == NULL) {
+            puts("out of memory");
+            close(checker.fd);
+            return 1;
+        }
+    }
+    const size_t reachable_words = (size_t) checker.free_bitmap_blocks * BITMAP_WORDS;
+    checker.reachable = calloc(reachable_words, sizeof(uint64_t));
+    if (checker.reachable == NULL) {
+        puts("out of memory");
+        free(checker.references);
+        close(checker.fd);
+        return 1;
+    }
+    // The metadata and the blocks after the end of the disk are never free
+    for (uint64_t i = 0; i < checker.metadata_end; i++)
+        reachable_set(checker.reachable, i);
+    for (uint64_t i = checker.superblock.blocks; i < reachable_words * 64; i++)
+        reachable_set(checker.reachable, i);
+    // Walk the tree and then compare the bitmap
+    queue_push(&checker, (struct CheckJob){.dnode = checker.root_dnode, .parent = checker.root_dnode});
+    // The snapshots folder is not in the root folder and is its own parent
+    const uint32_t snapshots = checker.superblock.snapshots;
+    if ((checker.superblock.features & CROWFS_FEATURE_REFCOUNT) && snapshots != 0) {
+        if (!is_data_block(&checker, snapshots))
+            check_error(&checker, "the superblock points to the invalid snapshots folder %u", snapshots);
+        else if (mark_reachable(&checker, snapshots, SUPERBLOCK_BLOCK))
+            queue_push(&checker, (struct CheckJob){.dnode = snapshots, .parent = snapshots});
+    }
+    int exit_code = 0;
+    if (run_workers(threads, tree_worker, &checker) != 0 || run_workers(threads, bitmap_worker, &checker) != 0) {
+        puts("cannot start the workers");
+        exit_code = 1;
+        goto end;
+    }
+    if (checker.references != NULL && check_refcounts(&checker) != 0)
+        check_error(&checker, "cannot read or write the refcount area");
+    if (checker.last_dirty_lazy_block >= 0 && repair_lazy_bitmap(&checker) != 0)
+        check_error(&checker, "cannot write the lazy free bitmap blocks");
+    if (checker.repair && (checker.superblock.features & CROWFS_FEATURE_BITMAP_SUMMARY) &&
+        repair_bitmap_summary(&checker) != 0)
+        check_error(&checker, "cannot write the bitmap summary");
+    printf("checked %llu folders, %llu files and %llu data blocks in %.3f s with %d threads\n",
+           (unsigned long long) checker.folders, (unsigned long long) checker.files,
+           (unsigned long long) checker.data_blocks, elapsed_seconds(&start), threads);
+    printf("%llu blocks are used in the bitmap but are not reachable\n", (unsigned long long) checker.leaked_blocks);
+    printf("%llu blocks are reachable but are free in the bitmap\n", (unsigned long long) checker.unmarked_blocks);
+    if (checker.superblock.features & CROWFS_FEATURE_BITMAP_SUMMARY)
+        printf("%llu bitmap blocks have free blocks but are full in the summary\n",
+               (unsigned long long) checker.hidden_bitmap_blocks);
+    if (checker.references != NULL)
+        printf("%llu blocks have a wrong refcount\n", (unsigned long long) checker.wrong_refcounts);
+    if (checker.repair)
+        printf("repaired %llu free bitmap blocks\n", (unsigned long long) checker.repaired_bitmap_blocks);
+    if (checker.repair && checker.references != NULL)
+        printf("repaired %llu refcount blocks\n", (unsigned long long) checker.repaired_refcount_blocks);
+    printf("%llu other errors\n", (unsigned long long) checker.errors);
+    // The bitmap and the refcounts are fixed by the repair but the other errors are not
+    if (checker.errors != 0 ||
+        (!checker.repair && checker.leaked_blocks + checker.unmarked_blocks + checker.hidden_bitmap_blocks +
+                            checker.wrong_refcounts != 0))
+        exit_code = 1;
+
+end:
+    free(checker.reachable);
+    free(checker.references);
+    free(checker.queue.jobs);
+    close(checker.fd);
+    return exit_code;
+}
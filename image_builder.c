@@ -0,0 +1,423 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "image_builder.h"
+
+/**
+ * Number of blocks which are written to the device in a single request
+ */
+#define BUILD_BATCH_BLOCKS 64
+/**
+ * The block of the superblock
+ */
+#define BUILD_SUPERBLOCK_BLOCK 1
+/**
+ * The first block of the bitmap
+ */
+#define BUILD_BITMAP_BLOCK 2
+
+/**
+ * A file or folder of the host which is going to be in the image
+ */
+struct BuildEntry {
+    // The path of this entry on host
+    char *host_path;
+    // One of CROWFS_ENTITY_*
+    uint8_t type;
+    // Size of the file
+    uint32_t size;
+    // The dnode of this entry in the image
+    uint32_t dnode;
+    // (Files only) The first block of the data of this file
+    uint32_t data_block;
+    // The index of the parent folder in the entries
+    size_t parent;
+    // (Folders only) The children of each folder are consecutive in the entries
+    size_t first_child, child_count;
+};
+
+/**
+ * The host tree in breadth first order. So the contents of each folder are
+ * consecutive and the root folder is the first entry.
+ */
+struct BuildTree {
+    struct BuildEntry *entries;
+    size_t count, capacity;
+    size_t files, folders;
+};
+
+/**
+ * Collects the blocks which are going to be written and writes them in batches.
+ * Blocks must be requested in ascending order without any gaps.
+ */
+struct BuildWriter {
+    struct CrowFS *fs;
+    union CrowFSBlock *blocks[BUILD_BATCH_BLOCKS];
+    // The index of blocks[0] on disk
+    uint32_t first_block;
+    // Number of blocks in the batch
+    uint32_t count;
+};
+
+static const char *entry_name(const struct BuildEntry *entry) {
+    const char *slash = strrchr(entry->host_path, '/');
+    return slash == NULL ? entry->host_path : slash + 1;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(entry_name(a), entry_name(b));
+}
+
+/**
+ * Number of blocks which a file uses for its data, including the indirect block
+ */
+static uint32_t file_blocks(uint32_t size) {
+    uint32_t data_blocks = (size + CROWFS_BLOCK_SIZE - 1) / CROWFS_BLOCK_SIZE;
+    return data_blocks + (data_blocks > CROWFS_DIRECT_BLOCKS ? 1 : 0);
+}
+
+static int build_tree_push(struct BuildTree *tree, char *host_path, uint8_t type, uint32_t size, size_t parent) {
+    if (tree->count == tree->capacity) {
+        size_t new_capacity = tree->capacity == 0 ? 64 : tree->capacity * 2;
+        struct BuildEntry *new_entries = realloc(tree->entries, new_capacity * sizeof(struct BuildEntry));
+        if (new_entries == NULL)
+            return 1;
+        tree->entries = new_entries;
+        tree->capacity = new_capacity;
+    }
+    tree->entries[tree->count++] = (struct BuildEntry) {
+        .host_path = host_path,
+        .type = type,
+        .size = size,
+        .parent = parent,
+    };
+    return 0;
+}
+
+static void build_tree_free(struct BuildTree *tree) {
+    for (size_t i = 0; i < tree->count; i++)
+        free(tree->entries[i].host_path);
+    free(tree->entries);
+}
+
+/**
+ * Scans the host folder in breadth first order
+ * @return 0 if ok, 1 on error. The error is written in out.
+ */
+static int build_tree_scan(struct BuildTree *tree, const char *host_folder, FILE *out) {
+    char *root_path = strdup(host_folder);
+    if (root_path == NULL || build_tree_push(tree, root_path, CROWFS_ENTITY_FOLDER, 0, 0) != 0) {
+        free(root_path);
+        fputs("out of memory\n", out);
+        return 1;
+    }
+    for (size_t i = 0; i < tree->count; i++) {
+        if (tree->entries[i].type != CROWFS_ENTITY_FOLDER)
+            continue;
+        if (i != 0) // root is not counted
+            tree->folders++;
+        DIR *dir = opendir(tree->entries[i].host_path);
+        if (dir == NULL) {
+            fprintf(out, "cannot open host folder %s: %s\n", tree->entries[i].host_path, strerror(errno));
+            return 1;
+        }
+        const size_t first_child = tree->count;
+        struct dirent *dir_entry;
+        while ((dir_entry = readdir(dir)) != NULL) {
+            if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0)
+                continue;
+            if (strlen(dir_entry->d_name) > CROWFS_MAX_FILENAME) {
+                fprintf(out, "name of %s/%s is too long\n", tree->entries[i].host_path, dir_entry->d_name);
+                closedir(dir);
+                return 1;
+            }
+            const size_t path_size = strlen(tree->entries[i].host_path) + strlen(dir_entry->d_name) + 2;
+            char *path = malloc(path_size);
+            if (path == NULL) {
+                fputs("out of memory\n", out);
+                closedir(dir);
+                return 1;
+            }
+            snprintf(path, path_size, "%s/%s", tree->entries[i].host_path, dir_entry->d_name);
+            struct stat host_stat;
+            if (lstat(path, &host_stat) == -1) {
+                fprintf(out, "cannot stat host file %s: %s\n", path, strerror(errno));
+                free(path);
+                closedir(dir);
+                return 1;
+            }
+            uint8_t type;
+            if (S_ISDIR(host_stat.st_mode)) {
+                type = CROWFS_ENTITY_FOLDER;
+            } else if (S_ISREG(host_stat.st_mode)) {
+                type = CROWFS_ENTITY_FILE;
+                if (host_stat.st_size > CROWFS_MAX_FILESIZE) {
+                    fprintf(out, "host file %s is too big\n", path);
+                    free(path);
+                    closedir(dir);
+                    return 1;
+                }
+                tree->files++;
+            } else {
+                fprintf(out, "skipping special file %s\n", path);
+                free(path);
+                continue;
+            }
+            if (build_tree_push(tree, path, type, type == CROWFS_ENTITY_FILE ? host_stat.st_size : 0, i) != 0) {
+                fputs("out of memory\n", out);
+                free(path);
+                closedir(dir);
+                return 1;
+            }
+        }
+        closedir(dir);
+        tree->entries[i].first_child = first_child;
+        tree->entries[i].child_count = tree->count - first_child;
+        if (tree->entries[i].child_count > CROWFS_MAX_DIR_CONTENTS) {
+            fprintf(out, "host folder %s has more than %d entries\n", tree->entries[i].host_path,
+                    CROWFS_MAX_DIR_CONTENTS);
+            return 1;
+        }
+        // Sort the contents to have reproducible images
+        qsort(tree->entries + first_child, tree->entries[i].child_count, sizeof(struct BuildEntry),
+              compare_entries);
+    }
+    return 0;
+}
+
+/**
+ * Assigns the dnodes and data blocks of the entries. The dnodes come right
+ * after the root folder in breadth first order and the data blocks come
+ * after all dnodes in the same order.
+ * @return The first block after the layout
+ */
+static uint64_t build_tree_layout(struct BuildTree *tree, uint32_t root_dnode) {
+    uint64_t next_block = root_dnode;
+    for (size_t i = 0; i < tree->count; i++)
+        tree->entries[i].dnode = next_block++;
+    for (size_t i = 0; i < tree->count; i++) {
+        if (tree->entries[i].type != CROWFS_ENTITY_FILE)
+            continue;
+        tree->entries[i].data_block = next_block;
+        next_block += file_blocks(tree->entries[i].size);
+    }
+    return next_block;
+}
+
+static int build_writer_flush(struct BuildWriter *writer) {
+    struct CrowFS *fs = writer->fs;
+    int result = 0;
+    if (writer->count == 0)
+        return 0;
+    if (fs->write_blocks != NULL) {
+        result = fs->write_blocks(fs->ctx, writer->first_block, writer->count, writer->blocks);
+    } else {
+        for (uint32_t i = 0; i < writer->count && result == 0; i++)
+            result = fs->write_block(fs->ctx, writer->first_block + i, writer->blocks[i]);
+    }
+    writer->first_block += writer->count;
+    writer->count = 0;
+    return result;
+}
+
+/**
+ * Gets the next block to write. The block is filled with zero.
+ * @return The block or NULL on error
+ */
+static union CrowFSBlock *build_writer_next(struct BuildWriter *writer) {
+    if (writer->count == BUILD_BATCH_BLOCKS && build_writer_flush(writer) != 0)
+        return NULL;
+    union CrowFSBlock **block = &writer->blocks[writer->count];
+    if (*block == NULL) {
+        *block = writer->fs->allocate_mem_block(writer->fs->ctx);
+        if (*block == NULL)
+            return NULL;
+    } else {
+        memset(*block, 0, sizeof(**block));
+    }
+    writer->count++;
+    return *block;
+}
+
+/**
+ * Marks a range of blocks as used in a bitmap block
+ * @param from The first bit to clear
+ * @param to One after the last bit to clear
+ */
+static void bitmap_clear_range(struct CrowFSBitmapBlock *bitmap, uint32_t from, uint32_t to) {
+    for (; from < to && from % 8 != 0; from++)
+        bitmap->bitmap[from / 8] &= ~(1 << (from % 8));
+    if (from + 8 <= to) {
+        memset(bitmap->bitmap + from / 8, 0, (to - from) / 8);
+        from += (to - from) / 8 * 8;
+    }
+    for (; from < to; from++)
+        bitmap->bitmap[from / 8] &= ~(1 << (from % 8));
+}
+
+/**
+ * Writes the data blocks of a file. The indirect block comes right after the
+ * last direct block, so reading the file is sequential.
+ * @return CROWFS_OK or the error. The error is written in out.
+ */
+static int build_write_file(struct BuildWriter *writer, const struct BuildEntry *entry, FILE *out) {
+    FILE *host_file = fopen(entry->host_path, "rb");
+    if (host_file == NULL) {
+        fprintf(out, "cannot open host file %s: %s\n", entry->host_path, strerror(errno));
+        return CROWFS_ERR_IO;
+    }
+    int result = CROWFS_OK;
+    const uint32_t data_blocks = (entry->size + CROWFS_BLOCK_SIZE - 1) / CROWFS_BLOCK_SIZE;
+    for (uint32_t i = 0; i < data_blocks; i++) {
+        if (i == CROWFS_DIRECT_BLOCKS) {
+            union CrowFSBlock *indirect = build_writer_next(writer);
+            if (indirect == NULL) {
+                result = CROWFS_ERR_IO;
+                break;
+            }
+            for (uint32_t j = 0; j < data_blocks - CROWFS_DIRECT_BLOCKS; j++)
+                indirect->indirect_block[j] = entry->data_block + CROWFS_DIRECT_BLOCKS + 1 + j;
+        }
+        union CrowFSBlock *block = build_writer_next(writer);
+        if (block == NULL) {
+            result = CROWFS_ERR_IO;
+            break;
+        }
+        const size_t expected = i == data_blocks - 1 ? entry->size - (size_t) i * CROWFS_BLOCK_SIZE
+                                                     : CROWFS_BLOCK_SIZE;
+        if (fread(block->raw_data, sizeof(char), expected, host_file) != expected) {
+            fprintf(out, "host file %s has changed while building\n", entry->host_path);
+            result = CROWFS_ERR_IO;
+            break;
+        }
+    }
+    fclose(host_file);
+    return result;
+}
+
+/**
+ * Writes the whole image in ascending order of the blocks
+ * @param superblock The superblock of the new image
+ * @param free_bitmap_blocks Number of free bitmap blocks of the new image
+ * @return CROWFS_OK or the error
+ */
+static int build_write(struct CrowFS *fs, const struct CrowFSSuperblock *superblock, uint32_t free_bitmap_blocks,
+                       const struct BuildTree *tree, uint32_t used_blocks, FILE *out) {
+    int result = CROWFS_OK;
+    const int64_t now = fs->current_date(fs->ctx);
+    struct BuildWriter writer = {
+        .fs = fs,
+        .first_block = BUILD_SUPERBLOCK_BLOCK,
+    };
+    union CrowFSBlock *block;
+#define NEXT_BLOCK() do { if ((block = build_writer_next(&writer)) == NULL) { result = CROWFS_ERR_IO; goto end; } } while (0)
+    // Superblock
+    NEXT_BLOCK();
+    block->superblock = *superblock;
+    // Bitmap. Everything before used_blocks and after the end of disk is used.
+    for (uint32_t i = 0; i < free_bitmap_blocks; i++) {
+        NEXT_BLOCK();
+        memset(block->bitmap.bitmap, 0xFF, sizeof(block->bitmap.bitmap));
+        const uint64_t first = (uint64_t) i * CROWFS_BITSET_COVERED_BLOCKS,
+                last = first + CROWFS_BITSET_COVERED_BLOCKS;
+        if (used_blocks > first)
+            bitmap_clear_range(&block->bitmap, 0, (used_blocks < last ? used_blocks : last) - first);
+        if (superblock->blocks < last)
+            bitmap_clear_range(&block->bitmap, superblock->blocks > first ? superblock->blocks - first : 0,
+                               CROWFS_BITSET_COVERED_BLOCKS);
+    }
+    // Dnodes
+    for (size_t i = 0; i < tree->count; i++) {
+        const struct BuildEntry *entry = &tree->entries[i];
+        NEXT_BLOCK();
+        block->header.type = entry->type;
+        block->header.creation_date = now;
+        if (i == 0)
+            strcpy(block->header.name, "/");
+        else
+            strcpy(block->header.name, entry_name(entry));
+        if (entry->type == CROWFS_ENTITY_FOLDER) {
+            // Like crowfs_new, the parent of root is itself
+            block->folder.parent = tree->entries[entry->parent].dnode;
+            for (size_t j = 0; j < entry->child_count; j++)
+                block->folder.content_dnodes[j] = tree->entries[entry->first_child + j].dnode;
+        } else {
+            const uint32_t data_blocks = (entry->size + CROWFS_BLOCK_SIZE - 1) / CROWFS_BLOCK_SIZE;
+            block->file.size = entry->size;
+            for (uint32_t j = 0; j < data_blocks && j < CROWFS_DIRECT_BLOCKS; j++)
+                block->file.direct_blocks[j] = entry->data_block + j;
+            if (data_blocks > CROWFS_DIRECT_BLOCKS)
+                block->file.indirect_block = entry->data_block + CROWFS_DIRECT_BLOCKS;
+        }
+    }
+    // Data
+    for (size_t i = 0; i < tree->count; i++)
+        if (tree->entries[i].type == CROWFS_ENTITY_FILE &&
+            (result = build_write_file(&writer, &tree->entries[i], out)) != CROWFS_OK)
+            goto end;
+    if (build_writer_flush(&writer) != 0)
+        result = CROWFS_ERR_IO;
+#undef NEXT_BLOCK
+
+end:
+    for (int i = 0; i < BUILD_BATCH_BLOCKS; i++)
+        if (writer.blocks[i] != NULL)
+            fs->free_mem_block(fs->ctx, writer.blocks[i]);
+    return result;
+}
+
+int image_build(const struct CommandContext *ctx, const char *host_folder) {
+    struct CrowFS *fs = ctx->fs;
+    struct BuildTree tree = {0};
+    int exit_code = 0;
+    // Compute the geometry exactly like crowfs_new. The mounted filesystem keeps
+    // its own until the new image is written.
+    struct CrowFSSuperblock superblock = {
+        .magic = {0},
+        .version = CROWFS_VERSION,
+        .blocks = fs->total_blocks(fs->ctx),
+    };
+    memcpy(superblock.magic, CROWFS_MAGIC, sizeof(superblock.magic));
+    const uint32_t free_bitmap_blocks =
+            (superblock.blocks + CROWFS_BITSET_COVERED_BLOCKS - 1) / CROWFS_BITSET_COVERED_BLOCKS;
+    const uint32_t root_dnode = BUILD_BITMAP_BLOCK + free_bitmap_blocks;
+    if (superblock.blocks <= 4 || superblock.blocks <= 3 + free_bitmap_blocks) {
+        fprintf(ctx->out, "cannot create the filesystem: error %d\n", CROWFS_ERR_TOO_SMALL);
+        return 1;
+    }
+    // Compute the layout in memory
+    if (build_tree_scan(&tree, host_folder, ctx->out) != 0) {
+        exit_code = 1;
+        goto end;
+    }
+    const uint64_t used_blocks = build_tree_layout(&tree, root_dnode);
+    if (used_blocks > superblock.blocks) {
+        fprintf(ctx->out, "cannot create the filesystem: %llu blocks are needed but the image has %u blocks\n",
+                (unsigned long long) used_blocks, superblock.blocks);
+        exit_code = 1;
+        goto end;
+    }
+    // Write everything in one pass
+    int result = build_write(fs, &superblock, free_bitmap_blocks, &tree, used_blocks, ctx->out);
+    if (result == CROWFS_OK) {
+        fs->superblock = superblock;
+        fs->free_bitmap_blocks = free_bitmap_blocks;
+        fs->root_dnode = root_dnode;
+        result = crowfs_init(fs);
+    }
+    if (result != CROWFS_OK) {
+        fprintf(ctx->out, "cannot create the filesystem: error %d\n", result);
+        exit_code = 1;
+        goto end;
+    }
+    fprintf(ctx->out, "File system created with %zu files and %zu folders using %llu of %u blocks\n",
+            tree.files, tree.folders, (unsigned long long) used_blocks, fs->superblock.blocks);
+
+end:
+    build_tree_free(&tree);
+    return exit_code;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "commands.h"
+
+/**
+ * Creates a new filesystem on ctx->fs which contains a copy of a host folder.
+ * Unlike crowfs_new followed by copying each file, the whole layout is computed
+ * in memory first and the image is written in a single sequential pass. The
+ * dnodes are grouped together after the root folder and the data of each file
+ * is contiguous. ctx->fs is initialized after a successful build.
+ * @param ctx The context of the command
+ * @param host_folder The host folder which becomes the root folder
+ * @return The exit code of the command. 0 if ok, 1 otherwise
+ */
+int image_build(const struct CommandContext *ctx, const char *host_folder);
@@ -0,0 +1,87 @@
+#include <string.h>
+#include <time.h>
+#include "latency_histogram.h"
+
+#define SUB_BUCKET_COUNT (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+#define SUB_BUCKET_HALF_COUNT (SUB_BUCKET_COUNT / 2)
+#define MAX_VALUE ((UINT64_C(1) << LATENCY_HISTOGRAM_MAX_MAGNITUDE) - 1)
+
+/**
+ * Gets the counter of a value. Values below SUB_BUCKET_COUNT are stored
+ * exactly and each bucket after that has half as much precision.
+ */
+static uint32_t counts_index(uint64_t value) {
+    const uint32_t bucket = 64 - __builtin_clzll(value | (SUB_BUCKET_COUNT - 1)) - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+    const uint32_t sub_bucket = (uint32_t) (value >> bucket);
+    return ((bucket + 1) << (LATENCY_HISTOGRAM_SUB_BUCKET_BITS - 1)) + sub_bucket - SUB_BUCKET_HALF_COUNT;
+}
+
+/**
+ * Gets the highest value which is stored in a counter
+ */
+static uint64_t highest_value(uint32_t index) {
+    int32_t bucket = (int32_t) (index >> (LATENCY_HISTOGRAM_SUB_BUCKET_BITS - 1)) - 1;
+    uint64_t sub_bucket = (index & (SUB_BUCKET_HALF_COUNT - 1)) + SUB_BUCKET_HALF_COUNT;
+    if (bucket < 0) {
+        sub_bucket -= SUB_BUCKET_HALF_COUNT;
+        bucket = 0;
+    }
+    return ((sub_bucket + 1) << bucket) - 1;
+}
+
+void latency_histogram_reset(struct LatencyHistogram *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void latency_histogram_record(struct LatencyHistogram *histogram, uint64_t value) {
+    if (value > MAX_VALUE)
+        value = MAX_VALUE;
+    histogram->counts[counts_index(value)]++;
+    histogram->total++;
+    histogram->sum += value;
+    if (value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+uint64_t latency_histogram_percentile(const struct LatencyHistogram *histogram, double percentile) {
+    if (histogram->total == 0)
+        return 0;
+    uint64_t wanted = (uint64_t) (percentile * (double) histogram->total + 0.5);
+    if (wanted == 0)
+        wanted = 1;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_HISTOGRAM_COUNTS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= wanted) {
+            const uint64_t value = highest_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+static uint64_t now_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void latencies_operation_begin(void *hook_ctx, uint8_t operation) {
+    ((struct OperationLatencies *) hook_ctx)->start = now_nanoseconds();
+}
+
+static void latencies_operation_end(void *hook_ctx, uint8_t operation) {
+    struct OperationLatencies *latencies = hook_ctx;
+    latency_histogram_record(&latencies->operations[operation], now_nanoseconds() - latencies->start);
+}
+
+void operation_latencies_attach(struct CrowFS *fs, struct OperationLatencies *latencies) {
+    for (int i = 0; i < CROWFS_OP_COUNT; i++)
+        latency_histogram_reset(&latencies->operations[i]);
+    fs->on_operation_begin = latencies_operation_begin;
+    fs->on_operation_end = latencies_operation_end;
+    fs->hook_ctx = latencies;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include "crowfs.h"
+
+/**
+ * A latency histogram in the style of HdrHistogram. Values are grouped in
+ * buckets which cover the powers of two and each bucket is split into linear
+ * sub-buckets, so every recorded value keeps about two significant digits
+ * regardless of its magnitude. The histogram has a fixed size and recording
+ * never allocates memory.
+ */
+
+/**
+ * Number of bits of the sub-buckets. Each bucket has 2^(bits - 1) sub-buckets
+ * so the relative error of a recorded value is at most 1 / 64.
+ */
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 7
+/**
+ * Values are clamped to 2^40 nanoseconds, which is about 18 minutes.
+ */
+#define LATENCY_HISTOGRAM_MAX_MAGNITUDE 40
+/**
+ * Number of counters of a histogram
+ */
+#define LATENCY_HISTOGRAM_COUNTS \
+    ((LATENCY_HISTOGRAM_MAX_MAGNITUDE - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 2) << (LATENCY_HISTOGRAM_SUB_BUCKET_BITS - 1))
+
+struct LatencyHistogram {
+    uint64_t counts[LATENCY_HISTOGRAM_COUNTS];
+    // Number of recorded values
+    uint64_t total;
+    // Exact minimum, maximum and sum of the recorded values
+    uint64_t min, max, sum;
+};
+
+/**
+ * Latencies of all public operations of a filesystem. This is the hook_ctx
+ * of the filesystem after operation_latencies_attach.
+ */
+struct OperationLatencies {
+    // Indexed by CROWFS_OP_*
+    struct LatencyHistogram operations[CROWFS_OP_COUNT];
+    // When the running operation has started
+    uint64_t start;
+};
+
+/**
+ * Removes all values of a histogram
+ * @param histogram The histogram to reset
+ */
+void latency_histogram_reset(struct LatencyHistogram *histogram);
+
+/**
+ * Records a value in a histogram
+ * @param histogram The histogram to record the value in
+ * @param value The value. Usually in nanoseconds.
+ */
+void latency_histogram_record(struct LatencyHistogram *histogram, uint64_t value);
+
+/**
+ * Gets a percentile of the recorded values
+ * @param histogram The histogram
+ * @param percentile The percentile between 0 and 1
+ * @return The highest value which is equivalent to the percentile or 0 if the histogram is empty
+ */
+uint64_t latency_histogram_percentile(const struct LatencyHistogram *histogram, double percentile);
+
+/**
+ * Sets the operation hooks of a filesystem to record the latency of each
+ * public operation in a histogram. The histograms are reset.
+ * @param fs The filesystem. Its hooks must not be used by anything else.
+ * @param latencies Where the latencies are recorded. Must outlive the filesystem.
+ */
+void operation_latencies_attach(struct CrowFS *fs, struct OperationLatencies *latencies);
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "block_device.h"
+#include "commands.h"
+#include "server.h"
+
+/**
+ * Maximum size of the strings in a request
+ */
+#define REQUEST_MAX_LENGTH (1024 * 1024)
+/**
+ * Maximum number of strings in a request
+ */
+#define REQUEST_MAX_ARGC 1024
+/**
+ * Number of accepted connections which can wait for a worker
+ */
+#define CONNECTION_QUEUE_SIZE 128
+/**
+ * How often the workers check if the server is stopping while waiting for a request
+ */
+#define POLL_INTERVAL_MS 500
+
+/**
+ * Each request is this header followed by argc null terminated strings. The
+ * first string is the working directory of the client, the second one is the
+ * image and the rest are the command and its arguments. Clients can send any
+ * number of requests on a single connection.
+ */
+struct __attribute__((__packed__)) ServerRequestHeader {
+    // Number of strings
+    uint16_t argc;
+    // Total size of the strings in bytes
+    uint32_t length;
+};
+
+/**
+ * Each response is this header followed by the output of the command
+ */
+struct __attribute__((__packed__)) ServerResponseHeader {
+    // The exit code of the command
+    int32_t exit_code;
+    // Size of the output in bytes
+    uint32_t length;
+};
+
+/**
+ * A mounted image of the server
+ */
+struct ServerImage {
+    // The real path of the image
+    char *path;
+    // The filesystem of the image
+    struct CrowFS fs;
+    // Is the filesystem initialized? If not, only "new" can be run on it
+    bool initialized;
+    // Only one command can run on each image at a time
+    pthread_mutex_t lock;
+    // Latencies of the operations since the image was mounted
+    struct OperationLatencies latencies;
+};
+
+/**
+ * State of the server which is shared between the workers
+ */
+struct Server {
+    struct ServerImage *images;
+    int image_count;
+    // Number of threads which each command can use
+    int command_threads;
+    // Ring buffer of accepted connections which are waiting for a worker
+    int connections[CONNECTION_QUEUE_SIZE];
+    size_t connections_head, connections_count;
+    pthread_mutex_t connections_lock;
+    pthread_cond_t connections_cond;
+};
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void server_stop_handler(int signal) {
+    server_stopping = 1;
+}
+
+/**
+ * Reads exactly size bytes from a socket
+ * @param wait_for_stop If true, gives up when the server is stopping
+ * @return 0 if ok, 1 on error, EOF or stop
+ */
+static int read_full(int fd, void *buffer, size_t size, bool wait_for_stop) {
+    char *ptr = buffer;
+    while (size > 0) {
+        if (wait_for_stop) {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            int ready = poll(&pfd, 1, POLL_INTERVAL_MS);
+            if (server_stopping)
+                return 1;
+            if (ready == 0 || (ready == -1 && errno == EINTR))
+                continue;
+            if (ready == -1)
+                return 1;
+        }
+        ssize_t n = read(fd, ptr, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        ptr += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Writes exactly size bytes to a socket
+ * @return 0 if ok, 1 on error
+ */
+static int write_full(int fd, const void *buffer, size_t size) {
+    const char *ptr = buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        ptr += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static struct ServerImage *server_find_image(struct Server *server, const char *path) {
+    for (int i = 0; i < server->image_count; i++)
+        if (strcmp(server->images[i].path, path) == 0)
+            return &server->images[i];
+    return NULL;
+}
+
+/**
+ * Runs a single request and writes the output of the command in out
+ * @return The exit code of the command
+ */
+static int server_execute(struct Server *server, int argc, char *argv[], FILE *out) {
+    if (argc < 3) {
+        fputs("Invalid request\n", out);
+        return 1;
+    }
+    struct ServerImage *image = server_find_image(server, argv[1]);
+    if (image == NULL) {
+        fprintf(out, "image %s is not served\n", argv[1]);
+        return 1;
+    }
+    pthread_mutex_lock(&image->lock);
+    int exit_code;
+    if (command_needs_init(argv[2]) && !image->initialized) {
+        fputs("cannot open the filesystem: it is not initialized\n", out);
+        exit_code = 1;
+    } else {
+        const struct CommandContext ctx = {
+            .fs = &image->fs,
+            .initialized = image->initialized,
+            .cwd = argv[0],
+            .out = out,
+            .in = NULL,
+            .threads = server->command_threads,
+            .latencies = &image->latencies,
+        };
+        exit_code = command_run(&ctx, argc - 2, argv + 2);
+        if (exit_code == 0 && !command_needs_init(argv[2]))
+            image->initialized = true;
+    }
+    pthread_mutex_unlock(&image->lock);
+    return exit_code;
+}
+
+/**
+ * Serves the requests of a connection until the client closes it
+ */
+static void server_serve_connection(struct Server *server, int fd) {
+    char *payload = NULL, **argv = NULL;
+    while (!server_stopping) {
+        struct ServerRequestHeader request;
+        if (read_full(fd, &request, sizeof(request), true) != 0)
+            break;
+        if (request.length > REQUEST_MAX_LENGTH || request.argc > REQUEST_MAX_ARGC)
+            break;
+        payload = malloc(request.length + 1);
+        argv = calloc(request.argc + 1, sizeof(char *));
+        if (payload == NULL || argv == NULL)
+            break;
+        if (read_full(fd, payload, request.length, false) != 0)
+            break;
+        payload[request.length] = '\0';
+        // Split the strings
+        int argc = 0;
+        for (size_t offset = 0; offset < request.length && argc < request.argc; argc++) {
+            argv[argc] = payload + offset;
+            offset += strlen(payload + offset) + 1;
+        }
+        // Run the command and capture the output
+        char *output = NULL;
+        size_t output_size = 0;
+        FILE *out = open_memstream(&output, &output_size);
+        if (out == NULL)
+            break;
+        int exit_code = server_execute(server, argc, argv, out);
+        fclose(out);
+        struct ServerResponseHeader response = {
+            .exit_code = exit_code,
+            .length = output_size,
+        };
+        int write_result = write_full(fd, &response, sizeof(response)) || write_full(fd, output, output_size);
+        free(output);
+        free(payload);
+        free(argv);
+        payload = NULL;
+        argv = NULL;
+        if (write_result != 0)
+            break;
+    }
+    free(payload);
+    free(argv);
+    close(fd);
+}
+
+static void *server_worker(void *arg) {
+    struct Server *server = arg;
+    while (1) {
+        pthread_mutex_lock(&server->connections_lock);
+        while (server->connections_count == 0 && !server_stopping)
+            pthread_cond_wait(&server->connections_cond, &server->connections_lock);
+        if (server->connections_count == 0) {
+            // Stopping and no more work
+            pthread_mutex_unlock(&server->connections_lock);
+            break;
+        }
+        int fd = server->connections[server->connections_head];
+        server->connections_head = (server->connections_head + 1) % CONNECTION_QUEUE_SIZE;
+        server->connections_count--;
+        pthread_cond_broadcast(&server->connections_cond);
+        pthread_mutex_unlock(&server->connections_lock);
+        server_serve_connection(server, fd);
+    }
+    return NULL;
+}
+
+/**
+ * Creates the listening Unix socket
+ * @return The socket or -1 on error
+ */
+static int server_listen(const char *socket_path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    unlink(socket_path); // remove the stale socket
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_run(const char *socket_path, char *images[], int image_count, const struct ServerOptions *options) {
+    int exit_code = 0, listen_fd = -1, opened_images = 0, started_workers = 0;
+    pthread_t *workers = NULL;
+    struct Server server = {
+        .images = calloc(image_count, sizeof(struct ServerImage)),
+        .image_count = image_count,
+        .command_threads = options->threads,
+        .connections_lock = PTHREAD_MUTEX_INITIALIZER,
+        .connections_cond = PTHREAD_COND_INITIALIZER,
+    };
+    if (server.images == NULL) {
+        puts("out of memory");
+        return 1;
+    }
+    // Mount all images once
+    for (; opened_images < image_count; opened_images++) {
+        struct ServerImage *image = &server.images[opened_images];
+        image->path = realpath(images[opened_images], NULL);
+        if (image->path == NULL) {
+            fprintf(stderr, "cannot open image %s: %s\n", images[opened_images], strerror(errno));
+            exit_code = 1;
+            goto end;
+        }
+        int result = options->direct ? direct_device_open(&image->fs, image->path)
+                                     : std_device_open(&image->fs, image->path);
+        if (result != 0) {
+            fprintf(stderr, "cannot open image %s: %s\n", image->path, strerror(errno));
+            free(image->path);
+            exit_code = 1;
+            goto end;
+        }
+        if (device_enable_cache(&image->fs, options->cache_blocks) != 0) {
+            fprintf(stderr, "cannot allocate the cache of image %s\n", image->path);
+            device_close(&image->fs);
+            free(image->path);
+            exit_code = 1;
+            goto end;
+        }
+        pthread_mutex_init(&image->lock, NULL);
+        operation_latencies_attach(&image->fs, &image->latencies);
+        image->fs.mount_flags = options->mount_flags;
+        result = crowfs_init(&image->fs);
+        image->initialized = result == CROWFS_OK;
+        if (!image->initialized)
+            fprintf(stderr, "image %s is not initialized: error %d\n", image->path, result);
+    }
+    listen_fd = server_listen(socket_path);
+    if (listen_fd == -1) {
+        perror("cannot listen on socket");
+        exit_code = 1;
+        goto end;
+    }
+    // Workers must not handle the signals, so the accept loop gets interrupted
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    struct sigaction action = {.sa_handler = server_stop_handler};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+    workers = calloc(options->threads, sizeof(pthread_t));
+    for (; workers != NULL && started_workers < options->threads; started_workers++)
+        if (pthread_create(&workers[started_workers], NULL, server_worker, &server) != 0)
+            break;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (started_workers == 0) {
+        puts("cannot start the workers");
+        exit_code = 1;
+        goto end;
+    }
+    printf("Serving %d images on %s with %d workers\n", image_count, socket_path, started_workers);
+    fflush(stdout);
+    // Accept the connections and pass them to the workers
+    while (!server_stopping) {
+        int client = accept(listen_fd, NULL, NULL);
+        if (client == -1)
+            continue; // interrupted or the client is gone
+        pthread_mutex_lock(&server.connections_lock);
+        while (server.connections_count == CONNECTION_QUEUE_SIZE && !server_stopping)
+            pthread_cond_wait(&server.connections_cond, &server.connections_lock);
+        // The queue might still be full, and the workers do not take new clients anymore
+        if (server_stopping) {
+            pthread_mutex_unlock(&server.connections_lock);
+            close(client);
+            break;
+        }
+        server.connections[(server.connections_head + server.connections_count) % CONNECTION_QUEUE_SIZE] = client;
+        server.connections_count++;
+        pthread_cond_broadcast(&server.connections_cond);
+        pthread_mutex_unlock(&server.connections_lock);
+    }
+
+end:
+    // Wake up the workers and wait for them to finish their current command
+    server_stopping = 1;
+    pthread_mutex_lock(&server.connections_lock);
+    pthread_cond_broadcast(&server.connections_cond);
+    pthread_mutex_unlock(&server.connections_lock);
+    for (int i = 0; i < started_workers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    if (listen_fd != -1) {
+        close(listen_fd);
+        unlink(socket_path);
+    }
+    for (int i = 0; i < opened_images; i++) {
+        crowfs_close(&server.images[i].fs);
+        device_close(&server.images[i].fs);
+        pthread_mutex_destroy(&server.images[i].lock);
+        free(server.images[i].path);
+    }
+    free(server.images);
+    return exit_code;
+}
+
+int client_run(const char *socket_path, const char *image, int argc, char *argv[]) {
+    int exit_code = 1;
+    char *payload = NULL, *output = NULL;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("cannot get the working directory");
+        return 1;
+    }
+    // Images are identified with their real path
+    char *image_path = realpath(image, NULL);
+    const char *image_id = image_path != NULL ? image_path : image;
+    // Build the request
+    size_t length = strlen(cwd) + 1 + strlen(image_id) + 1;
+    for (int i = 0; i < argc; i++)
+        length += strlen(argv[i]) + 1;
+    if (length > REQUEST_MAX_LENGTH || argc + 2 > REQUEST_MAX_ARGC) {
+        puts("the command is too long");
+        goto end;
+    }
+    payload = malloc(length);
+    if (payload == NULL) {
+        puts("out of memory");
+        goto end;
+    }
+    size_t offset = 0;
+    strcpy(payload + offset, cwd);
+    offset += strlen(cwd) + 1;
+    strcpy(payload + offset, image_id);
+    offset += strlen(image_id) + 1;
+    for (int i = 0; i < argc; i++) {
+        strcpy(payload + offset, argv[i]);
+        offset += strlen(argv[i]) + 1;
+    }
+    struct ServerRequestHeader request = {
+        .argc = argc + 2,
+        .length = length,
+    };
+    // Send it to the server
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        perror("cannot connect to the server");
+        if (fd != -1)
+            close(fd);
+        goto end;
+    }
+    struct ServerResponseHeader response;
+    if (write_full(fd, &request, sizeof(request)) != 0 || write_full(fd, payload, length) != 0 ||
+        read_full(fd, &response, sizeof(response), false) != 0) {
+        puts("cannot communicate with the server");
+        close(fd);
+        goto end;
+    }
+    output = malloc(response.length);
+    if ((response.length != 0 && output == NULL) || read_full(fd, output, response.length, false) != 0) {
+        puts("cannot communicate with the server");
+        close(fd);
+        goto end;
+    }
+    close(fd);
+    fwrite(output, 1, response.length, stdout);
+    exit_code = response.exit_code;
+
+end:
+    free(image_path);
+    free(payload);
+    free(output);
+    return exit_code;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Options of the images served by the server
+ */
+struct ServerOptions {
+    // Open the images with O_DIRECT
+    bool direct;
+    // Number of worker threads
+    int threads;
+    // Number of blocks to cache for each image
+    size_t cache_blocks;
+    // CROWFS_MOUNT_* flags of the images
+    uint32_t mount_flags;
+};
+
+/**
+ * Mounts the images once and serves interactor commands on a Unix socket until
+ * SIGINT or SIGTERM is received. Commands on different images run in parallel
+ * while commands on the same image are serialized.
+ * @param socket_path The path of the Unix socket to listen on
+ * @param images Path of the images to serve
+ * @param image_count Number of images
+ * @param options The server options
+ * @return The exit code of the program
+ */
+int server_run(const char *socket_path, char *images[], int image_count, const struct ServerOptions *options);
+
+/**
+ * Sends a command to a running server and prints its output
+ * @param socket_path The path of the Unix socket of the server
+ * @param image The image to run the command on. Must be one of the images of the server.
+ * @param argc Number of arguments including the command name
+ * @param argv The command name followed by its arguments
+ * @return The exit code of the command
+ */
+int client_run(const char *socket_path, const char *image, int argc, char *argv[]);